@@ -79,7 +79,15 @@ CryptConfig::CryptConfig()
 	m_AESSIV = false;
 	m_Raw64 = false;
 	m_HKDF = false;
+	m_AlignedBlocks = false;
+	m_LargeBlocks = false;
+	m_Compression = false;
+	m_XChaCha20Poly1305 = false;
 	m_reverse = false;
+
+	m_BlockSize = PLAIN_BS;
+
+	InitGeometry();
 	
 	m_pKeyBuf = NULL;
 
@@ -89,6 +97,8 @@ CryptConfig::CryptConfig()
 
 	m_pGcmContentKey = NULL;
 
+	m_pXChaChaContentKey = NULL;
+
 }
 
 
@@ -96,6 +106,7 @@ CryptConfig::~CryptConfig()
 {
 	delete m_pKeyBuf;	
 	delete m_pGcmContentKey;	
+	delete m_pXChaChaContentKey;
 }
 
 
@@ -277,6 +288,14 @@ CryptConfig::read(wstring& mes, const WCHAR *config_file_path, bool reverse)
 				m_VolumeName = vname;
 		}
 
+		if (d.HasMember("BlockSize") && !d["BlockSize"].IsNull()) {
+			if (!d["BlockSize"].IsInt()) {
+				mes = L"invalid BlockSize";
+				throw(-1);
+			}
+			m_BlockSize = d["BlockSize"].GetInt();
+		}
+
 		if (d.HasMember("FeatureFlags") && !d["FeatureFlags"].IsNull() && d["FeatureFlags"].IsArray()) {
 
 			rapidjson::Value& flags = d["FeatureFlags"];
@@ -299,6 +318,14 @@ CryptConfig::read(wstring& mes, const WCHAR *config_file_path, bool reverse)
 						m_Raw64 = true;
 					} else if (!strcmp(itr->GetString(), "HKDF")) {
 						m_HKDF = true;
+					} else if (!strcmp(itr->GetString(), "AlignedBlocks")) {
+						m_AlignedBlocks = true;
+					} else if (!strcmp(itr->GetString(), "LargeBlocks")) {
+						m_LargeBlocks = true;
+					} else if (!strcmp(itr->GetString(), "Compression")) {
+						m_Compression = true;
+					} else if (!strcmp(itr->GetString(), "XChaCha20Poly1305")) {
+						m_XChaCha20Poly1305 = true;
 					} else {
 						wstring wflag;
 						if (utf8_to_unicode(itr->GetString(), wflag)) {
@@ -313,6 +340,21 @@ CryptConfig::read(wstring& mes, const WCHAR *config_file_path, bool reverse)
 			}
 		}
 
+		// a block size other than the default is only honored along with the LargeBlocks
+		// feature flag, which makes versions that don't know about it refuse the volume
+		if (!m_LargeBlocks) {
+			m_BlockSize = PLAIN_BS;
+		} else if (!is_valid_block_size(m_BlockSize)) {
+			mes = L"invalid BlockSize";
+			throw(-1);
+		}
+
+		if (m_AlignedBlocks && m_Compression) {
+			mes = L"AlignedBlocks cannot be used with Compression";
+			throw(-1);
+		}
+
+		InitGeometry();
 		
 	} catch (...) {
 		bret = false;
@@ -321,6 +363,35 @@ CryptConfig::read(wstring& mes, const WCHAR *config_file_path, bool reverse)
 	return bret;
 }
 
+void CryptConfig::InitGeometry()
+{
+	// XChaCha20-Poly1305 uses a 24-byte nonce where AES uses a 16-byte IV
+	const int overhead = m_XChaCha20Poly1305 ? XCHACHA_BLOCK_OVERHEAD : CIPHER_BLOCK_OVERHEAD;
+
+	m_PlainBS = m_BlockSize;
+
+	if (m_AlignedBlocks) {
+		// Pad the header to a full page, and give each block a page after its
+		// data for its nonce and tag, so that the data of every block starts on
+		// a page boundary and a page-aligned read of a block's worth of
+		// plaintext reads whole pages of ciphertext (see write_block()).
+		m_HeaderLen = ALIGNED_BLOCK_LEN;
+		m_CipherBS = m_BlockSize + ALIGNED_BLOCK_LEN;
+	} else {
+		m_HeaderLen = FILE_HEADER_LEN;
+		m_CipherBS = m_BlockSize + overhead;
+		// with Compression, each block carries a length word after its IV (see write_block())
+		if (m_Compression)
+			m_CipherBS += BLOCK_LEN_HEADER_LEN;
+	}
+}
+
+bool CryptConfig::is_valid_block_size(int blocksize)
+{
+	// must be a power of 2 from 4KB to MAX_BLOCK_SIZE
+	return blocksize >= PLAIN_BS && blocksize <= MAX_BLOCK_SIZE && !(blocksize & (blocksize - 1));
+}
+
 bool CryptConfig::init_serial(CryptContext *con)
 {
 	BYTE diriv[DIR_IV_LEN];
@@ -532,11 +603,23 @@ bool CryptConfig::check_config(wstring& mes)
 	if (!m_EMENames && !m_PlaintextNames)
 		mes += L"EMENames is required unless PlaintextNames is specified\n";
 	
-	if (!m_GCMIV128) 
+	if (!m_GCMIV128 && !m_AESSIV && !m_XChaCha20Poly1305) 
 		mes += L"GCMIV128 must be specified\n";
 
+	if (m_XChaCha20Poly1305 && m_GCMIV128)
+		mes += L"XChaCha20Poly1305 and GCMIV128 cannot both be specified\n";
+
 	if (m_reverse && !m_AESSIV)
 		mes += L"reverse mode is being used but AESSIV not specfied\n";
+
+	if (m_reverse && m_Compression)
+		mes += L"Compression is not supported in reverse mode\n";
+
+	if (m_XChaCha20Poly1305 && m_AESSIV)
+		mes += L"XChaCha20Poly1305 and AESSIV cannot both be specified\n";
+
+	if (m_XChaCha20Poly1305 && !m_HKDF)
+		mes += L"XChaCha20Poly1305 requires HKDF\n";
 		
 	return mes.size() == 0;
 }
@@ -619,6 +702,10 @@ bool CryptConfig::decrypt_key(LPCTSTR password)
 			throw(-1);
 		}
 
+		if (m_XChaCha20Poly1305 && !this->InitXChaChaContentKey(this->GetMasterKey())) {
+			throw(-1);
+		}
+
 		if (m_VolumeName.size() > 0) {
 			string vol;
 			if (unicode_to_utf8(&m_VolumeName[0], vol)) {
@@ -643,7 +730,7 @@ bool CryptConfig::decrypt_key(LPCTSTR password)
 
 
 
-bool CryptConfig::create(const WCHAR *path, const WCHAR *specified_config_file_path, const WCHAR *password, bool eme, bool plaintext, bool longfilenames, bool siv, bool reverse, const WCHAR *volume_name, wstring& error_mes)
+bool CryptConfig::create(const WCHAR *path, const WCHAR *specified_config_file_path, const WCHAR *password, bool eme, bool plaintext, bool longfilenames, bool siv, bool xchacha, bool reverse, const WCHAR *volume_name, bool aligned, int blocksize, bool compress, wstring& error_mes)
 {
 
 	LockZeroBuffer<char> utf8pass(256);
@@ -681,6 +768,12 @@ bool CryptConfig::create(const WCHAR *path, const WCHAR *specified_config_file_p
 
 	if (siv)
 		m_AESSIV = true;
+	else if (xchacha)
+		m_XChaCha20Poly1305 = true;
+
+	// the 128-bit IV flag describes the AES content encryption, so
+	// XChaCha20-Poly1305 volumes (24-byte nonces) don't get it
+	m_GCMIV128 = !m_XChaCha20Poly1305;
 
 	// Raw64 and HKDF default to true
 	m_Raw64 = true;
@@ -689,6 +782,38 @@ bool CryptConfig::create(const WCHAR *path, const WCHAR *specified_config_file_p
 	if (reverse)
 		m_reverse = true;
 
+	if (aligned)
+		m_AlignedBlocks = true;
+
+	if (blocksize != PLAIN_BS) {
+		if (!is_valid_block_size(blocksize)) {
+			error_mes = L"invalid block size\n";
+			return false;
+		}
+		m_LargeBlocks = true;
+		m_BlockSize = blocksize;
+	}
+
+	if (xchacha && reverse) {
+		error_mes = L"XChaCha20-Poly1305 cannot be used in reverse mode\n";
+		return false;
+	}
+
+	if (compress) {
+		if (reverse) {
+			error_mes = L"compression cannot be used in reverse mode\n";
+			return false;
+		}
+		// an aligned block's tag follows its full-length data, so compression couldn't free any of the slot
+		if (aligned) {
+			error_mes = L"compression cannot be used with aligned blocks\n";
+			return false;
+		}
+		m_Compression = true;
+	}
+
+	InitGeometry();
+
 	try {
 
 		wstring config_path;
@@ -872,22 +997,36 @@ bool CryptConfig::create(const WCHAR *path, const WCHAR *specified_config_file_p
 		fprintf(fl, "\t},\n");
 		fprintf(fl, "\t\"Version\": %d,\n", m_Version);
 		fprintf(fl, "\t\"VolumeName\": \"%s\",\n", &volume_name_utf8[0]);
-		fprintf(fl, "\t\"FeatureFlags\": [\n");
+		if (m_LargeBlocks)
+			fprintf(fl, "\t\"BlockSize\": %d,\n", m_BlockSize);
+		vector<const char *> flags;
 		if (m_EMENames)
-			fprintf(fl, "\t\t\"EMENames\",\n");
+			flags.push_back("EMENames");
 		if (m_LongNames)
-			fprintf(fl, "\t\t\"LongNames\",\n");
+			flags.push_back("LongNames");
 		if (m_PlaintextNames)
-			fprintf(fl, "\t\t\"PlaintextNames\",\n");
+			flags.push_back("PlaintextNames");
 		else if (m_DirIV)
-			fprintf(fl, "\t\t\"DirIV\",\n");
+			flags.push_back("DirIV");
 		if (m_AESSIV)
-			fprintf(fl, "\t\t\"AESSIV\",\n");
+			flags.push_back("AESSIV");
+		if (m_XChaCha20Poly1305)
+			flags.push_back("XChaCha20Poly1305");
 		if (m_HKDF)
-			fprintf(fl, "\t\t\"HKDF\",\n");
+			flags.push_back("HKDF");
 		if (m_Raw64)
-			fprintf(fl, "\t\t\"Raw64\",\n");
-		fprintf(fl, "\t\t\"GCMIV128\"\n");
+			flags.push_back("Raw64");
+		if (m_AlignedBlocks)
+			flags.push_back("AlignedBlocks");
+		if (m_LargeBlocks)
+			flags.push_back("LargeBlocks");
+		if (m_Compression)
+			flags.push_back("Compression");
+		if (m_GCMIV128)
+			flags.push_back("GCMIV128");
+		fprintf(fl, "\t\"FeatureFlags\": [\n");
+		for (size_t i = 0; i < flags.size(); i++)
+			fprintf(fl, "\t\t\"%s\"%s\n", flags[i], i + 1 < flags.size() ? "," : "");
 		fprintf(fl, "\t]\n");
 		fprintf(fl, "}\n");
 
@@ -922,6 +1061,78 @@ bool CryptConfig::create(const WCHAR *path, const WCHAR *specified_config_file_p
 	return bret;
 }
 
+bool CryptConfig::create_ephemeral(bool plaintext, bool siv, bool xchacha, bool reverse, bool aligned, int blocksize, bool compress, wstring& error_mes)
+{
+	if (plaintext) {
+		m_PlaintextNames = true;
+	} else {
+		m_EMENames = true;
+		m_LongNames = true;
+	}
+
+	m_DirIV = !m_PlaintextNames;
+
+	if (siv)
+		m_AESSIV = true;
+	else if (xchacha)
+		m_XChaCha20Poly1305 = true;
+
+	m_Raw64 = true;
+	m_HKDF = true;
+	m_reverse = reverse;
+	m_AlignedBlocks = aligned;
+
+	if (blocksize != PLAIN_BS) {
+		if (!is_valid_block_size(blocksize)) {
+			error_mes = L"invalid block size\n";
+			return false;
+		}
+		m_LargeBlocks = true;
+		m_BlockSize = blocksize;
+	}
+
+	if (m_reverse && !m_AESSIV) {
+		error_mes = L"AES256-SIV must be used with Reverse\n";
+		return false;
+	}
+
+	if (compress) {
+		if (reverse || aligned) {
+			error_mes = L"compression cannot be used in reverse mode or with aligned blocks\n";
+			return false;
+		}
+		m_Compression = true;
+	}
+
+	InitGeometry();
+
+	m_Version = 2;
+
+	m_pKeyBuf = new LockZeroBuffer<unsigned char>(DEFAULT_KEY_LEN);
+
+	if (!m_pKeyBuf->IsLocked()) {
+		error_mes = L"cannot lock key buffer\n";
+		return false;
+	}
+
+	if (!get_sys_random_bytes(m_pKeyBuf->m_buf, GetMasterKeyLength())) {
+		error_mes = L"unable to generate master key\n";
+		return false;
+	}
+
+	if (!InitGCMContentKey(GetMasterKey(), m_HKDF)) {
+		error_mes = L"unable to init gcm content key\n";
+		return false;
+	}
+
+	if (m_XChaCha20Poly1305 && !InitXChaChaContentKey(GetMasterKey())) {
+		error_mes = L"unable to init xchacha20-poly1305 content key\n";
+		return false;
+	}
+
+	return true;
+}
+
 bool CryptConfig::InitGCMContentKey(const BYTE *key, bool hkdf)
 {
 	if (!hkdf)
@@ -940,3 +1151,19 @@ bool CryptConfig::InitGCMContentKey(const BYTE *key, bool hkdf)
 	return true;
 }
 
+bool CryptConfig::InitXChaChaContentKey(const BYTE *key)
+{
+	// gocryptfs only supports XChaCha20-Poly1305 together with HKDF
+	m_pXChaChaContentKey = new LockZeroBuffer<BYTE>(MASTER_KEY_LEN);
+
+	if (!m_pXChaChaContentKey->IsLocked())
+		return false;
+
+	return hkdfDerive(key, MASTER_KEY_LEN, m_pXChaChaContentKey->m_buf, m_pXChaChaContentKey->m_len, hkdfInfoXChaChaPoly1305Content);
+}
+
+int CryptConfig::ContentCryptMode()
+{
+	return m_XChaCha20Poly1305 ? CHACHA20_MODE_POLY1305 : AES_MODE_GCM;
+}
+
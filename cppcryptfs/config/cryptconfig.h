@@ -50,6 +50,7 @@ public:
 private:
 	LockZeroBuffer<unsigned char> *m_pKeyBuf;
 	LockZeroBuffer<BYTE> *m_pGcmContentKey;
+	LockZeroBuffer<BYTE> *m_pXChaChaContentKey;
 	bool m_DirIV;
 public:
 	wstring m_configPath;
@@ -60,9 +61,23 @@ public:
 	bool m_AESSIV;
 	bool m_Raw64;
 	bool m_HKDF;
+	bool m_AlignedBlocks;
+	bool m_LargeBlocks;
+	bool m_Compression;
+	bool m_XChaCha20Poly1305;
 
 	bool m_reverse;
 
+	// plaintext block size
+	int m_BlockSize;
+
+	// ciphertext file layout, derived from the feature flags by InitGeometry()
+	int m_PlainBS;
+	int m_CipherBS;
+	int m_HeaderLen;
+	int BlockOverhead() { return m_CipherBS - m_PlainBS; }
+	void InitGeometry();
+
 	int m_Version;
 	wstring m_VolumeName;
 
@@ -84,15 +99,30 @@ public:
 
 	const BYTE *GetGcmContentKey() { return m_HKDF ? m_pGcmContentKey->m_buf : GetMasterKey(); };
 
+	bool InitXChaChaContentKey(const BYTE *key);
+
+	const BYTE *GetXChaChaContentKey() { return m_pXChaChaContentKey ? m_pXChaChaContentKey->m_buf : NULL; };
+
+	// mode to pass to get_crypt_context() for file content (unless m_AESSIV)
+	int ContentCryptMode();
+
 	CryptConfig();
 	bool read(wstring& mes, const WCHAR *config_file_path = NULL, bool reverse = false);
 	bool decrypt_key(LPCTSTR password);
 
 	bool create(const WCHAR *path, const WCHAR *specified_config_path, const WCHAR *password, bool eme, bool plaintext, bool longfilenames, 
-					bool siv, bool reverse, const WCHAR *volume_name, wstring& error_mes);
+					bool siv, bool xchacha, bool reverse, const WCHAR *volume_name, bool aligned, int blocksize, bool compress, wstring& error_mes);
+
+	// Sets up a volume with a random master key and no config file, for
+	// running the filesystem code without mounting (benchmarks, replays).
+	// Unless plaintext is set, names are encrypted with EME and long names
+	// are used, and the caller must create the root diriv.
+	bool create_ephemeral(bool plaintext, bool siv, bool xchacha, bool reverse, bool aligned, int blocksize, bool compress, wstring& error_mes);
 
 	bool check_config(wstring& mes);
 
+	static bool is_valid_block_size(int blocksize);
+
 	bool write_volume_name();
 
 	bool init_serial(CryptContext *con);
@@ -35,9 +35,14 @@ FsInfo::FsInfo()
 	this->caseCacheHitRatio = 0.0f;
 	this->caseInsensitive = false;
 	this->dirIvCacheHitRatio = 0.0f;
+	this->directIo = false;
+	this->sparseZeroBlocks = false;
+	this->mmapReverse = false;
+	this->autoTuned = false;
 	this->fsThreads = 0;
 	this->ioBufferSize = 0;
 	this->lfnCacheHitRatio = 0.0f;
+	this->blockCacheHitRatio = 0.0f;
 	this->longFileNames = false;
 	this->mountManager = false;
 	this->readOnly = false;
@@ -37,8 +37,12 @@ public:
 	wstring configPath;
 	wstring fileNameEncryption;
 	wstring dataEncryption;
+	wstring aesImplementation;
+	wstring perfStats; // JSON
+	wstring autoTune; // calibration summary if autoTuned
 	float dirIvCacheHitRatio;
 	float lfnCacheHitRatio;
+	float blockCacheHitRatio;
 	float caseCacheHitRatio;
 	int ioBufferSize;
 	int fsThreads;
@@ -48,6 +52,10 @@ public:
 	bool mountManager;
 	bool caseInsensitive;
 	bool longFileNames;
+	bool directIo;
+	bool sparseZeroBlocks;
+	bool mmapReverse;
+	bool autoTuned;
 
 	FsInfo();
 	virtual ~FsInfo();
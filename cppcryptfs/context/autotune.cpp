@@ -0,0 +1,297 @@
+/*
+cppcryptfs : user-mode cryptographic virtual overlay filesystem.
+
+Copyright (C) 2016-2018 Bailey Brown (github.com/bailey27/cppcryptfs)
+
+cppcryptfs is based on the design of gocryptfs (github.com/rfjakob/gocryptfs)
+
+The MIT License (MIT)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#include "stdafx.h"
+
+#include "autotune.h"
+#include "cryptcontext.h"
+#include "crypt/cryptdefs.h"
+#include "crypt/crypt.h"
+#include "file/cryptio.h"
+#include "util/util.h"
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+
+static double elapsed_us(const LARGE_INTEGER& t0, const LARGE_INTEGER& t1, const LARGE_INTEGER& freq)
+{
+	return (double)(t1.QuadPart - t0.QuadPart) * 1e6 / freq.QuadPart;
+}
+
+// bytes per second one core encrypts with the volume's block engine
+static bool measure_crypt(CryptContext *con, double& bytes_per_s)
+{
+	CryptConfig *config = con->GetConfig();
+
+	const int plain_bs = config->m_PlainBS;
+
+	vector<BYTE> plain(plain_bs);
+	vector<BYTE> cipher(config->m_CipherBS);
+
+	for (size_t i = 0; i < plain.size(); i++)
+		plain[i] = (BYTE)(i * 7 + 1);
+
+	BYTE fileid[FILE_ID_LEN];
+	BYTE block0iv[BLOCK_SIV_LEN];
+
+	memset(fileid, 0, sizeof(fileid));
+	memset(block0iv, 0, sizeof(block0iv));
+
+	void *context = NULL;
+
+	if (!config->m_AESSIV) {
+		context = get_crypt_context(BLOCK_IV_LEN, config->ContentCryptMode());
+		if (!context)
+			return false;
+	}
+
+	LARGE_INTEGER freq, t0, t1;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&t0);
+
+	const LONGLONG duration = (LONGLONG)(AUTOTUNE_CRYPT_SECONDS * freq.QuadPart);
+
+	bool ok = true;
+	unsigned long long blocks = 0;
+
+	do {
+		// check the clock every few blocks
+		for (int i = 0; i < 16 && ok; i++, blocks++) {
+			ok = write_block(con, &cipher[0], NULL, fileid, blocks, &plain[0], plain_bs, context,
+				config->m_reverse ? block0iv : NULL) > 0;
+		}
+		QueryPerformanceCounter(&t1);
+	} while (ok && t1.QuadPart - t0.QuadPart < duration);
+
+	if (context)
+		free_crypt_context(context);
+
+	if (!ok)
+		return false;
+
+	bytes_per_s = (double)blocks * plain_bs * 1e6 / elapsed_us(t0, t1, freq);
+
+	return bytes_per_s > 0;
+}
+
+// times an unbuffered read of len bytes at offset
+static bool time_read(HANDLE hfile, LONGLONG offset, BYTE *buf, DWORD len, const LARGE_INTEGER& freq, vector<double>& times)
+{
+	OVERLAPPED ov;
+	memset(&ov, 0, sizeof(ov));
+	ov.Offset = (DWORD)offset;
+	ov.OffsetHigh = (DWORD)(offset >> 32);
+
+	DWORD nRead;
+	LARGE_INTEGER t0, t1;
+
+	QueryPerformanceCounter(&t0);
+	BOOL ok = ReadFile(hfile, buf, len, &nRead, &ov);
+	QueryPerformanceCounter(&t1);
+
+	if (!ok)
+		return false;
+
+	times.push_back(elapsed_us(t0, t1, freq));
+
+	return true;
+}
+
+// Median time of an uncached read of the backing volume, timed on a probe
+// file (see AUTOTUNE_PROBE_SIZE).  In reverse mode, where the base directory
+// holds the user's own files, or if the probe file can't be made, only the
+// first read of the config file is timed, because later reads of the same
+// page would be served by the disk's cache.
+static bool measure_read_latency(CryptContext *con, double& latency_us)
+{
+	CryptConfig *config = con->GetConfig();
+
+	// unbuffered I/O needs sector-aligned buffers
+	const DWORD len = 4096;
+	const DWORD stride = AUTOTUNE_PROBE_SIZE / AUTOTUNE_READS;
+
+	BYTE *buf = (BYTE*)VirtualAlloc(NULL, stride, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+
+	if (!buf)
+		return false;
+
+	vector<double> times;
+
+	LARGE_INTEGER freq;
+	QueryPerformanceFrequency(&freq);
+
+	bool ok = false;
+
+	HANDLE hfile = INVALID_HANDLE_VALUE;
+
+	if (!config->m_reverse) {
+		wstring probe = config->m_basedir + L"\\" AUTOTUNE_PROBE_NAME;
+
+		hfile = CreateFile(probe.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_NEW,
+			FILE_ATTRIBUTE_HIDDEN | FILE_FLAG_NO_BUFFERING | FILE_FLAG_WRITE_THROUGH | FILE_FLAG_DELETE_ON_CLOSE, NULL);
+	}
+
+	if (hfile != INVALID_HANDLE_VALUE) {
+		ok = true;
+
+		// fill it with data that the storage can't compress or deduplicate
+		ULONGLONG x = 0x9e3779b97f4a7c15ULL ^ GetTickCount64();
+
+		for (int i = 0; i < AUTOTUNE_READS && ok; i++) {
+			for (DWORD j = 0; j < stride / sizeof(x); j++) {
+				x ^= x << 13;
+				x ^= x >> 7;
+				x ^= x << 17;
+				((ULONGLONG*)buf)[j] = x;
+			}
+			DWORD nWritten;
+			ok = WriteFile(hfile, buf, stride, &nWritten, NULL) && nWritten == stride;
+		}
+
+		// backwards, so that no read is of the part after the last one
+		for (int i = AUTOTUNE_READS - 1; i >= 0 && ok; i--)
+			ok = time_read(hfile, (LONGLONG)i * stride, buf, len, freq, times);
+
+		CloseHandle(hfile);
+	}
+
+	if (!ok) {
+		times.clear();
+
+		wstring path = config->m_configPath;
+
+		if (path.empty()) {
+			path = config->m_basedir + L"\\";
+			path += DIR_IV_NAME;
+		}
+
+		hfile = CreateFile(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+			OPEN_EXISTING, FILE_FLAG_NO_BUFFERING, NULL);
+
+		if (hfile != INVALID_HANDLE_VALUE) {
+			ok = time_read(hfile, 0, buf, len, freq, times);
+			CloseHandle(hfile);
+		}
+	}
+
+	VirtualFree(buf, 0, MEM_RELEASE);
+
+	if (!ok)
+		return false;
+
+	nth_element(times.begin(), times.begin() + times.size() / 2, times.end());
+
+	latency_us = times[times.size() / 2];
+
+	return true;
+}
+
+// average time of a parallel_for() call that hands one empty task to each core
+static double measure_dispatch(int cores)
+{
+	if (cores < 2)
+		return 0;
+
+	auto nothing = [](int first, int last) -> bool { return true; };
+
+	LARGE_INTEGER freq, t0, t1;
+	QueryPerformanceFrequency(&freq);
+
+	// warm up the thread pool
+	parallel_for(cores, 1, nothing);
+
+	QueryPerformanceCounter(&t0);
+
+	for (int i = 0; i < AUTOTUNE_DISPATCHES; i++)
+		parallel_for(cores, 1, nothing);
+
+	QueryPerformanceCounter(&t1);
+
+	return elapsed_us(t0, t1, freq) / AUTOTUNE_DISPATCHES;
+}
+
+bool auto_tune(CryptContext *con, AutoTuneResult& result)
+{
+	CryptConfig *config = con->GetConfig();
+
+	SYSTEM_INFO si;
+	GetSystemInfo(&si);
+
+	result.cores = max((int)si.dwNumberOfProcessors, 1);
+
+	double bytes_per_s;
+
+	if (!measure_crypt(con, bytes_per_s))
+		return false;
+
+	if (!measure_read_latency(con, result.read_latency_us))
+		return false;
+
+	result.dispatch_us = measure_dispatch(result.cores);
+
+	result.crypt_mb_per_s = bytes_per_s / (1024 * 1024);
+
+	const int plain_bs = config->m_PlainBS;
+
+	const double block_us = plain_bs * 1e6 / bytes_per_s;
+
+	// the I/O buffer size is a power of two number of blocks
+	int blocks = 1;
+
+	while (blocks * block_us < AUTOTUNE_LATENCY_FACTOR * result.read_latency_us &&
+		(long long)blocks * 2 * plain_bs <= AUTOTUNE_MAX_BUFFER)
+		blocks *= 2;
+
+	result.bufferblocks = blocks;
+
+	const double buffer_us = blocks * block_us;
+
+	result.threads = (int)ceil(result.cores * (1 + result.read_latency_us / buffer_us));
+	result.threads = min(AUTOTUNE_MAX_THREADS, max(2, result.threads));
+
+	result.parallel_min_blocks = (int)ceil(AUTOTUNE_DISPATCH_FACTOR * result.dispatch_us / block_us);
+	result.parallel_min_blocks = min(256, max(1, result.parallel_min_blocks));
+
+	con->m_bufferblocks = result.bufferblocks;
+	con->m_threads = result.threads;
+	con->m_parallel_min_blocks = result.parallel_min_blocks;
+
+	return true;
+}
+
+wstring AutoTuneResult::ToString() const
+{
+	WCHAR buf[256];
+
+	swprintf_s(buf, L"%d cores, %.0f MB/s per core, %.0f us reads, %.0f us dispatch, %d blocks per task",
+		cores, crypt_mb_per_s, read_latency_us, dispatch_us, parallel_min_blocks);
+
+	return buf;
+}
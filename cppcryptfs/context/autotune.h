@@ -0,0 +1,96 @@
+/*
+cppcryptfs : user-mode cryptographic virtual overlay filesystem.
+
+Copyright (C) 2016-2018 Bailey Brown (github.com/bailey27/cppcryptfs)
+
+cppcryptfs is based on the design of gocryptfs (github.com/rfjakob/gocryptfs)
+
+The MIT License (MIT)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#pragma once
+
+#include <string>
+
+using namespace std;
+
+class CryptContext;
+
+// Mount-time calibration of the I/O buffer size, the number of Dokany
+// threads and the number of blocks a reverse mode read encrypts per thread.
+//
+// It measures how fast one core encrypts blocks with the volume's cipher,
+// how long an uncached read of the backing volume takes, and how long it
+// takes to hand work to the thread pool, and then picks
+//
+//   - the smallest I/O buffer whose encryption takes at least
+//     AUTOTUNE_LATENCY_FACTOR times as long as a read, so reads of the
+//     backing volume are a small part of each request
+//   - enough threads to keep every core busy while some of them wait for
+//     reads
+//   - enough blocks per parallel task that encrypting them takes at least
+//     AUTOTUNE_DISPATCH_FACTOR times as long as dispatching the task
+
+// time spent measuring the cipher
+#define AUTOTUNE_CRYPT_SECONDS 0.05
+
+// number of reads timed (the median is used)
+#define AUTOTUNE_READS 16
+
+// Reads are timed on a temporary file of this size in the base directory,
+// each of a different part of it, so that none of them is served from a
+// cache an earlier one filled.  The file is deleted when it is closed.
+#define AUTOTUNE_PROBE_SIZE (AUTOTUNE_READS * 64 * 1024)
+#define AUTOTUNE_PROBE_NAME L"cppcryptfs-autotune.tmp"
+
+// number of parallel_for() calls timed
+#define AUTOTUNE_DISPATCHES 32
+
+#define AUTOTUNE_LATENCY_FACTOR 4
+#define AUTOTUNE_DISPATCH_FACTOR 4
+
+// the most threads Dokany 1.x accepts (DOKAN_MAX_THREAD)
+#define AUTOTUNE_MAX_THREADS 15
+
+// largest I/O buffer, in bytes
+#define AUTOTUNE_MAX_BUFFER (1024 * 1024)
+
+struct AutoTuneResult {
+	// calibration
+	int cores;
+	double crypt_mb_per_s;    // one core
+	double read_latency_us;   // median uncached read of the backing volume
+	double dispatch_us;       // a parallel_for() call over all the cores
+
+	// chosen settings
+	int bufferblocks;         // in blocks of the volume's block size
+	int threads;
+	int parallel_min_blocks;
+
+	wstring ToString() const;
+};
+
+// Calibrates and sets con->m_bufferblocks, con->m_threads and
+// con->m_parallel_min_blocks.  The config must have been read and the block
+// engine initialized.  Returns false, and changes nothing, if a measurement
+// fails.
+bool auto_tune(CryptContext *con, AutoTuneResult& result);
@@ -28,7 +28,9 @@ THE SOFTWARE.
 
 #include "stdafx.h"
 #include "crypt/crypt.h"
+#include "crypt/aeskernel.h"
 #include "cryptcontext.h"
+#include "file/cryptfile.h"
 
 static RandomBytes random_bytes;
 
@@ -41,6 +43,55 @@ bool CryptContext::InitEme(const BYTE *key, bool hkdf)
 
 }
 
+bool CryptContext::OpenVolume(const WCHAR *path, const WCHAR *config_path, const WCHAR *password, wstring& mes)
+{
+	CryptConfig *config = GetConfig();
+
+	config->m_basedir = path;
+
+	// strip any trailing backslashes
+	while (config->m_basedir.size() > 0 && config->m_basedir[config->m_basedir.size() - 1] == '\\')
+		config->m_basedir.erase(config->m_basedir.size() - 1);
+
+	// this prefix enables up to 32K long file paths on NTFS
+	config->m_basedir = L"\\\\?\\" + config->m_basedir;
+
+	if (!config->read(mes, config_path)) {
+		if (mes.length() < 1)
+			mes = L"unable to load config";
+		return false;
+	}
+
+	if (!config->check_config(mes))
+		return false;
+
+	if (!config->decrypt_key(password)) {
+		mes = L"password incorrect";
+		return false;
+	}
+
+	if (config->m_EMENames && !InitEme(config->GetMasterKey(), config->m_HKDF)) {
+		mes = L"unable to initialize eme context";
+		return false;
+	}
+
+	if (config->m_AESSIV) {
+		try {
+			m_siv.SetKey(config->GetMasterKey(), 32, config->m_HKDF);
+		} catch (...) {
+			mes = L"unable to intialize AESSIV context";
+			return false;
+		}
+	}
+
+	if (!init_block_engine(this)) {
+		mes = L"unable to initialize block encryption";
+		return false;
+	}
+
+	return true;
+}
+
 
 CryptContext::CryptContext()
 {
@@ -50,6 +101,12 @@ CryptContext::CryptContext()
 
 	m_recycle_bin = false;
 	m_read_only = false;
+	m_direct_io = false;
+	m_batch_io = true;
+	m_sparse_zero_blocks = false;
+	m_mmap_reverse = false;
+	m_recorder = NULL;
+	memset(&m_block_engine, 0, sizeof(m_block_engine));
 
 	m_cache_ttl = 1;
 
@@ -57,6 +114,10 @@ CryptContext::CryptContext()
 
 	m_threads = 0;
 
+	m_parallel_min_blocks = REVERSE_MIN_BLOCKS_PER_TASK;
+
+	m_autotuned = false;
+
 	if (!m_mountEvent)
 		throw((int)GetLastError());
 
@@ -77,6 +138,8 @@ CryptContext::~CryptContext()
 	if (m_config)
 		delete m_config;
 
+	delete m_recorder;
+
 }
 
 void CryptContext::GetFsInfo(FsInfo & info)
@@ -85,13 +148,32 @@ void CryptContext::GetFsInfo(FsInfo & info)
 	info.cacheTTL = m_cache_ttl;
 	info.caseInsensitive = IsCaseInsensitive();
 	info.configPath = GetConfig()->m_configPath;
-	info.dataEncryption = GetConfig()->m_AESSIV ? L"AES256-SIV" : L"AES256-GCM";
+	if (GetConfig()->m_AESSIV)
+		info.dataEncryption = L"AES256-SIV";
+	else if (GetConfig()->m_XChaCha20Poly1305)
+		info.dataEncryption = L"XChaCha20-Poly1305";
+	else
+		info.dataEncryption = L"AES256-GCM";
+	if (GetConfig()->m_LargeBlocks)
+		info.dataEncryption += L", " + to_wstring(GetConfig()->m_BlockSize / 1024) + L"KB blocks";
+	if (GetConfig()->m_AlignedBlocks)
+		info.dataEncryption += L", aligned";
+	if (GetConfig()->m_Compression)
+		info.dataEncryption += L", compressed";
+	info.aesImplementation = aes_kernel()->name;
 	info.fileNameEncryption = GetConfig()->m_PlaintextNames ? L"none" : L"AES256-EME";
 	info.fsThreads = m_threads ? m_threads : CRYPT_DOKANY_DEFAULT_NUM_THREADS;
-	info.ioBufferSize = m_bufferblocks * 4;
+	info.ioBufferSize = (int)((long long)m_bufferblocks * GetConfig()->m_PlainBS / 1024);
 	info.longFileNames = GetConfig()->m_LongNames;
 	info.mountManager = m_recycle_bin;
 	info.readOnly = m_read_only;
+	info.directIo = m_direct_io;
+	info.sparseZeroBlocks = m_sparse_zero_blocks;
+	info.mmapReverse = m_mmap_reverse && GetConfig()->m_reverse;
+	info.perfStats = m_perf.ToJson();
+	info.autoTuned = m_autotuned;
+	if (m_autotuned)
+		info.autoTune = m_autotune.ToString();
 	info.reverse = GetConfig()->m_reverse;
 	info.path = GetConfig()->m_basedir;
 
@@ -124,4 +206,12 @@ void CryptContext::GetFsInfo(FsInfo & info)
 	hits = m_dir_iv_cache.hits();
 	lookups = m_dir_iv_cache.lookups();
 	info.dirIvCacheHitRatio = lookups ? (float)hits / (float)lookups : 0.0f;
+
+	if (m_block_cache.enabled()) {
+		hits = m_block_cache.hits();
+		lookups = m_block_cache.lookups();
+		info.blockCacheHitRatio = lookups ? (float)hits / (float)lookups : 0.0f;
+	} else {
+		info.blockCacheHitRatio = -1.0f;
+	}
 }
@@ -38,6 +38,12 @@ THE SOFTWARE.
 #include "crypt/siv.h"
 #include "filename/casecache.h"
 #include "context/FsInfo.h"
+#include "file/openfiles.h"
+#include "file/cryptio.h"
+#include "file/blockcache.h"
+#include "context/perfstats.h"
+#include "context/oprecorder.h"
+#include "context/autotune.h"
 
 // number of threads Dokany uses if threads is 0. Found from code inspection, not in header file
 #define CRYPT_DOKANY_DEFAULT_NUM_THREADS 5 
@@ -52,13 +58,25 @@ public:
 	DirIvCache m_dir_iv_cache;
 	LongFilenameCache m_lfn_cache;
 	CaseCache m_case_cache;
+	OpenFileTable m_open_files;
+	PerfStats m_perf;
+	OpRecorder *m_recorder; // NULL unless the operations are being recorded
+	BlockCache m_block_cache; // reverse mode only
 	EmeCryptContext m_eme;
 	SivContext m_siv;
+	BlockEngine m_block_engine;
 	int m_bufferblocks;
 	int m_cache_ttl;
 	int m_threads;
+	int m_parallel_min_blocks; // blocks per task when reverse mode encrypts in parallel
+	bool m_autotuned;
+	AutoTuneResult m_autotune; // valid if m_autotuned
 	bool m_recycle_bin;
 	bool m_read_only;
+	bool m_direct_io; // open backing files with FILE_FLAG_NO_BUFFERING
+	bool m_batch_io; // keep several transfers of a multi-block span in flight (overlapped I/O)
+	bool m_sparse_zero_blocks; // store all-zero blocks as holes in sparse backing files
+	bool m_mmap_reverse; // read plaintext files through memory mappings in reverse mode
 private:
 	bool m_caseinsensitive;
 public:
@@ -75,6 +93,11 @@ public:
 
 	bool InitEme(const BYTE *key, bool hkdf);
 
+	// Reads the config and decrypts the key of the filesystem at path, and
+	// sets up name and block encryption the way mounting does, for tools that
+	// work on the encrypted files directly.  Returns false and sets mes on error.
+	bool OpenVolume(const WCHAR *path, const WCHAR *config_path, const WCHAR *password, wstring& mes);
+
 	CryptContext();
 
 	CryptConfig *GetConfig() const { return m_config; };
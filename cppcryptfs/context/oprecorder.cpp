@@ -0,0 +1,343 @@
+/*
+cppcryptfs : user-mode cryptographic virtual overlay filesystem.
+
+Copyright (C) 2016-2018 Bailey Brown (github.com/bailey27/cppcryptfs)
+
+cppcryptfs is based on the design of gocryptfs (github.com/rfjakob/gocryptfs)
+
+The MIT License (MIT)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#include "stdafx.h"
+
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+
+#include "oprecorder.h"
+#include "util/util.h"
+
+static const char * const op_record_names[OPREC_OP_COUNT] = {
+	"create",
+	"cleanup",
+	"close",
+	"read",
+	"write",
+	"flush",
+	"get_info",
+	"find",
+	"delete_file",
+	"delete_directory",
+	"move",
+	"set_end_of_file",
+	"set_allocation_size",
+};
+
+const char *op_record_name(int op)
+{
+	return op >= 0 && op < OPREC_OP_COUNT ? op_record_names[op] : "unknown";
+}
+
+ULONGLONG OpRecorder::hash(const WCHAR *name, size_t len)
+{
+	wstring upper(name, len);
+
+	CharUpperBuffW(&upper[0], (DWORD)len);
+
+	BYTE mac[EVP_MAX_MD_SIZE];
+	unsigned int mac_len = 0;
+
+	if (!HMAC(EVP_sha256(), m_key, sizeof(m_key), (const BYTE*)upper.c_str(), len * sizeof(WCHAR), mac, &mac_len))
+		throw(-1);
+
+	ULONGLONG h;
+
+	memcpy(&h, mac, sizeof(h));
+
+	return h;
+}
+
+OpRecorder::OpRecorder()
+{
+	m_file = INVALID_HANDLE_VALUE;
+	m_start = 0;
+	memset(m_key, 0, sizeof(m_key));
+	m_stopped = false;
+	InitializeCriticalSection(&m_crit);
+	InitializeCriticalSection(&m_write_crit);
+}
+
+OpRecorder::~OpRecorder()
+{
+	if (m_file != INVALID_HANDLE_VALUE) {
+		if (!m_stopped)
+			write_out(m_buf);
+		CloseHandle(m_file);
+	}
+
+	SecureZeroMemory(m_key, sizeof(m_key));
+
+	DeleteCriticalSection(&m_write_crit);
+	DeleteCriticalSection(&m_crit);
+}
+
+bool OpRecorder::Open(const WCHAR *path, wstring& mes)
+{
+	m_file = CreateFile(path, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+
+	if (m_file == INVALID_HANDLE_VALUE) {
+		mes = L"unable to create operation recording ";
+		mes += path;
+		return false;
+	}
+
+	try {
+		m_buf.reserve(OP_RECORD_BUFFER_SIZE + 4096);
+		m_spare.reserve(OP_RECORD_BUFFER_SIZE + 4096);
+	} catch (...) {
+		mes = L"unable to allocate operation recording buffer";
+		return false;
+	}
+
+	if (!get_sys_random_bytes(m_key, sizeof(m_key))) {
+		mes = L"unable to get random bytes for operation recording key";
+		return false;
+	}
+
+	OpRecordFileHeader header;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, OP_RECORD_MAGIC, sizeof(header.magic));
+	header.version = OP_RECORD_VERSION;
+
+	LARGE_INTEGER freq;
+	QueryPerformanceFrequency(&freq);
+	header.frequency = freq.QuadPart;
+
+	DWORD nWritten;
+
+	if (!WriteFile(m_file, &header, sizeof(header), &nWritten, NULL) || nWritten != sizeof(header)) {
+		mes = L"unable to write operation recording header";
+		return false;
+	}
+
+	m_start = Now();
+
+	return true;
+}
+
+bool OpRecorder::write_out(vector<BYTE>& buf)
+{
+	if (buf.empty())
+		return true;
+
+	DWORD nWritten;
+
+	bool ok = WriteFile(m_file, &buf[0], (DWORD)buf.size(), &nWritten, NULL) && nWritten == buf.size();
+
+	buf.clear();
+
+	return ok;
+}
+
+void OpRecorder::append_path(const WCHAR *path)
+{
+	size_t count_pos = m_buf.size();
+
+	WORD count = 0;
+
+	m_buf.insert(m_buf.end(), (BYTE*)&count, (BYTE*)&count + sizeof(count));
+
+	const WCHAR *p = path ? path : L"";
+
+	while (*p) {
+		while (*p == '\\')
+			p++;
+		const WCHAR *end = p;
+		while (*end && *end != '\\')
+			end++;
+		if (end > p) {
+			OpRecordComponent comp;
+			comp.hash = hash(p, end - p);
+			comp.len = (WORD)(end - p);
+			m_buf.insert(m_buf.end(), (BYTE*)&comp, (BYTE*)&comp + sizeof(comp));
+			count++;
+		}
+		p = end;
+	}
+
+	memcpy(&m_buf[count_pos], &count, sizeof(count));
+}
+
+void OpRecorder::Record(OpRecord& rec, const WCHAR *path, const WCHAR *path2)
+{
+	rec.start -= m_start;
+	rec.npaths = path2 ? 2 : 1;
+
+	EnterCriticalSection(&m_crit);
+
+	if (m_file == INVALID_HANDLE_VALUE || m_stopped) {
+		LeaveCriticalSection(&m_crit);
+		return;
+	}
+
+	size_t pos = m_buf.size();
+
+	try {
+		m_buf.insert(m_buf.end(), (BYTE*)&rec, (BYTE*)&rec + sizeof(rec));
+		append_path(path);
+		if (path2)
+			append_path(path2);
+	} catch (...) {
+		m_buf.resize(pos);
+	}
+
+	if (m_buf.size() < OP_RECORD_BUFFER_SIZE) {
+		LeaveCriticalSection(&m_crit);
+		return;
+	}
+
+	// m_write_crit is taken before m_crit is released, so buffers are written
+	// in order.  It also waits for the previous write to finish with m_spare.
+	EnterCriticalSection(&m_write_crit);
+
+	m_buf.swap(m_spare);
+
+	LeaveCriticalSection(&m_crit);
+
+	bool ok = write_out(m_spare);
+
+	LeaveCriticalSection(&m_write_crit);
+
+	// stop recording if the file can't be written
+	if (!ok) {
+		EnterCriticalSection(&m_crit);
+		m_stopped = true;
+		LeaveCriticalSection(&m_crit);
+	}
+}
+
+
+static bool read_components(const vector<BYTE>& data, size_t& pos, vector<OpRecordComponent>& path)
+{
+	WORD count;
+
+	if (pos + sizeof(count) > data.size())
+		return false;
+
+	memcpy(&count, &data[pos], sizeof(count));
+	pos += sizeof(count);
+
+	if (pos + count * sizeof(OpRecordComponent) > data.size())
+		return false;
+
+	path.resize(count);
+
+	if (count > 0)
+		memcpy(&path[0], &data[pos], count * sizeof(OpRecordComponent));
+
+	pos += count * sizeof(OpRecordComponent);
+
+	return true;
+}
+
+bool read_op_recording(const WCHAR *filename, LONGLONG& frequency, vector<OpRecordEntry>& entries, wstring& mes)
+{
+	vector<BYTE> data;
+
+	HANDLE hfile = CreateFile(filename, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+
+	if (hfile == INVALID_HANDLE_VALUE) {
+		mes = L"unable to open ";
+		mes += filename;
+		return false;
+	}
+
+	bool ok = true;
+
+	try {
+		LARGE_INTEGER size;
+		if (!GetFileSizeEx(hfile, &size))
+			throw(-1);
+		data.resize((size_t)size.QuadPart);
+		size_t pos = 0;
+		while (pos < data.size()) {
+			DWORD nRead;
+			DWORD len = (DWORD)min(data.size() - pos, (size_t)(16 * 1024 * 1024));
+			if (!ReadFile(hfile, &data[pos], len, &nRead, NULL) || nRead == 0)
+				throw(-1);
+			pos += nRead;
+		}
+	} catch (...) {
+		mes = L"unable to read ";
+		mes += filename;
+		ok = false;
+	}
+
+	CloseHandle(hfile);
+
+	if (!ok)
+		return false;
+
+	OpRecordFileHeader header;
+
+	if (data.size() < sizeof(header)) {
+		mes = L"not an operation recording";
+		return false;
+	}
+
+	memcpy(&header, &data[0], sizeof(header));
+
+	if (memcmp(header.magic, OP_RECORD_MAGIC, sizeof(header.magic)) || header.version != OP_RECORD_VERSION || header.frequency <= 0) {
+		mes = L"not an operation recording, or from a different version";
+		return false;
+	}
+
+	frequency = header.frequency;
+
+	size_t pos = sizeof(header);
+
+	try {
+		while (pos + sizeof(OpRecord) <= data.size()) {
+			OpRecordEntry entry;
+			memcpy(&entry.rec, &data[pos], sizeof(entry.rec));
+			pos += sizeof(entry.rec);
+
+			if (entry.rec.op >= OPREC_OP_COUNT || entry.rec.npaths < 1 || entry.rec.npaths > 2) {
+				mes = L"operation recording is corrupt";
+				return false;
+			}
+
+			if (!read_components(data, pos, entry.path))
+				break;
+
+			if (entry.rec.npaths > 1 && !read_components(data, pos, entry.path2))
+				break;
+
+			entries.push_back(move(entry));
+		}
+	} catch (...) {
+		mes = L"unable to allocate memory for operation recording";
+		return false;
+	}
+
+	return true;
+}
@@ -0,0 +1,168 @@
+/*
+cppcryptfs : user-mode cryptographic virtual overlay filesystem.
+
+Copyright (C) 2016-2018 Bailey Brown (github.com/bailey27/cppcryptfs)
+
+cppcryptfs is based on the design of gocryptfs (github.com/rfjakob/gocryptfs)
+
+The MIT License (MIT)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#pragma once
+
+#include <windows.h>
+
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Recording of the filesystem operations a mounted volume receives, for
+// replaying later as a realistic benchmark (see dokan/cryptreplay.h).
+//
+// A recording is a binary file that starts with an OpRecordFileHeader and
+// is followed by one OpRecord per operation, each followed by its paths.
+// A path is stored as a WORD count of components followed by an
+// OpRecordComponent for each.  Names are not stored, only a hash of each
+// component (case-folded) and its length, so a recording preserves the shape
+// of the tree without revealing file names.  The hash is keyed with a random
+// key that is made for each recording and never stored, so names can't be
+// found by hashing guesses.
+
+#define OP_RECORD_MAGIC "CFSOPREC"
+#define OP_RECORD_VERSION 1
+
+// operations are buffered and written out in chunks of about this size
+#define OP_RECORD_BUFFER_SIZE (1024 * 1024)
+
+// length of the key path components are hashed with
+#define OP_RECORD_KEY_LEN 32
+
+enum OpRecordOp {
+	OPREC_CREATE,
+	OPREC_CLEANUP,
+	OPREC_CLOSE,
+	OPREC_READ,
+	OPREC_WRITE,
+	OPREC_FLUSH,
+	OPREC_GETINFO,
+	OPREC_FIND,
+	OPREC_DELETE_FILE,
+	OPREC_DELETE_DIRECTORY,
+	OPREC_MOVE,
+	OPREC_SET_END_OF_FILE,
+	OPREC_SET_ALLOCATION_SIZE,
+	OPREC_OP_COUNT
+};
+
+const char *op_record_name(int op);
+
+// OpRecord flags (from the DOKAN_FILE_INFO of the operation)
+#define OPREC_FLAG_DIRECTORY       0x01
+#define OPREC_FLAG_DELETE_ON_CLOSE 0x02
+#define OPREC_FLAG_PAGING_IO       0x04
+#define OPREC_FLAG_WRITE_TO_EOF    0x08
+#define OPREC_FLAG_NOCACHE         0x10
+#define OPREC_FLAG_SYNCHRONOUS_IO  0x20
+#define OPREC_FLAG_REPLACE         0x40  // MoveFile ReplaceIfExisting
+
+#pragma pack(push, 1)
+
+struct OpRecordFileHeader {
+	char magic[8];
+	DWORD version;
+	DWORD reserved;
+	LONGLONG frequency;  // QueryPerformanceFrequency() of the recording machine
+};
+
+struct OpRecord {
+	LONGLONG start;      // QueryPerformanceCounter() ticks since recording began
+	LONGLONG duration;   // in ticks
+	ULONGLONG handle;    // DokanFileInfo->Context after the operation; identifies an open
+	LONGLONG offset;     // file offset, or the new size for the set size operations
+	DWORD length;        // bytes requested
+	DWORD status;        // NTSTATUS returned
+	DWORD args[4];       // create: DesiredAccess, FileAttributes, ShareAccess, CreateOptions
+	DWORD thread;
+	BYTE op;             // OpRecordOp
+	BYTE flags;          // OPREC_FLAG_*
+	BYTE disposition;    // create: CreateDisposition
+	BYTE npaths;         // 2 for moves, otherwise 1
+};
+
+struct OpRecordComponent {
+	ULONGLONG hash;
+	WORD len;
+};
+
+#pragma pack(pop)
+
+// an operation read back from a recording
+struct OpRecordEntry {
+	OpRecord rec;
+	vector<OpRecordComponent> path;
+	vector<OpRecordComponent> path2;  // empty unless a move
+};
+
+// Reads a recording.  A recording that ends in a partial record (e.g. the
+// system crashed) is read up to there.
+bool read_op_recording(const WCHAR *filename, LONGLONG& frequency, vector<OpRecordEntry>& entries, wstring& mes);
+
+// Writes a recording.  Record() may be called from any thread.  Operations
+// are appended to m_buf under m_crit.  When it is full, it is swapped with
+// m_spare and written out after m_crit is released, so recording operations
+// doesn't wait for the disk.
+
+class OpRecorder {
+private:
+	HANDLE m_file;
+	LONGLONG m_start;
+	BYTE m_key[OP_RECORD_KEY_LEN];
+	bool m_stopped; // a write failed
+	vector<BYTE> m_buf;
+	vector<BYTE> m_spare;
+	CRITICAL_SECTION m_crit;
+	CRITICAL_SECTION m_write_crit; // held while m_spare is being written
+
+	// HMAC-SHA256 of a path component, upper-cased, truncated to 64 bits
+	ULONGLONG hash(const WCHAR *name, size_t len);
+
+	void append_path(const WCHAR *path);
+
+	// writes buf to the file and empties it
+	bool write_out(vector<BYTE>& buf);
+public:
+	static LONGLONG Now() { LARGE_INTEGER t; QueryPerformanceCounter(&t); return t.QuadPart; };
+
+	bool Open(const WCHAR *path, wstring& mes);
+
+	// rec.start is a Now() value, and is made relative to the start of the
+	// recording.  path2 is the destination of a move, otherwise NULL.
+	void Record(OpRecord& rec, const WCHAR *path, const WCHAR *path2 = NULL);
+
+	// disallow copying
+	OpRecorder(OpRecorder const&) = delete;
+	void operator=(OpRecorder const&) = delete;
+
+	OpRecorder();
+	virtual ~OpRecorder();
+};
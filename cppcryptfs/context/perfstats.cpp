@@ -0,0 +1,356 @@
+/*
+cppcryptfs : user-mode cryptographic virtual overlay filesystem.
+
+Copyright (C) 2016-2018 Bailey Brown (github.com/bailey27/cppcryptfs)
+
+cppcryptfs is based on the design of gocryptfs (github.com/rfjakob/gocryptfs)
+
+The MIT License (MIT)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#include "stdafx.h"
+
+#include "perfstats.h"
+
+#include <intrin.h>
+#include <unordered_map>
+
+static const WCHAR *op_names[PERF_OP_COUNT] = {
+	L"create",
+	L"read",
+	L"write",
+	L"find",
+	L"getinfo",
+	L"move",
+	L"delete",
+	L"encrypt_path",
+	L"get_dir_iv",
+	L"block_crypto",
+	L"backing_io",
+};
+
+const WCHAR *perf_op_name(int op)
+{
+	return op >= 0 && op < PERF_OP_COUNT ? op_names[op] : L"unknown";
+}
+
+// The PerfStats that exist, by id, so that a thread that exits can tell
+// whether the ones it has shards from are still there.
+
+class PerfStatsRegistry {
+public:
+	CRITICAL_SECTION m_crit;
+	unordered_map<ULONGLONG, PerfStats*> m_live;
+	ULONGLONG m_next_id;
+
+	static PerfStatsRegistry *getInstance()
+	{
+		static PerfStatsRegistry instance;
+
+		return &instance;
+	}
+
+	// disallow copying
+	PerfStatsRegistry(PerfStatsRegistry const&) = delete;
+	void operator=(PerfStatsRegistry const&) = delete;
+
+	PerfStatsRegistry() { InitializeCriticalSection(&m_crit); m_next_id = 1; };
+	virtual ~PerfStatsRegistry() { DeleteCriticalSection(&m_crit); };
+};
+
+// the shards the calling thread records into, by PerfStats id
+
+class PerfThreadShards {
+public:
+	struct Entry {
+		ULONGLONG id; // 0 if unused
+		PerfShard *shard;
+	};
+
+	Entry m_entries[PERF_THREAD_STATS];
+	int m_next_evict;
+
+	// gives the shard back to its PerfStats, if that still exists
+	static void Release(Entry& entry)
+	{
+		PerfStatsRegistry *reg = PerfStatsRegistry::getInstance();
+
+		EnterCriticalSection(&reg->m_crit);
+
+		auto it = reg->m_live.find(entry.id);
+
+		if (it != reg->m_live.end())
+			it->second->ReleaseShard(entry.shard);
+
+		LeaveCriticalSection(&reg->m_crit);
+
+		entry.id = 0;
+		entry.shard = NULL;
+	}
+
+	PerfThreadShards()
+	{
+		memset(m_entries, 0, sizeof(m_entries));
+		m_next_evict = 0;
+	}
+
+	~PerfThreadShards()
+	{
+		for (auto& entry : m_entries) {
+			if (entry.id)
+				Release(entry);
+		}
+	}
+
+	// disallow copying
+	PerfThreadShards(PerfThreadShards const&) = delete;
+	void operator=(PerfThreadShards const&) = delete;
+};
+
+static thread_local PerfThreadShards t_shards;
+
+PerfStats::PerfStats()
+{
+	InitializeCriticalSection(&m_shards_lock);
+
+	PerfStatsRegistry *reg = PerfStatsRegistry::getInstance();
+
+	EnterCriticalSection(&reg->m_crit);
+
+	m_id = reg->m_next_id++;
+
+	try {
+		reg->m_live[m_id] = this;
+	} catch (...) {
+		LeaveCriticalSection(&reg->m_crit);
+		DeleteCriticalSection(&m_shards_lock);
+		throw;
+	}
+
+	LeaveCriticalSection(&reg->m_crit);
+
+	LARGE_INTEGER freq;
+	QueryPerformanceFrequency(&freq);
+	m_ns_per_tick = 1e9 / (double)freq.QuadPart;
+
+	m_start = Now();
+}
+
+PerfStats::~PerfStats()
+{
+	PerfStatsRegistry *reg = PerfStatsRegistry::getInstance();
+
+	// after this, exiting threads no longer give shards back
+	EnterCriticalSection(&reg->m_crit);
+
+	reg->m_live.erase(m_id);
+
+	LeaveCriticalSection(&reg->m_crit);
+
+	for (auto shard : m_shards)
+		delete shard;
+
+	DeleteCriticalSection(&m_shards_lock);
+}
+
+// Gets a shard for the calling thread, reusing one from a thread that has
+// exited if there is one, and remembers it in the thread's t_shards.
+PerfShard *PerfStats::GetShard()
+{
+	PerfShard *shard = NULL;
+
+	EnterCriticalSection(&m_shards_lock);
+
+	try {
+		if (!m_free_shards.empty()) {
+			shard = m_free_shards.back();
+			m_free_shards.pop_back();
+		} else {
+			m_shards.reserve(m_shards.size() + 1);
+			shard = new PerfShard;
+			memset(shard, 0, sizeof(PerfShard));
+			m_shards.push_back(shard);
+		}
+	} catch (...) {
+		shard = NULL;
+	}
+
+	LeaveCriticalSection(&m_shards_lock);
+
+	if (!shard)
+		return NULL;
+
+	PerfThreadShards::Entry *entry = NULL;
+
+	for (auto& e : t_shards.m_entries) {
+		if (!e.id) {
+			entry = &e;
+			break;
+		}
+	}
+
+	// the thread is recording for more PerfStats than it keeps shards for
+	if (!entry) {
+		entry = &t_shards.m_entries[t_shards.m_next_evict];
+		t_shards.m_next_evict = (t_shards.m_next_evict + 1) % PERF_THREAD_STATS;
+		PerfThreadShards::Release(*entry);
+	}
+
+	entry->id = m_id;
+	entry->shard = shard;
+
+	return shard;
+}
+
+void PerfStats::ReleaseShard(PerfShard *shard)
+{
+	EnterCriticalSection(&m_shards_lock);
+
+	// if this fails, the shard is just not reused
+	try {
+		m_free_shards.push_back(shard);
+	} catch (...) {
+	}
+
+	LeaveCriticalSection(&m_shards_lock);
+}
+
+// The first PERF_SUB_BUCKETS buckets hold 0 .. PERF_SUB_BUCKETS - 1 ns
+// exactly.  After that, each power of two is split into PERF_SUB_BUCKETS
+// buckets by the bits that follow the most significant one.
+int PerfStats::Bucket(ULONGLONG ns)
+{
+	if (ns < PERF_SUB_BUCKETS)
+		return (int)ns;
+
+	unsigned long msb;
+	_BitScanReverse64(&msb, ns);
+
+	int bucket = (int)((msb - PERF_SUB_BUCKET_BITS + 1) << PERF_SUB_BUCKET_BITS) + (int)((ns >> (msb - PERF_SUB_BUCKET_BITS)) & (PERF_SUB_BUCKETS - 1));
+
+	return min(bucket, PERF_BUCKETS - 1);
+}
+
+// returns the smallest latency that falls in the bucket after bucket
+ULONGLONG PerfStats::BucketLimit(int bucket)
+{
+	bucket++;
+
+	if (bucket < PERF_SUB_BUCKETS)
+		return bucket;
+
+	int shift = (bucket >> PERF_SUB_BUCKET_BITS) - 1;
+
+	return (ULONGLONG)(PERF_SUB_BUCKETS + (bucket & (PERF_SUB_BUCKETS - 1))) << shift;
+}
+
+void PerfStats::Record(int op, LONGLONG ticks, ULONGLONG bytes, ULONGLONG weight)
+{
+	ULONGLONG ns = ticks > 0 ? (ULONGLONG)(ticks * m_ns_per_tick) : 0;
+
+	PerfShard *shard = NULL;
+
+	for (auto& e : t_shards.m_entries) {
+		if (e.id == m_id) {
+			shard = e.shard;
+			break;
+		}
+	}
+
+	if (!shard && (shard = GetShard()) == NULL)
+		return;
+
+	// only this thread writes the shard, so these needn't be interlocked
+	shard->count[op] += weight;
+	shard->total_ns[op] += ns * weight;
+	shard->bytes[op] += bytes * weight;
+	shard->buckets[op][Bucket(ns)] += weight;
+}
+
+wstring PerfStats::ToJson()
+{
+	double seconds = (Now() - m_start) * m_ns_per_tick / 1e9;
+
+	WCHAR buf[256];
+
+	swprintf_s(buf, L"{\n  \"seconds\": %.1f", seconds);
+
+	wstring json = buf;
+
+	static const double percentiles[] = { 0.5, 0.9, 0.99, 0.999 };
+	static const WCHAR *percentile_names[] = { L"p50", L"p90", L"p99", L"p999" };
+
+	for (int op = 0; op < PERF_OP_COUNT; op++) {
+
+		ULONGLONG count = 0, total_ns = 0, bytes = 0;
+		ULONGLONG buckets[PERF_BUCKETS];
+		memset(buckets, 0, sizeof(buckets));
+
+		EnterCriticalSection(&m_shards_lock);
+
+		for (auto shard : m_shards) {
+			count += shard->count[op];
+			total_ns += shard->total_ns[op];
+			bytes += shard->bytes[op];
+			for (int j = 0; j < PERF_BUCKETS; j++)
+				buckets[j] += shard->buckets[op][j];
+		}
+
+		LeaveCriticalSection(&m_shards_lock);
+
+		swprintf_s(buf, L",\n  \"%s\": {\"count\": %llu, \"bytes\": %llu, \"ops_per_sec\": %.1f, \"bytes_per_sec\": %.0f, \"mean_us\": %.1f",
+			op_names[op], count, bytes, seconds > 0 ? count / seconds : 0.0, seconds > 0 ? bytes / seconds : 0.0, count ? total_ns / 1000.0 / count : 0.0);
+
+		json += buf;
+
+		// percentiles are reported as the upper bound of the bucket they fall in
+		int bucket = 0;
+		ULONGLONG seen = 0;
+
+		for (int i = 0; i < (int)_countof(percentiles); i++) {
+			ULONGLONG rank = (ULONGLONG)(percentiles[i] * count + 0.5);
+			while (bucket < PERF_BUCKETS - 1 && seen + buckets[bucket] < max(rank, 1ULL))
+				seen += buckets[bucket++];
+			swprintf_s(buf, L", \"%s_us\": %.1f", percentile_names[i], count ? BucketLimit(bucket) / 1000.0 : 0.0);
+			json += buf;
+		}
+
+		// the non-empty buckets, as [upper bound in ns, count] pairs
+		json += L", \"histogram\": [";
+
+		bool first = true;
+
+		for (int i = 0; i < PERF_BUCKETS; i++) {
+			if (!buckets[i])
+				continue;
+			swprintf_s(buf, L"%s[%llu, %llu]", first ? L"" : L", ", BucketLimit(i), buckets[i]);
+			json += buf;
+			first = false;
+		}
+
+		json += L"]}";
+	}
+
+	json += L"\n}";
+
+	return json;
+}
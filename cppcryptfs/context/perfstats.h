@@ -0,0 +1,188 @@
+/*
+cppcryptfs : user-mode cryptographic virtual overlay filesystem.
+
+Copyright (C) 2016-2018 Bailey Brown (github.com/bailey27/cppcryptfs)
+
+cppcryptfs is based on the design of gocryptfs (github.com/rfjakob/gocryptfs)
+
+The MIT License (MIT)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#pragma once
+
+#include <windows.h>
+
+#include <string>
+#include <vector>
+
+#include "util/trace.h"
+
+using namespace std;
+
+// Operations whose latency is measured.  The first group are Dokany
+// callbacks, the rest are phases within them.
+
+enum PerfOp {
+	PERF_CREATE,
+	PERF_READ,
+	PERF_WRITE,
+	PERF_FIND,
+	PERF_GETINFO,
+	PERF_MOVE,
+	PERF_DELETE,
+	PERF_ENCRYPT_PATH,
+	PERF_GET_DIR_IV,
+	PERF_BLOCK_CRYPTO,
+	PERF_BACKING_IO,
+	PERF_OP_COUNT
+};
+
+const WCHAR *perf_op_name(int op);
+
+// Latencies are kept in log-linear buckets, eight per power of two of
+// nanoseconds, which bounds the error of a percentile to 12.5% over a range
+// of 1 ns to 36 minutes.
+#define PERF_SUB_BUCKET_BITS 3
+#define PERF_SUB_BUCKETS (1 << PERF_SUB_BUCKET_BITS)
+#define PERF_BUCKETS (40 * PERF_SUB_BUCKETS)
+
+// Each thread that records samples gets a shard of the counters to itself,
+// so recording takes no locks or interlocked operations.  A shard is only
+// written by its thread, and when the thread exits it is handed on to the
+// next new thread (the counts just keep accumulating).  A thread keeps
+// shards for up to this many PerfStats (i.e. mounted volumes) at once.
+#define PERF_THREAD_STATS 4
+
+// Operations too short and frequent to read the clock twice each (e.g. the
+// crypto of a block) are timed once in this many times per thread, and each
+// sample is counted as this many operations.
+#define PERF_SAMPLE_INTERVAL 16
+
+// returns true once in every PERF_SAMPLE_INTERVAL calls on a thread
+inline bool perf_sample()
+{
+	static thread_local unsigned int t_calls = 0;
+
+	return ++t_calls % PERF_SAMPLE_INTERVAL == 0;
+}
+
+struct PerfShard {
+	ULONGLONG count[PERF_OP_COUNT];
+	ULONGLONG total_ns[PERF_OP_COUNT];
+	ULONGLONG bytes[PERF_OP_COUNT];
+	ULONGLONG buckets[PERF_OP_COUNT][PERF_BUCKETS];
+};
+
+class PerfStats {
+	friend class PerfThreadShards;
+private:
+	ULONGLONG m_id; // unlike the address, never reused
+
+	CRITICAL_SECTION m_shards_lock;
+	vector<PerfShard*> m_shards;      // every shard, freed with the PerfStats
+	vector<PerfShard*> m_free_shards; // shards whose threads have exited
+
+	double m_ns_per_tick;
+	LONGLONG m_start;
+
+	static int Bucket(ULONGLONG ns);
+	static ULONGLONG BucketLimit(int bucket);
+
+	PerfShard *GetShard();
+	void ReleaseShard(PerfShard *shard);
+public:
+	static LONGLONG Now() { LARGE_INTEGER t; QueryPerformanceCounter(&t); return t.QuadPart; };
+
+	// records weight operations that each took ticks and transferred bytes
+	void Record(int op, LONGLONG ticks, ULONGLONG bytes, ULONGLONG weight = 1);
+
+	// Merges the shards and returns the counters, throughput and latency
+	// percentiles of every operation as a JSON object, one operation per line.
+	wstring ToJson();
+
+	// disallow copying
+	PerfStats(PerfStats const&) = delete;
+	void operator=(PerfStats const&) = delete;
+
+	PerfStats();
+	virtual ~PerfStats();
+};
+
+// Records the time from its construction to its destruction as one
+// operation.  If pbytes isn't NULL, *pbytes is taken as the number of bytes
+// transferred when it is destroyed.  If tracing is enabled, the operation is
+// also recorded as a trace event, along with the file, offset and status
+// given to SetTrace() and SetStatus().  A sampled operation is given the
+// number of operations it stands for with SetWeight().
+
+class PerfTimer {
+private:
+	PerfStats *m_stats;
+	int m_op;
+	LONGLONG m_start;
+	const DWORD *m_pbytes;
+	ULONGLONG m_bytes;
+	ULONGLONG m_weight;
+	ULONGLONG m_file;
+	LONGLONG m_offset;
+	DWORD m_status;
+public:
+	void AddBytes(ULONGLONG bytes) { m_bytes += bytes; };
+
+	void SetTrace(ULONGLONG file, LONGLONG offset) { m_file = file; m_offset = offset; };
+
+	void SetStatus(DWORD status) { m_status = status; };
+
+	void SetWeight(ULONGLONG weight) { m_weight = weight; };
+
+	// disallow copying
+	PerfTimer(PerfTimer const&) = delete;
+	void operator=(PerfTimer const&) = delete;
+
+	PerfTimer(PerfStats *stats, int op, const DWORD *pbytes = NULL)
+	{
+		m_stats = stats;
+		m_op = op;
+		m_pbytes = pbytes;
+		m_bytes = 0;
+		m_weight = 1;
+		m_file = 0;
+		m_offset = 0;
+		m_status = 0;
+		m_start = stats ? PerfStats::Now() : 0;
+	};
+
+	~PerfTimer()
+	{
+		if (!m_stats)
+			return;
+
+		LONGLONG ticks = PerfStats::Now() - m_start;
+
+		ULONGLONG bytes = m_bytes + (m_pbytes ? *m_pbytes : 0);
+
+		m_stats->Record(m_op, ticks, bytes, m_weight);
+
+		if (g_trace_enabled)
+			trace_event(m_op, m_start, ticks, m_file, m_offset, (DWORD)bytes, m_status);
+	};
+};
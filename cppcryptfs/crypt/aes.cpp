@@ -30,59 +30,25 @@ THE SOFTWARE.
 #include "AES.h"
 
 
-#ifdef USE_AES_NI
-#ifdef __cplusplus
-extern "C" {
-#endif
-
-	unsigned int OPENSSL_ia32cap_P[];
-
-#define HAVE_AES_NI   (OPENSSL_ia32cap_P[1]&(1<<(57-32)))
-
-	int aesni_set_encrypt_key(const unsigned char *userKey, int bits,
-		AES_KEY *key);
-	int aesni_set_decrypt_key(const unsigned char *userKey, int bits,
-		AES_KEY *key);
-
-	void aesni_encrypt(const unsigned char *in, unsigned char *out,
-		const AES_KEY *key);
-	void aesni_decrypt(const unsigned char *in, unsigned char *out,
-		const AES_KEY *key);
-#ifdef __cplusplus
-};
-#endif
-#endif // USE_AES_NI
-
-
 bool AES::use_aes_ni()
 {
-#ifdef USE_AES_NI
-	if (HAVE_AES_NI)
-		return true;
-#endif
-	return false;
+	return aes_kernel()->type != AES_KERNEL_PORTABLE;
 }
 
 void AES::initialize_keys(const unsigned char *key, int keylen /* in bits */, 
 				AES_KEY *encrypt_key, AES_KEY *decrypt_key)
 {
-#ifdef USE_AES_NI
-	if (AES::use_aes_ni()) {
-		aesni_set_encrypt_key(key, keylen, encrypt_key);
-		aesni_set_decrypt_key(key, keylen, decrypt_key);
-	} else
-#endif
-	{
-		AES_set_encrypt_key(key, keylen, encrypt_key);
-		AES_set_decrypt_key(key, keylen, decrypt_key);
-	}
+	if (keylen != 256)
+		throw(-1);
+
+	aes_kernel()->set_keys(key, encrypt_key, decrypt_key);
 }
 
 AES::AES()
 {
 	m_key_encrypt = NULL;
 	m_key_decrypt = NULL;
-	m_use_aes_ni = use_aes_ni();
+	m_kernel = aes_kernel();
 }
 
 AES::~AES()
@@ -99,26 +65,26 @@ void AES::set_keys(const AES_KEY *key_encrypt, const AES_KEY *key_decrypt)
 // encrypt single AES block (16 bytes)
 void AES::encrypt(const unsigned char* plain, unsigned char *cipher) const
 { 
-#ifdef USE_AES_NI
-	if (m_use_aes_ni) {
-		aesni_encrypt(plain, cipher, m_key_encrypt);
-	} else
-#endif
-	{
-		AES_encrypt(plain, cipher, m_key_encrypt);
-	}
+	m_kernel->encrypt_blocks(plain, cipher, 1, m_key_encrypt);
 }
 
 // decrypt single AES block (16 bytes)
 void AES::decrypt(const unsigned char *cipher, unsigned char *plain) const
 { 
-#ifdef USE_AES_NI
-	if (m_use_aes_ni) {
-		aesni_decrypt(cipher, plain, m_key_decrypt);
-	} else
-#endif
-	{
-		AES_decrypt(cipher, plain, m_key_decrypt);
-	}
+	m_kernel->decrypt_blocks(cipher, plain, 1, m_key_decrypt);
 }
 
+void AES::encrypt_blocks(const unsigned char *plain, unsigned char *cipher, size_t nblocks) const
+{
+	m_kernel->encrypt_blocks(plain, cipher, nblocks, m_key_encrypt);
+}
+
+void AES::decrypt_blocks(const unsigned char *cipher, unsigned char *plain, size_t nblocks) const
+{
+	m_kernel->decrypt_blocks(cipher, plain, nblocks, m_key_decrypt);
+}
+
+void AES::ctr(const unsigned char *in, unsigned char *out, size_t len, unsigned char *counter) const
+{
+	aes_kernel_ctr(m_kernel, m_key_encrypt, in, out, len, counter);
+}
@@ -28,9 +28,7 @@ THE SOFTWARE.
 
 #pragma once
 
-#include "openssl/aes.h"
-
-#define USE_AES_NI 1 // aes native instructions (if available)
+#include "aeskernel.h"
 
 // this class is used by aes-siv and eme
 
@@ -38,6 +36,7 @@ class AES
 {
 public:
 	// expanded aes keys are stored elsewhere (preferably in a LockZeroBuffer)
+	// keylen must be 256 (the kernels only do AES-256)
 	static void initialize_keys(const unsigned char *key, int keylen /* in bits */, 
 		AES_KEY *encrypt_key, AES_KEY *decrypt_key);
 
@@ -48,7 +47,14 @@ public:
 
 	// decrypt single AES block (16 bytes)
 	void decrypt(const unsigned char *cipher, unsigned char *plain) const;
-  
+
+	// encrypt/decrypt nblocks consecutive AES blocks (ECB)
+	void encrypt_blocks(const unsigned char *plain, unsigned char *cipher, size_t nblocks) const;
+
+	void decrypt_blocks(const unsigned char *cipher, unsigned char *plain, size_t nblocks) const;
+
+	// CTR mode, counter is 16 bytes big-endian and is advanced
+	void ctr(const unsigned char *in, unsigned char *out, size_t len, unsigned char *counter) const;
 
 	// disallow copying
 	AES(AES const&) = delete;
@@ -64,7 +70,7 @@ public:
 	 static bool use_aes_ni();
 
 private:	
-	 bool m_use_aes_ni;
+	 const AesKernel *m_kernel;
 };
 
 
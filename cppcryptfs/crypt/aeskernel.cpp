@@ -0,0 +1,486 @@
+/*
+cppcryptfs : user-mode cryptographic virtual overlay filesystem.
+
+Copyright (C) 2016-2018 Bailey Brown (github.com/bailey27/cppcryptfs)
+
+cppcryptfs is based on the design of gocryptfs (github.com/rfjakob/gocryptfs)
+
+The MIT License (MIT)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#include "stdafx.h"
+#include "aeskernel.h"
+
+#if defined(USE_AES_NI) && (defined(_M_IX86) || defined(_M_X64))
+#define AES_KERNEL_X86 1
+#include <intrin.h>
+#include <immintrin.h>
+#endif
+
+#define AES256_ROUNDS 14
+
+// portable kernel
+
+static void portable_set_keys(const unsigned char *key, AES_KEY *encrypt_key, AES_KEY *decrypt_key)
+{
+	AES_set_encrypt_key(key, 256, encrypt_key);
+	if (decrypt_key)
+		AES_set_decrypt_key(key, 256, decrypt_key);
+}
+
+static void portable_encrypt_blocks(const unsigned char *in, unsigned char *out, size_t nblocks, const AES_KEY *key)
+{
+	for (size_t i = 0; i < nblocks; i++)
+		AES_encrypt(in + i * 16, out + i * 16, key);
+}
+
+static void portable_decrypt_blocks(const unsigned char *in, unsigned char *out, size_t nblocks, const AES_KEY *key)
+{
+	for (size_t i = 0; i < nblocks; i++)
+		AES_decrypt(in + i * 16, out + i * 16, key);
+}
+
+#ifdef AES_KERNEL_X86
+
+// AES-NI kernel
+//
+// The round keys are stored in the AES_KEY as 15 consecutive 16-byte blocks,
+// decryption keys already in reverse order and passed through aesimc.  Nothing
+// here depends on OpenSSL's internal aesni_* key format.
+
+static inline __m128i aes256_assist_1(__m128i t1, __m128i t2)
+{
+	t2 = _mm_shuffle_epi32(t2, 0xff);
+	__m128i t4 = _mm_slli_si128(t1, 4);
+	t1 = _mm_xor_si128(t1, t4);
+	t4 = _mm_slli_si128(t4, 4);
+	t1 = _mm_xor_si128(t1, t4);
+	t4 = _mm_slli_si128(t4, 4);
+	t1 = _mm_xor_si128(t1, t4);
+	return _mm_xor_si128(t1, t2);
+}
+
+static inline __m128i aes256_assist_2(__m128i t1, __m128i t3)
+{
+	__m128i t2 = _mm_shuffle_epi32(_mm_aeskeygenassist_si128(t1, 0), 0xaa);
+	__m128i t4 = _mm_slli_si128(t3, 4);
+	t3 = _mm_xor_si128(t3, t4);
+	t4 = _mm_slli_si128(t4, 4);
+	t3 = _mm_xor_si128(t3, t4);
+	t4 = _mm_slli_si128(t4, 4);
+	t3 = _mm_xor_si128(t3, t4);
+	return _mm_xor_si128(t3, t2);
+}
+
+// _mm_aeskeygenassist_si128() needs the round constant as an immediate
+#define AES256_EXPAND_ROUND(i, rcon) \
+	t1 = aes256_assist_1(t1, _mm_aeskeygenassist_si128(t3, rcon)); \
+	rk[i] = t1; \
+	t3 = aes256_assist_2(t1, t3); \
+	rk[i + 1] = t3;
+
+static void aesni_set_keys(const unsigned char *key, AES_KEY *encrypt_key, AES_KEY *decrypt_key)
+{
+	__m128i rk[AES256_ROUNDS + 1];
+
+	__m128i t1 = _mm_loadu_si128((const __m128i*)key);
+	__m128i t3 = _mm_loadu_si128((const __m128i*)(key + 16));
+
+	rk[0] = t1;
+	rk[1] = t3;
+	AES256_EXPAND_ROUND(2, 0x01);
+	AES256_EXPAND_ROUND(4, 0x02);
+	AES256_EXPAND_ROUND(6, 0x04);
+	AES256_EXPAND_ROUND(8, 0x08);
+	AES256_EXPAND_ROUND(10, 0x10);
+	AES256_EXPAND_ROUND(12, 0x20);
+	rk[14] = aes256_assist_1(t1, _mm_aeskeygenassist_si128(t3, 0x40));
+
+	__m128i *enc = (__m128i*)encrypt_key->rd_key;
+
+	for (int i = 0; i <= AES256_ROUNDS; i++)
+		_mm_storeu_si128(enc + i, rk[i]);
+
+	encrypt_key->rounds = AES256_ROUNDS;
+
+	if (decrypt_key) {
+		__m128i *dec = (__m128i*)decrypt_key->rd_key;
+
+		_mm_storeu_si128(dec, rk[AES256_ROUNDS]);
+		for (int i = 1; i < AES256_ROUNDS; i++)
+			_mm_storeu_si128(dec + i, _mm_aesimc_si128(rk[AES256_ROUNDS - i]));
+		_mm_storeu_si128(dec + AES256_ROUNDS, rk[0]);
+
+		decrypt_key->rounds = AES256_ROUNDS;
+	}
+
+	SecureZeroMemory(rk, sizeof(rk));
+	t1 = t3 = _mm_setzero_si128();
+}
+
+#undef AES256_EXPAND_ROUND
+
+static inline void aesni_load_keys(const AES_KEY *key, __m128i *rk)
+{
+	const __m128i *p = (const __m128i*)key->rd_key;
+
+	for (int i = 0; i <= AES256_ROUNDS; i++)
+		rk[i] = _mm_loadu_si128(p + i);
+}
+
+// the tail of the wide kernels (fewer than 8 blocks left) is done here too
+static void aesni_encrypt_rk(const unsigned char *in, unsigned char *out, size_t nblocks, const __m128i *rk)
+{
+	const size_t ways = 8;
+
+	while (nblocks >= ways) {
+		__m128i b[ways];
+		for (size_t j = 0; j < ways; j++)
+			b[j] = _mm_xor_si128(_mm_loadu_si128((const __m128i*)in + j), rk[0]);
+		for (int r = 1; r < AES256_ROUNDS; r++) {
+			for (size_t j = 0; j < ways; j++)
+				b[j] = _mm_aesenc_si128(b[j], rk[r]);
+		}
+		for (size_t j = 0; j < ways; j++)
+			_mm_storeu_si128((__m128i*)out + j, _mm_aesenclast_si128(b[j], rk[AES256_ROUNDS]));
+		in += ways * 16;
+		out += ways * 16;
+		nblocks -= ways;
+	}
+
+	while (nblocks > 0) {
+		__m128i b = _mm_xor_si128(_mm_loadu_si128((const __m128i*)in), rk[0]);
+		for (int r = 1; r < AES256_ROUNDS; r++)
+			b = _mm_aesenc_si128(b, rk[r]);
+		_mm_storeu_si128((__m128i*)out, _mm_aesenclast_si128(b, rk[AES256_ROUNDS]));
+		in += 16;
+		out += 16;
+		nblocks--;
+	}
+}
+
+static void aesni_decrypt_rk(const unsigned char *in, unsigned char *out, size_t nblocks, const __m128i *rk)
+{
+	const size_t ways = 8;
+
+	while (nblocks >= ways) {
+		__m128i b[ways];
+		for (size_t j = 0; j < ways; j++)
+			b[j] = _mm_xor_si128(_mm_loadu_si128((const __m128i*)in + j), rk[0]);
+		for (int r = 1; r < AES256_ROUNDS; r++) {
+			for (size_t j = 0; j < ways; j++)
+				b[j] = _mm_aesdec_si128(b[j], rk[r]);
+		}
+		for (size_t j = 0; j < ways; j++)
+			_mm_storeu_si128((__m128i*)out + j, _mm_aesdeclast_si128(b[j], rk[AES256_ROUNDS]));
+		in += ways * 16;
+		out += ways * 16;
+		nblocks -= ways;
+	}
+
+	while (nblocks > 0) {
+		__m128i b = _mm_xor_si128(_mm_loadu_si128((const __m128i*)in), rk[0]);
+		for (int r = 1; r < AES256_ROUNDS; r++)
+			b = _mm_aesdec_si128(b, rk[r]);
+		_mm_storeu_si128((__m128i*)out, _mm_aesdeclast_si128(b, rk[AES256_ROUNDS]));
+		in += 16;
+		out += 16;
+		nblocks--;
+	}
+}
+
+static void aesni_encrypt_blocks(const unsigned char *in, unsigned char *out, size_t nblocks, const AES_KEY *key)
+{
+	__m128i rk[AES256_ROUNDS + 1];
+	aesni_load_keys(key, rk);
+	aesni_encrypt_rk(in, out, nblocks, rk);
+}
+
+static void aesni_decrypt_blocks(const unsigned char *in, unsigned char *out, size_t nblocks, const AES_KEY *key)
+{
+	__m128i rk[AES256_ROUNDS + 1];
+	aesni_load_keys(key, rk);
+	aesni_decrypt_rk(in, out, nblocks, rk);
+}
+
+// VAES kernels
+//
+// Same key format as the AES-NI kernel.  Each round key is broadcast to every
+// 128-bit lane, and four registers are kept in flight to cover the latency of
+// vaesenc.
+
+static void vaes256_encrypt_blocks(const unsigned char *in, unsigned char *out, size_t nblocks, const AES_KEY *key)
+{
+	__m128i rk[AES256_ROUNDS + 1];
+	aesni_load_keys(key, rk);
+
+	if (nblocks >= 8) {
+		__m256i wk[AES256_ROUNDS + 1];
+		for (int r = 0; r <= AES256_ROUNDS; r++)
+			wk[r] = _mm256_broadcastsi128_si256(rk[r]);
+
+		const size_t ways = 4;
+
+		while (nblocks >= ways * 2) {
+			__m256i b[ways];
+			for (size_t j = 0; j < ways; j++)
+				b[j] = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)in + j), wk[0]);
+			for (int r = 1; r < AES256_ROUNDS; r++) {
+				for (size_t j = 0; j < ways; j++)
+					b[j] = _mm256_aesenc_epi128(b[j], wk[r]);
+			}
+			for (size_t j = 0; j < ways; j++)
+				_mm256_storeu_si256((__m256i*)out + j, _mm256_aesenclast_epi128(b[j], wk[AES256_ROUNDS]));
+			in += ways * 32;
+			out += ways * 32;
+			nblocks -= ways * 2;
+		}
+
+		_mm256_zeroupper();
+	}
+
+	aesni_encrypt_rk(in, out, nblocks, rk);
+}
+
+static void vaes256_decrypt_blocks(const unsigned char *in, unsigned char *out, size_t nblocks, const AES_KEY *key)
+{
+	__m128i rk[AES256_ROUNDS + 1];
+	aesni_load_keys(key, rk);
+
+	if (nblocks >= 8) {
+		__m256i wk[AES256_ROUNDS + 1];
+		for (int r = 0; r <= AES256_ROUNDS; r++)
+			wk[r] = _mm256_broadcastsi128_si256(rk[r]);
+
+		const size_t ways = 4;
+
+		while (nblocks >= ways * 2) {
+			__m256i b[ways];
+			for (size_t j = 0; j < ways; j++)
+				b[j] = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)in + j), wk[0]);
+			for (int r = 1; r < AES256_ROUNDS; r++) {
+				for (size_t j = 0; j < ways; j++)
+					b[j] = _mm256_aesdec_epi128(b[j], wk[r]);
+			}
+			for (size_t j = 0; j < ways; j++)
+				_mm256_storeu_si256((__m256i*)out + j, _mm256_aesdeclast_epi128(b[j], wk[AES256_ROUNDS]));
+			in += ways * 32;
+			out += ways * 32;
+			nblocks -= ways * 2;
+		}
+
+		_mm256_zeroupper();
+	}
+
+	aesni_decrypt_rk(in, out, nblocks, rk);
+}
+
+static void vaes512_encrypt_blocks(const unsigned char *in, unsigned char *out, size_t nblocks, const AES_KEY *key)
+{
+	__m128i rk[AES256_ROUNDS + 1];
+	aesni_load_keys(key, rk);
+
+	if (nblocks >= 16) {
+		__m512i wk[AES256_ROUNDS + 1];
+		for (int r = 0; r <= AES256_ROUNDS; r++)
+			wk[r] = _mm512_broadcast_i32x4(rk[r]);
+
+		const size_t ways = 4;
+
+		while (nblocks >= ways * 4) {
+			__m512i b[ways];
+			for (size_t j = 0; j < ways; j++)
+				b[j] = _mm512_xor_si512(_mm512_loadu_si512((const __m512i*)in + j), wk[0]);
+			for (int r = 1; r < AES256_ROUNDS; r++) {
+				for (size_t j = 0; j < ways; j++)
+					b[j] = _mm512_aesenc_epi128(b[j], wk[r]);
+			}
+			for (size_t j = 0; j < ways; j++)
+				_mm512_storeu_si512((__m512i*)out + j, _mm512_aesenclast_epi128(b[j], wk[AES256_ROUNDS]));
+			in += ways * 64;
+			out += ways * 64;
+			nblocks -= ways * 4;
+		}
+
+		_mm256_zeroupper();
+	}
+
+	aesni_encrypt_rk(in, out, nblocks, rk);
+}
+
+static void vaes512_decrypt_blocks(const unsigned char *in, unsigned char *out, size_t nblocks, const AES_KEY *key)
+{
+	__m128i rk[AES256_ROUNDS + 1];
+	aesni_load_keys(key, rk);
+
+	if (nblocks >= 16) {
+		__m512i wk[AES256_ROUNDS + 1];
+		for (int r = 0; r <= AES256_ROUNDS; r++)
+			wk[r] = _mm512_broadcast_i32x4(rk[r]);
+
+		const size_t ways = 4;
+
+		while (nblocks >= ways * 4) {
+			__m512i b[ways];
+			for (size_t j = 0; j < ways; j++)
+				b[j] = _mm512_xor_si512(_mm512_loadu_si512((const __m512i*)in + j), wk[0]);
+			for (int r = 1; r < AES256_ROUNDS; r++) {
+				for (size_t j = 0; j < ways; j++)
+					b[j] = _mm512_aesdec_epi128(b[j], wk[r]);
+			}
+			for (size_t j = 0; j < ways; j++)
+				_mm512_storeu_si512((__m512i*)out + j, _mm512_aesdeclast_epi128(b[j], wk[AES256_ROUNDS]));
+			in += ways * 64;
+			out += ways * 64;
+			nblocks -= ways * 4;
+		}
+
+		_mm256_zeroupper();
+	}
+
+	aesni_decrypt_rk(in, out, nblocks, rk);
+}
+
+#endif // AES_KERNEL_X86
+
+static const AesKernel aes_kernels[AES_KERNEL_COUNT] = {
+	{ AES_KERNEL_PORTABLE, L"portable", portable_set_keys, portable_encrypt_blocks, portable_decrypt_blocks },
+#ifdef AES_KERNEL_X86
+	{ AES_KERNEL_AESNI, L"AES-NI", aesni_set_keys, aesni_encrypt_blocks, aesni_decrypt_blocks },
+	{ AES_KERNEL_VAES256, L"VAES-256", aesni_set_keys, vaes256_encrypt_blocks, vaes256_decrypt_blocks },
+	{ AES_KERNEL_VAES512, L"VAES-512", aesni_set_keys, vaes512_encrypt_blocks, vaes512_decrypt_blocks },
+#endif
+};
+
+// which kernels the cpu and os support, indexed by kernel type
+static void get_supported_kernels(bool *supported)
+{
+	for (int i = 0; i < AES_KERNEL_COUNT; i++)
+		supported[i] = false;
+
+	supported[AES_KERNEL_PORTABLE] = true;
+
+#ifdef AES_KERNEL_X86
+	int info[4];
+
+	__cpuid(info, 0);
+	int max_leaf = info[0];
+
+	__cpuid(info, 1);
+	bool aesni = (info[2] & (1 << 25)) != 0;
+	bool osxsave = (info[2] & (1 << 27)) != 0;
+	bool avx = (info[2] & (1 << 28)) != 0;
+
+	if (!aesni)
+		return;
+
+	supported[AES_KERNEL_AESNI] = true;
+
+	// the os must save the ymm (xcr0 bits 1-2) and zmm (bits 5-7) state
+	unsigned long long xcr0 = osxsave ? _xgetbv(0) : 0;
+	bool ymm_state = avx && (xcr0 & 0x06) == 0x06;
+	bool zmm_state = ymm_state && (xcr0 & 0xe6) == 0xe6;
+
+	if (max_leaf < 7)
+		return;
+
+	__cpuidex(info, 7, 0);
+	bool avx2 = (info[1] & (1 << 5)) != 0;
+	bool avx512f = (info[1] & (1 << 16)) != 0;
+	bool vaes = (info[2] & (1 << 9)) != 0;
+
+	supported[AES_KERNEL_VAES256] = vaes && avx2 && ymm_state;
+	supported[AES_KERNEL_VAES512] = vaes && avx512f && zmm_state;
+#endif
+}
+
+static const AesKernel *select_aes_kernel()
+{
+	bool supported[AES_KERNEL_COUNT];
+
+	get_supported_kernels(supported);
+
+	for (int i = AES_KERNEL_COUNT - 1; i > AES_KERNEL_PORTABLE; i--) {
+		if (supported[i])
+			return &aes_kernels[i];
+	}
+
+	return &aes_kernels[AES_KERNEL_PORTABLE];
+}
+
+const AesKernel *aes_kernel()
+{
+	static const AesKernel *kernel = select_aes_kernel();
+
+	return kernel;
+}
+
+const AesKernel *aes_kernel_by_type(int type)
+{
+	if (type < 0 || type >= AES_KERNEL_COUNT)
+		return NULL;
+
+	bool supported[AES_KERNEL_COUNT];
+
+	get_supported_kernels(supported);
+
+	return supported[type] ? &aes_kernels[type] : NULL;
+}
+
+static void increment_counter(unsigned char *counter)
+{
+	for (int i = 15; i >= 0; i--) {
+		if (++counter[i] != 0)
+			break;
+	}
+}
+
+void aes_kernel_ctr(const AesKernel *kernel, const AES_KEY *key, const unsigned char *in,
+	unsigned char *out, size_t len, unsigned char *counter)
+{
+	// enough counter blocks to keep the widest kernel busy
+	const size_t batch_blocks = 32;
+
+	unsigned char keystream[batch_blocks * 16];
+
+	while (len > 0) {
+		size_t nblocks = min((len + 15) / 16, batch_blocks);
+
+		for (size_t i = 0; i < nblocks; i++) {
+			memcpy(keystream + i * 16, counter, 16);
+			increment_counter(counter);
+		}
+
+		kernel->encrypt_blocks(keystream, keystream, nblocks, key);
+
+		size_t n = min(len, nblocks * 16);
+
+		for (size_t i = 0; i < n; i++)
+			out[i] = in[i] ^ keystream[i];
+
+		in += n;
+		out += n;
+		len -= n;
+	}
+
+	SecureZeroMemory(keystream, sizeof(keystream));
+}
@@ -0,0 +1,73 @@
+/*
+cppcryptfs : user-mode cryptographic virtual overlay filesystem.
+
+Copyright (C) 2016-2018 Bailey Brown (github.com/bailey27/cppcryptfs)
+
+cppcryptfs is based on the design of gocryptfs (github.com/rfjakob/gocryptfs)
+
+The MIT License (MIT)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#pragma once
+
+#include "openssl/aes.h"
+
+#define USE_AES_NI 1 // aes native instructions (if available)
+
+// AES kernels.  One of these is selected at run time according to what the
+// cpu supports (cpuid), and it is used for all AES-256 done by the AES class
+// (EME and AES-SIV).  GCM and XChaCha20-Poly1305 go through OpenSSL EVP, which
+// does its own dispatch.
+//
+// Each kernel expands keys in its own format, so an AES_KEY set up by one
+// kernel must only be used with that kernel.
+
+#define AES_KERNEL_PORTABLE 0 // OpenSSL AES_encrypt()/AES_decrypt()
+#define AES_KERNEL_AESNI    1 // AES-NI, 8 blocks interleaved
+#define AES_KERNEL_VAES256  2 // VAES on ymm registers, 2 blocks per instruction
+#define AES_KERNEL_VAES512  3 // VAES on zmm registers (AVX-512), 4 blocks per instruction
+
+#define AES_KERNEL_COUNT    4
+
+typedef void (*aes_set_keys_fn)(const unsigned char *key, AES_KEY *encrypt_key, AES_KEY *decrypt_key);
+
+// ECB over nblocks 16-byte blocks.  in and out may be the same buffer.
+typedef void (*aes_blocks_fn)(const unsigned char *in, unsigned char *out, size_t nblocks, const AES_KEY *key);
+
+struct AesKernel {
+	int type;
+	const WCHAR *name;
+	aes_set_keys_fn set_keys; // 256-bit keys only, decrypt_key may be NULL
+	aes_blocks_fn encrypt_blocks;
+	aes_blocks_fn decrypt_blocks;
+};
+
+// the kernel selected for this cpu
+const AesKernel *aes_kernel();
+
+// returns NULL if the cpu (or os) can't run the requested kernel
+const AesKernel *aes_kernel_by_type(int type);
+
+// CTR mode with a 128-bit big-endian counter, which is advanced past the blocks used.
+// len need not be a multiple of 16.  in and out may be the same buffer.
+void aes_kernel_ctr(const AesKernel *kernel, const AES_KEY *key, const unsigned char *in,
+	unsigned char *out, size_t len, unsigned char *counter);
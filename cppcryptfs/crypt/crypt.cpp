@@ -62,6 +62,9 @@ void *get_crypt_context(int ivlen, int mode)
 		case AES_MODE_GCM:
 			cipher = EVP_aes_256_gcm();
 			break;
+		case CHACHA20_MODE_POLY1305:
+			cipher = EVP_chacha20_poly1305();
+			break;
 		default:
 			handleErrors();
 			break;
@@ -211,21 +214,131 @@ int decrypt(const unsigned char *ciphertext, int ciphertext_len, unsigned char *
 	}
 }
 
+static inline unsigned int
+load32_le(const BYTE *p)
+{
+	return (unsigned int)p[0] | ((unsigned int)p[1] << 8) | ((unsigned int)p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+static inline void
+store32_le(BYTE *p, unsigned int v)
+{
+	p[0] = (BYTE)v;
+	p[1] = (BYTE)(v >> 8);
+	p[2] = (BYTE)(v >> 16);
+	p[3] = (BYTE)(v >> 24);
+}
+
+static inline void
+chacha_quarter_round(unsigned int& a, unsigned int& b, unsigned int& c, unsigned int& d)
+{
+	a += b; d ^= a; d = _rotl(d, 16);
+	c += d; b ^= c; b = _rotl(b, 12);
+	a += b; d ^= a; d = _rotl(d, 8);
+	c += d; b ^= c; b = _rotl(b, 7);
+}
+
+// HChaCha20 derives the 256-bit subkey that XChaCha20 uses from the key and the
+// first 16 bytes of the 24-byte nonce (draft-irtf-cfrg-xchacha).  OpenSSL only
+// provides ChaCha20-Poly1305 with a 12-byte nonce, so this is done here.
+
+static void
+hchacha20(const BYTE *key, const BYTE *nonce, BYTE *subkey)
+{
+	unsigned int x[16];
+
+	// "expand 32-byte k"
+	x[0] = 0x61707865;
+	x[1] = 0x3320646e;
+	x[2] = 0x79622d32;
+	x[3] = 0x6b206574;
+
+	int i;
+
+	for (i = 0; i < 8; i++)
+		x[4 + i] = load32_le(key + 4 * i);
+
+	for (i = 0; i < 4; i++)
+		x[12 + i] = load32_le(nonce + 4 * i);
+
+	for (i = 0; i < 10; i++) {
+		chacha_quarter_round(x[0], x[4], x[8], x[12]);
+		chacha_quarter_round(x[1], x[5], x[9], x[13]);
+		chacha_quarter_round(x[2], x[6], x[10], x[14]);
+		chacha_quarter_round(x[3], x[7], x[11], x[15]);
+		chacha_quarter_round(x[0], x[5], x[10], x[15]);
+		chacha_quarter_round(x[1], x[6], x[11], x[12]);
+		chacha_quarter_round(x[2], x[7], x[8], x[13]);
+		chacha_quarter_round(x[3], x[4], x[9], x[14]);
+	}
+
+	for (i = 0; i < 4; i++) {
+		store32_le(subkey + 4 * i, x[i]);
+		store32_le(subkey + 16 + 4 * i, x[12 + i]);
+	}
+
+	SecureZeroMemory(x, sizeof(x));
+}
+
+// XChaCha20-Poly1305 is ChaCha20-Poly1305 keyed with the HChaCha20 subkey and
+// using 4 zero bytes followed by the last 8 bytes of the nonce as its nonce.
+// encrypt() and decrypt() work for it as-is because EVP_CTRL_GCM_GET_TAG and
+// EVP_CTRL_GCM_SET_TAG are the same as EVP_CTRL_AEAD_GET_TAG and EVP_CTRL_AEAD_SET_TAG.
+
+int encrypt_xchacha(const unsigned char *plaintext, int plaintext_len, unsigned char *aad,
+	int aad_len, const unsigned char *key, const unsigned char *nonce,
+	unsigned char *ciphertext, unsigned char *tag, void *context)
+{
+	BYTE subkey[32];
+	BYTE iv[12];
+
+	hchacha20(key, nonce, subkey);
+
+	memset(iv, 0, 4);
+	memcpy(iv + 4, nonce + 16, 8);
+
+	int ciphertext_len = encrypt(plaintext, plaintext_len, aad, aad_len, subkey, iv, ciphertext, tag, context);
+
+	SecureZeroMemory(subkey, sizeof(subkey));
+
+	return ciphertext_len;
+}
+
+int decrypt_xchacha(const unsigned char *ciphertext, int ciphertext_len, unsigned char *aad,
+	int aad_len, unsigned char *tag, const unsigned char *key, const unsigned char *nonce,
+	unsigned char *plaintext, void *context)
+{
+	BYTE subkey[32];
+	BYTE iv[12];
+
+	hchacha20(key, nonce, subkey);
+
+	memset(iv, 0, 4);
+	memcpy(iv + 4, nonce + 16, 8);
+
+	int plaintext_len = decrypt(ciphertext, ciphertext_len, aad, aad_len, tag, subkey, iv, plaintext, context);
+
+	SecureZeroMemory(subkey, sizeof(subkey));
+
+	return plaintext_len;
+}
+
 int encrypt_siv(const unsigned char *plaintext, int plaintext_len, unsigned char *aad,
 	int aad_len, const unsigned char *iv, 
 	unsigned char *ciphertext, unsigned char *siv, const SivContext *context)
 {
 
-	if (aad_len != 24)
-		return -1;
+	// 24 bytes of block number and file id, plus the length word with Compression
+	unsigned char header_data[24+BLOCK_LEN_HEADER_LEN+16];
 
-	unsigned char header_data[24+16];
+	if (aad_len != 24 && aad_len != 24 + BLOCK_LEN_HEADER_LEN)
+		return -1;
 
 	memcpy(header_data, aad, aad_len);
 
 	memcpy(header_data + aad_len, iv, 16);
 
-	size_t header_sizes[2] = { 24, 16 };
+	size_t header_sizes[2] = { (size_t)aad_len, 16 };
 
 	memcpy(ciphertext, plaintext, plaintext_len);
 
@@ -240,16 +353,17 @@ int decrypt_siv(const unsigned char *ciphertext, int ciphertext_len, unsigned ch
 	unsigned char *plaintext, const SivContext *context)
 {
 
-	if (aad_len != 24)
-		return -1;
+	// 24 bytes of block number and file id, plus the length word with Compression
+	unsigned char header_data[24+BLOCK_LEN_HEADER_LEN+16];
 
-	unsigned char header_data[24+16];
+	if (aad_len != 24 && aad_len != 24 + BLOCK_LEN_HEADER_LEN)
+		return -1;
 
 	memcpy(header_data, aad, aad_len);
 
 	memcpy(header_data + aad_len, iv, 16);
 
-	size_t header_sizes[2] = { 24, 16 };
+	size_t header_sizes[2] = { (size_t)aad_len, 16 };
 
 	memcpy(plaintext, ciphertext, ciphertext_len);
 
@@ -461,6 +575,7 @@ bool decrypt_string_gcm(const string& base64_in, const BYTE *key, wstring& str)
 const char *hkdfInfoEMENames = "EME filename encryption";
 const char *hkdfInfoGCMContent = "AES-GCM file content encryption";
 const char *hkdfInfoSIVContent = "AES-SIV file content encryption";
+const char *hkdfInfoXChaChaPoly1305Content = "XChaCha20-Poly1305 file content encryption";
 
 bool hkdfDerive(const BYTE *masterKey, int masterKeyLen, BYTE *newKey, int newKeyLen, const char *info)
 {
@@ -47,6 +47,17 @@ int decrypt(const unsigned char *ciphertext, int ciphertext_len, unsigned char *
 	int aad_len, unsigned char *tag, const unsigned char *key, const unsigned char *iv, 
 	unsigned char *plaintext, void *context);
 
+// XChaCha20-Poly1305 (as used by gocryptfs -xchacha).  nonce is 24 bytes, and
+// context must come from get_crypt_context(..., CHACHA20_MODE_POLY1305).
+
+int encrypt_xchacha(const unsigned char *plaintext, int plaintext_len, unsigned char *aad,
+	int aad_len, const unsigned char *key, const unsigned char *nonce,
+	unsigned char *ciphertext, unsigned char *tag, void *context);
+
+int decrypt_xchacha(const unsigned char *ciphertext, int ciphertext_len, unsigned char *aad,
+	int aad_len, unsigned char *tag, const unsigned char *key, const unsigned char *nonce,
+	unsigned char *plaintext, void *context);
+
 int encrypt_siv(const unsigned char *plaintext, int plaintext_len, unsigned char *aad,
 	int aad_len, const unsigned char *iv,
 	unsigned char *ciphertext, unsigned char *siv, const SivContext *context);
@@ -69,4 +80,5 @@ bool hkdfDerive(const BYTE *masterKey, int masterKeyLen, BYTE *newKey, int newKe
 
 extern const char *hkdfInfoEMENames;
 extern const char *hkdfInfoGCMContent;
-extern const char *hkdfInfoSIVContent;
\ No newline at end of file
+extern const char *hkdfInfoSIVContent;
+extern const char *hkdfInfoXChaChaPoly1305Content;
\ No newline at end of file
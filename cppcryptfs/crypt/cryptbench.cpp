@@ -0,0 +1,375 @@
+/*
+cppcryptfs : user-mode cryptographic virtual overlay filesystem.
+
+Copyright (C) 2016-2018 Bailey Brown (github.com/bailey27/cppcryptfs)
+
+cppcryptfs is based on the design of gocryptfs (github.com/rfjakob/gocryptfs)
+
+The MIT License (MIT)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#include "stdafx.h"
+
+#include "cryptbench.h"
+#include "cryptdefs.h"
+#include "crypt.h"
+#include "eme.h"
+#include "siv.h"
+#include "aeskernel.h"
+#include "util/util.h"
+
+#include <vector>
+#include <functional>
+#include <memory>
+
+// A benchmark case.  make() is called once per thread to set up the
+// buffers and keys the thread uses, and returns a function that does one
+// operation on size bytes.
+
+struct BenchCase {
+	string name;
+	int size;
+	function<function<bool()>()> make;
+};
+
+struct BenchThread {
+	function<bool()> op;
+	HANDLE start;
+	LONGLONG deadline;
+	ULONGLONG ops;
+	bool ok;
+};
+
+static DWORD WINAPI bench_thread_proc(LPVOID param)
+{
+	BenchThread *bt = (BenchThread*)param;
+
+	WaitForSingleObject(bt->start, INFINITE);
+
+	LARGE_INTEGER now;
+
+	do {
+		// check the clock only every few operations, so it doesn't dominate small ones
+		for (int i = 0; i < 16; i++) {
+			if (!bt->op()) {
+				bt->ok = false;
+				return 0;
+			}
+		}
+		bt->ops += 16;
+		QueryPerformanceCounter(&now);
+	} while (now.QuadPart < bt->deadline);
+
+	return 0;
+}
+
+// Runs bc on nthreads threads at once for CRYPT_BENCHMARK_SECONDS, and
+// appends the result to json.
+static bool run_case(const BenchCase& bc, int nthreads, string& json)
+{
+	vector<BenchThread> threads(nthreads);
+	vector<HANDLE> handles;
+
+	HANDLE start = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+	if (!start)
+		return false;
+
+	LARGE_INTEGER freq, t0, t1;
+	QueryPerformanceFrequency(&freq);
+
+	bool ok = true;
+
+	for (auto& bt : threads) {
+		bt.op = bc.make();
+		bt.start = start;
+		bt.ops = 0;
+		bt.ok = true;
+		if (!bt.op) {
+			ok = false;
+			break;
+		}
+	}
+
+	if (ok) {
+		for (auto& bt : threads) {
+			HANDLE h = CreateThread(NULL, 0, bench_thread_proc, &bt, 0, NULL);
+			if (!h) {
+				ok = false;
+				break;
+			}
+			handles.push_back(h);
+		}
+	}
+
+	// the threads wait for start, so they all begin at once
+	QueryPerformanceCounter(&t0);
+
+	for (auto& bt : threads)
+		bt.deadline = t0.QuadPart + (LONGLONG)(CRYPT_BENCHMARK_SECONDS * freq.QuadPart);
+
+	SetEvent(start);
+
+	if (!handles.empty())
+		WaitForMultipleObjects((DWORD)handles.size(), &handles[0], TRUE, INFINITE);
+
+	QueryPerformanceCounter(&t1);
+
+	for (auto h : handles)
+		CloseHandle(h);
+
+	CloseHandle(start);
+
+	if (!ok)
+		return false;
+
+	ULONGLONG ops = 0;
+
+	for (auto& bt : threads) {
+		if (!bt.ok)
+			return false;
+		ops += bt.ops;
+	}
+
+	double seconds = (double)(t1.QuadPart - t0.QuadPart) / freq.QuadPart;
+
+	// ns_per_op is the time an operation takes on one thread, and mb_per_s
+	// is the combined rate of all the threads
+	char buf[256];
+
+	sprintf_s(buf, "%s\n    {\"name\": \"%s\", \"size\": %d, \"threads\": %d, \"ops\": %llu, \"ns_per_op\": %.1f, \"mb_per_s\": %.1f}",
+		json.back() == '[' ? "" : ",", bc.name.c_str(), bc.size, nthreads, ops,
+		ops ? seconds * 1e9 * nthreads / ops : 0.0, ops * (double)bc.size / seconds / (1024 * 1024));
+
+	json += buf;
+
+	return true;
+}
+
+static const BYTE zero_iv[BLOCK_IV_LEN] = { 0 };
+static const BYTE zero_nonce[BLOCK_XCHACHA_NONCE_LEN] = { 0 };
+
+static void fill(vector<BYTE>& buf)
+{
+	for (size_t i = 0; i < buf.size(); i++)
+		buf[i] = (BYTE)(i * 131 + 7);
+}
+
+static void add_aes_cases(vector<BenchCase>& cases, const AesKernel *kernel, const BYTE *key)
+{
+	string kernel_name;
+
+	if (!unicode_to_utf8(kernel->name, kernel_name))
+		return;
+
+	string name = "aes_" + kernel_name;
+
+	for (int size : { 4096, 1024 * 1024 }) {
+		cases.push_back({ name, size, [=]() -> function<bool()> {
+			auto aes_key = make_shared<AES_KEY>();
+			kernel->set_keys(key, aes_key.get(), NULL);
+			auto buf = make_shared<vector<BYTE>>(size);
+			fill(*buf);
+			return [=]() {
+				kernel->encrypt_blocks(&(*buf)[0], &(*buf)[0], size / 16, aes_key.get());
+				return true;
+			};
+		} });
+	}
+}
+
+bool run_crypt_benchmark(int nthreads, string& json, wstring& mes)
+{
+	BYTE key[32];
+
+	for (int i = 0; i < (int)sizeof(key); i++)
+		key[i] = (BYTE)i;
+
+	EmeCryptContext eme;
+	SivContext siv;
+
+	if (!eme.init(key, true) || !siv.SetKey(key, sizeof(key), true)) {
+		mes = L"unable to set up keys";
+		return false;
+	}
+
+	const EmeCryptContext *peme = &eme;
+	const SivContext *psiv = &siv;
+
+	vector<BenchCase> cases;
+
+	for (int type = 0; type < AES_KERNEL_COUNT; type++) {
+		const AesKernel *kernel = aes_kernel_by_type(type);
+		if (kernel)
+			add_aes_cases(cases, kernel, key);
+	}
+
+	static const int data_sizes[] = { 4096, 1024 * 1024 };
+
+	// names are padded to a multiple of 16 bytes before EME
+	static const int name_sizes[] = { 16, 64, 255 };
+
+	static unsigned char aad[24];
+
+	for (int size : data_sizes) {
+
+		for (bool dec : { false, true }) {
+			cases.push_back({ dec ? "gcm_decrypt" : "gcm_encrypt", size, [=]() -> function<bool()> {
+				void *ctx = get_crypt_context(BLOCK_IV_LEN, AES_MODE_GCM);
+				if (!ctx)
+					return NULL;
+				shared_ptr<void> context(ctx, free_crypt_context);
+				auto pt = make_shared<vector<BYTE>>(size);
+				auto ct = make_shared<vector<BYTE>>(size);
+				auto tag = make_shared<vector<BYTE>>(BLOCK_TAG_LEN);
+				fill(*pt);
+				if (encrypt(&(*pt)[0], size, aad, sizeof(aad), key, zero_iv, &(*ct)[0], &(*tag)[0], ctx) != size)
+					return NULL;
+				return [=]() {
+					if (dec)
+						return decrypt(&(*ct)[0], size, aad, sizeof(aad), &(*tag)[0], key, zero_iv, &(*pt)[0], context.get()) == size;
+					else
+						return encrypt(&(*pt)[0], size, aad, sizeof(aad), key, zero_iv, &(*ct)[0], &(*tag)[0], context.get()) == size;
+				};
+			} });
+		}
+
+		for (bool dec : { false, true }) {
+			cases.push_back({ dec ? "xchacha_decrypt" : "xchacha_encrypt", size, [=]() -> function<bool()> {
+				void *ctx = get_crypt_context(BLOCK_XCHACHA_NONCE_LEN, CHACHA20_MODE_POLY1305);
+				if (!ctx)
+					return NULL;
+				shared_ptr<void> context(ctx, free_crypt_context);
+				auto pt = make_shared<vector<BYTE>>(size);
+				auto ct = make_shared<vector<BYTE>>(size);
+				auto tag = make_shared<vector<BYTE>>(BLOCK_TAG_LEN);
+				fill(*pt);
+				if (encrypt_xchacha(&(*pt)[0], size, aad, sizeof(aad), key, zero_nonce, &(*ct)[0], &(*tag)[0], ctx) != size)
+					return NULL;
+				return [=]() {
+					if (dec)
+						return decrypt_xchacha(&(*ct)[0], size, aad, sizeof(aad), &(*tag)[0], key, zero_nonce, &(*pt)[0], context.get()) == size;
+					else
+						return encrypt_xchacha(&(*pt)[0], size, aad, sizeof(aad), key, zero_nonce, &(*ct)[0], &(*tag)[0], context.get()) == size;
+				};
+			} });
+		}
+
+		for (bool dec : { false, true }) {
+			cases.push_back({ dec ? "siv_decrypt" : "siv_encrypt", size, [=]() -> function<bool()> {
+				auto pt = make_shared<vector<BYTE>>(size);
+				auto ct = make_shared<vector<BYTE>>(size);
+				auto tag = make_shared<vector<BYTE>>(BLOCK_SIV_LEN);
+				fill(*pt);
+				if (encrypt_siv(&(*pt)[0], size, aad, sizeof(aad), zero_iv, &(*ct)[0], &(*tag)[0], psiv) != size)
+					return NULL;
+				return [=]() {
+					if (dec)
+						return decrypt_siv(&(*ct)[0], size, aad, sizeof(aad), &(*tag)[0], zero_iv, &(*pt)[0], psiv) == size;
+					else
+						return encrypt_siv(&(*pt)[0], size, aad, sizeof(aad), zero_iv, &(*ct)[0], &(*tag)[0], psiv) == size;
+				};
+			} });
+		}
+	}
+
+	for (int size : name_sizes) {
+
+		int padded = (size + 16) & ~15;
+
+		for (bool dec : { false, true }) {
+			cases.push_back({ dec ? "eme_decrypt" : "eme_encrypt", padded, [=]() -> function<bool()> {
+				auto buf = make_shared<vector<BYTE>>(padded);
+				fill(*buf);
+				return [=]() {
+					BYTE *out = EmeTransform(peme, zero_iv, &(*buf)[0], padded, !dec);
+					if (!out)
+						return false;
+					delete[] out;
+					return true;
+				};
+			} });
+		}
+
+		cases.push_back({ "base64_encode", size, [=]() -> function<bool()> {
+			auto buf = make_shared<vector<BYTE>>(size);
+			fill(*buf);
+			auto str = make_shared<string>();
+			return [=]() {
+				return base64_encode(&(*buf)[0], size, *str, true, false) != NULL;
+			};
+		} });
+
+		cases.push_back({ "base64_decode", size, [=]() -> function<bool()> {
+			vector<BYTE> buf(size);
+			fill(buf);
+			auto str = make_shared<string>();
+			if (!base64_encode(&buf[0], size, *str, true, false))
+				return NULL;
+			auto out = make_shared<vector<BYTE>>();
+			return [=]() {
+				return base64_decode(str->c_str(), *out, true, false);
+			};
+		} });
+	}
+
+	for (int size : { 16, 64, 255, 4096 }) {
+		cases.push_back({ "sha256", size, [=]() -> function<bool()> {
+			auto buf = make_shared<vector<BYTE>>(size);
+			fill(*buf);
+			return [=]() {
+				BYTE sum[SHA256_LEN];
+				return sha256(&(*buf)[0], size, sum);
+			};
+		} });
+	}
+
+	cases.push_back({ "hkdf", 32, [=]() -> function<bool()> {
+		return [=]() {
+			BYTE out[32];
+			return hkdfDerive(key, sizeof(key), out, sizeof(out), hkdfInfoGCMContent);
+		};
+	} });
+
+	string aes_name;
+	unicode_to_utf8(aes_kernel()->name, aes_name);
+
+	json = "{\n  \"aes_implementation\": \"" + aes_name + "\",\n  \"results\": [";
+
+	for (int threads : { 1, nthreads }) {
+		for (auto& bc : cases) {
+			if (!run_case(bc, threads, json)) {
+				mes = L"benchmark failed: ";
+				wstring name;
+				utf8_to_unicode(bc.name.c_str(), name);
+				mes += name;
+				return false;
+			}
+		}
+		if (nthreads == 1)
+			break;
+	}
+
+	json += "\n  ]\n}\n";
+
+	return true;
+}
@@ -41,11 +41,19 @@ THE SOFTWARE.
 #define DIR_IV_LEN 16
 #define BLOCK_TAG_LEN 16
 #define CIPHER_BLOCK_OVERHEAD (BLOCK_IV_LEN+BLOCK_TAG_LEN)
+#define BLOCK_XCHACHA_NONCE_LEN 24
+#define XCHACHA_BLOCK_OVERHEAD (BLOCK_XCHACHA_NONCE_LEN+BLOCK_TAG_LEN)
 #define CIPHER_BS (PLAIN_BS+CIPHER_BLOCK_OVERHEAD)
 #define CIPHER_FILE_OVERHEAD FILE_HEADER_LEN
+#define ALIGNED_BLOCK_LEN 4096 // header length, and slot length beyond the plaintext, with AlignedBlocks
+#define MAX_BLOCK_SIZE (1024*1024) // largest BlockSize allowed in the config file
+#define BLOCK_LEN_HEADER_LEN 4 // authenticated length word after the IV with Compression
+#define BLOCK_COMPRESSED_FLAG 0x80000000 // set in the length word if the block is compressed
+#define MAX_CIPHER_BLOCK_OVERHEAD (XCHACHA_BLOCK_OVERHEAD+BLOCK_LEN_HEADER_LEN)
 #define MASTER_KEY_LEN 32
 
 #define AES_MODE_GCM 1
+#define CHACHA20_MODE_POLY1305 2
 
 #define SALT_LEN 32
 
@@ -89,20 +89,12 @@ static void xorBlocks(BYTE* out,  const BYTE* in1,  const BYTE* in2, int len) {
 
 static void AesEncrypt(BYTE* dst, const BYTE* src, int len, const EmeCryptContext *eme_context)
 {
-	int numBlocks = len / 16;
-
-	for (int i = 0; i < numBlocks; i++) {
-		eme_context->m_aes_ctx.encrypt(src + i * 16, dst + i * 16);
-	}
+	eme_context->m_aes_ctx.encrypt_blocks(src, dst, len / 16);
 }
 
 static void AesDecrypt(BYTE* dst, const BYTE* src, int len, const EmeCryptContext *eme_context)
 {
-	int numBlocks = len / 16;
-
-	for (int i = 0; i < numBlocks; i++) {
-		eme_context->m_aes_ctx.decrypt(src + i * 16, dst + i * 16);
-	}
+	eme_context->m_aes_ctx.decrypt_blocks(src, dst, len / 16);
 }
 
 // aesTransform - encrypt or decrypt (according to "direction") using block
@@ -226,17 +218,14 @@ BYTE* EmeTransform(const EmeCryptContext *eme_context, const BYTE *T, const BYTE
 
 		BYTE **LTable = eme_context->m_LTable;
 
-		BYTE PPj[16];
-
 		for (int j = 0; j < m; j++) {
-			BYTE Pj[16];
-			memcpy(Pj, P + j * 16, 16);
 			/* PPj = 2**(j-1)*L xor Pj */
-			xorBlocks(PPj, Pj, LTable[j], 16);
-			/* PPPj = AESenc(K; PPj) */
-			aesTransform(C + j * 16, PPj, direction, 16, eme_context);
+			xorBlocks(C + j * 16, P + j * 16, LTable[j], 16);
 		}
 
+		/* PPPj = AESenc(K; PPj), all blocks in one pass so the wide AES kernels can be used */
+		aesTransform(C, C, direction, len, eme_context);
+
 		/* MP =(xorSum PPPj) xor T */
 		BYTE MP[16];
 		xorBlocks(MP, C, T, 16);
@@ -269,14 +258,12 @@ BYTE* EmeTransform(const EmeCryptContext *eme_context, const BYTE *T, const BYTE
 
 		memcpy(C, CCC1, 16);
 
-		for (int j = 0; j < m; j++) {
-			/* CCj = AES-enc(K; CCCj) */
-			BYTE dst[16];
-
-			aesTransform(dst, C + j * 16, direction, 16, eme_context);
+		/* CCj = AES-enc(K; CCCj) */
+		aesTransform(C, C, direction, len, eme_context);
 
+		for (int j = 0; j < m; j++) {
 			/* Cj = 2**(j-1)*L xor CCj */
-			xorBlocks(C + j * 16, dst, LTable[j], 16);
+			xorBlocks(C + j * 16, C + j * 16, LTable[j], 16);
 		}
 	} catch (...) {
 		error = true;
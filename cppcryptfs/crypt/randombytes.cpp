@@ -30,77 +30,89 @@ THE SOFTWARE.
 
 #include <windows.h>
 #include "util/util.h"
+#include "aeskernel.h"
 #include "randombytes.h"
 
-RandomBytes::RandomBytes()
+CtrDrbg::CtrDrbg() : m_state(1)
 {
+	m_generated = 0;
+	m_seeded = false;
+}
 
-	m_pRandBuf = new LockZeroBuffer<BYTE>(RANDOM_POOL_SIZE);
+CtrDrbg::~CtrDrbg()
+{
+}
 
-	if (!m_pRandBuf->IsLocked()) {
-		delete m_pRandBuf;
-		m_pRandBuf = NULL;
-		::MessageBox(NULL, L"cannot lock random pool", L"cppcryptfs", MB_OK | MB_ICONERROR);
-		bad_alloc exception;
-		throw exception;
-	}
+bool CtrDrbg::Reseed()
+{
+	State *st = m_state.m_buf;
 
-	m_randbuf = m_pRandBuf->m_buf;
+	if (!get_sys_random_bytes(st->next, sizeof(st->next)))
+		return false;
 
-	m_bufpos = RANDOM_POOL_SIZE;
+	aes_kernel()->set_keys(st->next, &st->key, NULL);
+	memcpy(st->v, st->next + 32, sizeof(st->v));
+	SecureZeroMemory(st->next, sizeof(st->next));
 
-	InitializeCriticalSection(&m_crit);
-}
+	m_generated = 0;
+	m_seeded = true;
 
-RandomBytes::~RandomBytes()
-{
-	// do not free m_randbuf.  It points to m_pRandBuf->m_buf
-	if (m_pRandBuf)
-		delete m_pRandBuf;
-
-	DeleteCriticalSection(&m_crit);
+	return true;
 }
 
-void RandomBytes::lock()
+// replace the key and v with the next 48 bytes of output
+void CtrDrbg::Update()
 {
-	EnterCriticalSection(&m_crit);
-}
+	State *st = m_state.m_buf;
 
-void RandomBytes::unlock()
-{
-	LeaveCriticalSection(&m_crit);
+	memset(st->next, 0, sizeof(st->next));
+	aes_kernel_ctr(aes_kernel(), &st->key, st->next, st->next, sizeof(st->next), st->v);
+
+	aes_kernel()->set_keys(st->next, &st->key, NULL);
+	memcpy(st->v, st->next + 32, sizeof(st->v));
+	SecureZeroMemory(st->next, sizeof(st->next));
 }
 
-bool RandomBytes::GetRandomBytes(unsigned char *buf, DWORD len)
+bool CtrDrbg::Generate(unsigned char *buf, DWORD len)
 {
-	if (len > RANDOM_POOL_SIZE) {
+	// never keep DRBG state in pageable memory
+	if (!m_state.IsLocked())
 		return get_sys_random_bytes(buf, len);
-	}
 
-	bool bret = true;
+	State *st = m_state.m_buf;
 
-	lock();
-
-	if (m_bufpos + len < RANDOM_POOL_SIZE) {
-		memcpy(buf, m_randbuf + m_bufpos, len);
-		m_bufpos += len;
-	} else {
-		DWORD bytes_copied = 0;
-		if (m_bufpos < RANDOM_POOL_SIZE) {
-			memcpy(buf, m_randbuf + m_bufpos, RANDOM_POOL_SIZE - m_bufpos);
-			bytes_copied += RANDOM_POOL_SIZE - m_bufpos;
-			m_bufpos += bytes_copied;
-		}
-		if (get_sys_random_bytes(m_randbuf, RANDOM_POOL_SIZE)) {
-			m_bufpos = 0;
-			memcpy(buf + bytes_copied, m_randbuf + m_bufpos, len - bytes_copied);
-			m_bufpos += len - bytes_copied;
-		} else {
-			bret = false;
+	while (len > 0) {
+		if (!m_seeded || m_generated >= DRBG_RESEED_INTERVAL) {
+			if (!Reseed())
+				return false;
 		}
+
+		DWORD n = min(len, DRBG_MAX_REQUEST);
+
+		memset(buf, 0, n);
+		aes_kernel_ctr(aes_kernel(), &st->key, buf, buf, n, st->v);
+
+		Update();
+
+		m_generated += n;
+		buf += n;
+		len -= n;
 	}
 
-	unlock();
+	return true;
+}
+
+RandomBytes::RandomBytes()
+{
+}
+
+RandomBytes::~RandomBytes()
+{
+}
+
+bool RandomBytes::GetRandomBytes(unsigned char *buf, DWORD len)
+{
+	thread_local CtrDrbg drbg;
 
-	return bret;
+	return drbg.Generate(buf, len);
 }
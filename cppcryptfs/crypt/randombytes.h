@@ -30,26 +30,54 @@ THE SOFTWARE.
 
 #include <windows.h>
 
+#include "openssl/aes.h"
 #include "util/LockZeroBuffer.h"
 
-#define RANDOM_POOL_SIZE (32*1024)
+// bytes a thread's DRBG produces before it is reseeded from the system RNG
+#define DRBG_RESEED_INTERVAL (1024*1024)
 
-class RandomBytes {
+// longest run of output between two updates of a DRBG's key
+#define DRBG_MAX_REQUEST (64*1024)
+
+// AES-256 CTR DRBG (after NIST SP 800-90A CTR_DRBG, without a derivation
+// function).  Each thread has its own, so generating IVs takes no lock.
+// It is seeded from the system RNG on first use and reseeded every
+// DRBG_RESEED_INTERVAL bytes, and its key is replaced after every request
+// so earlier output can't be recovered from the state.
+
+class CtrDrbg {
 private:
+	struct State {
+		AES_KEY key;
+		unsigned char v[16];
+		unsigned char next[32 + 16]; // key and v for the next update
+	};
+
+	LockZeroBuffer<State> m_state;
+
+	unsigned long long m_generated;
 
-	LockZeroBuffer<BYTE> *m_pRandBuf;
+	bool m_seeded;
 
-	unsigned char *m_randbuf; // do not free this. it points to m_pRandBuf->m_buf;
+	bool Reseed();
+	void Update();
 
-	DWORD m_bufpos;
+public:
+	bool Generate(unsigned char *buf, DWORD len);
 
-	CRITICAL_SECTION m_crit;
+	CtrDrbg();
 
+	// disallow copying
+	CtrDrbg(CtrDrbg const&) = delete;
+	void operator=(CtrDrbg const&) = delete;
 
-	void lock();
-	void unlock();
+	virtual ~CtrDrbg();
+};
 
+class RandomBytes {
 public:
+	// Uses the calling thread's DRBG.  A batched write can fetch the IVs for
+	// all of its blocks with one call.
 	bool GetRandomBytes(unsigned char *buf, DWORD len);
 
 	RandomBytes();
@@ -60,4 +88,3 @@ public:
 
 	virtual ~RandomBytes();
 };
-
@@ -99,6 +99,7 @@ THE SOFTWARE.
 #include "cryptdokanpriv.h"
 #include "FileNameEnc.h"
 #include "MountPointManager.h"
+#include "cryptreplay.h"
 
 
 
@@ -273,6 +274,7 @@ CryptCreateFile(LPCWSTR FileName, PDOKAN_IO_SECURITY_CONTEXT SecurityContext,
                 ULONG ShareAccess, ULONG CreateDisposition, ULONG CreateOptions,
                 PDOKAN_FILE_INFO DokanFileInfo) {
 
+  PerfTimer perf(&GetContext()->m_perf, PERF_CREATE);
   string actual_encrypted;
   FileNameEnc filePath(DokanFileInfo, FileName, &actual_encrypted);
   HANDLE handle = NULL;
@@ -587,13 +589,22 @@ CryptCreateFile(LPCWSTR FileName, PDOKAN_IO_SECURITY_CONTEXT SecurityContext,
                genericDesiredAccess, ShareAccess, creationDisposition,
                fileAttributesAndFlags);
 
+      // In direct I/O mode, we bypass the system cache for the backing file
+      // and let the cache on the plaintext side do the caching.
+      // The config file is read with plain ReadFile(), so it is excluded.
+      DWORD backingFlags = fileAttributesAndFlags;
+      if (GetContext()->m_direct_io &&
+          !rt_is_config_file(GetContext(), FileName)) {
+        backingFlags |= FILE_FLAG_NO_BUFFERING;
+      }
+
       handle = CreateFile(
           filePath,
           genericDesiredAccess, // GENERIC_READ|GENERIC_WRITE|GENERIC_EXECUTE,
           ShareAccess,
           &securityAttrib, // security attribute
           creationDisposition,
-          fileAttributesAndFlags, // |FILE_FLAG_NO_BUFFERING,
+          backingFlags,
           NULL);                  // template file handle
     }
 
@@ -621,6 +632,10 @@ CryptCreateFile(LPCWSTR FileName, PDOKAN_IO_SECURITY_CONTEXT SecurityContext,
         SetFileAttributes(filePath, fileAttributesAndFlags | fileAttr);
       }
 
+      // track per-file state shared by all handles open on the file
+      if (!is_virtual)
+        GetContext()->m_open_files.Register(handle);
+
       DokanFileInfo->Context =
           (ULONG64)handle; // save the file handle in Context
 
@@ -657,8 +672,10 @@ static void DOKAN_CALLBACK CryptCloseFile(LPCWSTR FileName,
   if (DokanFileInfo->Context) {
     DbgPrint(L"CloseFile: %s, %x\n", FileName, (DWORD)DokanFileInfo->Context);
     DbgPrint(L"\terror : not cleanuped file\n\n");
-    if ((HANDLE)DokanFileInfo->Context != INVALID_HANDLE_VALUE)
+    if ((HANDLE)DokanFileInfo->Context != INVALID_HANDLE_VALUE) {
+      GetContext()->m_open_files.Unregister((HANDLE)DokanFileInfo->Context);
       CloseHandle((HANDLE)DokanFileInfo->Context);
+    }
     DokanFileInfo->Context = 0;
   } else {
     DbgPrint(L"Close (no handle): %s\n\n", FileName);
@@ -671,8 +688,10 @@ static void DOKAN_CALLBACK CryptCleanup(LPCWSTR FileName,
 
   if (DokanFileInfo->Context) {
     DbgPrint(L"Cleanup: %s, %x\n\n", FileName, (DWORD)DokanFileInfo->Context);
-    if ((HANDLE)DokanFileInfo->Context != INVALID_HANDLE_VALUE)
+    if ((HANDLE)DokanFileInfo->Context != INVALID_HANDLE_VALUE) {
+      GetContext()->m_open_files.Unregister((HANDLE)DokanFileInfo->Context);
       CloseHandle((HANDLE)(DokanFileInfo->Context));
+    }
     DokanFileInfo->Context = 0;
   } else {
     DbgPrint(L"Cleanup: %s\n\tinvalid handle\n\n", FileName);
@@ -713,6 +732,8 @@ static NTSTATUS DOKAN_CALLBACK CryptReadFile(LPCWSTR FileName, LPVOID Buffer,
                                              LPDWORD ReadLength,
                                              LONGLONG Offset,
                                              PDOKAN_FILE_INFO DokanFileInfo) {
+  PerfTimer perf(&GetContext()->m_perf, PERF_READ, ReadLength);
+  perf.SetTrace(0, Offset);
   FileNameEnc filePath(DokanFileInfo, FileName);
   HANDLE handle = (HANDLE)DokanFileInfo->Context;
   BOOL opened = FALSE;
@@ -761,6 +782,8 @@ static NTSTATUS DOKAN_CALLBACK CryptReadFile(LPCWSTR FileName, LPVOID Buffer,
     }
   } else if (file->Associate(GetContext(), handle, FileName)) {
 
+    perf.SetTrace(file->TraceFile(), Offset);
+
     if (!file->Read((unsigned char *)Buffer, BufferLength, ReadLength,
                     Offset)) {
       DWORD error = GetLastError();
@@ -780,6 +803,8 @@ static NTSTATUS DOKAN_CALLBACK CryptReadFile(LPCWSTR FileName, LPVOID Buffer,
   if (opened)
     CloseHandle(handle);
 
+  perf.SetStatus(ret_status);
+
   return ret_status;
 }
 
@@ -788,6 +813,8 @@ static NTSTATUS DOKAN_CALLBACK CryptWriteFile(LPCWSTR FileName, LPCVOID Buffer,
                                               LPDWORD NumberOfBytesWritten,
                                               LONGLONG Offset,
                                               PDOKAN_FILE_INFO DokanFileInfo) {
+  PerfTimer perf(&GetContext()->m_perf, PERF_WRITE, NumberOfBytesWritten);
+  perf.SetTrace(0, Offset);
   FileNameEnc filePath(DokanFileInfo, FileName);
   HANDLE handle = (HANDLE)DokanFileInfo->Context;
   BOOL opened = FALSE;
@@ -821,6 +848,7 @@ static NTSTATUS DOKAN_CALLBACK CryptWriteFile(LPCWSTR FileName, LPCVOID Buffer,
 
   CryptFile *file = CryptFile::NewInstance(GetContext());
   if (file->Associate(GetContext(), handle, FileName)) {
+    perf.SetTrace(file->TraceFile(), Offset);
     if (!file->Write((const unsigned char *)Buffer, NumberOfBytesToWrite,
                      NumberOfBytesWritten, Offset,
                      DokanFileInfo->WriteToEndOfFile,
@@ -842,6 +870,8 @@ static NTSTATUS DOKAN_CALLBACK CryptWriteFile(LPCWSTR FileName, LPCVOID Buffer,
   if (opened)
     CloseHandle(handle);
 
+  perf.SetStatus(ret_status);
+
   return ret_status;
 }
 
@@ -869,6 +899,7 @@ CryptFlushFileBuffers(LPCWSTR FileName, PDOKAN_FILE_INFO DokanFileInfo) {
 static NTSTATUS DOKAN_CALLBACK CryptGetFileInformation(
     LPCWSTR FileName, LPBY_HANDLE_FILE_INFORMATION HandleFileInformation,
     PDOKAN_FILE_INFO DokanFileInfo) {
+  PerfTimer perf(&GetContext()->m_perf, PERF_GETINFO);
   FileNameEnc filePath(DokanFileInfo, FileName);
   HANDLE handle = (HANDLE)DokanFileInfo->Context;
   BOOL opened = FALSE;
@@ -921,6 +952,7 @@ static NTSTATUS DOKAN_CALLBACK
 CryptFindFiles(LPCWSTR FileName,
                PFillFindData FillFindData, // function pointer
                PDOKAN_FILE_INFO DokanFileInfo) {
+  PerfTimer perf(&GetContext()->m_perf, PERF_FIND);
   FileNameEnc filePath(DokanFileInfo, FileName);
   size_t fileLen = 0;
   HANDLE hFind = NULL;
@@ -944,6 +976,7 @@ CryptFindFiles(LPCWSTR FileName,
 static NTSTATUS DOKAN_CALLBACK CryptDeleteFile(LPCWSTR FileName,
                                                PDOKAN_FILE_INFO DokanFileInfo) {
 
+  PerfTimer perf(&GetContext()->m_perf, PERF_DELETE);
   FileNameEnc filePath(DokanFileInfo, FileName);
   HANDLE handle = (HANDLE)DokanFileInfo->Context;
 
@@ -978,6 +1011,7 @@ static NTSTATUS DOKAN_CALLBACK CryptDeleteFile(LPCWSTR FileName,
 static NTSTATUS DOKAN_CALLBACK
 CryptDeleteDirectory(LPCWSTR FileName, PDOKAN_FILE_INFO DokanFileInfo) {
 
+  PerfTimer perf(&GetContext()->m_perf, PERF_DELETE);
   FileNameEnc filePath(DokanFileInfo, FileName);
 
   DbgPrint(L"DeleteDirectory %s - %d\n", FileName,
@@ -1143,6 +1177,8 @@ CryptMoveFile(LPCWSTR FileName, // existing file name
 		The second step (the rename) is called "repair" here.
 	*/
 
+  PerfTimer perf(&GetContext()->m_perf, PERF_MOVE);
+
   bool needRepair = false;
 
   /* 
@@ -1866,6 +1902,49 @@ static DWORD WINAPI CryptThreadProc(_In_ LPVOID lpParameter
   return (DWORD)status;
 }
 
+void init_crypt_operations(PDOKAN_OPERATIONS dokanOperations) {
+  ZeroMemory(dokanOperations, sizeof(DOKAN_OPERATIONS));
+  dokanOperations->ZwCreateFile = CryptCreateFile;
+  dokanOperations->Cleanup = CryptCleanup;
+  dokanOperations->CloseFile = CryptCloseFile;
+  dokanOperations->ReadFile = CryptReadFile;
+  dokanOperations->WriteFile = CryptWriteFile;
+  dokanOperations->FlushFileBuffers = CryptFlushFileBuffers;
+  dokanOperations->GetFileInformation = CryptGetFileInformation;
+  dokanOperations->FindFiles = CryptFindFiles;
+  dokanOperations->FindFilesWithPattern = NULL;
+  dokanOperations->SetFileAttributes = CryptSetFileAttributes;
+  dokanOperations->SetFileTime = CryptSetFileTime;
+  dokanOperations->DeleteFile = CryptDeleteFile;
+  dokanOperations->DeleteDirectory = CryptDeleteDirectory;
+  dokanOperations->MoveFile = CryptMoveFile;
+  dokanOperations->SetEndOfFile = CryptSetEndOfFile;
+  dokanOperations->SetAllocationSize = CryptSetAllocationSize;
+  dokanOperations->LockFile = CryptLockFile;
+  dokanOperations->UnlockFile = CryptUnlockFile;
+  // We seem to work better if we export Get/SetFileSecurity even if we don't have SE_SECURITY_NAME privilege.
+  // It seems that GetFileSecurity() will work without that privilege, at least in the common cases.
+  // So it seems better to do as much Get/SetFileSecurity() as we can regardless of whether we
+  // we can get SE_SECURITY_NAME (getting it implies running as administrator).
+  //
+  // Dokany suggested setting the Get/Set callbacks to NULL if we don't have the privilege, but that keeps us from
+  // being able to copy files out of the encrypted fs, or even copy a file within it to a new file within it.
+  // So, whatever type of GetFileSecurity() that can work even without having SE_SECURITY_NAME
+  // seems to be required for copying files.
+  if (1 || have_security_name_privilege()) {
+    dokanOperations->GetFileSecurity = CryptGetFileSecurity;
+    dokanOperations->SetFileSecurity = CryptSetFileSecurity;
+  } else {
+    dokanOperations->GetFileSecurity = NULL;
+    dokanOperations->SetFileSecurity = NULL;
+  }
+  dokanOperations->GetDiskFreeSpace = CryptGetDiskFreeSpace;
+  dokanOperations->GetVolumeInformation = CryptGetVolumeInformation;
+  dokanOperations->Unmounted = CryptUnmounted;
+  dokanOperations->FindStreams = CryptFindStreams;
+  dokanOperations->Mounted = CryptMounted;
+}
+
 int mount_crypt_fs(const WCHAR* mountpoint, const WCHAR *path,
                    const WCHAR *config_path, const WCHAR *password,
                    wstring &mes, const CryptMountOptions& opts) {
@@ -1918,57 +1997,12 @@ int mount_crypt_fs(const WCHAR* mountpoint, const WCHAR *path,
 
     init_security_name_privilege(); // make sure AddSecurityNamePrivilege() has been called, whether or not we can get it
 
-    ZeroMemory(dokanOperations, sizeof(DOKAN_OPERATIONS));
-    dokanOperations->ZwCreateFile = CryptCreateFile;
-    dokanOperations->Cleanup = CryptCleanup;
-    dokanOperations->CloseFile = CryptCloseFile;
-    dokanOperations->ReadFile = CryptReadFile;
-    dokanOperations->WriteFile = CryptWriteFile;
-    dokanOperations->FlushFileBuffers = CryptFlushFileBuffers;
-    dokanOperations->GetFileInformation = CryptGetFileInformation;
-    dokanOperations->FindFiles = CryptFindFiles;
-    dokanOperations->FindFilesWithPattern = NULL;
-    dokanOperations->SetFileAttributes = CryptSetFileAttributes;
-    dokanOperations->SetFileTime = CryptSetFileTime;
-    dokanOperations->DeleteFile = CryptDeleteFile;
-    dokanOperations->DeleteDirectory = CryptDeleteDirectory;
-    dokanOperations->MoveFile = CryptMoveFile;
-    dokanOperations->SetEndOfFile = CryptSetEndOfFile;
-    dokanOperations->SetAllocationSize = CryptSetAllocationSize;
-    dokanOperations->LockFile = CryptLockFile;
-    dokanOperations->UnlockFile = CryptUnlockFile;
-    // We seem to work better if we export Get/SetFileSecurity even if we don't have SE_SECURITY_NAME privilege.
-    // It seems that GetFileSecurity() will work without that privilege, at least in the common cases.
-    // So it seems better to do as much Get/SetFileSecurity() as we can regardless of whether we
-    // we can get SE_SECURITY_NAME (getting it implies running as administrator).
-    //
-    // Dokany suggested setting the Get/Set callbacks to NULL if we don't have the privilege, but that keeps us from
-    // being able to copy files out of the encrypted fs, or even copy a file within it to a new file within it.
-    // So, whatever type of GetFileSecurity() that can work even without having SE_SECURITY_NAME
-    // seems to be required for copying files.
-    if (1 || have_security_name_privilege()) {
-      dokanOperations->GetFileSecurity = CryptGetFileSecurity;
-      dokanOperations->SetFileSecurity = CryptSetFileSecurity;
-    } else {
-      dokanOperations->GetFileSecurity = NULL;
-      dokanOperations->SetFileSecurity = NULL;
-    }
-    dokanOperations->GetDiskFreeSpace = CryptGetDiskFreeSpace;
-    dokanOperations->GetVolumeInformation = CryptGetVolumeInformation;
-    dokanOperations->Unmounted = CryptUnmounted;
-    dokanOperations->FindStreams = CryptFindStreams;
-    dokanOperations->Mounted = CryptMounted;
+    init_crypt_operations(dokanOperations);
 
     CryptContext *con = &tdata->con;
 
     con->m_bufferblocks = min(256, max(1, opts.numbufferblocks));
 
-	// initialize IoBufferPool singleton (will init if not already inited)
-	// block size is tuned for first mounted filesystem
-	// if subsquent mounts require a larger block due to setting being changed
-	// then those mounts buffers will come from the heap instead of the pool
-    IoBufferPool::getInstance(con->m_bufferblocks * CIPHER_BS); 
-
     con->m_dir_iv_cache.SetTTL(opts.cachettl);
     con->m_case_cache.SetTTL(opts.cachettl);
 
@@ -1978,6 +2012,12 @@ int mount_crypt_fs(const WCHAR* mountpoint, const WCHAR *path,
 
 	con->m_threads = opts.numthreads ? opts.numthreads : 5;
 
+	con->m_direct_io = opts.directio;
+
+	con->m_sparse_zero_blocks = opts.sparsezero;
+
+	con->m_mmap_reverse = opts.mmapreverse;
+
     CryptConfig *config = con->GetConfig();
 
     PDOKAN_OPTIONS dokanOptions = &tdata->options;
@@ -2025,6 +2065,11 @@ int mount_crypt_fs(const WCHAR* mountpoint, const WCHAR *path,
       throw(-1);
     }
 
+    // the I/O buffer size setting is in units of 4KB, so scale it to this
+    // volume's block size
+    if (config->m_PlainBS > PLAIN_BS)
+      con->m_bufferblocks = max(1, (int)((long long)con->m_bufferblocks * PLAIN_BS / config->m_PlainBS));
+
 	// reverse-mode filesystems won't work when mounted to an empty dir for the reason given below.
 	// i.e. because we don't support case-insensitive in reverse mode.
 	if (config->m_reverse && is_mountpoint_a_dir(mountpoint)) {
@@ -2063,6 +2108,28 @@ int mount_crypt_fs(const WCHAR* mountpoint, const WCHAR *path,
       }
     }
 
+    if (!init_block_engine(con)) {
+      mes = L"unable to initialize block encryption";
+      throw(-1);
+    }
+
+    // auto-tuning overrides the threads and I/O buffer size settings.  If
+    // it fails, the volume is mounted with the settings as they are
+    if (opts.autotune && auto_tune(con, con->m_autotune)) {
+      con->m_autotuned = true;
+      dokanOptions->ThreadCount = (USHORT)con->m_threads;
+    }
+
+    if (config->m_reverse)
+      con->m_block_cache.SetCapacity(REVERSE_BLOCK_CACHE_SIZE, config->m_CipherBS);
+
+    if (opts.recordpath && *opts.recordpath) {
+      con->m_recorder = new OpRecorder;
+      if (!con->m_recorder->Open(opts.recordpath, mes))
+        throw(-1);
+      record_crypt_operations(dokanOperations);
+    }
+
     config->init_serial(con);
 
     WCHAR fs_name[256];
@@ -49,6 +49,11 @@ typedef struct _struct_CryptMountOptions {
 	bool caseinsensitive;
 	bool mountmanager;
 	bool mountmanagerwarn;
+	bool directio;
+	bool sparsezero;
+	bool mmapreverse;
+	bool autotune; // calibrate threads, I/O buffer size and parallel threshold at mount
+	const WCHAR *recordpath; // record the operations to this file if not NULL
 } CryptMountOptions;
 
 class FsInfo;
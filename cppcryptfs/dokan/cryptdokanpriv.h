@@ -42,6 +42,9 @@ int WINAPI
 CryptCaseStreamsCallback(PWIN32_FIND_STREAM_DATA pfdata, LPCWSTR encrypted_name,
 	unordered_map<wstring, wstring> *pmap);
 
+// fills in the callbacks a cppcryptfs volume exports
+void init_crypt_operations(PDOKAN_OPERATIONS dokanOperations);
+
 #define GetContext()                                                           \
   ((CryptContext *)DokanFileInfo->DokanOptions->GlobalContext)
 
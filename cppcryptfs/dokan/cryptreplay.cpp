@@ -0,0 +1,769 @@
+/*
+cppcryptfs : user-mode cryptographic virtual overlay filesystem.
+
+Copyright (C) 2016-2018 Bailey Brown (github.com/bailey27/cppcryptfs)
+
+cppcryptfs is based on the design of gocryptfs (github.com/rfjakob/gocryptfs)
+
+The MIT License (MIT)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#include <ntstatus.h>
+#define WIN32_NO_STATUS
+
+#include <windows.h>
+#include "dokan/dokan.h"
+#include "dokan/fileinfo.h"
+
+#include "cryptreplay.h"
+#include "cryptdokanpriv.h"
+#include "context/cryptcontext.h"
+#include "context/oprecorder.h"
+#include "crypt/cryptdefs.h"
+#include "file/cryptio.h"
+#include "util/fileutil.h"
+
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <algorithm>
+#include <memory>
+
+#define REPLAY_SUCCEEDED(status) ((LONG)(status) >= 0)
+
+// the real callbacks, which the recording wrappers call
+static DOKAN_OPERATIONS g_crypt_ops;
+
+// Records one callback when it returns
+
+class RecordScope {
+private:
+	OpRecorder *m_recorder;
+	PDOKAN_FILE_INFO m_info;
+	LPCWSTR m_path;
+public:
+	OpRecord m_rec;
+	LPCWSTR m_path2;
+
+	RecordScope(int op, LPCWSTR path, PDOKAN_FILE_INFO info, LONGLONG offset = 0, DWORD length = 0)
+	{
+		m_recorder = ((CryptContext *)info->DokanOptions->GlobalContext)->m_recorder;
+		m_info = info;
+		m_path = path;
+		m_path2 = NULL;
+		memset(&m_rec, 0, sizeof(m_rec));
+		m_rec.op = (BYTE)op;
+		m_rec.offset = offset;
+		m_rec.length = length;
+		m_rec.handle = info->Context;
+		m_rec.thread = GetCurrentThreadId();
+		m_rec.start = OpRecorder::Now();
+	}
+
+	NTSTATUS Status(NTSTATUS status) { m_rec.status = (DWORD)status; return status; }
+
+	~RecordScope()
+	{
+		m_rec.duration = OpRecorder::Now() - m_rec.start;
+
+		// a create sets the handle
+		if (m_rec.op == OPREC_CREATE)
+			m_rec.handle = m_info->Context;
+
+		m_rec.flags |= (m_info->IsDirectory ? OPREC_FLAG_DIRECTORY : 0) |
+			(m_info->DeleteOnClose ? OPREC_FLAG_DELETE_ON_CLOSE : 0) |
+			(m_info->PagingIo ? OPREC_FLAG_PAGING_IO : 0) |
+			(m_info->WriteToEndOfFile ? OPREC_FLAG_WRITE_TO_EOF : 0) |
+			(m_info->Nocache ? OPREC_FLAG_NOCACHE : 0) |
+			(m_info->SynchronousIo ? OPREC_FLAG_SYNCHRONOUS_IO : 0);
+
+		if (m_recorder)
+			m_recorder->Record(m_rec, m_path, m_path2);
+	}
+
+	// disallow copying
+	RecordScope(RecordScope const&) = delete;
+	void operator=(RecordScope const&) = delete;
+};
+
+static NTSTATUS DOKAN_CALLBACK
+RecCreateFile(LPCWSTR FileName, PDOKAN_IO_SECURITY_CONTEXT SecurityContext,
+	ACCESS_MASK DesiredAccess, ULONG FileAttributes, ULONG ShareAccess,
+	ULONG CreateDisposition, ULONG CreateOptions, PDOKAN_FILE_INFO DokanFileInfo)
+{
+	RecordScope rec(OPREC_CREATE, FileName, DokanFileInfo);
+
+	rec.m_rec.args[0] = DesiredAccess;
+	rec.m_rec.args[1] = FileAttributes;
+	rec.m_rec.args[2] = ShareAccess;
+	rec.m_rec.args[3] = CreateOptions;
+	rec.m_rec.disposition = (BYTE)CreateDisposition;
+
+	return rec.Status(g_crypt_ops.ZwCreateFile(FileName, SecurityContext, DesiredAccess, FileAttributes,
+		ShareAccess, CreateDisposition, CreateOptions, DokanFileInfo));
+}
+
+static void DOKAN_CALLBACK RecCleanup(LPCWSTR FileName, PDOKAN_FILE_INFO DokanFileInfo)
+{
+	RecordScope rec(OPREC_CLEANUP, FileName, DokanFileInfo);
+
+	g_crypt_ops.Cleanup(FileName, DokanFileInfo);
+}
+
+static void DOKAN_CALLBACK RecCloseFile(LPCWSTR FileName, PDOKAN_FILE_INFO DokanFileInfo)
+{
+	RecordScope rec(OPREC_CLOSE, FileName, DokanFileInfo);
+
+	g_crypt_ops.CloseFile(FileName, DokanFileInfo);
+}
+
+static NTSTATUS DOKAN_CALLBACK RecReadFile(LPCWSTR FileName, LPVOID Buffer, DWORD BufferLength,
+	LPDWORD ReadLength, LONGLONG Offset, PDOKAN_FILE_INFO DokanFileInfo)
+{
+	RecordScope rec(OPREC_READ, FileName, DokanFileInfo, Offset, BufferLength);
+
+	return rec.Status(g_crypt_ops.ReadFile(FileName, Buffer, BufferLength, ReadLength, Offset, DokanFileInfo));
+}
+
+static NTSTATUS DOKAN_CALLBACK RecWriteFile(LPCWSTR FileName, LPCVOID Buffer, DWORD NumberOfBytesToWrite,
+	LPDWORD NumberOfBytesWritten, LONGLONG Offset, PDOKAN_FILE_INFO DokanFileInfo)
+{
+	RecordScope rec(OPREC_WRITE, FileName, DokanFileInfo, Offset, NumberOfBytesToWrite);
+
+	return rec.Status(g_crypt_ops.WriteFile(FileName, Buffer, NumberOfBytesToWrite, NumberOfBytesWritten, Offset, DokanFileInfo));
+}
+
+static NTSTATUS DOKAN_CALLBACK RecFlushFileBuffers(LPCWSTR FileName, PDOKAN_FILE_INFO DokanFileInfo)
+{
+	RecordScope rec(OPREC_FLUSH, FileName, DokanFileInfo);
+
+	return rec.Status(g_crypt_ops.FlushFileBuffers(FileName, DokanFileInfo));
+}
+
+static NTSTATUS DOKAN_CALLBACK RecGetFileInformation(LPCWSTR FileName,
+	LPBY_HANDLE_FILE_INFORMATION HandleFileInformation, PDOKAN_FILE_INFO DokanFileInfo)
+{
+	RecordScope rec(OPREC_GETINFO, FileName, DokanFileInfo);
+
+	return rec.Status(g_crypt_ops.GetFileInformation(FileName, HandleFileInformation, DokanFileInfo));
+}
+
+static NTSTATUS DOKAN_CALLBACK RecFindFiles(LPCWSTR FileName, PFillFindData FillFindData, PDOKAN_FILE_INFO DokanFileInfo)
+{
+	RecordScope rec(OPREC_FIND, FileName, DokanFileInfo);
+
+	return rec.Status(g_crypt_ops.FindFiles(FileName, FillFindData, DokanFileInfo));
+}
+
+static NTSTATUS DOKAN_CALLBACK RecDeleteFile(LPCWSTR FileName, PDOKAN_FILE_INFO DokanFileInfo)
+{
+	RecordScope rec(OPREC_DELETE_FILE, FileName, DokanFileInfo);
+
+	return rec.Status(g_crypt_ops.DeleteFile(FileName, DokanFileInfo));
+}
+
+static NTSTATUS DOKAN_CALLBACK RecDeleteDirectory(LPCWSTR FileName, PDOKAN_FILE_INFO DokanFileInfo)
+{
+	RecordScope rec(OPREC_DELETE_DIRECTORY, FileName, DokanFileInfo);
+
+	return rec.Status(g_crypt_ops.DeleteDirectory(FileName, DokanFileInfo));
+}
+
+static NTSTATUS DOKAN_CALLBACK RecMoveFile(LPCWSTR FileName, LPCWSTR NewFileName, BOOL ReplaceIfExisting,
+	PDOKAN_FILE_INFO DokanFileInfo)
+{
+	RecordScope rec(OPREC_MOVE, FileName, DokanFileInfo);
+
+	rec.m_path2 = NewFileName;
+
+	if (ReplaceIfExisting)
+		rec.m_rec.flags |= OPREC_FLAG_REPLACE;
+
+	return rec.Status(g_crypt_ops.MoveFile(FileName, NewFileName, ReplaceIfExisting, DokanFileInfo));
+}
+
+static NTSTATUS DOKAN_CALLBACK RecSetEndOfFile(LPCWSTR FileName, LONGLONG ByteOffset, PDOKAN_FILE_INFO DokanFileInfo)
+{
+	RecordScope rec(OPREC_SET_END_OF_FILE, FileName, DokanFileInfo, ByteOffset);
+
+	return rec.Status(g_crypt_ops.SetEndOfFile(FileName, ByteOffset, DokanFileInfo));
+}
+
+static NTSTATUS DOKAN_CALLBACK RecSetAllocationSize(LPCWSTR FileName, LONGLONG AllocSize, PDOKAN_FILE_INFO DokanFileInfo)
+{
+	RecordScope rec(OPREC_SET_ALLOCATION_SIZE, FileName, DokanFileInfo, AllocSize);
+
+	return rec.Status(g_crypt_ops.SetAllocationSize(FileName, AllocSize, DokanFileInfo));
+}
+
+void record_crypt_operations(PDOKAN_OPERATIONS dokanOperations)
+{
+	g_crypt_ops = *dokanOperations;
+
+	dokanOperations->ZwCreateFile = RecCreateFile;
+	dokanOperations->Cleanup = RecCleanup;
+	dokanOperations->CloseFile = RecCloseFile;
+	dokanOperations->ReadFile = RecReadFile;
+	dokanOperations->WriteFile = RecWriteFile;
+	dokanOperations->FlushFileBuffers = RecFlushFileBuffers;
+	dokanOperations->GetFileInformation = RecGetFileInformation;
+	dokanOperations->FindFiles = RecFindFiles;
+	dokanOperations->DeleteFile = RecDeleteFile;
+	dokanOperations->DeleteDirectory = RecDeleteDirectory;
+	dokanOperations->MoveFile = RecMoveFile;
+	dokanOperations->SetEndOfFile = RecSetEndOfFile;
+	dokanOperations->SetAllocationSize = RecSetAllocationSize;
+}
+
+// Replay
+
+struct ReplayOp {
+	OpRecord rec;
+	int path;   // index into ReplayTrace::paths
+	int path2;  // -1 unless a move
+};
+
+struct ReplayTrace {
+	LONGLONG frequency;
+	vector<ReplayOp> ops;
+	vector<wstring> paths;
+};
+
+// Makes up a name of length len for the component with the given hash,
+// different from the names made up so far if possible.
+static wstring make_name(ULONGLONG hash, WORD len, unordered_set<wstring>& used)
+{
+	wstring name;
+
+	for (int attempt = 0; attempt < 16; attempt++) {
+		WCHAR hex[17];
+		swprintf_s(hex, L"%016llx", hash);
+		name = hex;
+		if (len < name.size())
+			name.resize(len ? len : 1);
+		else
+			name.append(len - name.size(), 'x');
+		if (used.insert(name).second)
+			break;
+		hash = hash * 0x100000001b3ULL + 1;
+	}
+
+	return name;
+}
+
+static wstring make_path(const vector<OpRecordComponent>& comps, unordered_map<ULONGLONG, wstring>& names, unordered_set<wstring>& used_names)
+{
+	wstring path;
+
+	for (auto& comp : comps) {
+		auto it = names.find(comp.hash);
+		if (it == names.end())
+			it = names.insert(make_pair(comp.hash, make_name(comp.hash, comp.len, used_names))).first;
+		path += L"\\";
+		path += it->second;
+	}
+
+	if (path.empty())
+		path = L"\\";
+
+	return path;
+}
+
+static bool load_recording(const WCHAR *recording, ReplayTrace& trace, wstring& mes)
+{
+	vector<OpRecordEntry> entries;
+
+	if (!read_op_recording(recording, trace.frequency, entries, mes))
+		return false;
+
+	unordered_map<ULONGLONG, wstring> names;
+	unordered_set<wstring> used_names;
+	unordered_map<wstring, int> path_index;
+
+	for (auto& entry : entries) {
+		ReplayOp rop;
+		rop.rec = entry.rec;
+		rop.path = rop.path2 = -1;
+
+		for (int i = 0; i < entry.rec.npaths; i++) {
+			wstring path = make_path(i == 0 ? entry.path : entry.path2, names, used_names);
+			auto it = path_index.find(path);
+			if (it == path_index.end()) {
+				it = path_index.insert(make_pair(path, (int)trace.paths.size())).first;
+				trace.paths.push_back(path);
+			}
+			if (i == 0)
+				rop.path = it->second;
+			else
+				rop.path2 = it->second;
+		}
+
+		trace.ops.push_back(rop);
+	}
+
+	return true;
+}
+
+static int path_depth(const wstring& path)
+{
+	return path == L"\\" ? 0 : (int)count(path.begin(), path.end(), '\\');
+}
+
+static wstring parent_path(const wstring& path)
+{
+	size_t i = path.rfind('\\');
+
+	return i == 0 || i == wstring::npos ? L"\\" : path.substr(0, i);
+}
+
+struct ReplayPathState {
+	bool seen;
+	bool precreate; // existed before the recording started
+	bool dir;
+	LONGLONG size;
+};
+
+// Works out which files and directories existed when the recording started,
+// from the first operation on each path.
+static void find_preexisting(const ReplayTrace& trace, unordered_map<wstring, ReplayPathState>& state)
+{
+	for (auto& rop : trace.ops) {
+		const OpRecord& rec = rop.rec;
+
+		for (int i = 0; i < rec.npaths; i++) {
+			const wstring& path = trace.paths[i == 0 ? rop.path : rop.path2];
+
+			ReplayPathState& st = state[path];
+
+			if (!st.seen) {
+				st.seen = true;
+				if (i == 1) {
+					// a move's destination
+					st.precreate = false;
+				} else if (rec.op == OPREC_CREATE) {
+					bool creates = rec.disposition != FILE_OPEN && rec.disposition != FILE_OVERWRITE;
+					st.precreate = REPLAY_SUCCEEDED(rec.status) && !(rec.status == STATUS_SUCCESS && creates);
+				} else {
+					st.precreate = REPLAY_SUCCEEDED(rec.status);
+				}
+			}
+
+			if (i == 0) {
+				if ((rec.op == OPREC_CREATE && (rec.flags & OPREC_FLAG_DIRECTORY)) || rec.op == OPREC_FIND || rec.op == OPREC_DELETE_DIRECTORY)
+					st.dir = true;
+				if (rec.op == OPREC_READ)
+					st.size = max(st.size, rec.offset + (LONGLONG)rec.length);
+			}
+		}
+	}
+
+	// the parents of paths the recording uses must exist, unless the
+	// recording creates them
+	vector<wstring> paths;
+
+	for (auto& it : state)
+		paths.push_back(it.first);
+
+	for (auto& path : paths) {
+		for (wstring parent = parent_path(path); parent != L"\\"; parent = parent_path(parent)) {
+			ReplayPathState& st = state[parent];
+			st.dir = true;
+			if (st.seen && !st.precreate)
+				break;
+			st.precreate = true;
+		}
+	}
+}
+
+static int WINAPI replay_fill_find_data(PWIN32_FIND_DATAW fdata, PDOKAN_FILE_INFO DokanFileInfo)
+{
+	return 0;
+}
+
+static NTSTATUS replay_create(const DOKAN_OPERATIONS& ops, LPCWSTR path, ACCESS_MASK access, ULONG attributes, ULONG share,
+	ULONG disposition, ULONG options, PDOKAN_FILE_INFO info)
+{
+	DOKAN_IO_SECURITY_CONTEXT sec;
+
+	memset(&sec, 0, sizeof(sec));
+
+	// the driver sets IsDirectory before calling ZwCreateFile
+	info->IsDirectory = (options & FILE_DIRECTORY_FILE) != 0;
+
+	return ops.ZwCreateFile(path, &sec, access, attributes, share, disposition, options, info);
+}
+
+static bool precreate(const DOKAN_OPERATIONS& ops, PDOKAN_OPTIONS options, const wstring& path, const ReplayPathState& st)
+{
+	DOKAN_FILE_INFO info;
+
+	memset(&info, 0, sizeof(info));
+	info.DokanOptions = options;
+
+	NTSTATUS status = replay_create(ops, path.c_str(), st.dir ? FILE_GENERIC_READ : FILE_GENERIC_READ | FILE_GENERIC_WRITE,
+		FILE_ATTRIBUTE_NORMAL, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, FILE_OPEN_IF,
+		st.dir ? FILE_DIRECTORY_FILE : FILE_NON_DIRECTORY_FILE, &info);
+
+	if (!REPLAY_SUCCEEDED(status))
+		return false;
+
+	if (!st.dir && st.size > 0)
+		status = ops.SetEndOfFile(path.c_str(), st.size, &info);
+
+	ops.Cleanup(path.c_str(), &info);
+	ops.CloseFile(path.c_str(), &info);
+
+	return REPLAY_SUCCEEDED(status);
+}
+
+static void remove_tree(const wstring& dir)
+{
+	WIN32_FIND_DATA fdata;
+
+	HANDLE hfind = FindFirstFile((dir + L"\\*").c_str(), &fdata);
+
+	if (hfind != INVALID_HANDLE_VALUE) {
+		do {
+			if (!wcscmp(fdata.cFileName, L".") || !wcscmp(fdata.cFileName, L".."))
+				continue;
+			wstring path = dir + L"\\" + fdata.cFileName;
+			if (fdata.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+				remove_tree(path);
+			} else {
+				SetFileAttributes(path.c_str(), FILE_ATTRIBUTE_NORMAL);
+				DeleteFile(path.c_str());
+			}
+		} while (FindNextFile(hfind, &fdata));
+		FindClose(hfind);
+	}
+
+	RemoveDirectory(dir.c_str());
+}
+
+struct ReplayOpStats {
+	vector<LONGLONG> latencies;      // replayed, in ticks
+	vector<LONGLONG> recorded;       // recorded, in the recording's ticks
+	ULONGLONG bytes;
+};
+
+// replays the operations, keeping the latency of each
+static void replay(const DOKAN_OPERATIONS& ops, PDOKAN_OPTIONS options, const ReplayTrace& trace, bool paced,
+	vector<ReplayOpStats>& stats, ULONGLONG& mismatches)
+{
+	// infos of the handles open in the replay, keyed by the recorded handle
+	unordered_map<ULONGLONG, unique_ptr<DOKAN_FILE_INFO>> opens;
+
+	DWORD max_len = 0;
+
+	for (auto& rop : trace.ops) {
+		if (rop.rec.op == OPREC_READ || rop.rec.op == OPREC_WRITE)
+			max_len = max(max_len, rop.rec.length);
+	}
+
+	vector<BYTE> buf(max(max_len, (DWORD)1));
+
+	for (size_t i = 0; i < buf.size(); i++)
+		buf[i] = (BYTE)(i * 131 + 7);
+
+	LARGE_INTEGER freq, begin;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&begin);
+
+	for (auto& rop : trace.ops) {
+		const OpRecord& rec = rop.rec;
+		LPCWSTR path = trace.paths[rop.path].c_str();
+
+		if (paced) {
+			LONGLONG due = begin.QuadPart + (LONGLONG)((double)rec.start * freq.QuadPart / trace.frequency);
+			LARGE_INTEGER now;
+			QueryPerformanceCounter(&now);
+			if (now.QuadPart < due)
+				Sleep((DWORD)((due - now.QuadPart) * 1000 / freq.QuadPart));
+		}
+
+		DOKAN_FILE_INFO scratch;
+		memset(&scratch, 0, sizeof(scratch));
+		scratch.DokanOptions = options;
+
+		PDOKAN_FILE_INFO info = &scratch;
+
+		unique_ptr<DOKAN_FILE_INFO> created;
+
+		if (rec.op == OPREC_CREATE) {
+			created.reset(new DOKAN_FILE_INFO);
+			memset(created.get(), 0, sizeof(DOKAN_FILE_INFO));
+			created->DokanOptions = options;
+			info = created.get();
+		} else {
+			auto it = opens.find(rec.handle);
+			if (it != opens.end()) {
+				info = it->second.get();
+			} else if (rec.op == OPREC_CLEANUP || rec.op == OPREC_CLOSE) {
+				// the handle was opened before the recording started
+				continue;
+			}
+			info->IsDirectory = (rec.flags & OPREC_FLAG_DIRECTORY) != 0;
+			info->DeleteOnClose = (rec.flags & OPREC_FLAG_DELETE_ON_CLOSE) != 0;
+			info->PagingIo = (rec.flags & OPREC_FLAG_PAGING_IO) != 0;
+			info->WriteToEndOfFile = (rec.flags & OPREC_FLAG_WRITE_TO_EOF) != 0;
+			info->Nocache = (rec.flags & OPREC_FLAG_NOCACHE) != 0;
+			info->SynchronousIo = (rec.flags & OPREC_FLAG_SYNCHRONOUS_IO) != 0;
+		}
+
+		NTSTATUS status = STATUS_SUCCESS;
+		DWORD nbytes = 0;
+		BY_HANDLE_FILE_INFORMATION fileinfo;
+
+		LARGE_INTEGER t0, t1;
+		QueryPerformanceCounter(&t0);
+
+		switch (rec.op) {
+		case OPREC_CREATE:
+			status = replay_create(ops, path, rec.args[0], rec.args[1], rec.args[2], rec.disposition, rec.args[3], info);
+			break;
+		case OPREC_CLEANUP:
+			ops.Cleanup(path, info);
+			break;
+		case OPREC_CLOSE:
+			ops.CloseFile(path, info);
+			break;
+		case OPREC_READ:
+			status = ops.ReadFile(path, &buf[0], rec.length, &nbytes, rec.offset, info);
+			break;
+		case OPREC_WRITE:
+			status = ops.WriteFile(path, &buf[0], rec.length, &nbytes, rec.offset, info);
+			break;
+		case OPREC_FLUSH:
+			status = ops.FlushFileBuffers(path, info);
+			break;
+		case OPREC_GETINFO:
+			status = ops.GetFileInformation(path, &fileinfo, info);
+			break;
+		case OPREC_FIND:
+			status = ops.FindFiles(path, replay_fill_find_data, info);
+			break;
+		case OPREC_DELETE_FILE:
+			status = ops.DeleteFile(path, info);
+			break;
+		case OPREC_DELETE_DIRECTORY:
+			status = ops.DeleteDirectory(path, info);
+			break;
+		case OPREC_MOVE:
+			status = ops.MoveFile(path, trace.paths[rop.path2].c_str(), (rec.flags & OPREC_FLAG_REPLACE) != 0, info);
+			break;
+		case OPREC_SET_END_OF_FILE:
+			status = ops.SetEndOfFile(path, rec.offset, info);
+			break;
+		case OPREC_SET_ALLOCATION_SIZE:
+			status = ops.SetAllocationSize(path, rec.offset, info);
+			break;
+		}
+
+		QueryPerformanceCounter(&t1);
+
+		ReplayOpStats& st = stats[rec.op];
+
+		st.latencies.push_back(t1.QuadPart - t0.QuadPart);
+		st.recorded.push_back(rec.duration);
+		st.bytes += nbytes;
+
+		if (REPLAY_SUCCEEDED(status) != REPLAY_SUCCEEDED(rec.status))
+			mismatches++;
+
+		if (rec.op == OPREC_CREATE) {
+			if (REPLAY_SUCCEEDED(status)) {
+				auto it = opens.find(rec.handle);
+				if (it != opens.end()) {
+					// the recorded handle was reused without being closed in
+					// the recording, so this one is abandoned
+					ops.Cleanup(path, it->second.get());
+					ops.CloseFile(path, it->second.get());
+				}
+				opens[rec.handle] = move(created);
+			}
+		} else if (rec.op == OPREC_CLOSE) {
+			opens.erase(rec.handle);
+		}
+	}
+
+	for (auto& it : opens) {
+		ops.Cleanup(L"\\", it.second.get());
+		ops.CloseFile(L"\\", it.second.get());
+	}
+}
+
+// returns the pct percentile of ticks in microseconds
+static double percentile_us(vector<LONGLONG>& ticks, int pct, LONGLONG frequency)
+{
+	if (ticks.empty())
+		return 0.0;
+
+	auto it = ticks.begin() + min(ticks.size() - 1, ticks.size() * pct / 100);
+
+	nth_element(ticks.begin(), it, ticks.end());
+
+	return *it * 1e6 / frequency;
+}
+
+bool replay_operations(const WCHAR *recording, bool paced, int bufferblocks, string& json, wstring& mes)
+{
+	ReplayTrace trace;
+
+	if (!load_recording(recording, trace, mes))
+		return false;
+
+	unique_ptr<CryptContext> con;
+
+	try {
+		con.reset(new CryptContext);
+	} catch (...) {
+		mes = L"unable to create context";
+		return false;
+	}
+
+	CryptConfig *config = con->GetConfig();
+
+	if (!config->create_ephemeral(false, false, false, false, false, PLAIN_BS, false, mes))
+		return false;
+
+	if (!con->InitEme(config->GetMasterKey(), config->m_HKDF)) {
+		mes = L"unable to initialize eme context";
+		return false;
+	}
+
+	if (!init_block_engine(con.get())) {
+		mes = L"unable to initialize block encryption";
+		return false;
+	}
+
+	con->m_bufferblocks = min(256, max(1, bufferblocks));
+
+	WCHAR temp[MAX_PATH + 1];
+	WCHAR dir[MAX_PATH + 1];
+
+	if (!GetTempPath(_countof(temp), temp)) {
+		mes = L"unable to get temporary directory";
+		return false;
+	}
+
+	swprintf_s(dir, L"%scppcryptfs-replay-%u-%u", temp, GetCurrentProcessId(), GetTickCount());
+
+	if (!CreateDirectory(dir, NULL)) {
+		mes = L"unable to create ";
+		mes += dir;
+		return false;
+	}
+
+	// this prefix enables up to 32K long file paths on NTFS
+	config->m_basedir = L"\\\\?\\";
+	config->m_basedir += dir;
+
+	DOKAN_OPERATIONS ops;
+	DOKAN_OPTIONS options;
+
+	init_crypt_operations(&ops);
+
+	memset(&options, 0, sizeof(options));
+	options.Version = DOKAN_VERSION;
+	options.GlobalContext = (ULONG64)con.get();
+
+	bool ok = true;
+
+	vector<ReplayOpStats> stats(OPREC_OP_COUNT);
+	ULONGLONG mismatches = 0;
+
+	LARGE_INTEGER freq, t0, t1;
+	QueryPerformanceFrequency(&freq);
+
+	try {
+		if (!create_dir_iv(con.get(), config->m_basedir.c_str())) {
+			mes = L"unable to create root diriv";
+			throw(-1);
+		}
+
+		unordered_map<wstring, ReplayPathState> state;
+
+		find_preexisting(trace, state);
+
+		vector<wstring> pre;
+
+		for (auto& it : state) {
+			if (it.second.precreate)
+				pre.push_back(it.first);
+		}
+
+		// parents first
+		sort(pre.begin(), pre.end(), [](const wstring& a, const wstring& b) { return path_depth(a) < path_depth(b); });
+
+		for (auto& path : pre) {
+			if (!precreate(ops, &options, path, state[path])) {
+				mes = L"unable to create the files the recording starts with";
+				throw(-1);
+			}
+		}
+
+		QueryPerformanceCounter(&t0);
+
+		replay(ops, &options, trace, paced, stats, mismatches);
+
+		QueryPerformanceCounter(&t1);
+	} catch (...) {
+		ok = false;
+	}
+
+	remove_tree(config->m_basedir);
+
+	if (!ok)
+		return false;
+
+	char buf[512];
+
+	sprintf_s(buf, "{\n  \"operations\": %llu,\n  \"seconds\": %.3f,\n  \"paced\": %s,\n  \"status_mismatches\": %llu,\n  \"results\": [",
+		(unsigned long long)trace.ops.size(), (double)(t1.QuadPart - t0.QuadPart) / freq.QuadPart, paced ? "true" : "false", mismatches);
+
+	json = buf;
+
+	for (int op = 0; op < OPREC_OP_COUNT; op++) {
+		ReplayOpStats& st = stats[op];
+
+		if (st.latencies.empty())
+			continue;
+
+		LONGLONG total = 0;
+
+		for (auto t : st.latencies)
+			total += t;
+
+		sprintf_s(buf, "%s\n    {\"op\": \"%s\", \"count\": %llu, \"bytes\": %llu, \"mean_us\": %.1f, \"p50_us\": %.1f, \"p99_us\": %.1f, "
+			"\"recorded_p50_us\": %.1f, \"recorded_p99_us\": %.1f}",
+			json.back() == '[' ? "" : ",", op_record_name(op), (unsigned long long)st.latencies.size(), st.bytes,
+			total * 1e6 / freq.QuadPart / st.latencies.size(),
+			percentile_us(st.latencies, 50, freq.QuadPart), percentile_us(st.latencies, 99, freq.QuadPart),
+			percentile_us(st.recorded, 50, trace.frequency), percentile_us(st.recorded, 99, trace.frequency));
+
+		json += buf;
+	}
+
+	json += "\n  ]\n}\n";
+
+	return true;
+}
@@ -0,0 +1,52 @@
+/*
+cppcryptfs : user-mode cryptographic virtual overlay filesystem.
+
+Copyright (C) 2016-2018 Bailey Brown (github.com/bailey27/cppcryptfs)
+
+cppcryptfs is based on the design of gocryptfs (github.com/rfjakob/gocryptfs)
+
+The MIT License (MIT)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#pragma once
+
+#include <windows.h>
+#include <string>
+
+#include "dokan/dokan.h"
+
+using namespace std;
+
+// Replaces the callbacks in dokanOperations that are recorded (see
+// context/oprecorder.h) with wrappers that time each call and pass it to
+// the OpRecorder of the volume.
+void record_crypt_operations(PDOKAN_OPERATIONS dokanOperations);
+
+// Replays a recording made with --record against a new, empty volume in
+// a temporary directory, by calling the same callbacks Dokany would,
+// without mounting.  File names are made up from the recorded hashes and
+// lengths.  Files and directories the recording uses without creating
+// them are created first (with the largest size they are read at).
+// Operations are replayed one at a time in the recorded order, as fast as
+// possible, or if paced is set, no earlier than they were recorded.
+// The latency of each kind of operation is returned as JSON.
+bool replay_operations(const WCHAR *recording, bool paced, int bufferblocks, string& json, wstring& mes);
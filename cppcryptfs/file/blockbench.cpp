@@ -0,0 +1,972 @@
+/*
+cppcryptfs : user-mode cryptographic virtual overlay filesystem.
+
+Copyright (C) 2016-2018 Bailey Brown (github.com/bailey27/cppcryptfs)
+
+cppcryptfs is based on the design of gocryptfs (github.com/rfjakob/gocryptfs)
+
+The MIT License (MIT)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#include "stdafx.h"
+
+#include "crypt/cryptdefs.h"
+#include "context/cryptcontext.h"
+#include "blockbench.h"
+#include "cryptio.h"
+#include "cryptfile.h"
+#include "iobackend.h"
+#include "iobufferpool.h"
+#include "bulkcopy.h"
+#include "util/util.h"
+
+#include <vector>
+#include <functional>
+#include <memory>
+#include <algorithm>
+
+#ifdef _DEBUG
+#include <crtdbg.h>
+#endif
+
+// reverse mode needs a path to derive the file id and block 0 iv from
+#define BENCH_PATH L"\\blockbench"
+
+// appends start over once the file reaches this size
+#define BENCH_APPEND_LIMIT (1024 * 1024)
+
+// truncates pick sizes below this
+#define BENCH_TRUNCATE_LIMIT (1024 * 1024)
+
+// the overlapping write check has each thread write this many stripes of
+// this size, which isn't a multiple of the block size so stripes share blocks
+#define BENCH_CHECK_STRIPE 1000
+#define BENCH_CHECK_ROUNDS 256
+
+// The storage a case runs on.  The on disk backends differ in how
+// CryptFile's multi-block spans reach the disk.
+struct BenchBackend {
+	const char *name;
+	bool on_disk;
+	bool batch; // overlapped batches (HandleIoBackend batch mode)
+	bool direct; // FILE_FLAG_NO_BUFFERING (HandleIoBackend direct mode)
+	bool every_geometry; // run with every geometry, not just the default one
+};
+
+static const BenchBackend bench_backends[] = {
+	{ "memory", false, false, false, true },
+	{ "file", true, false, false, false },
+	{ "file_batch", true, true, false, true },
+	{ "file_direct", true, true, true, false },
+};
+
+// The volume layouts the cases are run on.  The first one is the default.
+// Reverse mode can't have compression or XChaCha20-Poly1305, so it skips
+// the geometries with them.
+struct BenchGeometry {
+	const char *name;
+	int blocksize;
+	bool aligned;  // AlignedBlocks
+	bool compress; // Compression
+	bool xchacha;  // XChaCha20-Poly1305 instead of AES256-GCM
+};
+
+static const BenchGeometry bench_geometries[] = {
+	{ "4k", PLAIN_BS, false, false, false },
+	{ "16k", 16 * 1024, false, false, false },
+	{ "64k", 64 * 1024, false, false, false },
+	{ "128k", 128 * 1024, false, false, false },
+	{ "aligned", PLAIN_BS, true, false, false },
+	{ "aligned_64k", 64 * 1024, true, false, false },
+	{ "compress_64k", 64 * 1024, false, true, false },
+	{ "xchacha", PLAIN_BS, false, false, true },
+};
+
+#ifdef _DEBUG
+
+// counts heap allocations while a case runs (the CRT only has hooks in debug builds)
+static volatile LONG g_heap_allocs;
+
+static int heap_alloc_hook(int allocType, void *userData, size_t size, int blockType, long requestNumber, const unsigned char *filename, int lineNumber)
+{
+	if (allocType == _HOOK_ALLOC || allocType == _HOOK_REALLOC)
+		InterlockedIncrement(&g_heap_allocs);
+
+	return TRUE;
+}
+
+#endif
+
+// A file the benchmark runs CryptFile on.  On disk it is a temporary file,
+// registered in the open file table like the handles CryptCreateFile() opens,
+// so concurrent handles use the same block locks they do when mounted.  In
+// memory it gets an OpenFile of its own for the same reason.
+
+class BenchFile {
+public:
+	CryptContext *m_con;
+	HANDLE m_handle;
+	IoBackend *m_io;
+	OpenFile *m_openfile;
+
+	bool Open(CryptContext *con, const BenchBackend& backend);
+
+	BOOL Associate(CryptFile *file)
+	{
+		if (m_handle != INVALID_HANDLE_VALUE)
+			return file->Associate(m_con, m_handle, BENCH_PATH);
+		else
+			return file->AssociateIo(m_con, m_io, BENCH_PATH, m_openfile);
+	}
+
+	// disallow copying
+	BenchFile(BenchFile const&) = delete;
+	void operator=(BenchFile const&) = delete;
+
+	BenchFile() { m_con = NULL; m_handle = INVALID_HANDLE_VALUE; m_io = NULL; m_openfile = NULL; };
+	virtual ~BenchFile();
+};
+
+bool BenchFile::Open(CryptContext *con, const BenchBackend& backend)
+{
+	m_con = con;
+
+	if (!backend.on_disk) {
+		m_io = new MemoryIoBackend;
+		m_openfile = m_con->m_open_files.New();
+		return true;
+	}
+
+	WCHAR dir[MAX_PATH + 1];
+	WCHAR path[MAX_PATH + 1];
+
+	if (!GetTempPath(_countof(dir), dir) || !GetTempFileName(dir, L"cfs", 0, path))
+		return false;
+
+	m_handle = CreateFile(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+		CREATE_ALWAYS, FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE | (backend.direct ? FILE_FLAG_NO_BUFFERING : 0), NULL);
+
+	if (m_handle == INVALID_HANDLE_VALUE) {
+		DeleteFile(path);
+		return false;
+	}
+
+	m_con->m_open_files.Register(m_handle);
+
+	HandleIoBackend *io = new HandleIoBackend(m_handle);
+	io->SetDirect(backend.direct);
+	m_io = io;
+
+	return true;
+}
+
+BenchFile::~BenchFile()
+{
+	if (m_handle != INVALID_HANDLE_VALUE) {
+		m_con->m_open_files.Unregister(m_handle);
+		CloseHandle(m_handle);
+	}
+
+	if (m_openfile)
+		m_con->m_open_files.Release(m_openfile);
+
+	delete m_io;
+}
+
+// Each operation gets its own CryptFile, the way the Dokany callbacks do.
+
+static bool bench_read(BenchFile *bf, BYTE *buf, DWORD len, LONGLONG offset)
+{
+	unique_ptr<CryptFile> file(CryptFile::NewInstance(bf->m_con));
+
+	DWORD nread = 0;
+
+	return bf->Associate(file.get()) && file->Read(buf, len, &nread, offset);
+}
+
+static bool bench_write(BenchFile *bf, const BYTE *buf, DWORD len, LONGLONG offset, bool append = false)
+{
+	unique_ptr<CryptFile> file(CryptFile::NewInstance(bf->m_con));
+
+	DWORD nwritten = 0;
+
+	return bf->Associate(file.get()) && file->Write(buf, len, &nwritten, offset, append, FALSE) && nwritten == len;
+}
+
+static bool bench_truncate(BenchFile *bf, LONGLONG size)
+{
+	unique_ptr<CryptFile> file(CryptFile::NewInstance(bf->m_con));
+
+	return bf->Associate(file.get()) && file->SetEndOfFile(size);
+}
+
+static void fill(vector<BYTE>& buf)
+{
+	for (size_t i = 0; i < buf.size(); i++)
+		buf[i] = (BYTE)(i * 131 + 7);
+}
+
+// Fills the file with BLOCK_BENCHMARK_FILE_SIZE bytes of plaintext.  In
+// reverse mode the backing file holds the plaintext, so it is written directly.
+static bool fill_file(BenchFile *bf)
+{
+	const DWORD chunk = 1024 * 1024;
+
+	vector<BYTE> buf(chunk);
+
+	fill(buf);
+
+	for (LONGLONG offset = 0; offset < BLOCK_BENCHMARK_FILE_SIZE; offset += chunk) {
+		if (bf->m_con->GetConfig()->m_reverse) {
+			DWORD nwritten;
+			if (!bf->m_io->WriteAt(offset, &buf[0], chunk, &nwritten) || nwritten != chunk)
+				return false;
+		} else if (!bench_write(bf, &buf[0], chunk, offset)) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static inline ULONGLONG next_rand(ULONGLONG& x)
+{
+	// xorshift64
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return x;
+}
+
+// A benchmark case.  make() is called once per thread, with the file the
+// thread uses, and returns a function that does one operation.
+
+struct BlockBenchCase {
+	string name;
+	int size;     // bytes per operation
+	bool filled;  // the file(s) start with BLOCK_BENCHMARK_FILE_SIZE bytes in them
+	bool shared;  // all the threads use one file
+	bool mixed;   // needs at least two threads
+	function<function<bool()>(BenchFile*, int)> make;
+};
+
+struct BlockBenchThread {
+	function<bool()> op;
+	HANDLE start;
+	LONGLONG deadline;
+	vector<LONGLONG> latencies;
+	bool ok;
+};
+
+static DWORD WINAPI block_bench_thread_proc(LPVOID param)
+{
+	BlockBenchThread *bt = (BlockBenchThread*)param;
+
+	WaitForSingleObject(bt->start, INFINITE);
+
+	LARGE_INTEGER t0, t1;
+
+	QueryPerformanceCounter(&t0);
+
+	// latencies has room for BLOCK_BENCHMARK_MAX_SAMPLES, so recording one
+	// doesn't allocate
+	while (bt->latencies.size() < bt->latencies.capacity()) {
+		if (!bt->op()) {
+			bt->ok = false;
+			return 0;
+		}
+		QueryPerformanceCounter(&t1);
+		bt->latencies.push_back(t1.QuadPart - t0.QuadPart);
+		if (t1.QuadPart >= bt->deadline)
+			break;
+		t0 = t1;
+	}
+
+	return 0;
+}
+
+static long long pool_allocs()
+{
+	IoBufferPoolStats stats;
+
+	IoBufferPool::getInstance()->GetStats(stats);
+
+	return stats.allocs + stats.fallbacks;
+}
+
+// Runs bc on nthreads threads at once for BLOCK_BENCHMARK_SECONDS, and
+// appends the result to json.
+static bool run_case(CryptContext *con, const BlockBenchCase& bc, const BenchGeometry& geometry, const BenchBackend& backend, int nthreads, string& json)
+{
+	con->m_batch_io = backend.batch;
+	con->m_direct_io = backend.direct;
+
+	vector<unique_ptr<BenchFile>> files;
+
+	for (int i = 0; i < (bc.shared ? 1 : nthreads); i++) {
+		files.push_back(unique_ptr<BenchFile>(new BenchFile));
+		if (!files.back()->Open(con, backend))
+			return false;
+		if (bc.filled && !fill_file(files.back().get()))
+			return false;
+	}
+
+	vector<BlockBenchThread> threads(nthreads);
+	vector<HANDLE> handles;
+
+	HANDLE start = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+	if (!start)
+		return false;
+
+	LARGE_INTEGER freq, t0, t1;
+	QueryPerformanceFrequency(&freq);
+
+	bool ok = true;
+
+	for (int i = 0; i < nthreads; i++) {
+		BlockBenchThread& bt = threads[i];
+		bt.op = bc.make(files[bc.shared ? 0 : i].get(), i);
+		bt.start = start;
+		bt.latencies.reserve(BLOCK_BENCHMARK_MAX_SAMPLES);
+		bt.ok = true;
+		if (!bt.op) {
+			ok = false;
+			break;
+		}
+	}
+
+	if (ok) {
+		for (auto& bt : threads) {
+			HANDLE h = CreateThread(NULL, 0, block_bench_thread_proc, &bt, 0, NULL);
+			if (!h) {
+				ok = false;
+				break;
+			}
+			handles.push_back(h);
+		}
+	}
+
+	long long pool_allocs_before = pool_allocs();
+
+#ifdef _DEBUG
+	g_heap_allocs = 0;
+	_CRT_ALLOC_HOOK prev_hook = _CrtSetAllocHook(heap_alloc_hook);
+#endif
+
+	// the threads wait for start, so they all begin at once
+	QueryPerformanceCounter(&t0);
+
+	for (auto& bt : threads)
+		bt.deadline = t0.QuadPart + (LONGLONG)(BLOCK_BENCHMARK_SECONDS * freq.QuadPart);
+
+	SetEvent(start);
+
+	if (!handles.empty())
+		WaitForMultipleObjects((DWORD)handles.size(), &handles[0], TRUE, INFINITE);
+
+	QueryPerformanceCounter(&t1);
+
+#ifdef _DEBUG
+	_CrtSetAllocHook(prev_hook);
+	long long heap_allocs = g_heap_allocs;
+#endif
+
+	long long allocs = pool_allocs() - pool_allocs_before;
+
+	for (auto h : handles)
+		CloseHandle(h);
+
+	CloseHandle(start);
+
+	if (!ok)
+		return false;
+
+	vector<LONGLONG> latencies;
+
+	for (auto& bt : threads) {
+		if (!bt.ok)
+			return false;
+		latencies.insert(latencies.end(), bt.latencies.begin(), bt.latencies.end());
+	}
+
+	size_t ops = latencies.size();
+
+	if (ops == 0)
+		return false;
+
+	double seconds = (double)(t1.QuadPart - t0.QuadPart) / freq.QuadPart;
+
+	auto percentile_us = [&](int pct) {
+		auto it = latencies.begin() + min(ops - 1, ops * pct / 100);
+		nth_element(latencies.begin(), it, latencies.end());
+		return *it * 1e6 / freq.QuadPart;
+	};
+
+	double p50 = percentile_us(50);
+	double p99 = percentile_us(99);
+
+	char buf[512];
+
+	sprintf_s(buf, "%s\n    {\"name\": \"%s\", \"mode\": \"%s\", \"geometry\": \"%s\", \"backend\": \"%s\", \"size\": %d, \"threads\": %d, \"ops\": %llu, "
+		"\"mb_per_s\": %.1f, \"p50_us\": %.1f, \"p99_us\": %.1f, \"pool_allocs_per_op\": %.3f, \"heap_allocs_per_op\": ",
+		json.back() == '[' ? "" : ",", bc.name.c_str(), con->GetConfig()->m_reverse ? "reverse" : "forward", geometry.name, backend.name,
+		bc.size, nthreads, (unsigned long long)ops, ops * (double)bc.size / seconds / (1024 * 1024), p50, p99, (double)allocs / ops);
+
+	json += buf;
+
+#ifdef _DEBUG
+	sprintf_s(buf, "%.3f}", (double)heap_allocs / ops);
+	json += buf;
+#else
+	json += "null}";
+#endif
+
+	return true;
+}
+
+struct OverlapCheckThread {
+	BenchFile *bf;
+	int thread;
+	int nthreads;
+	HANDLE start;
+	bool ok;
+};
+
+static DWORD WINAPI overlap_check_thread_proc(LPVOID param)
+{
+	OverlapCheckThread *ct = (OverlapCheckThread*)param;
+
+	vector<BYTE> buf(BENCH_CHECK_STRIPE, (BYTE)(ct->thread + 1));
+
+	WaitForSingleObject(ct->start, INFINITE);
+
+	for (int round = 0; round < BENCH_CHECK_ROUNDS; round++) {
+		LONGLONG offset = ((LONGLONG)round * ct->nthreads + ct->thread) * BENCH_CHECK_STRIPE;
+		if (!bench_write(ct->bf, &buf[0], BENCH_CHECK_STRIPE, offset)) {
+			ct->ok = false;
+			break;
+		}
+	}
+
+	return 0;
+}
+
+// Checks that concurrent writers of one file don't lose each other's data.
+// Each thread writes stripes filled with its own number, interleaved with the
+// other threads' stripes so that they share blocks, in increasing order so
+// that the file grows (and has holes filled in) while the others write.
+// Afterwards the file must be exactly as long as all the stripes, and each
+// stripe must read back as written.
+static bool check_overlapping_writes(CryptContext *con, const BenchGeometry& geometry, const BenchBackend& backend, int nthreads, wstring& mes)
+{
+	wstring geometry_name, backend_name;
+	utf8_to_unicode(geometry.name, geometry_name);
+	utf8_to_unicode(backend.name, backend_name);
+
+	mes = L"overlapping write check failed (" + geometry_name + L", " + backend_name + L"): ";
+
+	nthreads = max(2, nthreads);
+
+	con->m_batch_io = backend.batch;
+	con->m_direct_io = backend.direct;
+
+	BenchFile bf;
+
+	if (!bf.Open(con, backend)) {
+		mes += L"unable to create file";
+		return false;
+	}
+
+	vector<OverlapCheckThread> threads(nthreads);
+	vector<HANDLE> handles;
+
+	HANDLE start = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+	if (!start) {
+		mes += L"unable to create event";
+		return false;
+	}
+
+	bool ok = true;
+
+	for (int i = 0; i < nthreads; i++) {
+		OverlapCheckThread& ct = threads[i];
+		ct.bf = &bf;
+		ct.thread = i;
+		ct.nthreads = nthreads;
+		ct.start = start;
+		ct.ok = true;
+		HANDLE h = CreateThread(NULL, 0, overlap_check_thread_proc, &ct, 0, NULL);
+		if (!h) {
+			ok = false;
+			break;
+		}
+		handles.push_back(h);
+	}
+
+	SetEvent(start);
+
+	if (!handles.empty())
+		WaitForMultipleObjects((DWORD)handles.size(), &handles[0], TRUE, INFINITE);
+
+	for (auto h : handles)
+		CloseHandle(h);
+
+	CloseHandle(start);
+
+	if (!ok) {
+		mes += L"unable to create threads";
+		return false;
+	}
+
+	for (auto& ct : threads) {
+		if (!ct.ok) {
+			mes += L"write failed";
+			return false;
+		}
+	}
+
+	const DWORD size = (DWORD)BENCH_CHECK_ROUNDS * nthreads * BENCH_CHECK_STRIPE;
+
+	// one byte more than expected, to catch a file that is too long
+	vector<BYTE> data(size + 1);
+
+	unique_ptr<CryptFile> file(CryptFile::NewInstance(con));
+
+	DWORD nread = 0;
+
+	if (!bf.Associate(file.get()) || !file->Read(&data[0], size + 1, &nread, 0)) {
+		mes += L"read failed";
+		return false;
+	}
+
+	if (nread != size) {
+		mes += L"wrong file size";
+		return false;
+	}
+
+	for (DWORD i = 0; i < size; i++) {
+		if (data[i] != (BYTE)((i / BENCH_CHECK_STRIPE) % nthreads + 1)) {
+			mes += L"data lost";
+			return false;
+		}
+	}
+
+	mes.clear();
+
+	return true;
+}
+
+// Sets up a volume with the given geometry and a random key that exists
+// only for the benchmark, the same way mounting does.
+static bool init_context(CryptContext *con, bool reverse, const BenchGeometry& geometry, int bufferblocks, wstring& mes)
+{
+	CryptConfig *config = con->GetConfig();
+
+	// no names are used, and reverse mode requires AES256-SIV
+	if (!config->create_ephemeral(true, reverse, geometry.xchacha, reverse, geometry.aligned, geometry.blocksize, geometry.compress, mes))
+		return false;
+
+	if (config->m_AESSIV) {
+		try {
+			con->m_siv.SetKey(config->GetMasterKey(), 32, config->m_HKDF);
+		} catch (...) {
+			mes = L"unable to intialize AESSIV context";
+			return false;
+		}
+	}
+
+	if (!init_block_engine(con)) {
+		mes = L"unable to initialize block encryption";
+		return false;
+	}
+
+	con->m_bufferblocks = min(256, max(1, bufferblocks));
+
+	return true;
+}
+
+// Checks the AlignedBlocks layout.  The data of each block must be in one
+// page of the encrypted file, so that a page-aligned 4 KB read of plaintext
+// maps to exactly one page of ciphertext (besides the page with the block's
+// IV and tag).  Damaging the first or last byte of that page must make the
+// read of that block fail and leave the reads of the other blocks alone.
+static bool check_aligned_layout(int bufferblocks, wstring& mes)
+{
+	static const BenchGeometry aligned = { "aligned", PLAIN_BS, true, false, false };
+
+	unique_ptr<CryptContext> con;
+
+	try {
+		con.reset(new CryptContext);
+	} catch (...) {
+		mes = L"unable to create context";
+		return false;
+	}
+
+	if (!init_context(con.get(), false, aligned, bufferblocks, mes))
+		return false;
+
+	mes = L"aligned block layout check failed: ";
+
+	const BlockEngine& engine = con->m_block_engine;
+
+	if (engine.plain_bs != PLAIN_BS || engine.header_len % ALIGNED_BLOCK_LEN || engine.cipher_bs % ALIGNED_BLOCK_LEN) {
+		mes += L"blocks are not page-aligned";
+		return false;
+	}
+
+	BenchFile bf;
+
+	// in memory
+	if (!bf.Open(con.get(), bench_backends[0])) {
+		mes += L"unable to create file";
+		return false;
+	}
+
+	// whole blocks, written as one span, and a partial last block
+	const int blocks = 8;
+	const DWORD size = blocks * PLAIN_BS + 100;
+
+	vector<BYTE> data(size);
+	fill(data);
+
+	if (!bench_write(&bf, &data[0], size, 0)) {
+		mes += L"write failed";
+		return false;
+	}
+
+	vector<BYTE> buf(size + 1);
+
+	unique_ptr<CryptFile> file(CryptFile::NewInstance(con.get()));
+
+	DWORD nread = 0;
+
+	if (!bf.Associate(file.get()) || !file->Read(&buf[0], size + 1, &nread, 0) || nread != size || memcmp(&buf[0], &data[0], size)) {
+		mes += L"data lost";
+		return false;
+	}
+
+	for (int b = 0; b < blocks; b++) {
+		LONGLONG page = engine.header_len + (LONGLONG)b * engine.cipher_bs;
+		for (int pos : { 0, PLAIN_BS - 1 }) {
+			BYTE orig, bad;
+			DWORD n = 0;
+			if (!bf.m_io->ReadAt(page + pos, &orig, 1, &n) || n != 1) {
+				mes += L"read of backing file failed";
+				return false;
+			}
+			bad = orig ^ 1;
+			if (!bf.m_io->WriteAt(page + pos, &bad, 1, &n) || n != 1) {
+				mes += L"write of backing file failed";
+				return false;
+			}
+			for (int other = 0; other < blocks; other++) {
+				bool read_ok = bench_read(&bf, &buf[0], PLAIN_BS, (LONGLONG)other * PLAIN_BS) &&
+					!memcmp(&buf[0], &data[(size_t)other * PLAIN_BS], PLAIN_BS);
+				if (read_ok != (other != b)) {
+					mes += L"block " + to_wstring(b) + L" doesn't map to the page at " + to_wstring(page);
+					return false;
+				}
+			}
+			if (!bf.m_io->WriteAt(page + pos, &orig, 1, &n) || n != 1) {
+				mes += L"write of backing file failed";
+				return false;
+			}
+		}
+	}
+
+	mes.clear();
+
+	return true;
+}
+
+// Checks that --import leaves the zeroed tails of compressed blocks
+// unallocated, so that a file that compresses well takes less space on disk
+// than its slots.  Skipped if the volume of the temporary directory has no
+// sparse files.
+static bool check_sparse_import(int bufferblocks, wstring& mes)
+{
+	static const BenchGeometry compress = { "compress_64k", 64 * 1024, false, true, false };
+
+	WCHAR temp[MAX_PATH + 1];
+	WCHAR root[MAX_PATH + 1];
+	DWORD fs_flags = 0;
+
+	if (!GetTempPath(_countof(temp), temp) || !GetVolumePathName(temp, root, _countof(root)) ||
+		!GetVolumeInformation(root, NULL, 0, NULL, NULL, &fs_flags, NULL, 0) || !(fs_flags & FILE_SUPPORTS_SPARSE_FILES))
+		return true;
+
+	unique_ptr<CryptContext> con;
+
+	try {
+		con.reset(new CryptContext);
+	} catch (...) {
+		mes = L"unable to create context";
+		return false;
+	}
+
+	if (!init_context(con.get(), false, compress, bufferblocks, mes))
+		return false;
+
+	WCHAR dir[MAX_PATH + 1];
+
+	swprintf_s(dir, L"%scppcryptfs-import-%u-%u", temp, GetCurrentProcessId(), GetTickCount());
+
+	const wstring src_dir = wstring(dir) + L"\\src";
+	const wstring dst_dir = wstring(dir) + L"\\dst";
+
+	// the volume has plaintext names
+	const wstring src = src_dir + L"\\compressible.txt";
+	const wstring dst = dst_dir + L"\\compressible.txt";
+
+	const int blocks = 16;
+
+	string text;
+
+	for (int i = 0; (int)text.size() < blocks * compress.blocksize; i++)
+		text += "line " + to_string(i) + " of a file that compresses well\r\n";
+
+	text.resize((size_t)blocks * compress.blocksize);
+
+	mes = L"sparse import check failed: ";
+
+	bool ok = false;
+
+	if (!CreateDirectory(dir, NULL) || !CreateDirectory(src_dir.c_str(), NULL) || !CreateDirectory(dst_dir.c_str(), NULL)) {
+		mes += L"unable to create directories";
+	} else {
+		HANDLE hfile = CreateFile(src.c_str(), GENERIC_WRITE, 0, NULL, CREATE_NEW, FILE_ATTRIBUTE_NORMAL, NULL);
+
+		DWORD nWritten = 0;
+
+		bool written = hfile != INVALID_HANDLE_VALUE && WriteFile(hfile, text.c_str(), (DWORD)text.size(), &nWritten, NULL) && nWritten == text.size();
+
+		if (hfile != INVALID_HANDLE_VALUE)
+			CloseHandle(hfile);
+
+		con->GetConfig()->m_basedir = L"\\\\?\\" + dst_dir;
+
+		wstring report;
+		wstring import_mes;
+
+		if (!written) {
+			mes += L"unable to write source file";
+		} else if (!import_files(con.get(), src_dir.c_str(), report, import_mes)) {
+			mes += import_mes;
+		} else {
+			DWORD high = 0;
+			DWORD low = GetCompressedFileSize(dst.c_str(), &high);
+
+			const ULONGLONG allocated = ((ULONGLONG)high << 32) | low;
+			const ULONGLONG slots = con->m_block_engine.header_len + (ULONGLONG)blocks * con->m_block_engine.cipher_bs;
+
+			if (low == INVALID_FILE_SIZE && GetLastError() != NO_ERROR)
+				mes += L"file not imported: " + report;
+			else if (allocated >= slots)
+				mes += L"imported file takes " + to_wstring(allocated) + L" bytes on disk, the same as its slots";
+			else
+				ok = true;
+		}
+	}
+
+	DeleteFile(src.c_str());
+	DeleteFile(dst.c_str());
+	RemoveDirectory(src_dir.c_str());
+	RemoveDirectory(dst_dir.c_str());
+	RemoveDirectory(dir);
+
+	if (ok)
+		mes.clear();
+
+	return ok;
+}
+
+static void add_cases(vector<BlockBenchCase>& cases, bool reverse)
+{
+	const int seq_size = 1024 * 1024;
+	const int rand_size = 4096;
+	const int append_size = 100;
+
+	const LONGLONG rand_slots = BLOCK_BENCHMARK_FILE_SIZE / rand_size;
+
+	cases.push_back({ "seq_read", seq_size, true, true, false, [=](BenchFile *bf, int thread) -> function<bool()> {
+		auto buf = make_shared<vector<BYTE>>(seq_size);
+		// start the threads at different places in the file
+		auto offset = make_shared<LONGLONG>((LONGLONG)thread * seq_size % BLOCK_BENCHMARK_FILE_SIZE);
+		return [=]() {
+			bool ok = bench_read(bf, &(*buf)[0], seq_size, *offset);
+			*offset = (*offset + seq_size) % BLOCK_BENCHMARK_FILE_SIZE;
+			return ok;
+		};
+	} });
+
+	cases.push_back({ "rand_read", rand_size, true, true, false, [=](BenchFile *bf, int thread) -> function<bool()> {
+		auto buf = make_shared<vector<BYTE>>(rand_size);
+		auto state = make_shared<ULONGLONG>(0x9e3779b97f4a7c15ULL * (thread + 1));
+		return [=]() {
+			return bench_read(bf, &(*buf)[0], rand_size, (LONGLONG)(next_rand(*state) % rand_slots) * rand_size);
+		};
+	} });
+
+	// reverse mode is read-only
+	if (reverse)
+		return;
+
+	cases.push_back({ "seq_write", seq_size, false, false, false, [=](BenchFile *bf, int thread) -> function<bool()> {
+		auto buf = make_shared<vector<BYTE>>(seq_size);
+		fill(*buf);
+		auto offset = make_shared<LONGLONG>(0);
+		return [=]() {
+			bool ok = bench_write(bf, &(*buf)[0], seq_size, *offset);
+			*offset = (*offset + seq_size) % BLOCK_BENCHMARK_FILE_SIZE;
+			return ok;
+		};
+	} });
+
+	cases.push_back({ "rand_write", rand_size, true, true, false, [=](BenchFile *bf, int thread) -> function<bool()> {
+		auto buf = make_shared<vector<BYTE>>(rand_size);
+		fill(*buf);
+		auto state = make_shared<ULONGLONG>(0x9e3779b97f4a7c15ULL * (thread + 1));
+		return [=]() {
+			return bench_write(bf, &(*buf)[0], rand_size, (LONGLONG)(next_rand(*state) % rand_slots) * rand_size);
+		};
+	} });
+
+	cases.push_back({ "append", append_size, false, false, false, [=](BenchFile *bf, int thread) -> function<bool()> {
+		auto buf = make_shared<vector<BYTE>>(append_size);
+		fill(*buf);
+		auto size = make_shared<LONGLONG>(0);
+		return [=]() {
+			if (*size >= BENCH_APPEND_LIMIT) {
+				if (!bench_truncate(bf, 0))
+					return false;
+				*size = 0;
+			}
+			*size += append_size;
+			return bench_write(bf, &(*buf)[0], append_size, 0, true);
+		};
+	} });
+
+	// grows and shrinks the file to random, mostly unaligned, sizes
+	cases.push_back({ "truncate", 0, false, false, false, [=](BenchFile *bf, int thread) -> function<bool()> {
+		auto state = make_shared<ULONGLONG>(0x9e3779b97f4a7c15ULL * (thread + 1));
+		return [=]() {
+			return bench_truncate(bf, (LONGLONG)(next_rand(*state) % BENCH_TRUNCATE_LIMIT));
+		};
+	} });
+
+	// even threads read and odd threads write random blocks of the same file
+	cases.push_back({ "mixed_read_write", rand_size, true, true, true, [=](BenchFile *bf, int thread) -> function<bool()> {
+		auto buf = make_shared<vector<BYTE>>(rand_size);
+		fill(*buf);
+		auto state = make_shared<ULONGLONG>(0x9e3779b97f4a7c15ULL * (thread + 1));
+		bool writer = (thread & 1) != 0;
+		return [=]() {
+			LONGLONG offset = (LONGLONG)(next_rand(*state) % rand_slots) * rand_size;
+			if (writer)
+				return bench_write(bf, &(*buf)[0], rand_size, offset);
+			else
+				return bench_read(bf, &(*buf)[0], rand_size, offset);
+		};
+	} });
+}
+
+bool run_block_benchmark(int nthreads, int bufferblocks, string& json, wstring& mes)
+{
+	if (!check_aligned_layout(bufferblocks, mes))
+		return false;
+
+	if (!check_sparse_import(bufferblocks, mes))
+		return false;
+
+	json = "{\n  \"results\": [";
+
+	for (bool reverse : { false, true }) {
+
+		vector<BlockBenchCase> cases;
+
+		add_cases(cases, reverse);
+
+		for (auto& geometry : bench_geometries) {
+
+			if (reverse && (geometry.compress || geometry.xchacha))
+				continue;
+
+			const bool default_geometry = &geometry == &bench_geometries[0];
+
+			unique_ptr<CryptContext> con;
+
+			try {
+				con.reset(new CryptContext);
+			} catch (...) {
+				mes = L"unable to create context";
+				return false;
+			}
+
+			if (!init_context(con.get(), reverse, geometry, bufferblocks, mes))
+				return false;
+
+			// reverse mode is read-only
+			if (!reverse) {
+				for (auto& backend : bench_backends) {
+					if (!default_geometry && !backend.every_geometry)
+						continue;
+					if (!check_overlapping_writes(con.get(), geometry, backend, nthreads, mes))
+						return false;
+				}
+			}
+
+			for (int threads : { 1, nthreads }) {
+				for (auto& backend : bench_backends) {
+					if (!default_geometry && !backend.every_geometry)
+						continue;
+					for (auto& bc : cases) {
+						int n = threads;
+						if (bc.mixed) {
+							// needs a reader and a writer, so it's only run with the most threads
+							if (threads == 1 && nthreads > 1)
+								continue;
+							n = max(2, threads);
+						}
+						if (!run_case(con.get(), bc, geometry, backend, n, json)) {
+							mes = L"benchmark failed: ";
+							wstring name;
+							utf8_to_unicode(bc.name.c_str(), name);
+							mes += name;
+							utf8_to_unicode(geometry.name, name);
+							mes += L" (" + name + L")";
+							return false;
+						}
+					}
+				}
+				if (nthreads == 1)
+					break;
+			}
+		}
+	}
+
+	json += "\n  ]\n}\n";
+
+	return true;
+}
@@ -0,0 +1,60 @@
+/*
+cppcryptfs : user-mode cryptographic virtual overlay filesystem.
+
+Copyright (C) 2016-2018 Bailey Brown (github.com/bailey27/cppcryptfs)
+
+cppcryptfs is based on the design of gocryptfs (github.com/rfjakob/gocryptfs)
+
+The MIT License (MIT)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#pragma once
+
+#include <string>
+
+using namespace std;
+
+// seconds each case is run for, at each thread count
+#define BLOCK_BENCHMARK_SECONDS 0.5
+
+// size of the files the read and overwrite cases use
+#define BLOCK_BENCHMARK_FILE_SIZE (16 * 1024 * 1024)
+
+// most operations timed per thread in one case
+#define BLOCK_BENCHMARK_MAX_SAMPLES (1 << 18)
+
+// Runs CryptFileForward and CryptFileReverse end to end on files kept in
+// memory (MemoryIoBackend) and on temporary files on disk (HandleIoBackend,
+// once issuing each transfer on its own, once with overlapped batches and
+// once with overlapped batches and unbuffered I/O), without Dokany.  The
+// cases are sequential and random reads and writes, small appends, truncates
+// and concurrent readers and writers on one file.  They are run on volumes
+// with the default 4 KB blocks on every backend, and with larger blocks,
+// AlignedBlocks, Compression and XChaCha20-Poly1305 in memory and with
+// overlapped batches.  Before them, concurrent writers of overlapping blocks
+// of one file are run and the result is checked, and so are the page
+// alignment of AlignedBlocks and the space a compressible file takes after
+// --import into a volume with Compression.  Each case is run on one thread and on nthreads threads.
+// Throughput, p50/p99 latency and allocations per operation are returned as
+// JSON.
+// Returns false and sets mes on error.
+bool run_block_benchmark(int nthreads, int bufferblocks, string& json, wstring& mes);
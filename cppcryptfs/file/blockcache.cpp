@@ -0,0 +1,252 @@
+/*
+cppcryptfs : user-mode cryptographic virtual overlay filesystem.
+
+Copyright (C) 2016-2018 Bailey Brown (github.com/bailey27/cppcryptfs)
+
+cppcryptfs is based on the design of gocryptfs (github.com/rfjakob/gocryptfs)
+
+The MIT License (MIT)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#include "stdafx.h"
+
+#include <windows.h>
+
+#include "blockcache.h"
+
+#include "util/util.h"
+
+/*
+	Like DirIvCache, each shard keeps the node pointers in both an
+	unordered_map (for lookups) and a list (for LRU replacement).  Nodes and
+	their buffers are recycled rather than freed.
+*/
+
+BlockCacheNode::BlockCacheNode(int bufsize)
+{
+	m_last_write_time = { 0, 0 };
+	m_size = 0;
+	m_len = 0;
+	m_buf = new BYTE[bufsize];
+}
+
+BlockCacheNode::~BlockCacheNode()
+{
+	delete[] m_buf;
+}
+
+BlockCacheShard::BlockCacheShard()
+{
+	m_capacity = 0;
+	m_block_size = 0;
+	m_lookups = 0;
+	m_hits = 0;
+
+	InitializeSRWLock(&m_lock);
+}
+
+BlockCacheShard::~BlockCacheShard()
+{
+	for (auto it = m_lru_list.begin(); it != m_lru_list.end(); it++)
+		delete *it;
+
+	for (auto it = m_spare_node_list.begin(); it != m_spare_node_list.end(); it++)
+		delete *it;
+}
+
+void BlockCacheShard::update_lru(BlockCacheNode *node)
+{
+	if (node->m_list_it != m_lru_list.begin()) {
+		m_lru_list.erase(node->m_list_it);
+		m_lru_list.push_front(node);
+		node->m_list_it = m_lru_list.begin();
+	}
+}
+
+bool BlockCacheShard::lookup(const BlockCacheKey& key, const BlockCacheFile& file, BYTE *buf, int& len)
+{
+	bool found = false;
+
+	// exclusive because a hit moves the node to the front of the LRU list
+	AcquireSRWLockExclusive(&m_lock);
+
+	m_lookups++;
+
+	auto it = m_map.find(key);
+
+	if (it != m_map.end()) {
+
+		BlockCacheNode *node = it->second;
+
+		if (node->m_size == file.size && CompareFileTime(&node->m_last_write_time, &file.last_write_time) == 0) {
+			memcpy(buf, node->m_buf, node->m_len);
+			len = node->m_len;
+			update_lru(node);
+			found = true;
+			m_hits++;
+		} else {
+			// the file has changed since the block was stored
+			m_map.erase(it);
+			m_lru_list.erase(node->m_list_it);
+			m_spare_node_list.push_front(node);
+		}
+	}
+
+	ReleaseSRWLockExclusive(&m_lock);
+
+	return found;
+}
+
+bool BlockCacheShard::store(const BlockCacheKey& key, const BlockCacheFile& file, const BYTE *buf, int len)
+{
+	bool rval = true;
+
+	AcquireSRWLockExclusive(&m_lock);
+
+	try {
+
+		auto mp = m_map.emplace(key, (BlockCacheNode*)NULL);
+
+		BlockCacheNode *node;
+
+		if (mp.second) {
+
+			node = NULL;
+
+			if (m_map.size() > m_capacity) {
+				node = m_lru_list.back();
+				m_lru_list.pop_back();
+				m_map.erase(node->m_key);
+			}
+
+			if (!node) {
+				if (!m_spare_node_list.empty()) {
+					node = m_spare_node_list.front();
+					m_spare_node_list.pop_front();
+				} else {
+					node = new BlockCacheNode(m_block_size);
+				}
+			}
+
+			mp.first->second = node;
+			node->m_key = key;
+			m_lru_list.push_front(node);
+			node->m_list_it = m_lru_list.begin();
+
+		} else {
+			node = mp.first->second;
+			update_lru(node);
+		}
+
+		memcpy(node->m_buf, buf, len);
+		node->m_len = len;
+		node->m_last_write_time = file.last_write_time;
+		node->m_size = file.size;
+
+	} catch (...) {
+		// don't leave a key without a node behind
+		auto it = m_map.find(key);
+		if (it != m_map.end() && it->second == NULL)
+			m_map.erase(it);
+		rval = false;
+	}
+
+	ReleaseSRWLockExclusive(&m_lock);
+
+	return rval;
+}
+
+BlockCache::BlockCache()
+{
+	m_capacity = 0;
+	m_block_size = 0;
+}
+
+BlockCache::~BlockCache()
+{
+}
+
+BlockCacheShard& BlockCache::shard(const BlockCacheKey& key)
+{
+	// not the low bits, which pick the bucket in the shard's map
+	return m_shards[(BlockCacheKeyHash()(key) >> 16) % BLOCK_CACHE_SHARDS];
+}
+
+void BlockCache::SetCapacity(size_t bytes, int cipher_bs)
+{
+	m_capacity = cipher_bs > 0 ? bytes / cipher_bs : 0;
+	m_block_size = cipher_bs;
+
+	// rounded up, so each shard of an enabled cache holds at least one block
+	size_t shard_capacity = (m_capacity + BLOCK_CACHE_SHARDS - 1) / BLOCK_CACHE_SHARDS;
+
+	for (auto& s : m_shards) {
+		AcquireSRWLockExclusive(&s.m_lock);
+		s.m_capacity = shard_capacity;
+		s.m_block_size = cipher_bs;
+		s.m_map.reserve(shard_capacity);
+		ReleaseSRWLockExclusive(&s.m_lock);
+	}
+}
+
+bool BlockCache::lookup(const BlockCacheFile& file, LONGLONG block, BYTE *buf, int& len)
+{
+	BlockCacheKey key(file, block);
+
+	return shard(key).lookup(key, file, buf, len);
+}
+
+bool BlockCache::store(const BlockCacheFile& file, LONGLONG block, const BYTE *buf, int len)
+{
+	if (!m_capacity || len < 1 || len > m_block_size)
+		return false;
+
+	BlockCacheKey key(file, block);
+
+	return shard(key).store(key, file, buf, len);
+}
+
+long long BlockCache::hits()
+{
+	long long rval = 0;
+
+	for (auto& s : m_shards) {
+		AcquireSRWLockShared(&s.m_lock);
+		rval += s.m_hits;
+		ReleaseSRWLockShared(&s.m_lock);
+	}
+
+	return rval;
+}
+
+long long BlockCache::lookups()
+{
+	long long rval = 0;
+
+	for (auto& s : m_shards) {
+		AcquireSRWLockShared(&s.m_lock);
+		rval += s.m_lookups;
+		ReleaseSRWLockShared(&s.m_lock);
+	}
+
+	return rval;
+}
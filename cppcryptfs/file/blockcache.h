@@ -0,0 +1,186 @@
+/*
+cppcryptfs : user-mode cryptographic virtual overlay filesystem.
+
+Copyright (C) 2016-2018 Bailey Brown (github.com/bailey27/cppcryptfs)
+
+cppcryptfs is based on the design of gocryptfs (github.com/rfjakob/gocryptfs)
+
+The MIT License (MIT)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#pragma once
+
+#include <windows.h>
+
+#include <unordered_map>
+#include <list>
+
+#include "crypt/cryptdefs.h"
+
+using namespace std;
+
+// amount of ciphertext the reverse mode block cache holds
+#define REVERSE_BLOCK_CACHE_SIZE (32*1024*1024)
+
+// Identifies a plaintext file in reverse mode, and the version of it that
+// cached blocks were encrypted from.  The file id is derived from the path,
+// so hard links to the same file are encrypted differently and cached apart.
+
+struct BlockCacheFile {
+	DWORD volume_serial;
+	ULONGLONG file_index;
+	BYTE fileid[FILE_ID_LEN];
+	FILETIME last_write_time;
+	LONGLONG size;
+};
+
+struct BlockCacheKey {
+	DWORD volume_serial;
+	ULONGLONG file_index;
+	BYTE fileid[FILE_ID_LEN];
+	LONGLONG block;
+
+	BlockCacheKey(const BlockCacheFile& file, LONGLONG blk)
+	{
+		volume_serial = file.volume_serial;
+		file_index = file.file_index;
+		memcpy(fileid, file.fileid, sizeof(fileid));
+		block = blk;
+	}
+
+	BlockCacheKey() { volume_serial = 0; file_index = 0; memset(fileid, 0, sizeof(fileid)); block = 0; };
+
+	bool operator==(const BlockCacheKey& other) const
+	{
+		return block == other.block && file_index == other.file_index && volume_serial == other.volume_serial &&
+			!memcmp(fileid, other.fileid, sizeof(fileid));
+	}
+};
+
+struct BlockCacheKeyHash {
+	size_t operator()(const BlockCacheKey& key) const
+	{
+		ULONGLONG id;
+		memcpy(&id, key.fileid, sizeof(id));
+		return hash<ULONGLONG>()((key.file_index ^ id) * 0x9e3779b97f4a7c15ULL + key.block) ^ key.volume_serial;
+	}
+};
+
+class BlockCacheNode {
+
+public:
+	BlockCacheKey m_key;
+	FILETIME m_last_write_time;
+	LONGLONG m_size;
+	BYTE *m_buf; // cipher block size bytes
+	int m_len;
+	list<BlockCacheNode*>::iterator m_list_it;  // holds position in lru list
+
+	// disallow copying
+	BlockCacheNode(BlockCacheNode const&) = delete;
+	void operator=(BlockCacheNode const&) = delete;
+
+	BlockCacheNode(int bufsize);
+	virtual ~BlockCacheNode();
+};
+
+// One of the parts a BlockCache is split into.  Each has its own lock, LRU
+// list and share of the capacity.
+
+class BlockCacheShard {
+
+public:
+
+	size_t m_capacity; // in blocks
+	int m_block_size;
+
+	unordered_map<BlockCacheKey, BlockCacheNode*, BlockCacheKeyHash> m_map;
+
+	list<BlockCacheNode*> m_lru_list;
+
+	list<BlockCacheNode*> m_spare_node_list;
+
+	SRWLOCK m_lock;
+
+	long long m_lookups;
+	long long m_hits;
+
+	void update_lru(BlockCacheNode *node);
+
+	bool lookup(const BlockCacheKey& key, const BlockCacheFile& file, BYTE *buf, int& len);
+
+	bool store(const BlockCacheKey& key, const BlockCacheFile& file, const BYTE *buf, int len);
+
+	// disallow copying
+	BlockCacheShard(BlockCacheShard const&) = delete;
+	void operator=(BlockCacheShard const&) = delete;
+
+	BlockCacheShard();
+
+	virtual ~BlockCacheShard();
+};
+
+// number of independently locked parts of a BlockCache
+#define BLOCK_CACHE_SHARDS 16
+
+// LRU cache of the ciphertext of blocks of files in reverse mode.  Reverse mode
+// encryption is deterministic, so a block's ciphertext depends only on the
+// file and its contents.  An entry is used only if the file's last write time
+// and size are the same as when it was stored.
+//
+// The blocks of a multi-block read are encrypted on several threads at once
+// (see parallel_for()), so the cache is split into BLOCK_CACHE_SHARDS shards
+// by the hash of the key, and threads working on different blocks rarely wait
+// for each other.  Each shard does LRU replacement on its own.
+
+class BlockCache {
+
+private:
+
+	size_t m_capacity; // in blocks, 0 if the cache is disabled
+	int m_block_size;
+
+	BlockCacheShard m_shards[BLOCK_CACHE_SHARDS];
+
+	BlockCacheShard& shard(const BlockCacheKey& key);
+public:
+	// disallow copying
+	BlockCache(BlockCache const&) = delete;
+	void operator=(BlockCache const&) = delete;
+
+	BlockCache();
+
+	virtual ~BlockCache();
+
+	// must be called before the cache is used
+	void SetCapacity(size_t bytes, int cipher_bs);
+
+	bool enabled() const { return m_capacity > 0; }
+
+	// copies the block into buf (cipher block size bytes) and sets len if it is cached
+	bool lookup(const BlockCacheFile& file, LONGLONG block, BYTE *buf, int& len);
+
+	bool store(const BlockCacheFile& file, LONGLONG block, const BYTE *buf, int len);
+
+	long long hits();
+	long long lookups();
+};
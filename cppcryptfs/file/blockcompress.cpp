@@ -0,0 +1,101 @@
+/*
+cppcryptfs : user-mode cryptographic virtual overlay filesystem.
+
+Copyright (C) 2016-2018 Bailey Brown (github.com/bailey27/cppcryptfs)
+
+cppcryptfs is based on the design of gocryptfs (github.com/rfjakob/gocryptfs)
+
+The MIT License (MIT)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#include "stdafx.h"
+
+#include <compressapi.h>
+
+#include "blockcompress.h"
+
+// Compressor handles can't be shared between threads, and creating one costs
+// much more than compressing a block, so each thread keeps its own.
+
+class BlockCompressor
+{
+public:
+	COMPRESSOR_HANDLE m_compressor;
+	DECOMPRESSOR_HANDLE m_decompressor;
+
+	BlockCompressor()
+	{
+		m_compressor = NULL;
+		m_decompressor = NULL;
+	}
+
+	~BlockCompressor()
+	{
+		if (m_compressor)
+			CloseCompressor(m_compressor);
+		if (m_decompressor)
+			CloseDecompressor(m_decompressor);
+	}
+
+	// disallow copying
+	BlockCompressor(BlockCompressor const&) = delete;
+	void operator=(BlockCompressor const&) = delete;
+};
+
+static thread_local BlockCompressor t_compressor;
+
+int
+compress_block(const BYTE *src, int srclen, BYTE *dst, int dstlen)
+{
+	if (!t_compressor.m_compressor) {
+		if (!CreateCompressor(COMPRESS_ALGORITHM_XPRESS | COMPRESS_RAW, NULL, &t_compressor.m_compressor)) {
+			t_compressor.m_compressor = NULL;
+			return 0;
+		}
+	}
+
+	SIZE_T clen = 0;
+
+	// fails with ERROR_INSUFFICIENT_BUFFER if the data doesn't compress to dstlen bytes
+	if (!Compress(t_compressor.m_compressor, src, srclen, dst, dstlen, &clen))
+		return 0;
+
+	return (int)clen;
+}
+
+int
+decompress_block(const BYTE *src, int srclen, BYTE *dst, int dstlen)
+{
+	if (!t_compressor.m_decompressor) {
+		if (!CreateDecompressor(COMPRESS_ALGORITHM_XPRESS | COMPRESS_RAW, NULL, &t_compressor.m_decompressor)) {
+			t_compressor.m_decompressor = NULL;
+			return -1;
+		}
+	}
+
+	SIZE_T len = 0;
+
+	if (!Decompress(t_compressor.m_decompressor, src, srclen, dst, dstlen, &len))
+		return -1;
+
+	return (int)len;
+}
@@ -0,0 +1,49 @@
+/*
+cppcryptfs : user-mode cryptographic virtual overlay filesystem.
+
+Copyright (C) 2016-2018 Bailey Brown (github.com/bailey27/cppcryptfs)
+
+cppcryptfs is based on the design of gocryptfs (github.com/rfjakob/gocryptfs)
+
+The MIT License (MIT)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#pragma once
+
+#include <windows.h>
+
+// Per-block compression for volumes with the Compression feature flag.
+//
+// Uses the XPRESS algorithm from the Windows Compression API in raw mode (no
+// framing), which is in the same speed class as LZ4 and needs no extra
+// dependency.
+
+// Compresses srclen bytes from src into dst.  Returns the compressed length,
+// or 0 if the data doesn't fit in dstlen bytes (i.e. it isn't worth compressing)
+// or compression failed.
+int
+compress_block(const BYTE *src, int srclen, BYTE *dst, int dstlen);
+
+// Decompresses srclen bytes from src into dst.  dstlen must be the exact
+// uncompressed length.  Returns the decompressed length, or -1 on error.
+int
+decompress_block(const BYTE *src, int srclen, BYTE *dst, int dstlen);
@@ -0,0 +1,754 @@
+/*
+cppcryptfs : user-mode cryptographic virtual overlay filesystem.
+
+Copyright (C) 2016-2018 Bailey Brown (github.com/bailey27/cppcryptfs)
+
+cppcryptfs is based on the design of gocryptfs (github.com/rfjakob/gocryptfs)
+
+The MIT License (MIT)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#include "stdafx.h"
+
+#include "crypt/cryptdefs.h"
+#include "crypt/crypt.h"
+#include "context/cryptcontext.h"
+#include "filename/cryptfilename.h"
+#include "bulkcopy.h"
+#include "cryptio.h"
+#include "cryptfile.h"
+#include "iobackend.h"
+#include "util/util.h"
+#include "util/fileutil.h"
+
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <functional>
+
+struct BulkFile {
+	wstring src;
+	wstring dst;
+	LONGLONG size; // of src
+	LONGLONG blocks;
+	string long_name; // import only, what goes in the .name file if the encrypted name is long
+	BYTE fileid[FILE_ID_LEN];
+	bool created; // the destination was created (and truncated) by start_file()
+	volatile LONG failed; // set by the workers, and the destination is deleted after they finish
+};
+
+// a run of blocks of a file with more than BULK_CHUNK_BLOCKS blocks
+struct BulkChunk {
+	int file;
+	LONGLONG first_block;
+	int blocks;
+};
+
+struct BulkBuffers {
+	vector<BYTE> in;
+	vector<BYTE> out;
+};
+
+class BulkCopy {
+public:
+	CryptContext *m_con;
+	bool m_import;
+
+	vector<BulkFile> m_files;
+	vector<BulkChunk> m_chunks;
+
+	vector<wstring> m_errors;
+	long long m_num_errors;
+
+	long long m_dirs;
+	volatile LONGLONG m_bytes; // plaintext bytes copied
+
+	void Report(const wstring& error);
+
+	void AddFile(const wstring& src, const wstring& dst, LONGLONG size, const string& long_name);
+
+	// the plaintext side of the copy, which errors are reported by
+	const wstring& PlainPath(const BulkFile& file) const { return m_import ? file.src : file.dst; };
+
+	// disallow copying
+	BulkCopy(BulkCopy const&) = delete;
+	void operator=(BulkCopy const&) = delete;
+
+	BulkCopy(CryptContext *con, bool import);
+	~BulkCopy();
+
+private:
+	CRITICAL_SECTION m_crit;
+};
+
+BulkCopy::BulkCopy(CryptContext *con, bool import)
+{
+	m_con = con;
+	m_import = import;
+	m_num_errors = 0;
+	m_dirs = 0;
+	m_bytes = 0;
+
+	InitializeCriticalSection(&m_crit);
+}
+
+BulkCopy::~BulkCopy()
+{
+	DeleteCriticalSection(&m_crit);
+}
+
+void BulkCopy::Report(const wstring& error)
+{
+	EnterCriticalSection(&m_crit);
+
+	if (m_num_errors++ < BULK_MAX_ERRORS)
+		m_errors.push_back(error);
+
+	LeaveCriticalSection(&m_crit);
+}
+
+void BulkCopy::AddFile(const wstring& src, const wstring& dst, LONGLONG size, const string& long_name)
+{
+	const BlockEngine& engine = m_con->m_block_engine;
+
+	BulkFile file;
+
+	file.src = src;
+	file.dst = dst;
+	file.size = size;
+	file.long_name = long_name;
+	file.created = false;
+	file.failed = FALSE;
+
+	memset(file.fileid, 0, sizeof(file.fileid));
+
+	if (m_import)
+		file.blocks = (size + engine.plain_bs - 1) / engine.plain_bs;
+	else
+		file.blocks = size > engine.header_len ? (size - engine.header_len + engine.cipher_bs - 1) / engine.cipher_bs : 0;
+
+	m_files.push_back(file);
+}
+
+static wstring
+join_path(const wstring& dir, const WCHAR *name)
+{
+	return dir + L"\\" + name;
+}
+
+// full path with the \\?\ prefix, without trailing backslashes
+static bool
+get_long_path(const WCHAR *path, wstring& long_path)
+{
+	WCHAR buf[MAX_PATH + 1];
+
+	DWORD len = GetFullPathName(path, _countof(buf), buf, NULL);
+
+	if (len == 0 || len >= _countof(buf))
+		return false;
+
+	wstring full = buf;
+
+	while (full.size() > 0 && full[full.size() - 1] == '\\')
+		full.erase(full.size() - 1);
+
+	if (!wcsncmp(full.c_str(), L"\\\\?\\", 4))
+		long_path = full;
+	else if (!wcsncmp(full.c_str(), L"\\\\", 2))
+		long_path = L"\\\\?\\UNC\\" + full.substr(2);
+	else
+		long_path = L"\\\\?\\" + full;
+
+	return true;
+}
+
+static bool
+read_at(HANDLE hfile, LONGLONG offset, BYTE *buf, DWORD len, DWORD& total)
+{
+	total = 0;
+
+	while (total < len) {
+		OVERLAPPED ov;
+		memset(&ov, 0, sizeof(ov));
+		ov.Offset = (DWORD)(offset + total);
+		ov.OffsetHigh = (DWORD)((offset + total) >> 32);
+		DWORD nRead;
+		if (!ReadFile(hfile, buf + total, len - total, &nRead, &ov))
+			return false;
+		if (nRead == 0)
+			break;
+		total += nRead;
+	}
+
+	return true;
+}
+
+static bool
+write_at(HANDLE hfile, LONGLONG offset, const BYTE *buf, DWORD len)
+{
+	OVERLAPPED ov;
+	memset(&ov, 0, sizeof(ov));
+	ov.Offset = (DWORD)offset;
+	ov.OffsetHigh = (DWORD)(offset >> 32);
+
+	DWORD nWritten;
+
+	return WriteFile(hfile, buf, len, &nWritten, &ov) && nWritten == len;
+}
+
+// Walks a plaintext tree and creates the encrypted directories.
+// rel_dir is the path within the filesystem, and the root is the empty string.
+static void
+import_dir(BulkCopy& bc, const wstring& src_dir, const wstring& rel_dir)
+{
+	CryptContext *con = bc.m_con;
+
+	WIN32_FIND_DATAW fdata;
+
+	HANDLE hfind = FindFirstFileEx(join_path(src_dir, L"*").c_str(), FindExInfoBasic, &fdata, FindExSearchNameMatch, NULL, FIND_FIRST_EX_LARGE_FETCH);
+
+	if (hfind == INVALID_HANDLE_VALUE) {
+		bc.Report(L"unable to list directory: " + src_dir);
+		return;
+	}
+
+	vector<pair<wstring, wstring>> subdirs;
+
+	do {
+		const WCHAR *name = fdata.cFileName;
+
+		if (!wcscmp(name, L".") || !wcscmp(name, L".."))
+			continue;
+
+		wstring src = join_path(src_dir, name);
+		wstring rel = join_path(rel_dir, name);
+
+		wstring enc;
+		string actual_encrypted;
+
+		if (!encrypt_path(con, rel.c_str(), enc, &actual_encrypted)) {
+			bc.Report(L"unable to encrypt name: " + src);
+			continue;
+		}
+
+		if (fdata.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+			if (fdata.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT)
+				continue;
+			if (CreateDirectory(enc.c_str(), NULL)) {
+				if (!create_dir_iv(con, enc.c_str()) ||
+					(actual_encrypted.size() > 0 && !write_encrypted_long_name(enc.c_str(), actual_encrypted))) {
+					bc.Report(L"unable to create directory: " + src);
+					RemoveDirectory(enc.c_str());
+					continue;
+				}
+			} else if (GetLastError() != ERROR_ALREADY_EXISTS) {
+				bc.Report(L"unable to create directory: " + src);
+				continue;
+			}
+			bc.m_dirs++;
+			subdirs.push_back(make_pair(src, rel));
+		} else {
+			bc.AddFile(src, enc, ((LONGLONG)fdata.nFileSizeHigh << 32) | fdata.nFileSizeLow, actual_encrypted);
+		}
+
+	} while (FindNextFile(hfind, &fdata));
+
+	FindClose(hfind);
+
+	for (auto& it : subdirs)
+		import_dir(bc, it.first, it.second);
+}
+
+// Walks an encrypted tree and creates the plaintext directories.
+static void
+export_dir(BulkCopy& bc, const wstring& enc_dir, const wstring& dst_dir, bool root)
+{
+	CryptContext *con = bc.m_con;
+	CryptConfig *config = con->GetConfig();
+
+	BYTE dir_iv[DIR_IV_LEN];
+
+	if (!get_dir_iv(con, enc_dir.c_str(), dir_iv)) {
+		bc.Report(L"unable to read diriv: " + dst_dir);
+		return;
+	}
+
+	WIN32_FIND_DATAW fdata;
+
+	HANDLE hfind = FindFirstFileEx(join_path(enc_dir, L"*").c_str(), FindExInfoBasic, &fdata, FindExSearchNameMatch, NULL, FIND_FIRST_EX_LARGE_FETCH);
+
+	if (hfind == INVALID_HANDLE_VALUE) {
+		bc.Report(L"unable to list directory: " + dst_dir);
+		return;
+	}
+
+	const bool encrypted_names = !config->m_PlaintextNames;
+
+	vector<pair<wstring, wstring>> subdirs;
+
+	do {
+		const WCHAR *name = fdata.cFileName;
+
+		if (!wcscmp(name, L".") || !wcscmp(name, L".."))
+			continue;
+
+		if (config->DirIV() && !wcscmp(name, DIR_IV_NAME))
+			continue;
+
+		if (root && !wcscmp(name, CONFIG_NAME))
+			continue;
+
+		if (encrypted_names && is_long_name_file(name))
+			continue;
+
+		wstring enc = join_path(enc_dir, name);
+
+		// decrypt_filename() would create a missing .name file
+		if (encrypted_names && is_long_name(name) && GetFileAttributes((enc + LONGNAME_SUFFIX_W).c_str()) == INVALID_FILE_ATTRIBUTES) {
+			bc.Report(L"missing long name file: " + join_path(dst_dir, name));
+			continue;
+		}
+
+		wstring plain;
+
+		if (!decrypt_filename(con, dir_iv, enc_dir.c_str(), name, plain)) {
+			bc.Report(L"undecryptable file name: " + join_path(dst_dir, name));
+			continue;
+		}
+
+		wstring dst = join_path(dst_dir, plain.c_str());
+
+		if (fdata.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+			if (fdata.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT)
+				continue;
+			if (!CreateDirectory(dst.c_str(), NULL) && GetLastError() != ERROR_ALREADY_EXISTS) {
+				bc.Report(L"unable to create directory: " + dst);
+				continue;
+			}
+			bc.m_dirs++;
+			subdirs.push_back(make_pair(enc, dst));
+		} else {
+			bc.AddFile(enc, dst, ((LONGLONG)fdata.nFileSizeHigh << 32) | fdata.nFileSizeLow, "");
+		}
+
+	} while (FindNextFile(hfind, &fdata));
+
+	FindClose(hfind);
+
+	for (auto& it : subdirs)
+		export_dir(bc, it.first, it.second, false);
+}
+
+// Reads blocks [first, first + blocks) of the source file, encrypts or
+// decrypts them, and writes them to the destination file.
+static bool
+copy_blocks(BulkCopy& bc, const BulkFile& file, HANDLE hsrc, HANDLE hdst, LONGLONG first, int blocks, BulkBuffers& bufs, void *context)
+{
+	CryptContext *con = bc.m_con;
+
+	const BlockEngine& engine = con->m_block_engine;
+
+	const int in_bs = bc.m_import ? engine.plain_bs : engine.cipher_bs;
+
+	const LONGLONG src_offset = bc.m_import ? first * engine.plain_bs : engine.header_len + first * engine.cipher_bs;
+	const LONGLONG dst_offset = bc.m_import ? engine.header_len + first * engine.cipher_bs : first * engine.plain_bs;
+
+	const DWORD len = (DWORD)max(0LL, min((LONGLONG)blocks * in_bs, file.size - src_offset));
+
+	DWORD nRead = 0;
+
+	if (!read_at(hsrc, src_offset, &bufs.in[0], len, nRead)) {
+		bc.Report(L"read error: " + bc.PlainPath(file));
+		return false;
+	}
+
+	DWORD pos = 0;
+	DWORD out_len = 0;
+
+	for (LONGLONG block = first; pos < nRead; block++) {
+
+		int n = (int)min((DWORD)in_bs, nRead - pos);
+
+		int outn;
+
+		if (bc.m_import)
+			outn = write_block(con, &bufs.out[out_len], NULL, file.fileid, block, &bufs.in[pos], n, context);
+		else
+			outn = read_block(con, NULL, &bufs.in[pos], n, NULL, file.fileid, block, &bufs.out[out_len], context);
+
+		if (outn < 0) {
+			if (bc.m_import)
+				bc.Report(L"unable to encrypt: " + file.src);
+			else
+				bc.Report(L"corrupt block: " + file.dst + L" offset " + to_wstring(block * engine.plain_bs));
+			return false;
+		}
+
+		out_len += outn;
+		pos += n;
+	}
+
+	if (out_len > 0 && !write_at(hdst, dst_offset, &bufs.out[0], out_len)) {
+		bc.Report(L"write error: " + bc.PlainPath(file));
+		return false;
+	}
+
+	// the slots hold the zeroed tails of compressed blocks (see start_file())
+	if (bc.m_import && con->GetConfig()->m_Compression) {
+		HandleIoBackend io(hdst);
+		punch_zero_clusters(&io, dst_offset, &bufs.out[0], out_len);
+	}
+
+	InterlockedExchangeAdd64(&bc.m_bytes, bc.m_import ? nRead : out_len);
+
+	return true;
+}
+
+// Creates the destination file and copies the whole file if it is small.
+// Otherwise it sets the size of the destination, and the chunks are copied
+// later.
+static void
+start_file(BulkCopy& bc, BulkFile& file, BulkBuffers& bufs, void *context)
+{
+	CryptContext *con = bc.m_con;
+	CryptConfig *config = con->GetConfig();
+
+	const BlockEngine& engine = con->m_block_engine;
+
+	HANDLE hsrc = INVALID_HANDLE_VALUE;
+	HANDLE hdst = INVALID_HANDLE_VALUE;
+
+	try {
+		hsrc = CreateFile(file.src.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+
+		if (hsrc == INVALID_HANDLE_VALUE) {
+			bc.Report(L"unable to open: " + bc.PlainPath(file));
+			throw(-1);
+		}
+
+		if (file.size > 0) {
+			if (bc.m_import) {
+				if (!get_random_bytes(con, file.fileid, FILE_ID_LEN)) {
+					bc.Report(L"unable to get random bytes: " + file.src);
+					throw(-1);
+				}
+			} else {
+				FileHeader header;
+				DWORD nRead = 0;
+				static const BYTE zerobytes[FILE_ID_LEN] = { 0 };
+				if (file.size < engine.header_len || !read_at(hsrc, 0, (BYTE*)&header, FILE_HEADER_LEN, nRead) || nRead != FILE_HEADER_LEN ||
+					MakeBigEndianNative(header.version) != CRYPT_VERSION || !memcmp(header.fileid, zerobytes, FILE_ID_LEN)) {
+					bc.Report(L"bad file header: " + file.dst);
+					throw(-1);
+				}
+				memcpy(file.fileid, header.fileid, FILE_ID_LEN);
+			}
+		}
+
+		hdst = CreateFile(file.dst.c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+
+		if (hdst == INVALID_HANDLE_VALUE) {
+			bc.Report(L"unable to create: " + bc.PlainPath(file));
+			throw(-1);
+		}
+
+		file.created = true;
+
+		// so that the unused tails of compressed blocks can be deallocated
+		// (see punch_zero_clusters()).  If the volume has no sparse files,
+		// the tails are just left as zeros.
+		if (bc.m_import && config->m_Compression)
+			HandleIoBackend(hdst).SetSparse();
+
+		if (bc.m_import && file.long_name.size() > 0 && !write_encrypted_long_name(file.dst.c_str(), file.long_name)) {
+			bc.Report(L"unable to write long name: " + file.src);
+			throw(-1);
+		}
+
+		if (bc.m_import && file.size > 0) {
+			vector<BYTE> header(engine.header_len);
+			FileHeader hdr;
+			hdr.version = MakeBigEndian((unsigned short)CRYPT_VERSION);
+			memcpy(hdr.fileid, file.fileid, FILE_ID_LEN);
+			memcpy(&header[0], &hdr, FILE_HEADER_LEN);
+			if (!write_at(hdst, 0, &header[0], engine.header_len)) {
+				bc.Report(L"write error: " + file.src);
+				throw(-1);
+			}
+		}
+
+		if (file.blocks <= BULK_CHUNK_BLOCKS) {
+			if (file.blocks > 0 && !copy_blocks(bc, file, hsrc, hdst, 0, (int)file.blocks, bufs, context))
+				throw(-1);
+		} else {
+			LARGE_INTEGER l;
+			l.QuadPart = file.size;
+			if (!(bc.m_import ? adjust_file_size_up(con, l) : adjust_file_size_down(con, l)) ||
+				!SetFilePointerEx(hdst, l, NULL, FILE_BEGIN) || !SetEndOfFile(hdst)) {
+				bc.Report(L"unable to set size: " + bc.PlainPath(file));
+				throw(-1);
+			}
+		}
+
+	} catch (...) {
+		file.failed = TRUE;
+	}
+
+	if (hsrc != INVALID_HANDLE_VALUE)
+		CloseHandle(hsrc);
+
+	if (hdst != INVALID_HANDLE_VALUE)
+		CloseHandle(hdst);
+}
+
+static void
+copy_chunk(BulkCopy& bc, const BulkChunk& chunk, BulkBuffers& bufs, void *context)
+{
+	BulkFile& file = bc.m_files[chunk.file];
+
+	// another chunk of this file already failed
+	if (file.failed)
+		return;
+
+	bool ok = false;
+
+	HANDLE hsrc = CreateFile(file.src.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+
+	if (hsrc == INVALID_HANDLE_VALUE) {
+		bc.Report(L"unable to open: " + bc.PlainPath(file));
+	} else {
+		HANDLE hdst = CreateFile(file.dst.c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+
+		if (hdst == INVALID_HANDLE_VALUE) {
+			bc.Report(L"unable to open: " + bc.PlainPath(file));
+		} else {
+			ok = copy_blocks(bc, file, hsrc, hdst, chunk.first_block, chunk.blocks, bufs, context);
+			CloseHandle(hdst);
+		}
+
+		CloseHandle(hsrc);
+	}
+
+	if (!ok)
+		InterlockedExchange(&file.failed, TRUE);
+}
+
+// Deletes the destinations of the files that failed to copy, so no partial
+// file is left behind.  Destinations start_file() never created are left
+// alone.
+static void
+remove_failed_files(BulkCopy& bc)
+{
+	for (auto& file : bc.m_files) {
+		if (!file.failed || !file.created)
+			continue;
+		if (!DeleteFile(file.dst.c_str()) && GetLastError() != ERROR_FILE_NOT_FOUND) {
+			bc.Report(L"unable to delete partial file: " + bc.PlainPath(file));
+			continue;
+		}
+		if (bc.m_import && file.long_name.size() > 0)
+			DeleteFile((file.dst + LONGNAME_SUFFIX_W).c_str());
+	}
+}
+
+// Calls fn(i) for each i in [0, count) on all the cpus.  Each worker takes
+// the next i, so a few large items don't hold up the rest.
+static bool
+run_workers(BulkCopy& bc, int count, const function<void(int, BulkBuffers&, void*)>& fn)
+{
+	CryptConfig *config = bc.m_con->GetConfig();
+
+	const BlockEngine& engine = bc.m_con->m_block_engine;
+
+	SYSTEM_INFO si;
+	GetSystemInfo(&si);
+
+	const int workers = max((int)si.dwNumberOfProcessors, 1);
+
+	volatile LONG next = 0;
+
+	return parallel_for(workers, 1, [&](int first, int last) -> bool {
+
+		BulkBuffers bufs;
+
+		try {
+			bufs.in.resize((size_t)BULK_CHUNK_BLOCKS * engine.cipher_bs);
+			bufs.out.resize((size_t)BULK_CHUNK_BLOCKS * engine.cipher_bs);
+		} catch (...) {
+			return false;
+		}
+
+		void *context = NULL;
+
+		if (!config->m_AESSIV) {
+			context = get_crypt_context(BLOCK_IV_LEN, config->ContentCryptMode());
+			if (!context)
+				return false;
+		}
+
+		for (;;) {
+			LONG i = InterlockedIncrement(&next) - 1;
+			if (i >= count)
+				break;
+			fn(i, bufs, context);
+		}
+
+		if (context)
+			free_crypt_context(context);
+
+		return true;
+	});
+}
+
+static bool
+bulk_copy(CryptContext *con, bool import, const WCHAR *plain_dir, wstring& report, wstring& mes)
+{
+	CryptConfig *config = con->GetConfig();
+
+	if (config->m_reverse) {
+		mes = L"reverse mode filesystems can't be imported into or exported from";
+		return false;
+	}
+
+	wstring plain_root;
+
+	if (!get_long_path(plain_dir, plain_root)) {
+		mes = L"invalid path";
+		return false;
+	}
+
+	LARGE_INTEGER freq, t0, t1;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&t0);
+
+	BulkCopy bc(con, import);
+
+	if (import) {
+		DWORD attr = GetFileAttributes(plain_root.c_str());
+		if (attr == INVALID_FILE_ATTRIBUTES || !(attr & FILE_ATTRIBUTE_DIRECTORY)) {
+			mes = L"source is not a directory";
+			return false;
+		}
+		import_dir(bc, plain_root, L"");
+	} else {
+		if (!CreateDirectory(plain_root.c_str(), NULL) && GetLastError() != ERROR_ALREADY_EXISTS) {
+			mes = L"unable to create destination directory";
+			return false;
+		}
+		export_dir(bc, config->m_basedir, plain_root, true);
+	}
+
+	bool ok = run_workers(bc, (int)bc.m_files.size(), [&](int i, BulkBuffers& bufs, void *context) {
+		start_file(bc, bc.m_files[i], bufs, context);
+	});
+
+	if (ok) {
+		for (size_t i = 0; i < bc.m_files.size(); i++) {
+			const BulkFile& file = bc.m_files[i];
+			if (file.failed || file.blocks <= BULK_CHUNK_BLOCKS)
+				continue;
+			for (LONGLONG first = 0; first < file.blocks; first += BULK_CHUNK_BLOCKS) {
+				BulkChunk chunk;
+				chunk.file = (int)i;
+				chunk.first_block = first;
+				chunk.blocks = (int)min((LONGLONG)BULK_CHUNK_BLOCKS, file.blocks - first);
+				bc.m_chunks.push_back(chunk);
+			}
+		}
+
+		ok = run_workers(bc, (int)bc.m_chunks.size(), [&](int i, BulkBuffers& bufs, void *context) {
+			copy_chunk(bc, bc.m_chunks[i], bufs, context);
+		});
+	}
+
+	if (!ok) {
+		// the chunks of the large files may not all have been copied
+		for (auto& file : bc.m_files) {
+			if (file.blocks > BULK_CHUNK_BLOCKS)
+				file.failed = TRUE;
+		}
+	}
+
+	remove_failed_files(bc);
+
+	if (!ok) {
+		mes = L"unable to get crypt context";
+		return false;
+	}
+
+	QueryPerformanceCounter(&t1);
+
+	double seconds = (double)(t1.QuadPart - t0.QuadPart) / freq.QuadPart;
+
+	report.clear();
+
+	for (auto& it : bc.m_errors) {
+		report += it;
+		report += L"\n";
+	}
+
+	if (bc.m_num_errors > (long long)bc.m_errors.size())
+		report += L"... and " + to_wstring(bc.m_num_errors - bc.m_errors.size()) + L" more\n";
+
+	WCHAR buf[256];
+
+	swprintf_s(buf, L"%s %lld directories, %lld files, %lld MB in %.1f seconds (%.0f MB/s): %lld errors\n",
+		import ? L"imported" : L"exported", bc.m_dirs, (long long)bc.m_files.size(), (long long)(bc.m_bytes / (1024 * 1024)), seconds,
+		seconds > 0 ? bc.m_bytes / (1024.0 * 1024.0) / seconds : 0.0, bc.m_num_errors);
+
+	report += buf;
+
+	return true;
+}
+
+static bool
+bulk_copy(bool import, const WCHAR *path, const WCHAR *config_path, const WCHAR *password, const WCHAR *plain_dir, wstring& report, wstring& mes)
+{
+	unique_ptr<CryptContext> con;
+
+	try {
+		con.reset(new CryptContext);
+	} catch (...) {
+		mes = L"unable to create context";
+		return false;
+	}
+
+	if (!con->OpenVolume(path, config_path, password, mes))
+		return false;
+
+	return bulk_copy(con.get(), import, plain_dir, report, mes);
+}
+
+bool import_files(const WCHAR *path, const WCHAR *config_path, const WCHAR *password, const WCHAR *source, wstring& report, wstring& mes)
+{
+	return bulk_copy(true, path, config_path, password, source, report, mes);
+}
+
+bool import_files(CryptContext *con, const WCHAR *source, wstring& report, wstring& mes)
+{
+	return bulk_copy(con, true, source, report, mes);
+}
+
+bool export_files(const WCHAR *path, const WCHAR *config_path, const WCHAR *password, const WCHAR *dest, wstring& report, wstring& mes)
+{
+	return bulk_copy(false, path, config_path, password, dest, report, mes);
+}
@@ -0,0 +1,69 @@
+/*
+cppcryptfs : user-mode cryptographic virtual overlay filesystem.
+
+Copyright (C) 2016-2018 Bailey Brown (github.com/bailey27/cppcryptfs)
+
+cppcryptfs is based on the design of gocryptfs (github.com/rfjakob/gocryptfs)
+
+The MIT License (MIT)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+
+#pragma once
+
+#include <string>
+
+using namespace std;
+
+class CryptContext;
+
+// number of blocks a worker reads, encrypts or decrypts, and writes at a time.
+// Files of up to this many blocks are copied in one go.
+#define BULK_CHUNK_BLOCKS 256
+
+// errors listed in the report (the rest are only counted)
+#define BULK_MAX_ERRORS 1000
+
+// Copy a plaintext directory tree into a forward mode filesystem, or all of
+// a filesystem out to a plaintext directory, without mounting it.
+//
+// The source tree is walked and the destination directories are created on
+// the calling thread.  Then the files are copied in parallel: each worker
+// takes the next file, and copies it whole if it has at most
+// BULK_CHUNK_BLOCKS blocks.  Larger files are created (and their size set)
+// in that pass, and their chunks are then copied in parallel in a second
+// pass.  Each worker reads, encrypts or decrypts, and writes its own chunk,
+// so reading, crypto and writing overlap across the workers.
+//
+// Existing files are overwritten and existing directories are merged into.
+// A file that fails to copy has its destination deleted, so no partial file
+// is left.  File times and attributes are not copied.  Errors are listed by path in
+// report, followed by a summary line.  Returns false and sets mes only if the
+// filesystem can't be opened.  The filesystem must not be mounted.
+
+bool import_files(const WCHAR *path, const WCHAR *config_path, const WCHAR *password, const WCHAR *source, wstring& report, wstring& mes);
+
+bool export_files(const WCHAR *path, const WCHAR *config_path, const WCHAR *password, const WCHAR *dest, wstring& report, wstring& mes);
+
+// Imports into a filesystem that con already has open, whose m_basedir is
+// where its encrypted files go (used by the I/O benchmark's checks).
+bool import_files(CryptContext *con, const WCHAR *source, wstring& report, wstring& mes);
@@ -35,6 +35,23 @@ THE SOFTWARE.
 #include "util/util.h"
 #include "crypt/crypt.h"
 #include "iobufferpool.h"
+#include "openfiles.h"
+
+// The cached allocated ranges of a backing file are stale once it has been
+// written to or resized.  Invalidating before the change drops the old map,
+// and invalidating after it bumps the generation, so a query that overlapped
+// the change is not cached (see OpenFile::GetAllocatedRanges()).
+
+class RangesInvalidator {
+	OpenFile *m_file;
+public:
+	RangesInvalidator(OpenFile *file) { m_file = file; if (m_file) m_file->InvalidateRanges(); }
+	~RangesInvalidator() { if (m_file) m_file->InvalidateRanges(); }
+
+	// disallow copying
+	RangesInvalidator(RangesInvalidator const&) = delete;
+	void operator=(RangesInvalidator const&) = delete;
+};
 
 CryptFile *CryptFile::NewInstance(CryptContext *con)
 {
@@ -47,8 +64,10 @@ CryptFile *CryptFile::NewInstance(CryptContext *con)
 CryptFile::CryptFile()
 {
 	m_handle = INVALID_HANDLE_VALUE;
+	m_io = NULL;
 	m_is_empty = false;
 	m_con = NULL;
+	m_openfile = NULL;
 	m_real_file_size = (long long)-1;
 	memset(&m_header, 0, sizeof(m_header));
 }
@@ -57,11 +76,48 @@ CryptFile::CryptFile()
 CryptFile::~CryptFile()
 {
 	// don't close m_handle
+
+	if (m_openfile)
+		m_con->m_open_files.Release(m_openfile);
+}
+
+void CryptFile::SetHandle(HANDLE hfile)
+{
+	m_handle = hfile;
+	m_handle_io.SetHandle(hfile);
+	m_handle_io.SetDirect(m_con && m_con->m_direct_io);
+	m_handle_io.SetBatch(m_con && m_con->m_batch_io);
+	m_handle_io.SetStats(m_con ? &m_con->m_perf : NULL);
+	m_io = &m_handle_io;
+	if (m_con && !m_openfile)
+		m_openfile = m_con->m_open_files.Acquire(hfile);
+	m_handle_io.SetExtendLock(m_openfile ? &m_openfile->m_extend_lock : NULL);
+	m_handle_io.SetTraceFile(TraceFile());
+}
+
+ULONGLONG CryptFile::TraceFile()
+{
+	return m_openfile ? m_openfile->FileIndex() : 0;
+}
+
+BOOL CryptFile::AssociateIo(CryptContext *con, IoBackend *io, LPCWSTR inputPath, OpenFile *openfile)
+{
+	m_con = con;
+
+	m_handle = INVALID_HANDLE_VALUE;
+	m_io = io;
+
+	if (openfile && !m_openfile) {
+		m_con->m_open_files.AddRef(openfile);
+		m_openfile = openfile;
+	}
+
+	return Open(inputPath);
 }
 
 CryptFileForward::CryptFileForward()
 {
-	
+	m_size_gen = 0;
 }
 
 CryptFileForward::~CryptFileForward()
@@ -75,39 +131,42 @@ CryptFileForward::Associate(CryptContext *con, HANDLE hfile, LPCWSTR inputPath)
 
 	static_assert(sizeof(m_header) == FILE_HEADER_LEN, "sizeof(m_header) != FILE_HEADER_LEN");
 
-	m_handle = hfile;
-
 	m_con = con;
 
-	LARGE_INTEGER l;
+	SetHandle(hfile);
+
+	return Open(inputPath);
+}
+
+BOOL CryptFileForward::Open(LPCWSTR inputPath)
+{
+	// sampled before the size is read, so a change made while reading it is seen by RefreshSize()
+	if (m_openfile)
+		m_size_gen = m_openfile->m_block_locks.EndGeneration();
 
-	if (!GetFileSizeEx(hfile, &l)) {
+	if (!m_io->GetSize(m_real_file_size)) {
 		DbgPrint(L"ASSOCIATE: failed to get size of file\n");
 		return FALSE;
 	}
 
-	m_real_file_size = l.QuadPart;
+	return ReadHeader();
+}
 
-	if (l.QuadPart == 0) {
+// sets m_is_empty, or reads and checks the header, according to m_real_file_size
+BOOL CryptFileForward::ReadHeader()
+{
+	if (m_real_file_size == 0) {
 		m_header.version = CRYPT_VERSION;
 		m_is_empty = true;
 		return TRUE;
-	} else if (l.QuadPart < FILE_HEADER_LEN) {
+	} else if (m_real_file_size < m_con->GetConfig()->m_HeaderLen) {
 		DbgPrint(L"ASSOCIATE: missing file header\n");
 		return FALSE;
 	}
 
-	l.QuadPart = 0;
-
-	if (!SetFilePointerEx(hfile, l, NULL, FILE_BEGIN)) {
-		DbgPrint(L"ASSOCIATE: failed to seek\n");
-		return FALSE;
-	}
-
-
 	DWORD nread;
 
-	if (!ReadFile(hfile, &m_header, sizeof(m_header), &nread, NULL)) {
+	if (!m_io->ReadAt(0, &m_header, sizeof(m_header), &nread)) {
 		DWORD error = GetLastError();
 		DbgPrint(L"ASSOCIATE: failed to read header, error = %d\n", error);
 		return FALSE;
@@ -132,10 +191,83 @@ CryptFileForward::Associate(CryptContext *con, HANDLE hfile, LPCWSTR inputPath)
 		return FALSE;
 	}
 
+	m_is_empty = false;
+
+	return TRUE;
+}
+
+// Another handle may have resized the file (or written the header of an
+// empty one) since Associate(), so this is called once the blocks are locked.
+// That can only have happened if the end generation of the block locks has
+// changed, and then the size is shared with the other handles through the
+// OpenFile, so most reads and writes don't query it again.
+BOOL CryptFileForward::RefreshSize()
+{
+	LONG gen = m_openfile->m_block_locks.EndGeneration();
+
+	if (gen == m_size_gen)
+		return TRUE;
+
+	LONGLONG size;
+
+	if (!m_openfile->GetSize(m_io, gen, size))
+		return FALSE;
+
+	m_size_gen = gen;
+	m_real_file_size = size;
+
+	if (m_is_empty || m_real_file_size == 0)
+		return ReadHeader();
 
 	return TRUE;
 }
 
+// Locks the blocks touched by an operation on [offset, offset + len), shared
+// for reads and exclusive for changes.  An operation that reaches past EOF,
+// or that sets the size (tail is true), locks from the last block of the file
+// to the end, because it may rewrite that block and change the size.  The
+// size can change while waiting, so it is re-read and the lock retaken if
+// it no longer covers the last block.
+BOOL CryptFileForward::LockBlocks(BlockRangeGuard& guard, LONGLONG offset, LONGLONG len, bool exclusive, bool tail)
+{
+	// the file isn't open through any other handle from CryptCreateFile()
+	if (!m_openfile)
+		return TRUE;
+
+	const int plain_bs = m_con->GetConfig()->m_PlainBS;
+
+	const LONGLONG first = offset / plain_bs;
+	const LONGLONG last = len > 0 ? (offset + len - 1) / plain_bs : first;
+
+	while (true) {
+		LARGE_INTEGER size;
+		size.QuadPart = m_real_file_size;
+		if (!adjust_file_offset_down(m_con, size))
+			return FALSE;
+
+		const bool to_end = tail || offset + len > size.QuadPart;
+
+		const LONGLONG lo = to_end ? min(first, size.QuadPart / plain_bs) : first;
+
+		guard.Lock(&m_openfile->m_block_locks, lo, to_end ? BLOCK_RANGE_END : last, exclusive);
+
+		if (!RefreshSize())
+			return FALSE;
+
+		size.QuadPart = m_real_file_size;
+		if (!adjust_file_offset_down(m_con, size))
+			return FALSE;
+
+		if (!tail && offset + len <= size.QuadPart)
+			return TRUE;
+
+		if (to_end && lo <= size.QuadPart / plain_bs)
+			return TRUE;
+
+		guard.Unlock();
+	}
+}
+
 
 BOOL CryptFileForward::Read(unsigned char *buf, DWORD buflen, LPDWORD pNread, LONGLONG offset)
 {
@@ -153,6 +285,11 @@ BOOL CryptFileForward::Read(unsigned char *buf, DWORD buflen, LPDWORD pNread, LO
 		return TRUE;
 	}
 
+	BlockRangeGuard guard;
+
+	if (!LockBlocks(guard, offset, buflen, false))
+		return FALSE;
+
 	LONGLONG bytesleft = buflen;
 
 	unsigned char *p = buf;
@@ -160,7 +297,7 @@ BOOL CryptFileForward::Read(unsigned char *buf, DWORD buflen, LPDWORD pNread, LO
 	void *context;
 
 	if (!m_con->GetConfig()->m_AESSIV) {
-		context = get_crypt_context(BLOCK_IV_LEN, AES_MODE_GCM);
+		context = get_crypt_context(BLOCK_IV_LEN, m_con->GetConfig()->ContentCryptMode());
 
 		if (!context)
 			return FALSE;
@@ -175,13 +312,30 @@ BOOL CryptFileForward::Read(unsigned char *buf, DWORD buflen, LPDWORD pNread, LO
 	int bytesinbuf = 0;
 	int inputbuflen = 0;
 	int inputbufpos = 0;
+	long long inputoffset = 0;
+
+	const int plain_bs = m_con->GetConfig()->m_PlainBS;
+	const int cipher_bs = m_con->GetConfig()->m_CipherBS;
+
+	int blocks_spanned = (int)(((offset + buflen - 1) / plain_bs) - (offset / plain_bs)) + 1;
+
+	// If the backing file is sparse, blocks that lie entirely in a hole are
+	// returned as zeros without reading or decrypting anything.  read_block()
+	// would return the same zeros after failing to authenticate them.
+
+	AllocatedRanges ranges;
 
-	int blocks_spanned = (int)(((offset + buflen - 1) / PLAIN_BS) - (offset / PLAIN_BS)) + 1;
+	bool sparse = m_openfile && m_openfile->m_sparse &&
+		m_openfile->GetAllocatedRanges(m_handle, m_con->GetConfig()->m_HeaderLen + (offset / plain_bs)*cipher_bs, (LONGLONG)blocks_spanned*cipher_bs, ranges);
+
+	auto is_hole = [&](LONGLONG blockno) {
+		return sparse && !ranges.IsAllocated(m_con->GetConfig()->m_HeaderLen + blockno*cipher_bs, cipher_bs);
+	};
 
 	try {
 
 		if (blocks_spanned > 1 && m_con->m_bufferblocks > 1) {
-			inputbuflen = min(m_con->m_bufferblocks, blocks_spanned)*CIPHER_BS;
+			inputbuflen = min(m_con->m_bufferblocks, blocks_spanned)*cipher_bs;
 			iobuf = IoBufferPool::getInstance()->GetIoBuffer(inputbuflen);
 			if (iobuf == NULL) {
 				SetLastError(ERROR_OUTOFMEMORY);
@@ -189,45 +343,77 @@ BOOL CryptFileForward::Read(unsigned char *buf, DWORD buflen, LPDWORD pNread, LO
 			}
 			inputbuf = iobuf->m_pBuf;
 
-			long long blockoff = FILE_HEADER_LEN + (offset / PLAIN_BS)*CIPHER_BS;
-
-			LARGE_INTEGER l;
-
-			l.QuadPart = blockoff;
-
-			if (!SetFilePointerEx(m_handle, l, NULL, FILE_BEGIN)) {
-				 throw(-1);
-			}
-			
+			inputoffset = m_con->GetConfig()->m_HeaderLen + (offset / plain_bs)*cipher_bs;
 		}
 
 		while (bytesleft > 0) {
 
-			LONGLONG blockno = offset / PLAIN_BS;
-			int blockoff = (int)(offset % PLAIN_BS);
+			LONGLONG blockno = offset / plain_bs;
+			int blockoff = (int)(offset % plain_bs);
 
 			int advance;
 
+			if (is_hole(blockno)) {
+
+				int holebytes = HoleBlockLen(blockno);
+
+				if (holebytes < 1)
+					break;
+
+				// skip the block's ciphertext if it was already read into the buffer
+				if (inputbuf) {
+					if (bytesinbuf > 0) {
+						int consumed = min(cipher_bs, bytesinbuf);
+						inputbufpos += consumed;
+						bytesinbuf -= consumed;
+					} else {
+						inputoffset += cipher_bs;
+					}
+				}
+
+				int blockcpy = (int)min(bytesleft, holebytes - blockoff);
+
+				if (blockcpy < 1)
+					break;
+
+				memset(p, 0, blockcpy);
+
+				p += blockcpy;
+				offset += blockcpy;
+				bytesleft -= blockcpy;
+				*pNread += blockcpy;
+
+				continue;
+			}
+
 			if (inputbuf && bytesinbuf < 1) {
 				DWORD nRead = 0;
-				DWORD blocksleft =  (DWORD)(((offset + bytesleft - 1) / PLAIN_BS) - (offset / PLAIN_BS)) + 1;
-				DWORD readlen = min((DWORD)inputbuflen, blocksleft*CIPHER_BS);
-				if (!ReadFile(m_handle, inputbuf, readlen, &nRead, NULL)) {
+				DWORD blocksleft =  (DWORD)(((offset + bytesleft - 1) / plain_bs) - (offset / plain_bs)) + 1;
+				if (sparse) {
+					// only read up to the next hole
+					DWORD run = 1;
+					while (run < blocksleft && !is_hole(blockno + run))
+						run++;
+					blocksleft = run;
+				}
+				DWORD readlen = min((DWORD)inputbuflen, blocksleft*cipher_bs);
+				if (!m_io->ReadSpan(inputoffset, inputbuf, readlen, &nRead)) {
 					throw(-1);
 				}
+				inputoffset += nRead;
 				bytesinbuf = nRead;
 				inputbufpos = 0;
 			}
 
-			if (blockoff == 0 && bytesleft >= PLAIN_BS) {
+			if (blockoff == 0 && bytesleft >= plain_bs) {
 
 				if (inputbuf) {
 					int consumed = 0;
-					advance = read_block(m_con, INVALID_HANDLE_VALUE, inputbuf + inputbufpos, bytesinbuf, &consumed, m_header.fileid, blockno, p, context);
+					advance = read_block(m_con, NULL, inputbuf + inputbufpos, bytesinbuf, &consumed, m_header.fileid, blockno, p, context);
 					inputbufpos += consumed;
 					bytesinbuf -= consumed;
 				} else {
-					advance = read_block(m_con, m_handle, NULL, 0, NULL, m_header.fileid, blockno, p, context);
+					advance = read_block(m_con, m_io, NULL, 0, NULL, m_header.fileid, blockno, p, context);
 				}
 
 				if (advance < 0)
@@ -238,17 +424,24 @@ BOOL CryptFileForward::Read(unsigned char *buf, DWORD buflen, LPDWORD pNread, LO
 
 			} else {
 
-				unsigned char blockbuf[PLAIN_BS];
+				BlockBuffer block_buf(plain_bs);
+
+				unsigned char *blockbuf = block_buf.m_buf;
+
+				if (!blockbuf) {
+					SetLastError(ERROR_OUTOFMEMORY);
+					throw(-1);
+				}
 
 				int blockbytes = 0;
 
 				if (inputbuf) {
 					int consumed = 0;
-					blockbytes = read_block(m_con, INVALID_HANDLE_VALUE, inputbuf + inputbufpos, bytesinbuf, &consumed, m_header.fileid, blockno, blockbuf, context);
+					blockbytes = read_block(m_con, NULL, inputbuf + inputbufpos, bytesinbuf, &consumed, m_header.fileid, blockno, blockbuf, context);
 					inputbufpos += consumed;
 					bytesinbuf -= consumed;
 				} else {
-					blockbytes = read_block(m_con, m_handle, NULL, 0, NULL, m_header.fileid, blockno, blockbuf, context);
+					blockbytes = read_block(m_con, m_io, NULL, 0, NULL, m_header.fileid, blockno, blockbuf, context);
 				}
 
 				if (blockbytes < 0)
@@ -285,21 +478,33 @@ BOOL CryptFileForward::Read(unsigned char *buf, DWORD buflen, LPDWORD pNread, LO
 	return bRet;
 }
 
-BOOL CryptFileForward::FlushOutput(LONGLONG& beginblock, BYTE *outputbuf, int& outputbytes)
+// Returns the plaintext length of a block that lies in a hole of the backing
+// file (a full block unless it is the last one), or 0 if the block is past the
+// end of the file.
+
+int CryptFileForward::HoleBlockLen(LONGLONG blockno)
 {
-	long long outputoffset = FILE_HEADER_LEN + beginblock*CIPHER_BS;
+	CryptConfig *cfg = m_con->GetConfig();
 
-	LARGE_INTEGER l;
+	LONGLONG start = cfg->m_HeaderLen + blockno*cfg->m_CipherBS;
 
-	l.QuadPart = outputoffset;
+	if (start >= m_real_file_size)
+		return 0;
 
-	if (!SetFilePointerEx(m_handle, l, NULL, FILE_BEGIN)) {
-		return FALSE;
-	}
+	LONGLONG len = min(m_real_file_size - start, (LONGLONG)cfg->m_CipherBS);
+
+	return len > cfg->BlockOverhead() ? (int)len - cfg->BlockOverhead() : 0;
+}
+
+BOOL CryptFileForward::FlushOutput(LONGLONG& beginblock, BYTE *outputbuf, int& outputbytes)
+{
+	CryptConfig *cfg = m_con->GetConfig();
+
+	long long outputoffset = cfg->m_HeaderLen + beginblock*cfg->m_CipherBS;
 
 	DWORD outputwritten;
 
-	if (!WriteFile(m_handle, outputbuf, outputbytes, &outputwritten, NULL)) {
+	if (!m_io->WriteSpan(outputoffset, outputbuf, outputbytes, &outputwritten)) {
 		return FALSE;
 	}
 
@@ -307,23 +512,69 @@ BOOL CryptFileForward::FlushOutput(LONGLONG& beginblock, BYTE *outputbuf, int& o
 		return FALSE;
 	}
 
+	// the span holds the zeroed tails of compressed blocks
+	if (cfg->m_Compression)
+		punch_zero_clusters(m_io, outputoffset, outputbuf, outputbytes);
+
 	outputbytes = 0;
 	beginblock = 0;
 
 	return TRUE;
 }
 
-// write version and fileid to empty file before writing to it
+// marks the backing file sparse (once per open file) so zero runs can be deallocated
 
-BOOL CryptFileForward::WriteVersionAndFileId()
+BOOL CryptFileForward::MakeSparse()
 {
-	if (m_real_file_size == (long long)-1)
+	if (m_openfile && m_openfile->m_sparse)
+		return TRUE;
+
+	if (!m_io->SetSparse())
+		return FALSE;
+
+	if (m_openfile)
+		m_openfile->m_sparse = true;
+
+	return TRUE;
+}
+
+// stores a run of all-zero plaintext blocks as a hole instead of encrypting them.
+// read_block() already returns zeros for all-zero ciphertext, so holes need no metadata.
+
+BOOL CryptFileForward::FlushZeroRun(LONGLONG& zerobegin, LONGLONG& zeroblocks)
+{
+	CryptConfig *cfg = m_con->GetConfig();
+
+	LONGLONG start = cfg->m_HeaderLen + zerobegin*cfg->m_CipherBS;
+
+	LONGLONG end = start + zeroblocks*cfg->m_CipherBS;
+
+	LONGLONG size;
+
+	if (!m_io->GetSize(size))
 		return FALSE;
 
-	LARGE_INTEGER l;
-	l.QuadPart = 0;
+	if (start < size) {
+		if (!m_io->PunchHole(start, min(end, size) - start))
+			return FALSE;
+	}
+
+	if (end > size) {
+		if (!m_io->SetSize(end))
+			return FALSE;
+	}
+
+	zerobegin = 0;
+	zeroblocks = 0;
+
+	return TRUE;
+}
+
+// write version and fileid to empty file before writing to it
 
-	if (!SetFilePointerEx(m_handle, l, NULL, FILE_BEGIN))
+BOOL CryptFileForward::WriteVersionAndFileId()
+{
+	if (m_real_file_size == (long long)-1)
 		return FALSE;
 
 	if (!get_random_bytes(m_con, m_header.fileid, FILE_ID_LEN))
@@ -333,20 +584,30 @@ BOOL CryptFileForward::WriteVersionAndFileId()
 
 	m_header.version = MakeBigEndian(version);
 
+	// with AlignedBlocks the header is zero-padded so the first block starts on a page boundary
+
+	static_assert(ALIGNED_BLOCK_LEN >= FILE_HEADER_LEN, "ALIGNED_BLOCK_LEN < FILE_HEADER_LEN");
+
+	const int header_len = m_con->GetConfig()->m_HeaderLen;
+
+	BYTE header_buf[ALIGNED_BLOCK_LEN];
+
+	memset(header_buf, 0, header_len);
+	memcpy(header_buf, &m_header, sizeof(m_header));
+
+	m_header.version = CRYPT_VERSION;
+
 	DWORD nWritten = 0;
 
-	if (!WriteFile(m_handle, &m_header, sizeof(m_header), &nWritten, NULL)) {
-		m_header.version = CRYPT_VERSION;
+	if (!m_io->WriteAt(0, header_buf, header_len, &nWritten)) {
 		return FALSE;
 	}
 
-	m_header.version = CRYPT_VERSION;
-
-	m_real_file_size = FILE_HEADER_LEN;
+	m_real_file_size = header_len;
 
 	m_is_empty = false;
 
-	return nWritten == FILE_HEADER_LEN;
+	return nWritten == header_len;
 }
 
 
@@ -366,17 +627,26 @@ BOOL CryptFileForward::Write(const unsigned char *buf, DWORD buflen, LPDWORD pNw
 
 	BOOL bRet = TRUE;
 
+	RangesInvalidator invalidator(m_openfile);
+
+	BlockRangeGuard guard;
+
+	// with bWriteToEndOfFile, offset isn't known until the size is, but the
+	// lock will cover whatever EOF turns out to be
+	if (!LockBlocks(guard, offset, buflen, true, bWriteToEndOfFile != FALSE))
+		return FALSE;
+
 	if (bWriteToEndOfFile) {
 		LARGE_INTEGER l;
 		l.QuadPart = m_real_file_size;
-		if (!adjust_file_offset_down(l))
+		if (!adjust_file_offset_down(m_con, l))
 			return FALSE;
 		offset = l.QuadPart;
 	} else {
 		if (bPagingIo) {
 			LARGE_INTEGER l;
 			l.QuadPart = m_real_file_size;
-			if (!adjust_file_offset_down(l))
+			if (!adjust_file_offset_down(m_con, l))
 				return FALSE;
 
 			if (offset >= l.QuadPart)
@@ -400,12 +670,14 @@ BOOL CryptFileForward::Write(const unsigned char *buf, DWORD buflen, LPDWORD pNw
 	} else {
 		LARGE_INTEGER size_down;
 		size_down.QuadPart = m_real_file_size;
-		adjust_file_offset_down(size_down);
+		adjust_file_offset_down(m_con, size_down);
 		// if creating a hole, call this->SetEndOfFile() to deal with last block if necessary
-		if (offset > size_down.QuadPart && (size_down.QuadPart % PLAIN_BS)) {
+		if (offset > size_down.QuadPart && (size_down.QuadPart % m_con->GetConfig()->m_PlainBS)) {
 			DbgPrint(L"Calling SetEndOfFile %llu to deal with hole\n", offset);
-			SetEndOfFile(offset, FALSE);
+			SetEndOfFileLocked(offset, FALSE);
 		}
+		if (offset > size_down.QuadPart && m_con->m_sparse_zero_blocks)
+			MakeSparse();
 	}
 
 	LONGLONG bytesleft = buflen;
@@ -415,7 +687,7 @@ BOOL CryptFileForward::Write(const unsigned char *buf, DWORD buflen, LPDWORD pNw
 	void *context;
 	
 	if (!m_con->GetConfig()->m_AESSIV) {
-		context = get_crypt_context(BLOCK_IV_LEN, AES_MODE_GCM);
+		context = get_crypt_context(BLOCK_IV_LEN, m_con->GetConfig()->ContentCryptMode());
 
 		if (!context)
 			return FALSE;
@@ -429,26 +701,61 @@ BOOL CryptFileForward::Write(const unsigned char *buf, DWORD buflen, LPDWORD pNw
 	int outputbuflen = 0;
 	LONGLONG beginblock;
 
-	int blocks_spanned = (int)(((offset + buflen - 1) / PLAIN_BS) - (offset / PLAIN_BS)) + 1;
+	// IVs for the blocks encrypted into outputbuf, fetched all at once when it is empty
+	BYTE ivs_local[WRITE_STACK_IV_BLOCKS * BLOCK_XCHACHA_NONCE_LEN];
+	IoBuffer *iv_iobuf = NULL;
+	BYTE *ivs = NULL;
+	const int iv_len = m_con->m_block_engine.iv_len;
+
+	bool zero_holes = m_con->m_sparse_zero_blocks;
+	LONGLONG zerobegin = 0;
+	LONGLONG zeroblocks = 0;
+
+	const int plain_bs = m_con->GetConfig()->m_PlainBS;
+	const int cipher_bs = m_con->GetConfig()->m_CipherBS;
+
+	int blocks_spanned = (int)(((offset + buflen - 1) / plain_bs) - (offset / plain_bs)) + 1;
+
+	// so that the unused tails of compressed blocks can be deallocated (see punch_zero_clusters())
+	if (m_con->GetConfig()->m_Compression)
+		MakeSparse();
 
 	try {
 
 		if (blocks_spanned > 1 && m_con->m_bufferblocks > 1) {
-			outputbuflen = min(m_con->m_bufferblocks, blocks_spanned)*CIPHER_BS;
+			outputbuflen = min(m_con->m_bufferblocks, blocks_spanned)*cipher_bs;
 			iobuf = IoBufferPool::getInstance()->GetIoBuffer(outputbuflen);
 			if (iobuf == NULL) {
 				SetLastError(ERROR_OUTOFMEMORY);
 				throw(-1);
 			}
 			outputbuf = iobuf->m_pBuf;
+			int ivs_len = (outputbuflen / cipher_bs) * iv_len;
+			if (ivs_len <= (int)sizeof(ivs_local)) {
+				ivs = ivs_local;
+			} else {
+				iv_iobuf = IoBufferPool::getInstance()->GetIoBuffer(ivs_len);
+				if (iv_iobuf == NULL) {
+					SetLastError(ERROR_OUTOFMEMORY);
+					throw(-1);
+				}
+				ivs = iv_iobuf->m_pBuf;
+			}
 		}
 
-		BYTE cipher_buf[CIPHER_BS];
+		BlockBuffer cipher_block_buf(cipher_bs);
+
+		BYTE *cipher_buf = cipher_block_buf.m_buf;
+
+		if (!cipher_buf) {
+			SetLastError(ERROR_OUTOFMEMORY);
+			throw(-1);
+		}
 
 		while (bytesleft > 0) {
 
-			LONGLONG blockno = offset / PLAIN_BS;
-			int blockoff = (int)(offset % PLAIN_BS);
+			LONGLONG blockno = offset / plain_bs;
+			int blockoff = (int)(offset % plain_bs);
 
 			int advance;
 
@@ -457,24 +764,53 @@ BOOL CryptFileForward::Write(const unsigned char *buf, DWORD buflen, LPDWORD pNw
 					throw(-1);
 			}
 
-			if (blockoff == 0 && bytesleft >= PLAIN_BS) { // overwriting whole blocks
+			if (zero_holes && blockoff == 0 && bytesleft >= plain_bs && is_all_zeros(p, plain_bs)) {
+				if (!MakeSparse()) {
+					zero_holes = false;
+				} else {
+					if (outputbuf && outputbytes > 0) {
+						if (!FlushOutput(beginblock, outputbuf, outputbytes))
+							throw(-1);
+					}
+					if (zeroblocks == 0)
+						zerobegin = blockno;
+					zeroblocks++;
+					advance = plain_bs;
+					p += advance;
+					offset += advance;
+					bytesleft -= advance;
+					*pNwritten += advance;
+					continue;
+				}
+			}
+
+			if (zeroblocks > 0) {
+				if (!FlushZeroRun(zerobegin, zeroblocks))
+					throw(-1);
+			}
+
+			if (blockoff == 0 && bytesleft >= plain_bs) { // overwriting whole blocks
 
 				if (outputbuf) {
-					if (outputbytes == 0)
+					if (outputbytes == 0) {
 						beginblock = blockno;
+						int ivcount = (int)min(bytesleft / plain_bs, outputbuflen / cipher_bs);
+						if (!get_random_bytes(m_con, ivs, ivcount * iv_len))
+							throw(-1);
+					}
 
-					advance = write_block(m_con, outputbuf + outputbytes, INVALID_HANDLE_VALUE, m_header.fileid, blockno, p, PLAIN_BS, context);
+					advance = write_block(m_con, outputbuf + outputbytes, NULL, m_header.fileid, blockno, p, plain_bs, context, ivs + (outputbytes / cipher_bs) * iv_len);
 					
-					if (advance == CIPHER_BS) {
-						advance = PLAIN_BS;
+					if (advance == cipher_bs) {
+						advance = plain_bs;
 					} else {
 						throw(-1);
 					}
-					outputbytes += CIPHER_BS;
+					outputbytes += cipher_bs;
 				} else {
-					advance = write_block(m_con, cipher_buf, m_handle, m_header.fileid, blockno, p, PLAIN_BS, context);
+					advance = write_block(m_con, cipher_buf, m_io, m_header.fileid, blockno, p, plain_bs, context);
 
-					if (advance != PLAIN_BS)
+					if (advance != plain_bs)
 						throw(-1);
 				} 
 	
@@ -487,18 +823,25 @@ BOOL CryptFileForward::Write(const unsigned char *buf, DWORD buflen, LPDWORD pNw
 						throw(-1);
 				}
 
-				unsigned char blockbuf[PLAIN_BS];
+				BlockBuffer block_buf(plain_bs);
+
+				unsigned char *blockbuf = block_buf.m_buf;
 
-				memset(blockbuf, 0, sizeof(blockbuf));
+				if (!blockbuf) {
+					SetLastError(ERROR_OUTOFMEMORY);
+					throw(-1);
+				}
+
+				memset(blockbuf, 0, plain_bs);
 
-				int blockbytes = read_block(m_con, m_handle, NULL, 0, NULL, m_header.fileid, blockno, blockbuf, context);
+				int blockbytes = read_block(m_con, m_io, NULL, 0, NULL, m_header.fileid, blockno, blockbuf, context);
 
 				if (blockbytes < 0) {
 					bRet = FALSE;
 					break;
 				}
 
-				int blockcpy = (int)min(bytesleft, PLAIN_BS - blockoff);
+				int blockcpy = (int)min(bytesleft, plain_bs - blockoff);
 
 				if (blockcpy < 1)
 					break;
@@ -507,7 +850,7 @@ BOOL CryptFileForward::Write(const unsigned char *buf, DWORD buflen, LPDWORD pNw
 
 				int blockwrite = max(blockoff + blockcpy, blockbytes);
 
-				int nWritten = write_block(m_con, cipher_buf, m_handle, m_header.fileid, blockno, blockbuf, blockwrite, context);
+				int nWritten = write_block(m_con, cipher_buf, m_io, m_header.fileid, blockno, blockbuf, blockwrite, context);
 
 				advance = blockcpy;
 
@@ -528,6 +871,11 @@ BOOL CryptFileForward::Write(const unsigned char *buf, DWORD buflen, LPDWORD pNw
 				throw(-1);
 		}
 
+		if (zeroblocks > 0) {
+			if (!FlushZeroRun(zerobegin, zeroblocks))
+				throw(-1);
+		}
+
 	} catch (...) {
 		bRet = FALSE;
 	}
@@ -537,6 +885,9 @@ BOOL CryptFileForward::Write(const unsigned char *buf, DWORD buflen, LPDWORD pNw
 	if (iobuf)
 		IoBufferPool::getInstance()->ReleaseIoBuffer(iobuf);
 
+	if (iv_iobuf)
+		IoBufferPool::getInstance()->ReleaseIoBuffer(iv_iobuf);
+
 	if (context)
 		free_crypt_context(context);
 
@@ -550,24 +901,19 @@ CryptFileForward::LockFile(LONGLONG ByteOffset, LONGLONG Length)
 	if (m_real_file_size == (long long)-1)
 		return FALSE;
 
-	long long start_block = ByteOffset / PLAIN_BS;
-
-	long long end_block = (ByteOffset + Length - 1) / PLAIN_BS;
+	CryptConfig *cfg = m_con->GetConfig();
 
-	long long start_offset = CIPHER_FILE_OVERHEAD + start_block*CIPHER_BS;
+	long long start_block = ByteOffset / cfg->m_PlainBS;
 
-	long long end_offset = CIPHER_FILE_OVERHEAD + end_block*CIPHER_BS;
-
-	long long length = end_offset - start_offset;
+	long long end_block = (ByteOffset + Length - 1) / cfg->m_PlainBS;
 
-	
-	LARGE_INTEGER off, len;
+	long long start_offset = cfg->m_HeaderLen + start_block*cfg->m_CipherBS;
 
-	off.QuadPart = start_offset;
+	long long end_offset = cfg->m_HeaderLen + end_block*cfg->m_CipherBS;
 
-	len.QuadPart = length;
+	long long length = end_offset - start_offset;
 
-	return ::LockFile(m_handle, off.LowPart, off.HighPart, len.LowPart, len.HighPart);
+	return m_io->Lock(start_offset, length);
 }
 
 BOOL
@@ -576,24 +922,19 @@ CryptFileForward::UnlockFile(LONGLONG ByteOffset, LONGLONG Length)
 	if (m_real_file_size == (long long)-1)
 		return FALSE;
 
-	long long start_block = ByteOffset / PLAIN_BS;
-
-	long long end_block = (ByteOffset + Length - 1) / PLAIN_BS;
-
-	long long start_offset = CIPHER_FILE_OVERHEAD + start_block*CIPHER_BS;
-
-	long long end_offset = CIPHER_FILE_OVERHEAD + end_block*CIPHER_BS;
+	CryptConfig *cfg = m_con->GetConfig();
 
-	long long length = end_offset - start_offset;
+	long long start_block = ByteOffset / cfg->m_PlainBS;
 
+	long long end_block = (ByteOffset + Length - 1) / cfg->m_PlainBS;
 
-	LARGE_INTEGER off, len;
+	long long start_offset = cfg->m_HeaderLen + start_block*cfg->m_CipherBS;
 
-	off.QuadPart = start_offset;
+	long long end_offset = cfg->m_HeaderLen + end_block*cfg->m_CipherBS;
 
-	len.QuadPart = length;
+	long long length = end_offset - start_offset;
 
-	return ::UnlockFile(m_handle, off.LowPart, off.HighPart, len.LowPart, len.HighPart);
+	return m_io->Unlock(start_offset, length);
 }
 
 
@@ -609,9 +950,23 @@ CryptFileForward::SetEndOfFile(LONGLONG offset, BOOL bSet)
 	if (m_real_file_size == (long long)-1)
 		return FALSE;
 
-	if (m_handle == NULL || m_handle == INVALID_HANDLE_VALUE)
+	if (!m_io)
+		return FALSE;
+
+	BlockRangeGuard guard;
+
+	if (!LockBlocks(guard, offset, 0, true, true))
 		return FALSE;
 
+	return SetEndOfFileLocked(offset, bSet);
+}
+
+// SetEndOfFile() for a caller that already holds the lock on the last block
+BOOL
+CryptFileForward::SetEndOfFileLocked(LONGLONG offset, BOOL bSet)
+{
+	RangesInvalidator invalidator(m_openfile);
+
 	if (m_is_empty && offset != 0) {
 		if (!WriteVersionAndFileId())
 			return FALSE;
@@ -621,7 +976,7 @@ CryptFileForward::SetEndOfFile(LONGLONG offset, BOOL bSet)
 
 	size_down.QuadPart = m_real_file_size;
 
-	if (!adjust_file_offset_down(size_down)) {
+	if (!adjust_file_offset_down(m_con, size_down)) {
 		return FALSE;
 	}
 
@@ -629,32 +984,36 @@ CryptFileForward::SetEndOfFile(LONGLONG offset, BOOL bSet)
 
 	if (bSet) {
 		up_off.QuadPart = offset;
-		if (!adjust_file_offset_up_truncate_zero(up_off))
+		if (!adjust_file_offset_up_truncate_zero(m_con, up_off))
 			return FALSE;
 	}
 
+	const int plain_bs = m_con->GetConfig()->m_PlainBS;
+
 	long long last_block;
 	int to_write;
 
 	bool growing = false;
 
 	if (offset < size_down.QuadPart) {
-		last_block = offset / PLAIN_BS;
-		to_write = (int)(offset % PLAIN_BS);
+		last_block = offset / plain_bs;
+		to_write = (int)(offset % plain_bs);
 	} else if (offset > size_down.QuadPart) {
-		last_block = size_down.QuadPart / PLAIN_BS;
-		to_write = size_down.QuadPart % PLAIN_BS ? (int)min(PLAIN_BS, offset - size_down.QuadPart) : 0;
+		last_block = size_down.QuadPart / plain_bs;
+		to_write = size_down.QuadPart % plain_bs ? (int)min(plain_bs, offset - size_down.QuadPart) : 0;
 		growing = true;
 	} else {
 		to_write = 0;
 	}
 
+	// growth is zero-filled, so let it be a hole if we're storing zero blocks that way
+	if (growing && m_con->m_sparse_zero_blocks)
+		MakeSparse();
+
 	if (to_write == 0) { 
 		if (bSet) {
 			DbgPrint(L"setting end of file at %d\n", (int)up_off.QuadPart);
-			if (!SetFilePointerEx(m_handle, up_off, NULL, FILE_BEGIN))
-				return FALSE;
-			return ::SetEndOfFile(m_handle);
+			return m_io->SetSize(up_off.QuadPart);
 		} else {
 			return TRUE;
 		}
@@ -662,14 +1021,23 @@ CryptFileForward::SetEndOfFile(LONGLONG offset, BOOL bSet)
 
 	// need to re-write truncated or expanded last block
 
-	unsigned char buf[PLAIN_BS];
+	BlockBuffer plain_block_buf(plain_bs);
+	BlockBuffer cipher_block_buf(m_con->GetConfig()->m_CipherBS);
+
+	unsigned char *buf = plain_block_buf.m_buf;
+	BYTE *cipher_buf = cipher_block_buf.m_buf;
+
+	if (!buf || !cipher_buf) {
+		SetLastError(ERROR_OUTOFMEMORY);
+		return FALSE;
+	}
 
-	memset(buf, 0, sizeof(buf));
+	memset(buf, 0, plain_bs);
 
 	void *context;
 
 	if (!m_con->GetConfig()->m_AESSIV) {
-		context = get_crypt_context(BLOCK_IV_LEN, AES_MODE_GCM);
+		context = get_crypt_context(BLOCK_IV_LEN, m_con->GetConfig()->ContentCryptMode());
 
 		if (!context)
 			return FALSE;
@@ -677,7 +1045,7 @@ CryptFileForward::SetEndOfFile(LONGLONG offset, BOOL bSet)
 		context = NULL;
 	}
 
-	int nread = read_block(m_con, m_handle, NULL, 0, NULL, m_header.fileid, last_block, buf, context);
+	int nread = read_block(m_con, m_io, NULL, 0, NULL, m_header.fileid, last_block, buf, context);
 
 	if (nread < 0) {
 		free_crypt_context(context);
@@ -688,10 +1056,7 @@ CryptFileForward::SetEndOfFile(LONGLONG offset, BOOL bSet)
 		free_crypt_context(context);
 
 		if (bSet) {
-			if (!SetFilePointerEx(m_handle, up_off, NULL, FILE_BEGIN)) {
-				return FALSE;
-			}
-			return ::SetEndOfFile(m_handle);
+			return m_io->SetSize(up_off.QuadPart);
 		} else {
 			return TRUE;
 		}
@@ -699,11 +1064,9 @@ CryptFileForward::SetEndOfFile(LONGLONG offset, BOOL bSet)
 
 	// if growing the file, then we're appending to_write zero bytes to the last block
 	if (growing)
-		to_write = min(to_write + nread, PLAIN_BS);
-
-	BYTE cipher_buf[CIPHER_BS];
+		to_write = min(to_write + nread, plain_bs);
 
-	int nwritten = write_block(m_con, cipher_buf, m_handle, m_header.fileid, last_block, buf, to_write, context);
+	int nwritten = write_block(m_con, cipher_buf, m_io, m_header.fileid, last_block, buf, to_write, context);
 
 	free_crypt_context(context);
 
@@ -711,10 +1074,7 @@ CryptFileForward::SetEndOfFile(LONGLONG offset, BOOL bSet)
 		return FALSE;
 
 	if (bSet) {
-		if (!SetFilePointerEx(m_handle, up_off, NULL, FILE_BEGIN))
-			return FALSE;
-
-		return ::SetEndOfFile(m_handle);
+		return m_io->SetSize(up_off.QuadPart);
 	} else {
 		return TRUE;
 	}
@@ -724,6 +1084,8 @@ CryptFileForward::SetEndOfFile(LONGLONG offset, BOOL bSet)
 CryptFileReverse::CryptFileReverse()
 {
 	memset(m_block0iv, 0, sizeof(m_block0iv));
+	memset(&m_cache_file, 0, sizeof(m_cache_file));
+	m_use_cache = false;
 }
 
 CryptFileReverse::~CryptFileReverse()
@@ -734,25 +1096,26 @@ CryptFileReverse::~CryptFileReverse()
 
 BOOL CryptFileReverse::Associate(CryptContext *con, HANDLE hfile, LPCWSTR inputPath)
 {
-	m_handle = hfile;
-
 	m_con = con;
 
-	LARGE_INTEGER l;
+	SetHandle(hfile);
+
+	return Open(inputPath);
+}
 
+BOOL CryptFileReverse::Open(LPCWSTR inputPath)
+{
 	if (inputPath == NULL) {
 		DbgPrint(L"ASSOCIATE: failed because inputPath is NULL\n");
 		return FALSE;
 	}
 
-	if (!GetFileSizeEx(hfile, &l)) {
+	if (!m_io->GetSize(m_real_file_size)) {
 		DbgPrint(L"ASSOCIATE: failed to get size of file\n");
 		return FALSE;
 	}
 
-	m_real_file_size = l.QuadPart;
-
-	if (l.QuadPart == 0) {
+	if (m_real_file_size == 0) {
 		m_header.version = CRYPT_VERSION;
 		m_is_empty = true;
 		return TRUE;
@@ -774,9 +1137,194 @@ BOOL CryptFileReverse::Associate(CryptContext *con, HANDLE hfile, LPCWSTR inputP
 	if (!derive_path_iv(m_con, inputPath, m_block0iv, TYPE_BLOCK0IV))
 		return FALSE;
 
+	if (m_con->m_block_cache.enabled()) {
+		BY_HANDLE_FILE_INFORMATION info;
+		if (m_handle != INVALID_HANDLE_VALUE && GetFileInformationByHandle(m_handle, &info)) {
+			m_cache_file.volume_serial = info.dwVolumeSerialNumber;
+			m_cache_file.file_index = ((ULONGLONG)info.nFileIndexHigh << 32) | info.nFileIndexLow;
+			memcpy(m_cache_file.fileid, m_header.fileid, sizeof(m_cache_file.fileid));
+			m_cache_file.last_write_time = info.ftLastWriteTime;
+			m_cache_file.size = m_real_file_size;
+			m_use_cache = true;
+		}
+	}
+
 	return TRUE;
 }
 
+// Copies len bytes of plaintext out of a mapped view of a file.  If the file
+// shrinks underneath the view, touching the missing pages raises
+// EXCEPTION_IN_PAGE_ERROR, which is turned into a read error.  Only the copy
+// is guarded, and no C++ objects may live in this function because of __try.
+static bool copy_from_view(BYTE *dst, const BYTE *src, size_t len)
+{
+	__try {
+		memcpy(dst, src, len);
+		return true;
+	} __except (GetExceptionCode() == EXCEPTION_IN_PAGE_ERROR ? EXCEPTION_EXECUTE_HANDLER : EXCEPTION_CONTINUE_SEARCH) {
+		SetLastError(ERROR_READ_FAULT);
+		return false;
+	}
+}
+
+// Returns a pointer to up to len bytes of plaintext at offset in a mapped
+// view of the file, holding a reference to the view in view, or NULL if the
+// file isn't mapped.  nRead is set to the number of bytes, which is short only
+// at EOF.
+const BYTE *CryptFileReverse::GetMappedPlaintext(LONGLONG offset, DWORD len, DWORD& nRead, shared_ptr<MappedView>& view)
+{
+	if (!m_con->m_mmap_reverse || !m_openfile || m_handle == INVALID_HANDLE_VALUE || offset >= m_real_file_size)
+		return NULL;
+
+	len = (DWORD)min((LONGLONG)len, m_real_file_size - offset);
+
+	view = m_openfile->GetView(m_handle, m_real_file_size, offset, len);
+
+	const BYTE *p = view ? view->Get(offset, len) : NULL;
+
+	if (p)
+		nRead = len;
+
+	return p;
+}
+
+// Puts the ciphertext of a block in cipher_buf (m_CipherBS bytes), from the
+// block cache or by reading and encrypting the plaintext, which goes through
+// plain_buf (m_PlainBS bytes) even when the file is mapped.  Returns the length
+// of the ciphertext, 0 at EOF, or -1 on error.
+int CryptFileReverse::EncryptBlock(LONGLONG blockno, BYTE *plain_buf, BYTE *cipher_buf, void *context)
+{
+	int len;
+
+	if (m_use_cache && m_con->m_block_cache.lookup(m_cache_file, blockno, cipher_buf, len))
+		return len;
+
+	const int plain_bs = m_con->GetConfig()->m_PlainBS;
+
+	DWORD nRead = 0;
+
+	shared_ptr<MappedView> view;
+
+	const BYTE *mapped = GetMappedPlaintext(blockno * plain_bs, plain_bs, nRead, view);
+
+	if (mapped) {
+		if (!copy_from_view(plain_buf, mapped, nRead))
+			return -1;
+	} else {
+		if (!m_io->ReadAt(blockno * plain_bs, plain_buf, plain_bs, &nRead))
+			return -1;
+
+		if (nRead == 0)
+			return 0;
+	}
+
+	len = write_block(m_con, cipher_buf, NULL, m_header.fileid, blockno, plain_buf, (int)nRead, context, m_block0iv);
+
+	if (len > 0 && m_use_cache)
+		m_con->m_block_cache.store(m_cache_file, blockno, cipher_buf, len);
+
+	return len;
+}
+
+// Reads the plaintext of nblocks blocks with one read and encrypts them, in
+// parallel, into cipher_buf (nblocks * m_CipherBS bytes).  Returns the length
+// of the ciphertext, which is short only at EOF, or -1 on error.
+int CryptFileReverse::EncryptBlocks(LONGLONG blockno, int nblocks, BYTE *cipher_buf)
+{
+	const int plain_bs = m_con->GetConfig()->m_PlainBS;
+	const int cipher_bs = m_con->GetConfig()->m_CipherBS;
+
+	int rval = -1;
+
+	DWORD nRead = 0;
+
+	// encrypt from the page cache, a block at a time, if the file is mapped
+	shared_ptr<MappedView> view;
+
+	const BYTE *plain_buf = GetMappedPlaintext(blockno * plain_bs, (DWORD)nblocks * plain_bs, nRead, view);
+
+	const bool mapped = plain_buf != NULL;
+
+	// otherwise the plaintext is read into a buffer
+	IoBuffer *iobuf = NULL;
+
+	if (!mapped) {
+		iobuf = IoBufferPool::getInstance()->GetIoBuffer((size_t)nblocks * plain_bs);
+
+		if (!iobuf) {
+			SetLastError(ERROR_OUTOFMEMORY);
+			return -1;
+		}
+
+		plain_buf = iobuf->m_pBuf;
+	}
+
+	if (mapped || m_io->ReadSpan(blockno * plain_bs, iobuf->m_pBuf, (DWORD)nblocks * plain_bs, &nRead)) {
+
+		const int full_blocks = (int)(nRead / plain_bs);
+		const int tail = (int)(nRead % plain_bs);
+		const int count = full_blocks + (tail ? 1 : 0);
+
+		auto encrypt_range = [&](int first, int last) -> bool {
+			void *context = NULL;
+
+			if (!m_con->GetConfig()->m_AESSIV) {
+				context = get_crypt_context(BLOCK_IV_LEN, m_con->GetConfig()->ContentCryptMode());
+				if (!context)
+					return false;
+			}
+
+			// mapped plaintext is copied out of the view before it is encrypted
+			BlockBuffer scratch(mapped ? plain_bs : 0);
+
+			bool ok = !mapped || scratch.m_buf;
+
+			if (!ok)
+				SetLastError(ERROR_OUTOFMEMORY);
+
+			for (int i = first; i < last && ok; i++) {
+				BYTE *out = cipher_buf + (size_t)i * cipher_bs;
+				int ptlen = i < full_blocks ? plain_bs : tail;
+				int len;
+
+				if (m_use_cache && m_con->m_block_cache.lookup(m_cache_file, blockno + i, out, len))
+					continue;
+
+				const BYTE *ptbuf = plain_buf + (size_t)i * plain_bs;
+
+				if (mapped) {
+					if (!copy_from_view(scratch.m_buf, ptbuf, ptlen)) {
+						ok = false;
+						break;
+					}
+					ptbuf = scratch.m_buf;
+				}
+
+				len = write_block(m_con, out, NULL, m_header.fileid, blockno + i, ptbuf, ptlen, context, m_block0iv);
+
+				if (len != ptlen + cipher_bs - plain_bs) {
+					ok = false;
+				} else if (m_use_cache) {
+					m_con->m_block_cache.store(m_cache_file, blockno + i, out, len);
+				}
+			}
+
+			if (context)
+				free_crypt_context(context);
+
+			return ok;
+		};
+
+		if (parallel_for(count, m_con->m_parallel_min_blocks, encrypt_range))
+			rval = full_blocks * cipher_bs + (tail ? tail + cipher_bs - plain_bs : 0);
+	}
+
+	if (iobuf)
+		IoBufferPool::getInstance()->ReleaseIoBuffer(iobuf);
+
+	return rval;
+}
+
 BOOL CryptFileReverse::Read(unsigned char *buf, DWORD buflen, LPDWORD pNread, LONGLONG offset)
 {
 	if (m_real_file_size == (long long)-1)
@@ -798,7 +1346,7 @@ BOOL CryptFileReverse::Read(unsigned char *buf, DWORD buflen, LPDWORD pNread, LO
 	void *context;
 
 	if (!m_con->GetConfig()->m_AESSIV) {
-		context = get_crypt_context(BLOCK_IV_LEN, AES_MODE_GCM);
+		context = get_crypt_context(BLOCK_IV_LEN, m_con->GetConfig()->ContentCryptMode());
 
 		if (!context)
 			return FALSE;
@@ -808,49 +1356,72 @@ BOOL CryptFileReverse::Read(unsigned char *buf, DWORD buflen, LPDWORD pNread, LO
 
 	BOOL bRet = TRUE;
 
+	const int header_len = m_con->GetConfig()->m_HeaderLen;
+	const int plain_bs = m_con->GetConfig()->m_PlainBS;
+	const int cipher_bs = m_con->GetConfig()->m_CipherBS;
+
 	try {
 
-		if (offset < sizeof(m_header)) {
-			long long copylen = min(sizeof(m_header) - offset, min(bytesleft, sizeof(m_header)));
-			memcpy(p, (BYTE*)&m_header + offset, copylen);
+		if (offset < header_len) {
+			// anything in the virtual header past m_header is zero padding
+			long long copylen = min(header_len - offset, bytesleft);
+			memset(p, 0, (size_t)copylen);
+			if (offset < sizeof(m_header))
+				memcpy(p, (BYTE*)&m_header + offset, (size_t)min(sizeof(m_header) - offset, copylen));
 			bytesleft -= copylen;
 			offset += copylen;
 			p += copylen;
 			*pNread += (int)copylen;
 		} 
 
-		while (bytesleft > 0) {	
+		const LONGLONG max_blocks = IO_BUFFER_MAX_SIZE / plain_bs;
 
-			LONGLONG blockno = (offset - sizeof(m_header)) / CIPHER_BS;
+		// Runs of two or more whole blocks are encrypted by EncryptBlocks(), which
+		// has buffers of its own, so the plaintext block buffer is only needed for
+		// what is left over (a partial block at either end, or a single block).
+		LONGLONG single = bytesleft;
 
-			int blockoff = (int)((offset - sizeof(m_header)) % CIPHER_BS);
+		if ((offset - header_len) % cipher_bs == 0) {
+			while (single >= 2 * cipher_bs)
+				single -= min(single / cipher_bs, max_blocks) * cipher_bs;
+		}
 
-			LARGE_INTEGER l;
+		BlockBuffer plain_block_buf(single > 0 ? plain_bs : 0);
+
+		BYTE *plain_buf = plain_block_buf.m_buf;
 
-			l.QuadPart = blockno * PLAIN_BS;
+		if (!plain_buf) {
+			SetLastError(ERROR_OUTOFMEMORY);
+			throw(-1);
+		}
+
+		while (bytesleft > 0) {	
 
-			if (!SetFilePointerEx(m_handle, l, NULL, FILE_BEGIN)) {
-				bRet = FALSE;
-				break;
-			}	
+			LONGLONG blockno = (offset - header_len) / cipher_bs;
+
+			int blockoff = (int)((offset - header_len) % cipher_bs);
 
 			int advance;
 
-			BYTE plain_buf[PLAIN_BS];
+			if (blockoff == 0 && bytesleft >= 2 * cipher_bs) {
+				// read all the whole blocks at once and encrypt them in parallel
+				int nblocks = (int)min(bytesleft / cipher_bs, max_blocks);
 
-			if (blockoff == 0 && bytesleft >= CIPHER_BS) {
-				DWORD nRead = 0;
-				if (!ReadFile(m_handle, plain_buf, sizeof(plain_buf), &nRead, NULL)) {
-					bRet = FALSE;
+				advance = EncryptBlocks(blockno, nblocks, p);
+
+				if (advance < 0)
+					throw(-1);
+
+				if (advance < 1)
 					break;
-				}
 
-				if (nRead == 0) {
-					bRet = TRUE;
+				if (advance < nblocks * cipher_bs) {
+					*pNread += advance;
 					break;
 				}
-				// advance = read_block(m_con, m_handle, m_header.fileid, blockno, p, context);
-				advance = write_block(m_con, p, INVALID_HANDLE_VALUE, m_header.fileid, blockno, plain_buf, (int)nRead, context, m_block0iv);
+
+			} else if (blockoff == 0 && bytesleft >= cipher_bs) {
+				advance = EncryptBlock(blockno, plain_buf, p, context);
 
 				if (advance < 0)
 					throw(-1);
@@ -860,20 +1431,16 @@ BOOL CryptFileReverse::Read(unsigned char *buf, DWORD buflen, LPDWORD pNread, LO
 
 			} else {
 
-				unsigned char blockbuf[CIPHER_BS];
-				DWORD nRead = 0;
-				if (!ReadFile(m_handle, plain_buf, sizeof(plain_buf), &nRead, NULL)) {
-					bRet = FALSE;
-					break;
-				}
+				BlockBuffer block_buf(cipher_bs);
 
-				if (nRead == 0) {
-					bRet = TRUE;
-					break;
+				unsigned char *blockbuf = block_buf.m_buf;
+
+				if (!blockbuf) {
+					SetLastError(ERROR_OUTOFMEMORY);
+					throw(-1);
 				}
 
-				//int blockbytes = read_block(m_con, m_handle, m_header.fileid, blockno, blockbuf, context);
-				int blockbytes = write_block(m_con, blockbuf, INVALID_HANDLE_VALUE, m_header.fileid, blockno, plain_buf, (int)nRead, context, m_block0iv);
+				int blockbytes = EncryptBlock(blockno, plain_buf, blockbuf, context);
 
 				if (blockbytes < 0)
 					throw(-1);
@@ -31,10 +31,17 @@ THE SOFTWARE.
 #include <windows.h>
 
 #include <string>
+#include <memory>
+
+#include "iobackend.h"
+#include "blockcache.h"
 
 using namespace std;
 
 class CryptContext;
+class OpenFile;
+class BlockRangeGuard;
+class MappedView;
 
 typedef struct struct_FileHeader {
 	unsigned short version;
@@ -50,14 +57,27 @@ public:
 
 	HANDLE m_handle;
 
+	// all ciphertext (or reverse mode plaintext) I/O goes through m_io
+	IoBackend *m_io;
+
 	wstring m_path;
 
 	CryptContext *m_con;
 
+	// state shared with other handles to the same file, NULL if the file
+	// isn't open through a handle from CryptCreateFile()
+	OpenFile *m_openfile;
+
 	static CryptFile *NewInstance(CryptContext *con);
 
 	virtual BOOL Associate(CryptContext *con, HANDLE hfile, LPCWSTR inputPath = NULL) = 0;
 
+	// Associates the file with storage that isn't a Win32 handle, e.g. a
+	// MemoryIoBackend.  io is not owned and must outlive the CryptFile.
+	// openfile, if not NULL, is the shared state of the file io holds (from
+	// OpenFileTable::New()), and a reference to it is taken.
+	BOOL AssociateIo(CryptContext *con, IoBackend *io, LPCWSTR inputPath = NULL, OpenFile *openfile = NULL);
+
 	virtual BOOL Read(unsigned char *buf, DWORD buflen, LPDWORD pNread, LONGLONG offset) = 0;
 
 	virtual BOOL Write(const unsigned char *buf, DWORD buflen, LPDWORD pNwritten, LONGLONG offset, BOOL bWriteToEndOfFile, BOOL bPagingIo) = 0;
@@ -70,6 +90,9 @@ public:
 
 	BOOL NotImplemented() { SetLastError(ERROR_ACCESS_DENIED); return FALSE; };
 
+	// identifies the backing file in trace events (see TraceRecord::file)
+	ULONGLONG TraceFile();
+
 	// disallow copying
 	CryptFile(CryptFile const&) = delete;
 	void operator=(CryptFile const&) = delete;
@@ -77,6 +100,12 @@ public:
 	CryptFile();
 	virtual ~CryptFile();
 
+protected:
+	HandleIoBackend m_handle_io;
+	void SetHandle(HANDLE hfile);
+
+	// finishes associating once m_con and m_io are set
+	virtual BOOL Open(LPCWSTR inputPath) = 0;
 };
 
 class CryptFileForward:  public CryptFile
@@ -106,16 +135,45 @@ public:
 	~CryptFileForward();
 
 protected:
+	// end generation of the block locks when m_real_file_size was read
+	LONG m_size_gen;
+
+	virtual BOOL Open(LPCWSTR inputPath);
 	BOOL FlushOutput(LONGLONG& beginblock, BYTE *outputbuf, int& outputbytes); 
+	BOOL FlushZeroRun(LONGLONG& zerobegin, LONGLONG& zeroblocks);
+	BOOL MakeSparse();
 	BOOL WriteVersionAndFileId();
+	int HoleBlockLen(LONGLONG blockno);
+	BOOL ReadHeader();
+	BOOL RefreshSize();
+	BOOL LockBlocks(BlockRangeGuard& guard, LONGLONG offset, LONGLONG len, bool exclusive, bool tail = false);
+	BOOL SetEndOfFileLocked(LONGLONG offset, BOOL bSet);
 
 
 };
 
+// a buffered write keeps the IVs for up to this many blocks on the stack,
+// and gets a buffer from the IoBufferPool for more
+#define WRITE_STACK_IV_BLOCKS 64
+
+// a reverse mode read encrypts its whole blocks in parallel, by default at
+// least this many blocks per thread (see CryptContext::m_parallel_min_blocks)
+#define REVERSE_MIN_BLOCKS_PER_TASK 16
+
 class CryptFileReverse:  public CryptFile
 {
 private:
 	BYTE m_block0iv[BLOCK_SIV_LEN];
+
+	// identity and version of the plaintext file for the block cache
+	BlockCacheFile m_cache_file;
+	bool m_use_cache;
+
+	int EncryptBlock(LONGLONG blockno, BYTE *plain_buf, BYTE *cipher_buf, void *context);
+	int EncryptBlocks(LONGLONG blockno, int nblocks, BYTE *cipher_buf);
+	const BYTE *GetMappedPlaintext(LONGLONG offset, DWORD len, DWORD& nRead, shared_ptr<MappedView>& view);
+protected:
+	virtual BOOL Open(LPCWSTR inputPath);
 public:
 
 
@@ -0,0 +1,507 @@
+/*
+cppcryptfs : user-mode cryptographic virtual overlay filesystem.
+
+Copyright (C) 2016-2018 Bailey Brown (github.com/bailey27/cppcryptfs)
+
+cppcryptfs is based on the design of gocryptfs (github.com/rfjakob/gocryptfs)
+
+The MIT License (MIT)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#include "stdafx.h"
+
+#include "crypt/cryptdefs.h"
+#include "crypt/crypt.h"
+#include "context/cryptcontext.h"
+#include "filename/cryptfilename.h"
+#include "cryptfsck.h"
+#include "cryptio.h"
+#include "cryptfile.h"
+#include "util/util.h"
+
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <functional>
+
+struct FsckFile {
+	wstring plain_path;
+	wstring enc_path;
+	LONGLONG size;
+	// set by the header pass
+	bool header_ok;
+	BYTE fileid[FILE_ID_LEN];
+};
+
+// a run of blocks of one file after its first FSCK_CHUNK_BLOCKS blocks,
+// checked by one worker
+struct FsckChunk {
+	int file;
+	LONGLONG first_block;
+	int blocks;
+};
+
+class FsckState {
+public:
+	CryptContext *m_con;
+
+	vector<FsckFile> m_files;
+	vector<FsckChunk> m_chunks;
+
+	vector<wstring> m_problems;
+	long long m_num_problems;
+
+	long long m_dirs;
+	long long m_names;
+	volatile LONGLONG m_bytes;
+
+	void Report(const wstring& problem);
+
+	void AddFile(const wstring& plain_path, const wstring& enc_path, LONGLONG size);
+
+	// disallow copying
+	FsckState(FsckState const&) = delete;
+	void operator=(FsckState const&) = delete;
+
+	FsckState(CryptContext *con);
+	~FsckState();
+
+private:
+	CRITICAL_SECTION m_crit;
+};
+
+FsckState::FsckState(CryptContext *con)
+{
+	m_con = con;
+	m_num_problems = 0;
+	m_dirs = 0;
+	m_names = 0;
+	m_bytes = 0;
+
+	InitializeCriticalSection(&m_crit);
+}
+
+FsckState::~FsckState()
+{
+	DeleteCriticalSection(&m_crit);
+}
+
+void FsckState::Report(const wstring& problem)
+{
+	EnterCriticalSection(&m_crit);
+
+	if (m_num_problems++ < FSCK_MAX_PROBLEMS)
+		m_problems.push_back(problem);
+
+	LeaveCriticalSection(&m_crit);
+}
+
+static LONGLONG
+file_blocks(const BlockEngine& engine, LONGLONG size)
+{
+	return size > engine.header_len ? (size - engine.header_len + engine.cipher_bs - 1) / engine.cipher_bs : 0;
+}
+
+void FsckState::AddFile(const wstring& plain_path, const wstring& enc_path, LONGLONG size)
+{
+	const BlockEngine& engine = m_con->m_block_engine;
+
+	FsckFile file;
+
+	file.plain_path = plain_path;
+	file.enc_path = enc_path;
+	file.size = size;
+	file.header_ok = false;
+	memset(file.fileid, 0, sizeof(file.fileid));
+
+	m_files.push_back(file);
+
+	LONGLONG blocks = file_blocks(engine, size);
+
+	// the first chunk is checked by the header pass
+	for (LONGLONG first = FSCK_CHUNK_BLOCKS; first < blocks; first += FSCK_CHUNK_BLOCKS) {
+		FsckChunk chunk;
+		chunk.file = (int)m_files.size() - 1;
+		chunk.first_block = first;
+		chunk.blocks = (int)min((LONGLONG)FSCK_CHUNK_BLOCKS, blocks - first);
+		m_chunks.push_back(chunk);
+	}
+}
+
+static wstring
+join_path(const wstring& dir, const WCHAR *name)
+{
+	return dir + L"\\" + name;
+}
+
+static bool
+read_fsck_dir_iv(const wstring& enc_dir, BYTE *dir_iv)
+{
+	HANDLE hfile = CreateFile(join_path(enc_dir, DIR_IV_NAME).c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+
+	if (hfile == INVALID_HANDLE_VALUE)
+		return false;
+
+	// the diriv must be exactly DIR_IV_LEN bytes
+	BYTE buf[DIR_IV_LEN + 1];
+	DWORD nRead = 0;
+
+	BOOL bRet = ReadFile(hfile, buf, sizeof(buf), &nRead, NULL);
+
+	CloseHandle(hfile);
+
+	if (!bRet || nRead != DIR_IV_LEN)
+		return false;
+
+	memcpy(dir_iv, buf, DIR_IV_LEN);
+
+	return true;
+}
+
+static bool
+file_exists(const wstring& path)
+{
+	return GetFileAttributes(path.c_str()) != INVALID_FILE_ATTRIBUTES;
+}
+
+// Checks the names in one directory and queues its files, then recurses.
+// Plaintext paths start with a backslash, and the root is the empty string.
+static void
+check_dir(FsckState& st, const wstring& enc_dir, const wstring& plain_dir)
+{
+	CryptContext *con = st.m_con;
+	CryptConfig *config = con->GetConfig();
+
+	st.m_dirs++;
+
+	const WCHAR *display_dir = plain_dir.empty() ? L"\\" : plain_dir.c_str();
+
+	BYTE dir_iv[DIR_IV_LEN];
+
+	memset(dir_iv, 0, sizeof(dir_iv));
+
+	if (config->DirIV() && !read_fsck_dir_iv(enc_dir, dir_iv)) {
+		st.Report(wstring(L"missing or bad diriv: ") + display_dir);
+		return;
+	}
+
+	WIN32_FIND_DATAW fdata;
+
+	HANDLE hfind = FindFirstFileEx(join_path(enc_dir, L"*").c_str(), FindExInfoBasic, &fdata, FindExSearchNameMatch, NULL, FIND_FIRST_EX_LARGE_FETCH);
+
+	if (hfind == INVALID_HANDLE_VALUE) {
+		st.Report(wstring(L"unable to list directory: ") + display_dir);
+		return;
+	}
+
+	const bool encrypted_names = !config->m_PlaintextNames;
+
+	vector<pair<wstring, wstring>> subdirs;
+
+	do {
+		const WCHAR *name = fdata.cFileName;
+
+		if (!wcscmp(name, L".") || !wcscmp(name, L".."))
+			continue;
+
+		if (config->DirIV() && !wcscmp(name, DIR_IV_NAME))
+			continue;
+
+		if (plain_dir.empty() && !wcscmp(name, CONFIG_NAME))
+			continue;
+
+		wstring enc_path = join_path(enc_dir, name);
+
+		wstring plain;
+
+		if (encrypted_names && is_long_name_file(name)) {
+			// decrypt_filename() reads the .name file of the name it is given
+			wstring owner(name, wcslen(name) - LONGNAME_SUFFIX_LEN);
+			if (!decrypt_filename(con, dir_iv, enc_dir.c_str(), owner.c_str(), plain))
+				st.Report(L"undecryptable long name file: " + join_path(plain_dir, name));
+			else if (!file_exists(join_path(enc_dir, owner.c_str())))
+				st.Report(L"orphaned long name file: " + join_path(plain_dir, plain.c_str()));
+			continue;
+		}
+
+		st.m_names++;
+
+		if (encrypted_names && is_long_name(name) && !file_exists(enc_path + LONGNAME_SUFFIX_W)) {
+			st.Report(L"missing long name file: " + join_path(plain_dir, name));
+			continue;
+		}
+
+		if (!decrypt_filename(con, dir_iv, enc_dir.c_str(), name, plain)) {
+			st.Report(L"undecryptable file name: " + join_path(plain_dir, name));
+			continue;
+		}
+
+		wstring plain_path = join_path(plain_dir, plain.c_str());
+
+		if (encrypted_names && is_long_name(name)) {
+			// the long name is derived from the encrypted name the .name file holds
+			wstring enc;
+			if (!encrypt_filename(con, dir_iv, plain.c_str(), enc) || wcscmp(enc.c_str(), name)) {
+				st.Report(L"long name doesn't match its .name file: " + plain_path);
+				continue;
+			}
+		}
+
+		if (fdata.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+			if (!(fdata.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT))
+				subdirs.push_back(make_pair(enc_path, plain_path));
+		} else {
+			st.AddFile(plain_path, enc_path, ((LONGLONG)fdata.nFileSizeHigh << 32) | fdata.nFileSizeLow);
+		}
+
+	} while (FindNextFile(hfind, &fdata));
+
+	FindClose(hfind);
+
+	for (auto& it : subdirs)
+		check_dir(st, it.first, it.second);
+}
+
+static bool
+read_at(HANDLE hfile, LONGLONG offset, BYTE *buf, DWORD len, DWORD& total)
+{
+	total = 0;
+
+	while (total < len) {
+		OVERLAPPED ov;
+		memset(&ov, 0, sizeof(ov));
+		ov.Offset = (DWORD)(offset + total);
+		ov.OffsetHigh = (DWORD)((offset + total) >> 32);
+		DWORD nRead;
+		if (!ReadFile(hfile, buf + total, len - total, &nRead, &ov))
+			return false;
+		if (nRead == 0)
+			break;
+		total += nRead;
+	}
+
+	return true;
+}
+
+// Reads and verifies blocks [first_block, first_block + blocks) of a file
+// whose header has already been checked.
+static void
+check_blocks(FsckState& st, const FsckFile& file, HANDLE hfile, LONGLONG first_block, int blocks, BYTE *buf, BYTE *ptbuf, void *context)
+{
+	CryptContext *con = st.m_con;
+
+	const BlockEngine& engine = con->m_block_engine;
+
+	const LONGLONG offset = engine.header_len + first_block * engine.cipher_bs;
+
+	const DWORD len = (DWORD)min((LONGLONG)blocks * engine.cipher_bs, file.size - offset);
+
+	DWORD nRead = 0;
+
+	if (len > 0 && !read_at(hfile, offset, buf, len, nRead)) {
+		st.Report(L"read error: " + file.plain_path + L" offset " + to_wstring(first_block * engine.plain_bs));
+		return;
+	}
+
+	DWORD pos = 0;
+
+	for (LONGLONG block = first_block; pos < nRead; block++) {
+		if (read_block(con, NULL, buf + pos, nRead - pos, NULL, file.fileid, block, ptbuf, context) < 0)
+			st.Report(L"corrupt block: " + file.plain_path + L" offset " + to_wstring(block * engine.plain_bs));
+		pos += min((DWORD)engine.cipher_bs, nRead - pos);
+	}
+
+	InterlockedExchangeAdd64(&st.m_bytes, nRead);
+}
+
+static HANDLE
+open_file(FsckState& st, const FsckFile& file)
+{
+	HANDLE hfile = CreateFile(file.enc_path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+		OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+
+	if (hfile == INVALID_HANDLE_VALUE)
+		st.Report(L"unable to open file: " + file.plain_path);
+
+	return hfile;
+}
+
+// Header pass: checks the header and the first chunk of a file.  The chunks
+// after it open the file again, so that a volume with many large files doesn't
+// keep a handle open to each of them for the whole check.
+static void
+check_file(FsckState& st, FsckFile& file, BYTE *buf, BYTE *ptbuf, void *context)
+{
+	const BlockEngine& engine = st.m_con->m_block_engine;
+
+	if (file.size == 0)
+		return;
+
+	HANDLE hfile = open_file(st, file);
+
+	if (hfile == INVALID_HANDLE_VALUE)
+		return;
+
+	FileHeader header;
+	DWORD nRead = 0;
+
+	bool header_ok = file.size >= engine.header_len && read_at(hfile, 0, (BYTE*)&header, FILE_HEADER_LEN, nRead) && nRead == FILE_HEADER_LEN;
+
+	static const BYTE zerobytes[FILE_ID_LEN] = { 0 };
+
+	if (header_ok)
+		header_ok = MakeBigEndianNative(header.version) == CRYPT_VERSION && memcmp(header.fileid, zerobytes, FILE_ID_LEN);
+
+	if (!header_ok) {
+		st.Report(L"bad file header: " + file.plain_path);
+		CloseHandle(hfile);
+		return;
+	}
+
+	memcpy(file.fileid, header.fileid, FILE_ID_LEN);
+	file.header_ok = true;
+
+	const LONGLONG blocks = file_blocks(engine, file.size);
+
+	check_blocks(st, file, hfile, 0, (int)min((LONGLONG)FSCK_CHUNK_BLOCKS, blocks), buf, ptbuf, context);
+
+	CloseHandle(hfile);
+}
+
+// Runs fn(i) for i in [0, count) on all the logical CPUs.  Each worker takes
+// the next unchecked index, so large files are spread across all of them.
+static bool
+run_workers(FsckState& st, size_t count, const function<void(size_t i, BYTE *buf, BYTE *ptbuf, void *context)>& fn)
+{
+	CryptContext *con = st.m_con;
+
+	SYSTEM_INFO si;
+	GetSystemInfo(&si);
+
+	const int workers = max((int)si.dwNumberOfProcessors, 1);
+
+	volatile LONG next = 0;
+
+	return parallel_for(workers, 1, [&](int first, int last) -> bool {
+		vector<BYTE> buf((size_t)FSCK_CHUNK_BLOCKS * con->m_block_engine.cipher_bs);
+		vector<BYTE> ptbuf(con->m_block_engine.plain_bs);
+
+		void *context = NULL;
+
+		if (!con->GetConfig()->m_AESSIV) {
+			context = get_crypt_context(BLOCK_IV_LEN, con->GetConfig()->ContentCryptMode());
+			if (!context)
+				return false;
+		}
+
+		for (;;) {
+			LONG i = InterlockedIncrement(&next) - 1;
+			if (i >= (LONG)count)
+				break;
+			fn((size_t)i, &buf[0], &ptbuf[0], context);
+		}
+
+		if (context)
+			free_crypt_context(context);
+
+		return true;
+	});
+}
+
+bool check_crypt_fs(const WCHAR *path, const WCHAR *config_path, const WCHAR *password, wstring& report, wstring& mes)
+{
+	unique_ptr<CryptContext> con;
+
+	try {
+		con.reset(new CryptContext);
+	} catch (...) {
+		mes = L"unable to create context";
+		return false;
+	}
+
+	if (!con->OpenVolume(path, config_path, password, mes))
+		return false;
+
+	CryptConfig *config = con->GetConfig();
+
+	if (config->m_reverse) {
+		mes = L"reverse mode filesystems have no encrypted files to check";
+		return false;
+	}
+
+	LARGE_INTEGER freq, t0, t1;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&t0);
+
+	FsckState st(con.get());
+
+	check_dir(st, config->m_basedir, L"");
+
+	// the header pass reads each file's header once, and the chunk pass
+	// verifies the rest of the blocks with the file ids it found
+	bool ok = run_workers(st, st.m_files.size(), [&](size_t i, BYTE *buf, BYTE *ptbuf, void *context) {
+		check_file(st, st.m_files[i], buf, ptbuf, context);
+	});
+
+	if (ok) {
+		ok = run_workers(st, st.m_chunks.size(), [&](size_t i, BYTE *buf, BYTE *ptbuf, void *context) {
+			const FsckChunk& chunk = st.m_chunks[i];
+			const FsckFile& file = st.m_files[chunk.file];
+			if (!file.header_ok)
+				return;
+			HANDLE hfile = open_file(st, file);
+			if (hfile != INVALID_HANDLE_VALUE) {
+				check_blocks(st, file, hfile, chunk.first_block, chunk.blocks, buf, ptbuf, context);
+				CloseHandle(hfile);
+			}
+		});
+	}
+
+	if (!ok) {
+		mes = L"unable to get crypt context";
+		return false;
+	}
+
+	QueryPerformanceCounter(&t1);
+
+	double seconds = (double)(t1.QuadPart - t0.QuadPart) / freq.QuadPart;
+
+	report.clear();
+
+	for (auto& it : st.m_problems) {
+		report += it;
+		report += L"\n";
+	}
+
+	if (st.m_num_problems > (long long)st.m_problems.size())
+		report += L"... and " + to_wstring(st.m_num_problems - st.m_problems.size()) + L" more\n";
+
+	WCHAR buf[256];
+
+	swprintf_s(buf, L"checked %lld directories, %lld names, %lld files, %lld MB in %.1f seconds (%.0f MB/s): %lld problems\n",
+		st.m_dirs, st.m_names, (long long)st.m_files.size(), (long long)(st.m_bytes / (1024 * 1024)), seconds,
+		seconds > 0 ? st.m_bytes / (1024.0 * 1024.0) / seconds : 0.0, st.m_num_problems);
+
+	report += buf;
+
+	return true;
+}
@@ -0,0 +1,56 @@
+/*
+cppcryptfs : user-mode cryptographic virtual overlay filesystem.
+
+Copyright (C) 2016-2018 Bailey Brown (github.com/bailey27/cppcryptfs)
+
+cppcryptfs is based on the design of gocryptfs (github.com/rfjakob/gocryptfs)
+
+The MIT License (MIT)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+
+#pragma once
+
+#include <string>
+
+using namespace std;
+
+// number of blocks a worker reads and verifies at a time
+#define FSCK_CHUNK_BLOCKS 256
+
+// problems listed in the report (the rest are only counted)
+#define FSCK_MAX_PROBLEMS 1000
+
+// Checks a forward mode filesystem without mounting it.  The directory tree
+// is walked on the calling thread, and every directory's diriv, every file
+// name and every longname .name file is checked to decrypt.  Then the file
+// headers and the tag of every block are verified in parallel, reading
+// FSCK_CHUNK_BLOCKS blocks at a time.  Each header is read once, with the
+// first chunk of its file, and the rest of the chunks use the file id found
+// there.
+//
+// The filesystem must not be mounted while it is checked.
+//
+// Problems are reported by plaintext path (and, for blocks, plaintext offset)
+// in report, followed by a summary line.  Returns false and sets mes only if
+// the filesystem can't be opened.
+bool check_crypt_fs(const WCHAR *path, const WCHAR *config_path, const WCHAR *password, wstring& report, wstring& mes);
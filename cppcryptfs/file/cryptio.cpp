@@ -33,47 +33,113 @@ THE SOFTWARE.
 #include "util/util.h"
 #include "crypt/crypt.h"
 #include "cryptio.h"
+#include "iobackend.h"
+#include "iobufferpool.h"
+#include "blockcompress.h"
 
+BlockBuffer::BlockBuffer(int len)
+{
+	if (len <= (int)sizeof(m_local)) {
+		m_iobuf = NULL;
+		m_buf = m_local;
+	} else {
+		m_iobuf = IoBufferPool::getInstance()->GetIoBuffer(len);
+		m_buf = m_iobuf ? m_iobuf->m_pBuf : NULL;
+	}
+}
 
+BlockBuffer::~BlockBuffer()
+{
+	if (m_iobuf)
+		IoBufferPool::getInstance()->ReleaseIoBuffer(m_iobuf);
+}
 
-int
-read_block(CryptContext *con, HANDLE hfile, BYTE *inputbuf, int bytesinbuf, int *bytes_consumed, const unsigned char *fileid, unsigned long long block, unsigned char *ptbuf, void *openssl_crypt_context)
+void
+punch_zero_clusters(IoBackend *io, LONGLONG offset, const BYTE *buf, DWORD len)
+{
+	const LONGLONG end = offset + len;
+
+	LONGLONG run = -1; // start of the current run of zero clusters
+
+	LONGLONG c;
+
+	for (c = (offset + PUNCH_CLUSTER - 1) & ~((LONGLONG)PUNCH_CLUSTER - 1); c + PUNCH_CLUSTER <= end; c += PUNCH_CLUSTER) {
+		if (is_all_zeros(buf + (c - offset), PUNCH_CLUSTER)) {
+			if (run < 0)
+				run = c;
+		} else if (run >= 0) {
+			io->PunchHole(run, c - run);
+			run = -1;
+		}
+	}
+
+	// failure is ignored, because the zeros are already there
+	if (run >= 0)
+		io->PunchHole(run, c - run);
+}
+
+// The block engine.  read_block_t() and write_block_t() are instantiated for
+// each cipher, direction and layout, so that none of those are decided per
+// block, and init_block_engine() picks the instantiations for the volume.
+//
+// A block is normally laid out as IV, length word (with Compression), then
+// the ciphertext and tag (AES-SIV puts its tag, the SIV, before the
+// ciphertext).  With AlignedBlocks the ciphertext comes first, at the start
+// of the slot, which is on a page boundary, and is followed by the IV and
+// tag, and the slot is padded with zeros to ptlen + ALIGNED_BLOCK_LEN bytes.
+
+#define BLOCK_CIPHER_GCM 0
+#define BLOCK_CIPHER_SIV 1
+#define BLOCK_CIPHER_XCHACHA 2
+
+template<int cipher, bool compression, bool aligned>
+static int
+read_block_t(CryptContext *con, IoBackend *io, BYTE *inputbuf, int bytesinbuf, int *bytes_consumed, const unsigned char *fileid, unsigned long long block, unsigned char *ptbuf, void *openssl_crypt_context)
 {
 	static_assert(BLOCK_IV_LEN == BLOCK_SIV_LEN, "BLOCK_IV_LEN != BLOCK_SIV_LEN.");
 	static_assert(BLOCK_SIV_LEN == BLOCK_TAG_LEN, "BLOCK_SIV_LEN != BLOCK_TAG_LEN.");
 
-	long long offset = FILE_HEADER_LEN + block*CIPHER_BS;
+	const int ivlen = cipher == BLOCK_CIPHER_XCHACHA ? BLOCK_XCHACHA_NONCE_LEN : BLOCK_IV_LEN;
 
-	LARGE_INTEGER l;
+	const int hdrlen = compression ? BLOCK_LEN_HEADER_LEN : 0;
 
-	l.QuadPart = offset;
+	const int overhead = ivlen + hdrlen + BLOCK_TAG_LEN;
 
-	if (hfile != INVALID_HANDLE_VALUE) {
-		if (!SetFilePointerEx(hfile, l, NULL, FILE_BEGIN)) {
-			return -1;
-		}
-	}
+	const BlockEngine& engine = con->m_block_engine;
+
+	// bytes a slot has besides the plaintext (so the padding too, with AlignedBlocks)
+	const int slot_overhead = aligned ? engine.cipher_bs - engine.plain_bs : overhead;
+
+	long long offset = engine.header_len + block*engine.cipher_bs;
 
 	unsigned long long be_block = MakeBigEndian(block);
 
-	unsigned char auth_data[sizeof(be_block) + FILE_ID_LEN];
+	unsigned char auth_data[sizeof(be_block) + FILE_ID_LEN + BLOCK_LEN_HEADER_LEN];
+
+	int auth_len = sizeof(be_block) + FILE_ID_LEN;
 
 	memcpy(auth_data, &be_block, sizeof(be_block));
 
 	memcpy(auth_data + sizeof(be_block), fileid, FILE_ID_LEN);
 
-	unsigned char buf[CIPHER_BS];
+	BlockBuffer block_buf(io ? engine.cipher_bs : 0);
+
+	unsigned char *buf = block_buf.m_buf;
+
+	if (!buf) {
+		SetLastError(ERROR_OUTOFMEMORY);
+		return -1;
+	}
 
 	DWORD nread = 0;
 
-	if (hfile == INVALID_HANDLE_VALUE && inputbuf) {
-		int to_consume = min(CIPHER_BS, bytesinbuf);
+	if (!io && inputbuf) {
+		int to_consume = min(engine.cipher_bs, bytesinbuf);
 		if (bytes_consumed != NULL)
 			*bytes_consumed = to_consume;
 		nread = to_consume;
 	} else {
-		if (!ReadFile(hfile, buf, sizeof(buf), &nread, NULL)) {
-			DWORD error = GetLastError();
+		if (!io->ReadAt(offset, buf, engine.cipher_bs, &nread)) {
 			return -1;
 		}
 	}
@@ -81,28 +147,90 @@ read_block(CryptContext *con, HANDLE hfile, BYTE *inputbuf, int bytesinbuf, int
 	if (nread == 0)
 		return 0;
 
-	if (nread <= CIPHER_BLOCK_OVERHEAD) {
+	if ((int)nread <= slot_overhead) {
 		SetLastError(ERROR_INVALID_DATA);
 		return -1;
 	}
 
+	BYTE *cipher_buf = inputbuf ? inputbuf : buf;
+
+	// the plaintext length follows from the length of the slot the block occupies
+	const int slot_ptlen = nread - slot_overhead;
+
+	BYTE *iv = aligned ? cipher_buf + slot_ptlen : cipher_buf;
+
+	int ctlen = slot_ptlen;
+
+	bool compressed = false;
+
+	if (compression) {
+		unsigned int hdr;
+		memcpy(&hdr, iv + ivlen, sizeof(hdr));
+		memcpy(auth_data + auth_len, &hdr, sizeof(hdr));
+		auth_len += sizeof(hdr);
+		hdr = MakeBigEndianNative(hdr);
+		if (hdr & BLOCK_COMPRESSED_FLAG) {
+			int clen = (int)(hdr & ~BLOCK_COMPRESSED_FLAG);
+			// a bad length can only come from corruption, which decryption would catch anyway
+			if (clen > 0 && clen < slot_ptlen) {
+				ctlen = clen;
+				compressed = true;
+			}
+		}
+	}
+
+	BlockBuffer zbuf(compressed ? ctlen : 0);
+
+	if (!zbuf.m_buf) {
+		SetLastError(ERROR_OUTOFMEMORY);
+		return -1;
+	}
+
+	// the ciphertext, and the tag (or SIV)
+	BYTE *ct, *tag;
+
+	if (aligned) {
+		ct = cipher_buf;
+		tag = iv + ivlen + hdrlen;
+	} else if (cipher == BLOCK_CIPHER_SIV) {
+		tag = cipher_buf + ivlen + hdrlen;
+		ct = tag + BLOCK_SIV_LEN;
+	} else {
+		ct = cipher_buf + ivlen + hdrlen;
+		tag = ct + ctlen;
+	}
+
+	BYTE *outbuf = compressed ? zbuf.m_buf : ptbuf;
+
 	int ptlen;
 	
-	if (con->GetConfig()->m_AESSIV) {
-		ptlen = decrypt_siv((inputbuf ? inputbuf : buf) + BLOCK_IV_LEN + BLOCK_SIV_LEN, nread - BLOCK_IV_LEN - BLOCK_SIV_LEN, auth_data, sizeof(auth_data), 
-			(inputbuf ? inputbuf : buf) + BLOCK_IV_LEN, (inputbuf ? inputbuf : buf), ptbuf, &con->m_siv);	
-	} else {
-		ptlen = decrypt((inputbuf ? inputbuf : buf) + BLOCK_IV_LEN, nread - BLOCK_IV_LEN - BLOCK_TAG_LEN, auth_data, sizeof(auth_data),
-			(inputbuf ? inputbuf : buf) + nread - BLOCK_TAG_LEN, con->GetConfig()->GetGcmContentKey(), (inputbuf ? inputbuf : buf), ptbuf, openssl_crypt_context);
+	{
+		// a block takes about as long as reading the clock, so it's sampled
+		PerfTimer perf(perf_sample() ? &con->m_perf : NULL, PERF_BLOCK_CRYPTO);
+
+		perf.SetWeight(PERF_SAMPLE_INTERVAL);
+		perf.AddBytes(ctlen);
+		perf.SetTrace(0, block * engine.plain_bs);
+
+		if (cipher == BLOCK_CIPHER_SIV) {
+			ptlen = decrypt_siv(ct, ctlen, auth_data, auth_len, 
+				tag, iv, outbuf, &con->m_siv);	
+		} else if (cipher == BLOCK_CIPHER_XCHACHA) {
+			ptlen = decrypt_xchacha(ct, ctlen, auth_data, auth_len,
+				tag, engine.content_key, iv, outbuf, openssl_crypt_context);
+		} else {
+			ptlen = decrypt(ct, ctlen, auth_data, auth_len,
+				tag, engine.content_key, iv, outbuf, openssl_crypt_context);
+		}
 	}
 
 	if (ptlen < 0) {  // return all zeros for un-authenticated blocks (might exist if file was resized without writing)
 
 		// if we read all zeros, then it is (probably) really from a hole in the file
 
-		if (is_all_zeros(inputbuf ? inputbuf : buf, nread)) {
-			memset(ptbuf, 0, nread - (BLOCK_IV_LEN + BLOCK_TAG_LEN));
-			return nread - (BLOCK_IV_LEN + BLOCK_TAG_LEN);
+		if (is_all_zeros(cipher_buf, nread)) {
+			memset(ptbuf, 0, slot_ptlen);
+			return slot_ptlen;
 		} else {
 			// if there are any non-zero bytes, then there is definitely corrupted data, so return an error
 			SetLastError(ERROR_DATA_CHECKSUM_ERROR);
@@ -111,30 +239,34 @@ read_block(CryptContext *con, HANDLE hfile, BYTE *inputbuf, int bytesinbuf, int
 	
 	}
 
+	if (compressed) {
+		ptlen = decompress_block(zbuf.m_buf, ptlen, ptbuf, slot_ptlen);
+		if (ptlen != slot_ptlen) {
+			SetLastError(ERROR_INVALID_DATA);
+			return -1;
+		}
+	}
+
 	return ptlen;
 }
 
-int
-write_block(CryptContext *con, unsigned char *cipher_buf, HANDLE hfile, const unsigned char *fileid, unsigned long long block, const unsigned char *ptbuf, int ptlen, void *openssl_crypt_context, const unsigned char *block0iv)
+template<int cipher, bool reverse, bool compression, bool aligned>
+static int
+write_block_t(CryptContext *con, unsigned char *cipher_buf, IoBackend *io, const unsigned char *fileid, unsigned long long block, const unsigned char *ptbuf, int ptlen, void *openssl_crypt_context, const unsigned char *block0iv)
 {
+	const int ivlen = cipher == BLOCK_CIPHER_XCHACHA ? BLOCK_XCHACHA_NONCE_LEN : BLOCK_IV_LEN;
 
+	const int hdrlen = compression ? BLOCK_LEN_HEADER_LEN : 0;
 
-	long long offset = FILE_HEADER_LEN + block*CIPHER_BS;
-
-	LARGE_INTEGER l;
-
-	l.QuadPart = offset;
-
-	if (hfile != INVALID_HANDLE_VALUE) {
-		if (!SetFilePointerEx(hfile, l, NULL, FILE_BEGIN)) {
-			return -1;
-		}
-	}
+	const BlockEngine& engine = con->m_block_engine;
 
+	long long offset = engine.header_len + block*engine.cipher_bs;
 
 	unsigned long long be_block = MakeBigEndian(block);
 
-	unsigned char auth_data[sizeof(be_block) + FILE_ID_LEN];
+	unsigned char auth_data[sizeof(be_block) + FILE_ID_LEN + BLOCK_LEN_HEADER_LEN];
+
+	int auth_len = sizeof(be_block) + FILE_ID_LEN;
 
 	memcpy(auth_data, &be_block, sizeof(be_block));
 
@@ -142,8 +274,12 @@ write_block(CryptContext *con, unsigned char *cipher_buf, HANDLE hfile, const un
 
 	unsigned char tag[BLOCK_TAG_LEN];
 
-	if (!con->GetConfig()->m_reverse) {
-		if (!get_random_bytes(con, cipher_buf, BLOCK_IV_LEN))
+	BYTE *iv = aligned ? cipher_buf + ptlen : cipher_buf;
+
+	if (!reverse) {
+		if (block0iv)
+			memcpy(iv, block0iv, ivlen);
+		else if (!get_random_bytes(con, iv, ivlen))
 			return -1;
 	} else {
 		if (!block0iv)
@@ -163,44 +299,166 @@ write_block(CryptContext *con, unsigned char *cipher_buf, HANDLE hfile, const un
 
 		block0IVlow = MakeBigEndian(block0IVlow);
 
-		memcpy(cipher_buf, block0iv, 8);
-		memcpy(cipher_buf + 8, &block0IVlow, sizeof(block0IVlow));
+		memcpy(iv, block0iv, 8);
+		memcpy(iv + 8, &block0IVlow, sizeof(block0IVlow));
 		
 		
 	}
 
-	bool siv = con->GetConfig()->m_AESSIV;
+	// With Compression, the IV is followed by an authenticated length word, and
+	// the block is stored compressed if that saves at least an eighth of it.
+	// A compressed block still occupies the slot an uncompressed one would, so
+	// offsets and file sizes are unchanged and random access needs no index.
+	// The unused tail of the slot is zeroed (see punch_zero_clusters()).
 
-	int ctlen;
+	const unsigned char *src = ptbuf;
+	int srclen = ptlen;
+
+	BlockBuffer zbuf(compression ? ptlen : 0);
+
+	if (compression) {
+		if (!zbuf.m_buf) {
+			SetLastError(ERROR_OUTOFMEMORY);
+			return -1;
+		}
+		unsigned int hdr = ptlen;
+		int clen = compress_block(ptbuf, ptlen, zbuf.m_buf, ptlen - ptlen / 8);
+		if (clen > 0) {
+			src = zbuf.m_buf;
+			srclen = clen;
+			hdr = clen | BLOCK_COMPRESSED_FLAG;
+		}
+		hdr = MakeBigEndian(hdr);
+		memcpy(iv + ivlen, &hdr, sizeof(hdr));
+		memcpy(auth_data + auth_len, &hdr, sizeof(hdr));
+		auth_len += sizeof(hdr);
+	}
+
+	// where the ciphertext and the tag (or SIV) go
+	BYTE *ct, *tagp;
 
-	if (siv) {
-		ctlen = encrypt_siv(ptbuf, ptlen, auth_data, sizeof(auth_data), 
-			cipher_buf, cipher_buf + BLOCK_IV_LEN + BLOCK_SIV_LEN, cipher_buf + BLOCK_IV_LEN, &con->m_siv);
+	if (aligned) {
+		ct = cipher_buf;
+		tagp = iv + ivlen + hdrlen;
+	} else if (cipher == BLOCK_CIPHER_SIV) {
+		tagp = cipher_buf + ivlen + hdrlen;
+		ct = tagp + BLOCK_SIV_LEN;
 	} else {
-		ctlen = encrypt(ptbuf, ptlen, auth_data, sizeof(auth_data), con->GetConfig()->GetGcmContentKey(),
-			cipher_buf, cipher_buf + BLOCK_IV_LEN, tag, openssl_crypt_context);
+		ct = cipher_buf + ivlen + hdrlen;
+		tagp = NULL; // after the ciphertext, whose length isn't known yet
 	}
 
-	if (ctlen < 0 || ctlen > PLAIN_BS)
+	int ctlen;
+
+	{
+		PerfTimer perf(perf_sample() ? &con->m_perf : NULL, PERF_BLOCK_CRYPTO);
+
+		perf.SetWeight(PERF_SAMPLE_INTERVAL);
+		perf.AddBytes(srclen);
+		perf.SetTrace(0, block * engine.plain_bs);
+
+		if (cipher == BLOCK_CIPHER_SIV) {
+			ctlen = encrypt_siv(src, srclen, auth_data, auth_len, 
+				iv, ct, tagp, &con->m_siv);
+		} else if (cipher == BLOCK_CIPHER_XCHACHA) {
+			ctlen = encrypt_xchacha(src, srclen, auth_data, auth_len, engine.content_key,
+				iv, ct, tag, openssl_crypt_context);
+		} else {
+			ctlen = encrypt(src, srclen, auth_data, auth_len, engine.content_key,
+				iv, ct, tag, openssl_crypt_context);
+		}
+	}
+
+	if (ctlen < 0 || ctlen > engine.plain_bs)
 		return -1;
 
-	if (!siv)
-		memcpy(cipher_buf + BLOCK_IV_LEN + ctlen, tag, sizeof(tag));
+	if (cipher != BLOCK_CIPHER_SIV)
+		memcpy(tagp ? tagp : ct + ctlen, tag, sizeof(tag));
+
+	const int overhead = ivlen + hdrlen + (int)sizeof(tag);
+
+	const int slotlen = ptlen + (aligned ? engine.cipher_bs - engine.plain_bs : overhead);
+
+	const int used = ctlen + overhead;
 
-	if (!con->GetConfig()->m_reverse && hfile != INVALID_HANDLE_VALUE) {
+	// The unused tail of a compressed block, and the padding of an aligned
+	// slot, are written along with the block, so that the block is one write
+	// that extends the file if it needs to, without any size calls.
+	if (used < slotlen)
+		memset(cipher_buf + used, 0, slotlen - used);
+
+	if (!reverse && io) {
 
 		DWORD nWritten = 0;
 
-		if (!WriteFile(hfile, cipher_buf, BLOCK_IV_LEN + ctlen + sizeof(tag), &nWritten, NULL)) {
+		if (!io->WriteAt(offset, cipher_buf, slotlen, &nWritten)) {
 			return -1;
 		}
 		
-		if (nWritten == BLOCK_IV_LEN + ctlen + sizeof(tag)) {
-			return ptlen;
-		} else {
+		if (nWritten != (DWORD)slotlen) {
 			return -1;
 		}
+
+		if (compression && used < slotlen)
+			punch_zero_clusters(io, offset + used, cipher_buf + used, slotlen - used);
+
+		return ptlen;
+	} else {
+		return slotlen;
+	}
+}
+
+template<int cipher>
+static void
+select_block_engine(BlockEngine& engine, bool reverse, bool compression, bool aligned)
+{
+	// the config doesn't allow Compression with AlignedBlocks
+	if (aligned) {
+		engine.read = read_block_t<cipher, false, true>;
+		engine.write = reverse ? write_block_t<cipher, true, false, true> : write_block_t<cipher, false, false, true>;
+	} else if (compression) {
+		engine.read = read_block_t<cipher, true, false>;
+		engine.write = reverse ? write_block_t<cipher, true, true, false> : write_block_t<cipher, false, true, false>;
+	} else {
+		engine.read = read_block_t<cipher, false, false>;
+		engine.write = reverse ? write_block_t<cipher, true, false, false> : write_block_t<cipher, false, false, false>;
+	}
+}
+
+bool
+init_block_engine(CryptContext *con)
+{
+	CryptConfig *cfg = con->GetConfig();
+
+	BlockEngine& engine = con->m_block_engine;
+
+	engine.header_len = cfg->m_HeaderLen;
+	engine.plain_bs = cfg->m_PlainBS;
+	engine.cipher_bs = cfg->m_CipherBS;
+	engine.iv_len = cfg->m_XChaCha20Poly1305 ? BLOCK_XCHACHA_NONCE_LEN : BLOCK_IV_LEN;
+
+	if (cfg->m_AESSIV) {
+		engine.content_key = NULL;
+		select_block_engine<BLOCK_CIPHER_SIV>(engine, cfg->m_reverse, cfg->m_Compression, cfg->m_AlignedBlocks);
+	} else if (cfg->m_XChaCha20Poly1305) {
+		engine.content_key = cfg->GetXChaChaContentKey();
+		select_block_engine<BLOCK_CIPHER_XCHACHA>(engine, cfg->m_reverse, cfg->m_Compression, cfg->m_AlignedBlocks);
 	} else {
-		return BLOCK_IV_LEN + ctlen + sizeof(tag);
+		engine.content_key = cfg->GetGcmContentKey();
+		select_block_engine<BLOCK_CIPHER_GCM>(engine, cfg->m_reverse, cfg->m_Compression, cfg->m_AlignedBlocks);
 	}
+
+	return cfg->m_AESSIV || engine.content_key != NULL;
+}
+
+int
+read_block(CryptContext *con, IoBackend *io, BYTE *inputbuf, int bytesinbuf, int *bytes_consumed, const unsigned char *fileid, unsigned long long block, unsigned char *ptbuf, void *openssl_crypt_context)
+{
+	return con->m_block_engine.read(con, io, inputbuf, bytesinbuf, bytes_consumed, fileid, block, ptbuf, openssl_crypt_context);
+}
+
+int
+write_block(CryptContext *con, unsigned char *cipher_buf, IoBackend *io, const unsigned char *fileid, unsigned long long block, const unsigned char *ptbuf, int ptlen, void *openssl_crypt_context, const unsigned char *block0iv)
+{
+	return con->m_block_engine.write(con, cipher_buf, io, fileid, block, ptbuf, ptlen, openssl_crypt_context, block0iv);
 }
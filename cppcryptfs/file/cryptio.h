@@ -30,10 +30,80 @@ THE SOFTWARE.
 
 #include <windows.h>
 
+#include "crypt/cryptdefs.h"
+
 class CryptContext;
+class IoBackend;
+class IoBuffer;
+
+// Scratch space for one plaintext or ciphertext block.  Blocks of the default
+// size live on the stack; larger ones (see BlockSize in the config) come from
+// the IoBufferPool.  m_buf is NULL if the allocation failed.
+
+class BlockBuffer
+{
+	BYTE m_local[PLAIN_BS + MAX_CIPHER_BLOCK_OVERHEAD];
+	IoBuffer *m_iobuf;
+public:
+	BYTE *m_buf;
+
+	BlockBuffer(int len);
+	~BlockBuffer();
+
+	// disallow copying
+	BlockBuffer(BlockBuffer const&) = delete;
+	void operator=(BlockBuffer const&) = delete;
+};
+
+typedef int (*read_block_fn)(CryptContext *con, IoBackend *io, BYTE *inputbuf, int bytesinbuf, int *bytes_consumed, const unsigned char *fileid, unsigned long long block, unsigned char *ptbuf, void *openssl_crypt_context);
+
+typedef int (*write_block_fn)(CryptContext *con, unsigned char *cipher_buf, IoBackend *io, const unsigned char *fileid, unsigned long long block, const unsigned char *ptbuf, int ptlen, void *openssl_crypt_context, const unsigned char *block0iv);
+
+// Block encryption specialized for a volume's cipher, direction (forward or
+// reverse) and layout.  init_block_engine() picks the specialization when the
+// filesystem is mounted, after the key has been decrypted, and it is kept in
+// the CryptContext.
+
+struct BlockEngine
+{
+	read_block_fn read;
+	write_block_fn write;
+
+	// copied from the config so the block path doesn't have to go through it
+	int header_len;
+	int plain_bs;
+	int cipher_bs;
+	int iv_len;
+	const BYTE *content_key; // GCM or XChaCha20-Poly1305 key (NULL for AES-SIV)
+};
+
+bool
+init_block_engine(CryptContext *con);
+
+// If io is NULL, read_block() decrypts from inputbuf, and write_block() only
+// encrypts into cipher_buf (and returns the length of the ciphertext).
+//
+// In reverse mode, block0iv is the IV of the file's first block, from which
+// the IV of every other block is derived.  In forward mode it is optional,
+// and if given, it is used as the block's (iv_len byte) IV instead of a
+// fresh random one, so a batched write can get all of its IVs at once.
 
 int
-read_block(CryptContext *con, HANDLE hfile, BYTE *inputbuf, int bytesinbuf, int *bytes_consumed, const unsigned char *fileid, unsigned long long block, unsigned char *ptbuf, void *openssl_crypt_context);
+read_block(CryptContext *con, IoBackend *io, BYTE *inputbuf, int bytesinbuf, int *bytes_consumed, const unsigned char *fileid, unsigned long long block, unsigned char *ptbuf, void *openssl_crypt_context);
 
 int
-write_block(CryptContext *con, unsigned char *cipher_buf, HANDLE hfile, const unsigned char *fileid, unsigned long long block, const unsigned char *ptbuf, int ptlen, void *openssl_crypt_context, const unsigned char *block0iv = NULL);
+write_block(CryptContext *con, unsigned char *cipher_buf, IoBackend *io, const unsigned char *fileid, unsigned long long block, const unsigned char *ptbuf, int ptlen, void *openssl_crypt_context, const unsigned char *block0iv = NULL);
+
+// The unused tail of a compressed block's slot is written as zeros along with
+// the block.  Afterwards, the whole clusters of zeros in buf, which has just
+// been written at offset, are deallocated with PunchHole() (one call per run
+// of them, so a span of blocks costs one call per block at most).  Space is
+// only saved if the file is sparse and a tail covers at least one whole
+// cluster, so with 4 KB blocks, whose tails are always shorter than a
+// cluster, no call is made at all.  With 64 KB blocks, a block that
+// compresses to half its size frees 7 of its 16 clusters.
+
+#define PUNCH_CLUSTER 4096 // the usual NTFS cluster size
+
+void
+punch_zero_clusters(IoBackend *io, LONGLONG offset, const BYTE *buf, DWORD len);
@@ -0,0 +1,791 @@
+/*
+cppcryptfs : user-mode cryptographic virtual overlay filesystem.
+
+Copyright (C) 2016-2018 Bailey Brown (github.com/bailey27/cppcryptfs)
+
+cppcryptfs is based on the design of gocryptfs (github.com/rfjakob/gocryptfs)
+
+The MIT License (MIT)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#include "stdafx.h"
+
+#include <winioctl.h>
+
+#include "iobackend.h"
+#include "iobufferpool.h"
+#include "context/perfstats.h"
+
+// Direct mode writes that only partly cover a sector do a read-modify-write
+// of that sector, so two of them must not run on the same sector at once.
+// The sector number picks one of these locks.  Collisions between
+// unrelated files only cost a little contention.
+
+#define DIRECT_IO_LOCK_STRIPES 64
+
+static SRWLOCK g_sector_locks[DIRECT_IO_LOCK_STRIPES]; // zero-initialized, same as SRWLOCK_INIT
+
+// The extend lock of a backend that wasn't given one by SetExtendLock()
+// is picked from these by handle.
+
+static SRWLOCK g_extend_locks[DIRECT_IO_LOCK_STRIPES];
+
+static inline bool
+is_aligned(LONGLONG n)
+{
+	return (n & (DIRECT_IO_ALIGNMENT - 1)) == 0;
+}
+
+static inline int
+sector_lock_index(LONGLONG offset)
+{
+	return (int)((offset / DIRECT_IO_ALIGNMENT) % DIRECT_IO_LOCK_STRIPES);
+}
+
+BOOL
+IoBackend::ReadBatch(IoRequest *reqs, int count)
+{
+	for (int i = 0; i < count; i++) {
+		reqs[i].transferred = 0;
+		if (!ReadAt(reqs[i].offset, reqs[i].buf, reqs[i].len, &reqs[i].transferred))
+			return FALSE;
+		// short read means we hit end of file, so the rest of the requests would read nothing
+		if (reqs[i].transferred < reqs[i].len) {
+			for (int j = i + 1; j < count; j++)
+				reqs[j].transferred = 0;
+			break;
+		}
+	}
+	return TRUE;
+}
+
+BOOL
+IoBackend::WriteBatch(IoRequest *reqs, int count)
+{
+	for (int i = 0; i < count; i++) {
+		reqs[i].transferred = 0;
+		if (!WriteAt(reqs[i].offset, reqs[i].buf, reqs[i].len, &reqs[i].transferred))
+			return FALSE;
+		if (reqs[i].transferred != reqs[i].len)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+BOOL
+IoBackend::ReadSpan(LONGLONG offset, void *buf, DWORD len, LPDWORD pNread)
+{
+	IoRequest reqs[IO_BATCH_DEPTH];
+
+	*pNread = 0;
+
+	while (len > 0) {
+		int count = 0;
+		DWORD batch_len = 0;
+		while (count < IO_BATCH_DEPTH && batch_len < len) {
+			LONGLONG pos = offset + batch_len;
+			DWORD seg = (DWORD)min((LONGLONG)(len - batch_len), IO_SPAN_SEGMENT - pos % IO_SPAN_SEGMENT);
+			reqs[count].offset = pos;
+			reqs[count].buf = (BYTE*)buf + batch_len;
+			reqs[count].len = seg;
+			reqs[count].transferred = 0;
+			batch_len += seg;
+			count++;
+		}
+		if (!ReadBatch(reqs, count))
+			return FALSE;
+		for (int i = 0; i < count; i++) {
+			*pNread += reqs[i].transferred;
+			if (reqs[i].transferred < reqs[i].len)
+				return TRUE;
+		}
+		offset += batch_len;
+		buf = (BYTE*)buf + batch_len;
+		len -= batch_len;
+	}
+
+	return TRUE;
+}
+
+BOOL
+IoBackend::WriteSpan(LONGLONG offset, const void *buf, DWORD len, LPDWORD pNwritten)
+{
+	IoRequest reqs[IO_BATCH_DEPTH];
+
+	*pNwritten = 0;
+
+	while (len > 0) {
+		int count = 0;
+		DWORD batch_len = 0;
+		while (count < IO_BATCH_DEPTH && batch_len < len) {
+			LONGLONG pos = offset + batch_len;
+			DWORD seg = (DWORD)min((LONGLONG)(len - batch_len), IO_SPAN_SEGMENT - pos % IO_SPAN_SEGMENT);
+			reqs[count].offset = pos;
+			reqs[count].buf = (BYTE*)buf + batch_len;
+			reqs[count].len = seg;
+			reqs[count].transferred = 0;
+			batch_len += seg;
+			count++;
+		}
+		if (!WriteBatch(reqs, count))
+			return FALSE;
+		*pNwritten += batch_len;
+		offset += batch_len;
+		buf = (const BYTE*)buf + batch_len;
+		len -= batch_len;
+	}
+
+	return TRUE;
+}
+
+HandleIoBackend::HandleIoBackend(HANDLE h)
+{
+	m_handle = h;
+	m_direct = false;
+	m_batch = false;
+	m_stats = NULL;
+	m_extend_lock = NULL;
+	m_trace_file = 0;
+	m_async = INVALID_HANDLE_VALUE;
+	m_async_access = 0;
+
+	for (int i = 0; i < IO_BATCH_DEPTH; i++)
+		m_events[i] = NULL;
+}
+
+HandleIoBackend::~HandleIoBackend()
+{
+	CloseAsync();
+
+	for (int i = 0; i < IO_BATCH_DEPTH; i++) {
+		if (m_events[i])
+			CloseHandle(m_events[i]);
+	}
+}
+
+SRWLOCK *
+HandleIoBackend::ExtendLock()
+{
+	if (m_extend_lock)
+		return m_extend_lock;
+
+	return &g_extend_locks[((ULONG_PTR)m_handle >> 2) % DIRECT_IO_LOCK_STRIPES];
+}
+
+void
+HandleIoBackend::CloseAsync()
+{
+	if (m_async != INVALID_HANDLE_VALUE) {
+		CloseHandle(m_async);
+		m_async = INVALID_HANDLE_VALUE;
+		m_async_access = 0;
+	}
+}
+
+// Opens the overlapped handle and the events a batch needs.  Returns false
+// if the batch should be issued one request at a time instead.
+bool
+HandleIoBackend::CanBatch(const IoRequest *reqs, int count, DWORD access)
+{
+	if (!m_batch || count < 2 || m_handle == INVALID_HANDLE_VALUE)
+		return false;
+
+	// unaligned direct transfers need the bounce buffer of ReadAt() and WriteAt()
+	if (m_direct) {
+		for (int i = 0; i < count; i++) {
+			if (!(is_aligned(reqs[i].offset) && is_aligned(reqs[i].len) && is_aligned((LONGLONG)(ULONG_PTR)reqs[i].buf)))
+				return false;
+		}
+	}
+
+	if (m_async == INVALID_HANDLE_VALUE || (m_async_access & access) != access) {
+		CloseAsync();
+		m_async = ReOpenFile(m_handle, access, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+			FILE_FLAG_OVERLAPPED | (m_direct ? FILE_FLAG_NO_BUFFERING : 0));
+		if (m_async == INVALID_HANDLE_VALUE) {
+			// don't try again for every batch
+			m_batch = false;
+			return false;
+		}
+		m_async_access = access;
+	}
+
+	for (int i = 0; i < min(count, IO_BATCH_DEPTH); i++) {
+		if (!m_events[i]) {
+			m_events[i] = CreateEvent(NULL, TRUE, FALSE, NULL);
+			if (!m_events[i])
+				return false;
+		}
+	}
+
+	return true;
+}
+
+// Issues up to IO_BATCH_DEPTH requests on m_async and waits for all of them.
+BOOL
+HandleIoBackend::IssueBatch(IoRequest *reqs, int count, bool write)
+{
+	PerfTimer perf(m_stats, PERF_BACKING_IO);
+	perf.SetTrace(m_trace_file, reqs[0].offset);
+
+	OVERLAPPED ovs[IO_BATCH_DEPTH];
+	bool pending[IO_BATCH_DEPTH];
+
+	BOOL bRet = TRUE;
+	DWORD lasterr = 0;
+
+	int issued;
+
+	for (issued = 0; issued < count; issued++) {
+		IoRequest& req = reqs[issued];
+		OVERLAPPED& ov = ovs[issued];
+
+		memset(&ov, 0, sizeof(ov));
+		ov.Offset = (DWORD)req.offset;
+		ov.OffsetHigh = (DWORD)(req.offset >> 32);
+		ov.hEvent = m_events[issued];
+
+		req.transferred = 0;
+		pending[issued] = true;
+
+		BOOL ok = write ? WriteFile(m_async, req.buf, req.len, NULL, &ov) : ReadFile(m_async, req.buf, req.len, NULL, &ov);
+
+		if (!ok && GetLastError() != ERROR_IO_PENDING) {
+			if (!write && GetLastError() == ERROR_HANDLE_EOF) {
+				// reading at or past end of file just reads nothing
+				pending[issued] = false;
+				continue;
+			}
+			lasterr = GetLastError();
+			bRet = FALSE;
+			break;
+		}
+	}
+
+	// everything issued has to finish before the buffers and OVERLAPPEDs go away
+	for (int i = 0; i < issued; i++) {
+		if (!pending[i])
+			continue;
+		DWORD n = 0;
+		if (!GetOverlappedResult(m_async, &ovs[i], &n, TRUE)) {
+			if (write || GetLastError() != ERROR_HANDLE_EOF) {
+				lasterr = GetLastError();
+				bRet = FALSE;
+			}
+			n = 0;
+		}
+		reqs[i].transferred = n;
+		perf.AddBytes(n);
+		if (write && n != reqs[i].len)
+			bRet = FALSE;
+	}
+
+	if (!bRet && lasterr)
+		SetLastError(lasterr);
+
+	return bRet;
+}
+
+BOOL
+HandleIoBackend::ReadBatch(IoRequest *reqs, int count)
+{
+	if (!CanBatch(reqs, count, GENERIC_READ))
+		return IoBackend::ReadBatch(reqs, count);
+
+	for (int i = 0; i < count; i += IO_BATCH_DEPTH) {
+		if (!IssueBatch(reqs + i, min(count - i, IO_BATCH_DEPTH), false))
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+BOOL
+HandleIoBackend::WriteBatch(IoRequest *reqs, int count)
+{
+	if (!CanBatch(reqs, count, GENERIC_WRITE))
+		return IoBackend::WriteBatch(reqs, count);
+
+	// the batch may extend the file (see DirectWriteAt())
+	if (m_direct)
+		AcquireSRWLockShared(ExtendLock());
+
+	BOOL bRet = TRUE;
+
+	for (int i = 0; i < count; i += IO_BATCH_DEPTH) {
+		if (!IssueBatch(reqs + i, min(count - i, IO_BATCH_DEPTH), true)) {
+			bRet = FALSE;
+			break;
+		}
+	}
+
+	if (m_direct)
+		ReleaseSRWLockShared(ExtendLock());
+
+	return bRet;
+}
+
+BOOL
+HandleIoBackend::ReadSpan(LONGLONG offset, void *buf, DWORD len, LPDWORD pNread)
+{
+	if (!m_batch || len <= IO_SPAN_SEGMENT || (m_direct && !(is_aligned(offset) && is_aligned((LONGLONG)(ULONG_PTR)buf))))
+		return ReadAt(offset, buf, len, pNread);
+
+	return IoBackend::ReadSpan(offset, buf, len, pNread);
+}
+
+BOOL
+HandleIoBackend::WriteSpan(LONGLONG offset, const void *buf, DWORD len, LPDWORD pNwritten)
+{
+	if (!m_batch || len <= IO_SPAN_SEGMENT || (m_direct && !(is_aligned(offset) && is_aligned((LONGLONG)(ULONG_PTR)buf))))
+		return WriteAt(offset, buf, len, pNwritten);
+
+	return IoBackend::WriteSpan(offset, buf, len, pNwritten);
+}
+
+BOOL
+HandleIoBackend::ReadAt(LONGLONG offset, void *buf, DWORD len, LPDWORD pNread)
+{
+	if (m_direct && !(is_aligned(offset) && is_aligned(len) && is_aligned((LONGLONG)(ULONG_PTR)buf)))
+		return DirectReadAt(offset, buf, len, pNread);
+
+	PerfTimer perf(m_stats, PERF_BACKING_IO, pNread);
+	perf.SetTrace(m_trace_file, offset);
+
+	OVERLAPPED ov;
+	LARGE_INTEGER l;
+
+	l.QuadPart = offset;
+
+	memset(&ov, 0, sizeof(ov));
+	ov.Offset = l.LowPart;
+	ov.OffsetHigh = l.HighPart;
+
+	*pNread = 0;
+
+	if (!ReadFile(m_handle, buf, len, pNread, &ov)) {
+		// reading at or past end of file is not an error, it just reads nothing
+		if (GetLastError() == ERROR_HANDLE_EOF) {
+			*pNread = 0;
+			return TRUE;
+		}
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+BOOL
+HandleIoBackend::WriteAt(LONGLONG offset, const void *buf, DWORD len, LPDWORD pNwritten)
+{
+	if (m_direct && !(is_aligned(offset) && is_aligned(len) && is_aligned((LONGLONG)(ULONG_PTR)buf)))
+		return DirectWriteAt(offset, buf, len, pNwritten);
+
+	if (!m_direct)
+		return RawWriteAt(offset, buf, len, pNwritten);
+
+	// an aligned write may extend the file, which a padded write
+	// in DirectWriteAt() must not be in the middle of
+	AcquireSRWLockShared(ExtendLock());
+
+	BOOL bRet = RawWriteAt(offset, buf, len, pNwritten);
+
+	ReleaseSRWLockShared(ExtendLock());
+
+	return bRet;
+}
+
+BOOL
+HandleIoBackend::RawWriteAt(LONGLONG offset, const void *buf, DWORD len, LPDWORD pNwritten)
+{
+	PerfTimer perf(m_stats, PERF_BACKING_IO, pNwritten);
+	perf.SetTrace(m_trace_file, offset);
+
+	OVERLAPPED ov;
+	LARGE_INTEGER l;
+
+	l.QuadPart = offset;
+
+	memset(&ov, 0, sizeof(ov));
+	ov.Offset = l.LowPart;
+	ov.OffsetHigh = l.HighPart;
+
+	*pNwritten = 0;
+
+	return WriteFile(m_handle, buf, len, pNwritten, &ov);
+}
+
+BOOL
+HandleIoBackend::DirectReadAt(LONGLONG offset, void *buf, DWORD len, LPDWORD pNread)
+{
+	*pNread = 0;
+
+	if (len == 0)
+		return TRUE;
+
+	LONGLONG start = offset & ~((LONGLONG)DIRECT_IO_ALIGNMENT - 1);
+	LONGLONG end = (offset + len + DIRECT_IO_ALIGNMENT - 1) & ~((LONGLONG)DIRECT_IO_ALIGNMENT - 1);
+
+	DWORD span = (DWORD)(end - start);
+
+	IoBuffer *bounce = IoBufferPool::getInstance()->GetIoBuffer(span);
+
+	if (!bounce) {
+		SetLastError(ERROR_OUTOFMEMORY);
+		return FALSE;
+	}
+
+	DWORD nread = 0;
+
+	// the bounce buffer is aligned, so this goes straight to ReadFile()
+	BOOL bRet = ReadAt(start, bounce->m_pBuf, span, &nread);
+
+	if (bRet) {
+		DWORD skip = (DWORD)(offset - start);
+		if (nread > skip) {
+			*pNread = min(len, nread - skip);
+			memcpy(buf, bounce->m_pBuf + skip, *pNread);
+		}
+	}
+
+	IoBufferPool::getInstance()->ReleaseIoBuffer(bounce);
+
+	return bRet;
+}
+
+BOOL
+HandleIoBackend::DirectWriteAt(LONGLONG offset, const void *buf, DWORD len, LPDWORD pNwritten)
+{
+	*pNwritten = 0;
+
+	if (len == 0)
+		return TRUE;
+
+	LONGLONG start = offset & ~((LONGLONG)DIRECT_IO_ALIGNMENT - 1);
+	LONGLONG end = (offset + len + DIRECT_IO_ALIGNMENT - 1) & ~((LONGLONG)DIRECT_IO_ALIGNMENT - 1);
+
+	DWORD span = (DWORD)(end - start);
+
+	IoBuffer *bounce = IoBufferPool::getInstance()->GetIoBuffer(span);
+
+	if (!bounce) {
+		SetLastError(ERROR_OUTOFMEMORY);
+		return FALSE;
+	}
+
+	BYTE *p = bounce->m_pBuf;
+
+	bool partial_head = offset != start;
+	bool partial_tail = offset + len != end;
+
+	// lock the sectors we read-modify-write, in index order to avoid deadlock
+
+	int lock1 = -1, lock2 = -1;
+
+	if (partial_head)
+		lock1 = sector_lock_index(start);
+
+	if (partial_tail) {
+		int tail_lock = sector_lock_index(end - DIRECT_IO_ALIGNMENT);
+		if (lock1 < 0)
+			lock1 = tail_lock;
+		else if (tail_lock != lock1)
+			lock2 = tail_lock;
+	}
+
+	if (lock2 >= 0 && lock2 < lock1) {
+		int tmp = lock1;
+		lock1 = lock2;
+		lock2 = tmp;
+	}
+
+	if (lock1 >= 0)
+		AcquireSRWLockExclusive(&g_sector_locks[lock1]);
+	if (lock2 >= 0)
+		AcquireSRWLockExclusive(&g_sector_locks[lock2]);
+
+	// A padded tail sector that goes past end of file extends the file to
+	// end, which has to be cut back to where this write's data ends.  Nothing
+	// else may change the size between reading it and cutting it back, or a
+	// concurrent extending write would be truncated, so that is done holding
+	// the extend lock exclusively.  Other writes hold it shared.  The extend
+	// lock is always taken after the sector locks.
+
+	SRWLOCK *extend_lock = ExtendLock();
+	bool exclusive = false;
+
+	AcquireSRWLockShared(extend_lock);
+
+	BOOL bRet = TRUE;
+
+	try {
+		LONGLONG file_size;
+
+		if (!GetSize(file_size))
+			throw(-1);
+
+		if (partial_tail && end > file_size) {
+			ReleaseSRWLockShared(extend_lock);
+			AcquireSRWLockExclusive(extend_lock);
+			exclusive = true;
+			// it may have grown while the lock was released
+			if (!GetSize(file_size))
+				throw(-1);
+		}
+
+		DWORD nread;
+
+		if (partial_head) {
+			memset(p, 0, DIRECT_IO_ALIGNMENT);
+			if (!ReadAt(start, p, DIRECT_IO_ALIGNMENT, &nread))
+				throw(-1);
+		}
+
+		if (partial_tail && (end - DIRECT_IO_ALIGNMENT != start || !partial_head)) {
+			memset(p + span - DIRECT_IO_ALIGNMENT, 0, DIRECT_IO_ALIGNMENT);
+			if (!ReadAt(end - DIRECT_IO_ALIGNMENT, p + span - DIRECT_IO_ALIGNMENT, DIRECT_IO_ALIGNMENT, &nread))
+				throw(-1);
+		}
+
+		memcpy(p + (offset - start), buf, len);
+
+		DWORD nwritten = 0;
+
+		if (!RawWriteAt(start, p, span, &nwritten) || nwritten != span)
+			throw(-1);
+
+		// Writing whole sectors may have extended the file past where the data
+		// ends.  The size can't have changed since file_size was read, so this
+		// only ever cuts off the padding this write added.
+		if (exclusive && end > file_size) {
+			if (!RawSetSize(max(file_size, offset + len)))
+				throw(-1);
+		}
+
+		*pNwritten = len;
+
+	} catch (...) {
+		bRet = FALSE;
+	}
+
+	if (exclusive)
+		ReleaseSRWLockExclusive(extend_lock);
+	else
+		ReleaseSRWLockShared(extend_lock);
+
+	if (lock2 >= 0)
+		ReleaseSRWLockExclusive(&g_sector_locks[lock2]);
+	if (lock1 >= 0)
+		ReleaseSRWLockExclusive(&g_sector_locks[lock1]);
+
+	IoBufferPool::getInstance()->ReleaseIoBuffer(bounce);
+
+	return bRet;
+}
+
+BOOL
+HandleIoBackend::GetSize(LONGLONG& size)
+{
+	LARGE_INTEGER l;
+
+	if (!GetFileSizeEx(m_handle, &l))
+		return FALSE;
+
+	size = l.QuadPart;
+
+	return TRUE;
+}
+
+BOOL
+HandleIoBackend::SetSize(LONGLONG size)
+{
+	if (!m_direct)
+		return RawSetSize(size);
+
+	AcquireSRWLockExclusive(ExtendLock());
+
+	BOOL bRet = RawSetSize(size);
+
+	ReleaseSRWLockExclusive(ExtendLock());
+
+	return bRet;
+}
+
+BOOL
+HandleIoBackend::RawSetSize(LONGLONG size)
+{
+	FILE_END_OF_FILE_INFO eof;
+
+	eof.EndOfFile.QuadPart = size;
+
+	return SetFileInformationByHandle(m_handle, FileEndOfFileInfo, &eof, sizeof(eof));
+}
+
+BOOL
+HandleIoBackend::Lock(LONGLONG offset, LONGLONG len)
+{
+	LARGE_INTEGER off, l;
+
+	off.QuadPart = offset;
+	l.QuadPart = len;
+
+	return ::LockFile(m_handle, off.LowPart, off.HighPart, l.LowPart, l.HighPart);
+}
+
+BOOL
+HandleIoBackend::Unlock(LONGLONG offset, LONGLONG len)
+{
+	LARGE_INTEGER off, l;
+
+	off.QuadPart = offset;
+	l.QuadPart = len;
+
+	return ::UnlockFile(m_handle, off.LowPart, off.HighPart, l.LowPart, l.HighPart);
+}
+
+BOOL
+HandleIoBackend::SetSparse()
+{
+	DWORD nret;
+
+	return DeviceIoControl(m_handle, FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &nret, NULL);
+}
+
+BOOL
+HandleIoBackend::PunchHole(LONGLONG offset, LONGLONG len)
+{
+	FILE_ZERO_DATA_INFORMATION zero;
+
+	zero.FileOffset.QuadPart = offset;
+	zero.BeyondFinalZero.QuadPart = offset + len;
+
+	DWORD nret;
+
+	return DeviceIoControl(m_handle, FSCTL_SET_ZERO_DATA, &zero, sizeof(zero), NULL, 0, &nret, NULL);
+}
+
+BOOL
+MemoryIoBackend::ReadAt(LONGLONG offset, void *buf, DWORD len, LPDWORD pNread)
+{
+	if (offset < 0) {
+		SetLastError(ERROR_NEGATIVE_SEEK);
+		return FALSE;
+	}
+
+	AcquireSRWLockShared(&m_lock);
+
+	DWORD n = 0;
+
+	if (offset < (LONGLONG)m_data.size())
+		n = (DWORD)min((LONGLONG)len, (LONGLONG)m_data.size() - offset);
+
+	if (n)
+		memcpy(buf, &m_data[(size_t)offset], n);
+
+	ReleaseSRWLockShared(&m_lock);
+
+	*pNread = n;
+
+	return TRUE;
+}
+
+BOOL
+MemoryIoBackend::WriteAt(LONGLONG offset, const void *buf, DWORD len, LPDWORD pNwritten)
+{
+	*pNwritten = 0;
+
+	if (offset < 0) {
+		SetLastError(ERROR_NEGATIVE_SEEK);
+		return FALSE;
+	}
+
+	BOOL bRet = TRUE;
+
+	AcquireSRWLockExclusive(&m_lock);
+
+	try {
+		if (offset + (LONGLONG)len > (LONGLONG)m_data.size())
+			m_data.resize((size_t)(offset + (LONGLONG)len));
+		if (len)
+			memcpy(&m_data[(size_t)offset], buf, len);
+		*pNwritten = len;
+	} catch (...) {
+		SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+		bRet = FALSE;
+	}
+
+	ReleaseSRWLockExclusive(&m_lock);
+
+	return bRet;
+}
+
+BOOL
+MemoryIoBackend::GetSize(LONGLONG& size)
+{
+	AcquireSRWLockShared(&m_lock);
+
+	size = (LONGLONG)m_data.size();
+
+	ReleaseSRWLockShared(&m_lock);
+
+	return TRUE;
+}
+
+BOOL
+MemoryIoBackend::SetSize(LONGLONG size)
+{
+	if (size < 0) {
+		SetLastError(ERROR_NEGATIVE_SEEK);
+		return FALSE;
+	}
+
+	BOOL bRet = TRUE;
+
+	AcquireSRWLockExclusive(&m_lock);
+
+	try {
+		m_data.resize((size_t)size);
+	} catch (...) {
+		SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+		bRet = FALSE;
+	}
+
+	ReleaseSRWLockExclusive(&m_lock);
+
+	return bRet;
+}
+
+BOOL
+MemoryIoBackend::PunchHole(LONGLONG offset, LONGLONG len)
+{
+	AcquireSRWLockExclusive(&m_lock);
+
+	if (offset >= 0 && offset < (LONGLONG)m_data.size()) {
+		len = min(len, (LONGLONG)m_data.size() - offset);
+		if (len > 0)
+			memset(&m_data[(size_t)offset], 0, (size_t)len);
+	}
+
+	ReleaseSRWLockExclusive(&m_lock);
+
+	return TRUE;
+}
@@ -0,0 +1,248 @@
+/*
+cppcryptfs : user-mode cryptographic virtual overlay filesystem.
+
+Copyright (C) 2016-2018 Bailey Brown (github.com/bailey27/cppcryptfs)
+
+cppcryptfs is based on the design of gocryptfs (github.com/rfjakob/gocryptfs)
+
+The MIT License (MIT)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#pragma once
+
+#include <windows.h>
+
+#include <vector>
+
+class PerfStats;
+
+// ReadSpan() and WriteSpan() cut transfers at multiples of this offset
+#define IO_SPAN_SEGMENT (64 * 1024)
+
+// most requests a batch has in flight at once
+#define IO_BATCH_DEPTH 16
+
+// One positioned transfer.  Used for submitting several reads or
+// writes to a backend at once.
+
+typedef struct struct_IoRequest {
+	LONGLONG offset;
+	void *buf;
+	DWORD len;
+	DWORD transferred;
+} IoRequest;
+
+// IoBackend is the storage interface that CryptFile and the block routines
+// in cryptio.cpp do their ciphertext I/O through.
+//
+// All transfers are positioned (they take an explicit offset), so no
+// file pointer state is shared between callers, and a backend is free to
+// have more than one request in flight.  The batch methods let a backend
+// that supports asynchronous submission queue a whole span of blocks at once.
+// The default implementations just issue the requests one after another.
+//
+// ReadSpan() and WriteSpan() split one large contiguous transfer into
+// IO_SPAN_SEGMENT sized requests and pass them to the batch methods, so that
+// a backend with asynchronous submission has several of them in flight.
+
+class IoBackend {
+public:
+
+	virtual BOOL ReadAt(LONGLONG offset, void *buf, DWORD len, LPDWORD pNread) = 0;
+
+	virtual BOOL WriteAt(LONGLONG offset, const void *buf, DWORD len, LPDWORD pNwritten) = 0;
+
+	virtual BOOL ReadBatch(IoRequest *reqs, int count);
+
+	virtual BOOL WriteBatch(IoRequest *reqs, int count);
+
+	// *pNread is short only at end of file
+	virtual BOOL ReadSpan(LONGLONG offset, void *buf, DWORD len, LPDWORD pNread);
+
+	virtual BOOL WriteSpan(LONGLONG offset, const void *buf, DWORD len, LPDWORD pNwritten);
+
+	virtual BOOL GetSize(LONGLONG& size) = 0;
+
+	virtual BOOL SetSize(LONGLONG size) = 0;
+
+	virtual BOOL Lock(LONGLONG offset, LONGLONG len) = 0;
+
+	virtual BOOL Unlock(LONGLONG offset, LONGLONG len) = 0;
+
+	// Marks the storage as sparse, so that ranges passed to PunchHole() and
+	// growth from SetSize() don't take up space.  Backends that can't do
+	// this fail with ERROR_NOT_SUPPORTED.
+	virtual BOOL SetSparse() { SetLastError(ERROR_NOT_SUPPORTED); return FALSE; };
+
+	// Zeroes [offset, offset + len) and deallocates the whole allocation
+	// units within it.
+	virtual BOOL PunchHole(LONGLONG offset, LONGLONG len) { SetLastError(ERROR_NOT_SUPPORTED); return FALSE; };
+
+	// returns INVALID_HANDLE_VALUE if the backend is not backed by a Win32 handle
+	virtual HANDLE GetHandle() { return INVALID_HANDLE_VALUE; };
+
+	// disallow copying
+	IoBackend(IoBackend const&) = delete;
+	void operator=(IoBackend const&) = delete;
+
+	IoBackend() {};
+	virtual ~IoBackend() {};
+};
+
+// Offsets, lengths and buffer addresses used with a handle opened with
+// FILE_FLAG_NO_BUFFERING must be multiples of the volume sector size.
+// 4096 is a multiple of every sector size in common use.
+#define DIRECT_IO_ALIGNMENT 4096
+
+// The default backend.  Does synchronous I/O on a Win32 file handle.
+// Reads and writes pass the offset in an OVERLAPPED structure,
+// which saves the SetFilePointerEx() call per transfer.
+//
+// In batch mode, a batch of more than one request is issued as overlapped
+// I/O on a second handle to the file (opened with ReOpenFile() and
+// FILE_FLAG_OVERLAPPED the first time a batch needs it), with up to
+// IO_BATCH_DEPTH requests in flight.  If the file can't be reopened (e.g.
+// because of its sharing mode), the requests are issued one at a time.
+//
+// In direct mode (used when the handle was opened with FILE_FLAG_NO_BUFFERING),
+// unaligned transfers are rounded out to sector boundaries and done through
+// a page-aligned bounce buffer from the IoBufferPool.  Partial sectors at the
+// ends of a write are read, modified and written back.  A padded write that
+// extends the file cuts it back to where its data ends while holding the
+// extend lock exclusively, and other writes and size changes hold it too, so
+// the cut never truncates another write.  The extend lock must be shared by
+// every backend on the same file (see SetExtendLock()).
+
+class HandleIoBackend : public IoBackend {
+private:
+	HANDLE m_handle;
+	bool m_direct;
+	bool m_batch;
+	PerfStats *m_stats;
+	SRWLOCK *m_extend_lock;
+	ULONGLONG m_trace_file;
+
+	// the overlapped handle batches use, and the access it was opened with
+	HANDLE m_async;
+	DWORD m_async_access;
+	HANDLE m_events[IO_BATCH_DEPTH];
+
+	BOOL DirectReadAt(LONGLONG offset, void *buf, DWORD len, LPDWORD pNread);
+	BOOL DirectWriteAt(LONGLONG offset, const void *buf, DWORD len, LPDWORD pNwritten);
+
+	// WriteAt() and SetSize() without the extend lock
+	BOOL RawWriteAt(LONGLONG offset, const void *buf, DWORD len, LPDWORD pNwritten);
+	BOOL RawSetSize(LONGLONG size);
+
+	SRWLOCK *ExtendLock();
+
+	bool CanBatch(const IoRequest *reqs, int count, DWORD access);
+	BOOL IssueBatch(IoRequest *reqs, int count, bool write);
+	void CloseAsync();
+public:
+
+	void SetHandle(HANDLE h) { CloseAsync(); m_handle = h; };
+
+	void SetDirect(bool direct) { m_direct = direct; };
+
+	void SetBatch(bool batch) { m_batch = batch; };
+
+	// Direct mode size changes are serialized with this lock, which should
+	// belong to the file (OpenFile::m_extend_lock).  Without one, a lock
+	// picked by handle is used, which only covers writes through this handle.
+	void SetExtendLock(SRWLOCK *lock) { m_extend_lock = lock; };
+
+	// transfers are timed as PERF_BACKING_IO if stats isn't NULL
+	void SetStats(PerfStats *stats) { m_stats = stats; };
+
+	// what identifies the file in trace events (see TraceRecord::file)
+	void SetTraceFile(ULONGLONG file) { m_trace_file = file; };
+
+	virtual HANDLE GetHandle() { return m_handle; };
+
+	virtual BOOL ReadAt(LONGLONG offset, void *buf, DWORD len, LPDWORD pNread);
+
+	virtual BOOL WriteAt(LONGLONG offset, const void *buf, DWORD len, LPDWORD pNwritten);
+
+	virtual BOOL ReadBatch(IoRequest *reqs, int count);
+
+	virtual BOOL WriteBatch(IoRequest *reqs, int count);
+
+	// a span that won't be batched is done as one transfer
+	virtual BOOL ReadSpan(LONGLONG offset, void *buf, DWORD len, LPDWORD pNread);
+
+	virtual BOOL WriteSpan(LONGLONG offset, const void *buf, DWORD len, LPDWORD pNwritten);
+
+	virtual BOOL GetSize(LONGLONG& size);
+
+	virtual BOOL SetSize(LONGLONG size);
+
+	virtual BOOL Lock(LONGLONG offset, LONGLONG len);
+
+	virtual BOOL Unlock(LONGLONG offset, LONGLONG len);
+
+	virtual BOOL SetSparse();
+
+	virtual BOOL PunchHole(LONGLONG offset, LONGLONG len);
+
+	// disallow copying
+	HandleIoBackend(HandleIoBackend const&) = delete;
+	void operator=(HandleIoBackend const&) = delete;
+
+	HandleIoBackend(HANDLE h = INVALID_HANDLE_VALUE);
+	virtual ~HandleIoBackend(); // closes m_async, but not m_handle
+};
+
+// Keeps the file in memory.  Used to run CryptFile without a disk or a
+// mounted filesystem, e.g. for benchmarking the block engine.  Each
+// transfer is atomic with respect to the others; reads run concurrently
+// and writes and size changes are exclusive.  Byte range locks are no-ops.
+
+class MemoryIoBackend : public IoBackend {
+private:
+	std::vector<BYTE> m_data;
+	SRWLOCK m_lock;
+public:
+
+	virtual BOOL ReadAt(LONGLONG offset, void *buf, DWORD len, LPDWORD pNread);
+
+	virtual BOOL WriteAt(LONGLONG offset, const void *buf, DWORD len, LPDWORD pNwritten);
+
+	virtual BOOL GetSize(LONGLONG& size);
+
+	virtual BOOL SetSize(LONGLONG size);
+
+	virtual BOOL Lock(LONGLONG offset, LONGLONG len) { return TRUE; };
+
+	virtual BOOL Unlock(LONGLONG offset, LONGLONG len) { return TRUE; };
+
+	virtual BOOL SetSparse() { return TRUE; };
+
+	virtual BOOL PunchHole(LONGLONG offset, LONGLONG len);
+
+	// disallow copying
+	MemoryIoBackend(MemoryIoBackend const&) = delete;
+	void operator=(MemoryIoBackend const&) = delete;
+
+	MemoryIoBackend() { InitializeSRWLock(&m_lock); };
+	virtual ~MemoryIoBackend() {};
+};
@@ -26,94 +26,364 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 THE SOFTWARE.
 */
 
+
 #include "stdafx.h"
 #include "iobufferpool.h"
 
-IoBuffer::IoBuffer(bool fromPool, size_t bufferSize)
+/*
+	Buffers come from one of three places, tried in order:
+
+	1. the calling thread's magazine (a small per-thread cache that needs no synchronization)
+	2. the global depot for the buffer's size class (a lock-free SLIST)
+	3. the heap
+
+	When a buffer is released it goes back to the thread's magazine, or to
+	the depot if the magazine is full.  Pooled buffers are never freed on
+	the I/O path.  Every IO_BUFFER_TRIM_INTERVAL ms, buffers in each depot
+	beyond the peak number that were in use at once since the last trim
+	are given back to the heap.  A trim also bumps m_flush_gen, and each
+	thread empties its magazine into the depot the next time it uses the
+	pool, so buffers cached by threads are released by the following trim.
+
+	The per-thread hit counters are plain (non-interlocked) counters in the
+	magazine.  GetStats() sums them over the registered magazines.
+*/
+
+class IoBufferPoolMagazine {
+public:
+	IoBuffer *m_bufs[IO_BUFFER_NUM_CLASSES][IO_BUFFER_MAGAZINE_SIZE];
+	int m_count[IO_BUFFER_NUM_CLASSES];
+
+	LONG m_flush_gen;
+
+	// only written by the owning thread
+	volatile LONGLONG m_gets;
+	volatile LONGLONG m_magazine_hits;
+	volatile LONGLONG m_depot_hits;
+
+	IoBufferPoolMagazine *m_prev;
+	IoBufferPoolMagazine *m_next;
+
+	IoBufferPoolMagazine()
+	{
+		memset(m_bufs, 0, sizeof(m_bufs));
+		memset(m_count, 0, sizeof(m_count));
+		m_gets = 0;
+		m_magazine_hits = 0;
+		m_depot_hits = 0;
+		m_prev = NULL;
+		m_next = NULL;
+		IoBufferPool *pool = IoBufferPool::getInstance();
+		m_flush_gen = pool->m_flush_gen;
+		pool->add_magazine(this);
+	}
+
+	// return cached buffers to the depot when the thread exits
+	~IoBufferPoolMagazine()
+	{
+		IoBufferPool *pool = IoBufferPool::getInstance();
+		pool->flush_magazine(this);
+		pool->remove_magazine(this);
+	}
+
+	// disallow copying
+	IoBufferPoolMagazine(IoBufferPoolMagazine const&) = delete;
+	void operator=(IoBufferPoolMagazine const&) = delete;
+};
+
+static thread_local IoBufferPoolMagazine t_magazine;
+
+void *IoBuffer::operator new(size_t size)
+{
+	void *p = _aligned_malloc(size, MEMORY_ALLOCATION_ALIGNMENT);
+	if (!p)
+		throw std::bad_alloc();
+	return p;
+}
+
+void IoBuffer::operator delete(void *p)
+{
+	_aligned_free(p);
+}
+
+IoBuffer::IoBuffer(bool fromPool, size_t bufferSize, int sizeClass)
 {
+	m_entry.Next = NULL;
 	m_bIsFromPool = fromPool;
 	m_bufferSize = bufferSize;
-	m_pBuf = NULL;
-	m_pBuf = new unsigned char[bufferSize];
+	m_sizeClass = sizeClass;
+	m_pBuf = (unsigned char*)_aligned_malloc(bufferSize, IO_BUFFER_ALIGNMENT);
+	if (!m_pBuf)
+		throw std::bad_alloc();
 }
 
 IoBuffer::~IoBuffer()
 {
 	if (m_pBuf)
-		delete[] m_pBuf;
+		_aligned_free(m_pBuf);
 }
 
-void IoBufferPool::lock()
+IoBufferPool::IoBufferPool()
 {
-	EnterCriticalSection(&m_crit);
+	static_assert(IO_BUFFER_MAX_SIZE == 8 * 1024 * 1024, "IO_BUFFER_MAX_SIZE != 8MB");
+
+	for (int sc = 0; sc < IO_BUFFER_NUM_CLASSES; sc++) {
+		InitializeSListHead(&m_classes[sc].m_depot);
+		m_classes[sc].m_in_use = 0;
+		m_classes[sc].m_high_water = 0;
+		m_classes[sc].m_total = 0;
+	}
+
+	m_last_trim = (LONGLONG)GetTickCount64();
+
+	m_flush_gen = 0;
+
+	InitializeCriticalSection(&m_magazines_lock);
+	m_magazines = NULL;
+
+	m_retired_gets = 0;
+	m_retired_magazine_hits = 0;
+	m_retired_depot_hits = 0;
+
+	m_allocs = 0;
+	m_fallbacks = 0;
+	m_trimmed = 0;
+	m_bytes_pooled = 0;
 }
 
-void IoBufferPool::unlock()
+IoBufferPool::~IoBufferPool()
 {
-	LeaveCriticalSection(&m_crit);
+	for (int sc = 0; sc < IO_BUFFER_NUM_CLASSES; sc++) {
+		IoBuffer *pBuf;
+		while ((pBuf = depot_pop(sc)) != NULL) {
+			delete pBuf;
+		}
+	}
+
+	DeleteCriticalSection(&m_magazines_lock);
 }
 
-void IoBufferPool::init(size_t buffer_size)
+int IoBufferPool::size_class(size_t buffer_size)
 {
-	if (buffer_size == 0) {
-		throw std::runtime_error("error: attempting to init IoBufferPool with buffer_size of 0");
-	}
-	m_buffer_size = buffer_size;
-	m_num_buffers = 0;
-	InitializeCriticalSection(&m_crit);
+	if (buffer_size > IO_BUFFER_MAX_SIZE)
+		return -1;
+
+	int sc = 0;
+
+	while (class_size(sc) < buffer_size)
+		sc++;
+
+	return sc;
 }
 
-IoBufferPool::~IoBufferPool()
+void IoBufferPool::depot_push(IoBuffer *pBuf)
 {
-	for (IoBuffer* pBuf : m_buffers) {
-		delete pBuf;
-	}
+	InterlockedPushEntrySList(&m_classes[pBuf->m_sizeClass].m_depot, &pBuf->m_entry);
+}
 
-	if (m_buffer_size) { // was initialized
-		DeleteCriticalSection(&m_crit);
+IoBuffer *IoBufferPool::depot_pop(int sc)
+{
+	PSLIST_ENTRY entry = InterlockedPopEntrySList(&m_classes[sc].m_depot);
+
+	if (!entry)
+		return NULL;
+
+	// IoBuffer has a vtable, so m_entry is not at offset 0
+	return CONTAINING_RECORD(entry, IoBuffer, m_entry);
+}
+
+void IoBufferPool::free_buffer(IoBuffer *pBuf)
+{
+	InterlockedDecrement(&m_classes[pBuf->m_sizeClass].m_total);
+	InterlockedAdd64(&m_bytes_pooled, -(LONGLONG)pBuf->m_bufferSize);
+	delete pBuf;
+}
+
+void IoBufferPool::flush_magazine(IoBufferPoolMagazine *mag)
+{
+	for (int sc = 0; sc < IO_BUFFER_NUM_CLASSES; sc++) {
+		while (mag->m_count[sc] > 0) {
+			IoBuffer *pBuf = mag->m_bufs[sc][--mag->m_count[sc]];
+			mag->m_bufs[sc][mag->m_count[sc]] = NULL;
+			InterlockedDecrement(&m_classes[sc].m_in_use);
+			depot_push(pBuf);
+		}
 	}
+
+	mag->m_flush_gen = m_flush_gen;
+}
+
+void IoBufferPool::add_magazine(IoBufferPoolMagazine *mag)
+{
+	EnterCriticalSection(&m_magazines_lock);
+
+	mag->m_prev = NULL;
+	mag->m_next = m_magazines;
+	if (m_magazines)
+		m_magazines->m_prev = mag;
+	m_magazines = mag;
+
+	LeaveCriticalSection(&m_magazines_lock);
+}
+
+void IoBufferPool::remove_magazine(IoBufferPoolMagazine *mag)
+{
+	EnterCriticalSection(&m_magazines_lock);
+
+	if (mag->m_prev)
+		mag->m_prev->m_next = mag->m_next;
+	else
+		m_magazines = mag->m_next;
+	if (mag->m_next)
+		mag->m_next->m_prev = mag->m_prev;
+
+	m_retired_gets += mag->m_gets;
+	m_retired_magazine_hits += mag->m_magazine_hits;
+	m_retired_depot_hits += mag->m_depot_hits;
+
+	LeaveCriticalSection(&m_magazines_lock);
 }
 
 IoBuffer * IoBufferPool::GetIoBuffer(size_t buffer_size)
 {
 	IoBuffer *pb = NULL;
 
-	if (buffer_size <= m_buffer_size) {
-		lock();
+	IoBufferPoolMagazine& mag = t_magazine;
+
+	mag.m_gets++;
+
+	if (mag.m_flush_gen != m_flush_gen)
+		flush_magazine(&mag);
+
+	int sc = size_class(buffer_size);
+
+	if (sc < 0) {
+		InterlockedIncrement64(&m_fallbacks);
 		try {
-			if (m_buffers.size() > 0) {
-				pb = m_buffers.front();
-				m_buffers.pop_front();
-			} else if (m_num_buffers < m_max_buffers) {
-				pb = new IoBuffer(true, m_buffer_size);
-				m_num_buffers++;
-			}
+			pb = new IoBuffer(false, buffer_size);
 		} catch (...) {
 			pb = NULL;
 		}
-		unlock();
-	} 
-	if (pb == NULL) {
+		return pb;
+	}
+
+	if (mag.m_count[sc] > 0) {
+		pb = mag.m_bufs[sc][--mag.m_count[sc]];
+		mag.m_magazine_hits++;
+		return pb;
+	}
+
+	SizeClass& cls = m_classes[sc];
+
+	if ((pb = depot_pop(sc)) != NULL) {
+		mag.m_depot_hits++;
+	} else {
 		try {
-			pb = new IoBuffer(false, buffer_size);
+			pb = new IoBuffer(true, class_size(sc), sc);
 		} catch (...) {
-			pb = NULL;
+			return NULL;
 		}
+		InterlockedIncrement(&cls.m_total);
+		InterlockedIncrement64(&m_allocs);
+		InterlockedAdd64(&m_bytes_pooled, (LONGLONG)pb->m_bufferSize);
 	}
-	
+
+	LONG in_use = InterlockedIncrement(&cls.m_in_use);
+
+	LONG high_water = cls.m_high_water;
+
+	while (in_use > high_water) {
+		LONG prev = InterlockedCompareExchange(&cls.m_high_water, in_use, high_water);
+		if (prev == high_water)
+			break;
+		high_water = prev;
+	}
+
 	return pb;
 }
 
 void IoBufferPool::ReleaseIoBuffer(IoBuffer * pBuf)
 {
+	if (!pBuf)
+		return;
 
-	if (pBuf->m_bIsFromPool) {
-		lock();
-		m_buffers.push_front(pBuf);
-		unlock();
-	} else {
+	if (!pBuf->m_bIsFromPool) {
 		delete pBuf;
+		return;
+	}
+
+	int sc = pBuf->m_sizeClass;
+
+	IoBufferPoolMagazine& mag = t_magazine;
+
+	if (mag.m_flush_gen != m_flush_gen)
+		flush_magazine(&mag);
+
+	if (mag.m_count[sc] < IO_BUFFER_MAGAZINE_SIZE) {
+		mag.m_bufs[sc][mag.m_count[sc]++] = pBuf;
+	} else {
+		InterlockedDecrement(&m_classes[sc].m_in_use);
+		depot_push(pBuf);
+	}
+
+	LONGLONG now = (LONGLONG)GetTickCount64();
+	LONGLONG last = m_last_trim;
+
+	// only the thread that manages to update m_last_trim does the trimming
+	if (now - last >= IO_BUFFER_TRIM_INTERVAL && 
+		InterlockedCompareExchange64(&m_last_trim, now, last) == last) {
+		trim();
 	}
 }
 
+void IoBufferPool::trim()
+{
+	// have every thread give its magazine back to the depot on its next call.
+	// Threads that do not call again keep their (bounded) magazines until
+	// they exit.
+	InterlockedIncrement(&m_flush_gen);
+
+	flush_magazine(&t_magazine);
+
+	for (int sc = 0; sc < IO_BUFFER_NUM_CLASSES; sc++) {
+
+		SizeClass& cls = m_classes[sc];
+
+		// keep as many buffers as were in use at the same time since the last trim
 
+		LONG keep = max(cls.m_high_water, cls.m_in_use);
+
+		while (cls.m_total > keep) {
+			IoBuffer *pBuf = depot_pop(sc);
+			if (!pBuf)
+				break;
+			free_buffer(pBuf);
+			InterlockedIncrement64(&m_trimmed);
+		}
+
+		// start measuring the high-water mark again for the next interval
+		InterlockedExchange(&cls.m_high_water, cls.m_in_use);
+	}
+}
+
+void IoBufferPool::GetStats(IoBufferPoolStats& stats)
+{
+	EnterCriticalSection(&m_magazines_lock);
+
+	stats.gets = m_retired_gets;
+	stats.magazineHits = m_retired_magazine_hits;
+	stats.depotHits = m_retired_depot_hits;
+
+	for (IoBufferPoolMagazine *mag = m_magazines; mag; mag = mag->m_next) {
+		stats.gets += mag->m_gets;
+		stats.magazineHits += mag->m_magazine_hits;
+		stats.depotHits += mag->m_depot_hits;
+	}
+
+	LeaveCriticalSection(&m_magazines_lock);
+
+	stats.allocs = m_allocs;
+	stats.fallbacks = m_fallbacks;
+	stats.trimmed = m_trimmed;
+	stats.bytesPooled = m_bytes_pooled;
+}
@@ -30,58 +30,115 @@ THE SOFTWARE.
 #pragma once
 
 #include <windows.h>
-#include <list>
 
 using namespace std;
 
-class IoBuffer {
+// Buffers are grouped into power-of-two size classes, from 4KB up to 8MB.
+// Requests bigger than the largest class are allocated from the heap and
+// freed on release (these are counted as fallbacks).
+
+#define IO_BUFFER_MIN_CLASS_SHIFT 12
+#define IO_BUFFER_NUM_CLASSES 12
+#define IO_BUFFER_MAX_SIZE ((size_t)1 << (IO_BUFFER_MIN_CLASS_SHIFT + IO_BUFFER_NUM_CLASSES - 1))
+
+// buffer memory is page-aligned so it can be used for unbuffered I/O
+#define IO_BUFFER_ALIGNMENT 4096
+
+// number of buffers of each size class a thread keeps for itself
+#define IO_BUFFER_MAGAZINE_SIZE 4
+
+// how often (in milliseconds) the depots are trimmed down to their high-water marks
+#define IO_BUFFER_TRIM_INTERVAL 30000
+
+// IoBuffer objects are linked into the lock-free depot lists,
+// so they need the alignment required for SLIST_ENTRY
+class DECLSPEC_ALIGN(MEMORY_ALLOCATION_ALIGNMENT) IoBuffer {
 public:
+	SLIST_ENTRY m_entry;
 
 	unsigned char *m_pBuf;
 	size_t m_bufferSize;
 	bool m_bIsFromPool;
+	int m_sizeClass;
+
+	static void *operator new(size_t size);
+	static void operator delete(void *p);
 
 	// disallow copying
 	IoBuffer(IoBuffer const&) = delete;
 	void operator=(IoBuffer const&) = delete;
 
-	IoBuffer(bool fromPool, size_t bufferSize);
+	IoBuffer(bool fromPool, size_t bufferSize, int sizeClass = -1);
 	virtual ~IoBuffer();
 
 };
 
+typedef struct struct_IoBufferPoolStats {
+	long long gets;          // total number of GetIoBuffer() calls
+	long long magazineHits;  // satisfied from the calling thread's magazine
+	long long depotHits;     // satisfied from the global depot
+	long long allocs;        // new pooled buffers allocated from the heap
+	long long fallbacks;     // too big for any size class, so allocated and freed per request
+	long long trimmed;       // pooled buffers freed by high-water-mark trimming
+	long long bytesPooled;   // bytes currently held in pooled buffers (in use or cached)
+} IoBufferPoolStats;
+
+class IoBufferPoolMagazine;
+
 class IoBufferPool {
+	friend class IoBufferPoolMagazine;
 private:
-	CRITICAL_SECTION m_crit;
-	const int m_max_buffers = 10;
-	int m_num_buffers;
-	size_t m_buffer_size;
-	list<IoBuffer*> m_buffers;
-	void lock();
-	void unlock();
 
-	void init(size_t buffer_size);
+	// per size class state.  The depot is a lock-free stack of cached buffers.
+	// Buffers sitting in a thread's magazine count as in use, so taking them
+	// from and returning them to a magazine touches no shared state.
+	struct DECLSPEC_ALIGN(MEMORY_ALLOCATION_ALIGNMENT) SizeClass {
+		SLIST_HEADER m_depot;
+		volatile LONG m_in_use;      // buffers outside the depot (handed out or in a magazine)
+		volatile LONG m_high_water;  // max of m_in_use since last trim
+		volatile LONG m_total;       // buffers of this class that exist
+	};
+
+	SizeClass m_classes[IO_BUFFER_NUM_CLASSES];
 
-	IoBufferPool() { m_buffer_size = 0; }
+	volatile LONGLONG m_last_trim;
+
+	// bumped by trim() to tell every thread to flush its magazine to the depot
+	volatile LONG m_flush_gen;
+
+	// live magazines, so GetStats() can sum their counters
+	CRITICAL_SECTION m_magazines_lock;
+	IoBufferPoolMagazine *m_magazines;
+
+	// counters of magazines whose threads have exited (protected by m_magazines_lock)
+	LONGLONG m_retired_gets;
+	LONGLONG m_retired_magazine_hits;
+	LONGLONG m_retired_depot_hits;
+
+	volatile LONGLONG m_allocs;
+	volatile LONGLONG m_fallbacks;
+	volatile LONGLONG m_trimmed;
+	volatile LONGLONG m_bytes_pooled;
+
+	static int size_class(size_t buffer_size);
+	static size_t class_size(int sc) { return (size_t)1 << (IO_BUFFER_MIN_CLASS_SHIFT + sc); };
+
+	void depot_push(IoBuffer *pBuf);
+	IoBuffer *depot_pop(int sc);
+	void free_buffer(IoBuffer *pBuf);
+	void flush_magazine(IoBufferPoolMagazine *mag);
+	void add_magazine(IoBufferPoolMagazine *mag);
+	void remove_magazine(IoBufferPoolMagazine *mag);
+	void trim();
+
+	IoBufferPool();
 
 public:
 
-	static IoBufferPool* getInstance(size_t buffer_size = 0)
+	static IoBufferPool* getInstance()
 	{
-		static IoBufferPool  instance; 
-
-		// We don't need to care about thread safety with this singleton
-		// because getInstance() is called with an argument only during a mount operation which 
-		// is always initiated from the main thread. If instance.m_buffer_size is not
-		// 0 then init() won't be called again.
-		// The methods that involve IoBuffers are all thread-safe.
-		if (buffer_size == 0 && instance.m_buffer_size == 0) {
-			throw std::runtime_error("error: attempting to use uninitialized IoBufferPool");
-		}
-
-		if (buffer_size != 0 && instance.m_buffer_size == 0) {
-			instance.init(buffer_size);
-		}
+		static IoBufferPool instance;
+
 		return &instance;
 	}
 
@@ -92,4 +149,6 @@ public:
 	virtual ~IoBufferPool();
 	IoBuffer *GetIoBuffer(size_t buffer_size);
 	void ReleaseIoBuffer(IoBuffer *pBuf);
+
+	void GetStats(IoBufferPoolStats& stats);
 };
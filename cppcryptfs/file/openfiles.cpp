@@ -0,0 +1,663 @@
+/*
+cppcryptfs : user-mode cryptographic virtual overlay filesystem.
+
+Copyright (C) 2016-2018 Bailey Brown (github.com/bailey27/cppcryptfs)
+
+cppcryptfs is based on the design of gocryptfs (github.com/rfjakob/gocryptfs)
+
+The MIT License (MIT)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include "stdafx.h"
+
+#include <windows.h>
+#include <winioctl.h>
+
+#include <algorithm>
+
+#include "openfiles.h"
+#include "iobackend.h"
+
+// max number of ranges fetched per DeviceIoControl() call
+#define ALLOCATED_RANGES_PER_QUERY 64
+
+// the files that have a view, and the address space their views take up
+// (see MAPPED_VIEW_BUDGET)
+static SRWLOCK g_views_lock = SRWLOCK_INIT;
+static vector<OpenFile*> g_viewed_files;
+static LONGLONG g_views_size = 0;
+
+// ticks every time a view is used, for finding the least recently used ones
+static volatile LONGLONG g_views_clock = 0;
+
+bool AllocatedRanges::Query(HANDLE hfile, LONGLONG start, LONGLONG len)
+{
+	Clear();
+
+	FILE_ALLOCATED_RANGE_BUFFER in;
+	FILE_ALLOCATED_RANGE_BUFFER out[ALLOCATED_RANGES_PER_QUERY];
+
+	in.FileOffset.QuadPart = start;
+	in.Length.QuadPart = len;
+
+	const LONGLONG end = start + len;
+
+	while (in.Length.QuadPart > 0) {
+
+		DWORD nret = 0;
+
+		BOOL bRet = DeviceIoControl(hfile, FSCTL_QUERY_ALLOCATED_RANGES, &in, sizeof(in), out, sizeof(out), &nret, NULL);
+
+		DWORD error = bRet ? ERROR_SUCCESS : GetLastError();
+
+		if (!bRet && error != ERROR_MORE_DATA) {
+			Clear();
+			return false;
+		}
+
+		DWORD count = nret / sizeof(out[0]);
+
+		for (DWORD i = 0; i < count; i++)
+			m_ranges.push_back(out[i]);
+
+		if (error != ERROR_MORE_DATA || count == 0)
+			break;
+
+		LONGLONG next = out[count - 1].FileOffset.QuadPart + out[count - 1].Length.QuadPart;
+
+		in.FileOffset.QuadPart = next;
+		in.Length.QuadPart = end - next;
+	}
+
+	m_start = start;
+	m_end = end;
+
+	return true;
+}
+
+bool AllocatedRanges::IsAllocated(LONGLONG offset, LONGLONG len) const
+{
+	// anything we don't know about is treated as allocated
+	if (!Covers(offset, len))
+		return true;
+
+	const LONGLONG end = offset + len;
+
+	// the ranges are sorted by offset, so find the first one that ends after offset
+
+	size_t lo = 0;
+	size_t hi = m_ranges.size();
+
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		if (m_ranges[mid].FileOffset.QuadPart + m_ranges[mid].Length.QuadPart <= offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo < m_ranges.size() && m_ranges[lo].FileOffset.QuadPart < end;
+}
+
+BlockRangeLocks::BlockRangeLocks()
+{
+	InitializeSRWLock(&m_lock);
+	InitializeConditionVariable(&m_released);
+	m_next_ticket = 0;
+	m_end_gen = 0;
+}
+
+BlockRangeLocks::~BlockRangeLocks()
+{
+}
+
+// true if the request with the given ticket has to wait for a held lock or
+// for an earlier request that is waiting
+bool BlockRangeLocks::conflicts(LONGLONG first, LONGLONG last, bool exclusive, ULONGLONG ticket) const
+{
+	for (auto& r : m_held) {
+		if (r.first <= last && first <= r.last && (exclusive || r.exclusive))
+			return true;
+	}
+
+	for (auto& r : m_waiting) {
+		if (r.ticket < ticket && r.first <= last && first <= r.last && (exclusive || r.exclusive))
+			return true;
+	}
+
+	return false;
+}
+
+void BlockRangeLocks::remove_waiting(ULONGLONG ticket)
+{
+	for (auto it = m_waiting.begin(); it != m_waiting.end(); it++) {
+		if (it->ticket == ticket) {
+			m_waiting.erase(it);
+			break;
+		}
+	}
+}
+
+void BlockRangeLocks::Lock(LONGLONG first, LONGLONG last, bool exclusive)
+{
+	AcquireSRWLockExclusive(&m_lock);
+
+	ULONGLONG ticket = m_next_ticket++;
+
+	bool waited = false;
+
+	try {
+		if (conflicts(first, last, exclusive, ticket)) {
+			// queue up, so that later requests that conflict with this one wait behind it
+			m_waiting.push_back({ first, last, exclusive, ticket });
+			waited = true;
+			do {
+				SleepConditionVariableSRW(&m_released, &m_lock, INFINITE, 0);
+			} while (conflicts(first, last, exclusive, ticket));
+			// now blocks the requests behind it as a held lock instead
+			remove_waiting(ticket);
+		}
+		m_held.push_back({ first, last, exclusive, ticket });
+	} catch (...) {
+		if (waited)
+			remove_waiting(ticket);
+		ReleaseSRWLockExclusive(&m_lock);
+		if (waited)
+			WakeAllConditionVariable(&m_released);
+		throw;
+	}
+
+	ReleaseSRWLockExclusive(&m_lock);
+}
+
+void BlockRangeLocks::Unlock(LONGLONG first, LONGLONG last, bool exclusive)
+{
+	AcquireSRWLockExclusive(&m_lock);
+
+	for (auto it = m_held.begin(); it != m_held.end(); it++) {
+		if (it->first == first && it->last == last && it->exclusive == exclusive) {
+			m_held.erase(it);
+			break;
+		}
+	}
+
+	// bumped before the lock is released, so whoever takes it next sees the new generation
+	if (exclusive && last == BLOCK_RANGE_END)
+		EndChanged();
+
+	ReleaseSRWLockExclusive(&m_lock);
+
+	WakeAllConditionVariable(&m_released);
+}
+
+void BlockRangeGuard::Lock(BlockRangeLocks *locks, LONGLONG first, LONGLONG last, bool exclusive)
+{
+	Unlock();
+
+	locks->Lock(first, last, exclusive);
+
+	m_locks = locks;
+	m_first = first;
+	m_last = last;
+	m_exclusive = exclusive;
+}
+
+void BlockRangeGuard::Unlock()
+{
+	if (m_locks) {
+		m_locks->Unlock(m_first, m_last, m_exclusive);
+		m_locks = NULL;
+	}
+}
+
+OpenFile::OpenFile(const OpenFileId& id)
+{
+	m_id = id;
+	m_refcount = 0;
+	m_sparse = false;
+	InitializeSRWLock(&m_ranges_lock);
+	m_ranges_gen = 0;
+	InitializeSRWLock(&m_view_lock);
+	m_mapping = NULL;
+	m_mapping_size = 0;
+	m_view_used = 0;
+	InitializeSRWLock(&m_size_lock);
+	m_size = 0;
+	m_size_gen = 0;
+	m_size_valid = false;
+	InitializeSRWLock(&m_extend_lock);
+}
+
+OpenFile::~OpenFile()
+{
+	// the file can still be found in g_viewed_files until its view is dropped
+	AcquireSRWLockExclusive(&m_view_lock);
+	SetView(NULL);
+	ReleaseSRWLockExclusive(&m_view_lock);
+
+	if (m_mapping)
+		CloseHandle(m_mapping);
+}
+
+void OpenFile::SetView(const shared_ptr<MappedView>& view)
+{
+	AcquireSRWLockExclusive(&g_views_lock);
+
+	if (view && !m_view)
+		g_viewed_files.push_back(this);
+	else if (!view && m_view)
+		g_viewed_files.erase(find(g_viewed_files.begin(), g_viewed_files.end(), this));
+
+	g_views_size += (view ? view->m_len : 0) - (m_view ? m_view->m_len : 0);
+
+	ReleaseSRWLockExclusive(&g_views_lock);
+
+	m_view = view;
+}
+
+LONGLONG OpenFile::ReserveView(LONGLONG want, LONGLONG need)
+{
+	AcquireSRWLockExclusive(&g_views_lock);
+
+	const LONGLONG nfiles = (LONGLONG)g_viewed_files.size() + (m_view ? 0 : 1);
+
+	LONGLONG len = max(min(want, max(MAPPED_VIEW_BUDGET / nfiles, (LONGLONG)MAPPED_VIEW_MIN_SIZE)), need);
+
+	// this file's own view is about to be replaced
+	LONGLONG available = MAPPED_VIEW_BUDGET - g_views_size + (m_view ? m_view->m_len : 0);
+
+	if (available < len) {
+		try {
+			vector<OpenFile*> lru;
+
+			for (auto f : g_viewed_files) {
+				if (f != this)
+					lru.push_back(f);
+			}
+
+			sort(lru.begin(), lru.end(), [](const OpenFile *a, const OpenFile *b) { return a->m_view_used < b->m_view_used; });
+
+			for (auto f : lru) {
+				if (available >= len)
+					break;
+
+				// a file that is busy with its own view is skipped rather than
+				// waited for, so two files making room can't deadlock
+				if (!TryAcquireSRWLockExclusive(&f->m_view_lock))
+					continue;
+
+				available += f->m_view->m_len;
+				g_views_size -= f->m_view->m_len;
+				g_viewed_files.erase(find(g_viewed_files.begin(), g_viewed_files.end(), f));
+				f->m_view = NULL;
+
+				ReleaseSRWLockExclusive(&f->m_view_lock);
+			}
+		} catch (...) {
+		}
+	}
+
+	// if the budget can't be freed up, the view is shrunk to what's left
+	len = max(min(len, available), need);
+
+	ReleaseSRWLockExclusive(&g_views_lock);
+
+	return len;
+}
+
+shared_ptr<MappedView> OpenFile::GetView(HANDLE hfile, LONGLONG file_size, LONGLONG offset, LONGLONG len)
+{
+	if (offset >= file_size)
+		return NULL;
+
+	len = min(len, file_size - offset);
+
+	shared_ptr<MappedView> view;
+
+	AcquireSRWLockShared(&m_view_lock);
+
+	if (m_view && m_view->Get(offset, len))
+		view = m_view;
+
+	ReleaseSRWLockShared(&m_view_lock);
+
+	if (view) {
+		m_view_used = InterlockedIncrement64(&g_views_clock);
+		return view;
+	}
+
+	static DWORD granularity = 0;
+
+	if (!granularity) {
+		SYSTEM_INFO si;
+		GetSystemInfo(&si);
+		granularity = si.dwAllocationGranularity;
+	}
+
+	// views start on an allocation granularity boundary
+	LONGLONG view_offset = offset - (offset % granularity);
+
+	AcquireSRWLockExclusive(&m_view_lock);
+
+	try {
+		LONGLONG view_len = ReserveView(min((LONGLONG)MAPPED_VIEW_SIZE, file_size - view_offset), offset + len - view_offset);
+
+		if ((SIZE_T)view_len != view_len)
+			throw(-1);
+
+		// the mapping is recreated when the file has grown past it, so that it
+		// covers all of it
+		if (m_mapping && m_mapping_size < view_offset + view_len) {
+			CloseHandle(m_mapping);
+			m_mapping = NULL;
+		}
+
+		if (!m_mapping) {
+			m_mapping = CreateFileMapping(hfile, NULL, PAGE_READONLY, 0, 0, NULL);
+			m_mapping_size = file_size;
+		}
+
+		if (m_mapping) {
+			view = make_shared<MappedView>();
+
+			view->m_base = (const BYTE*)MapViewOfFile(m_mapping, FILE_MAP_READ, (DWORD)(view_offset >> 32), (DWORD)view_offset, (SIZE_T)view_len);
+
+			if (view->m_base) {
+				view->m_offset = view_offset;
+				view->m_len = view_len;
+				SetView(view);
+				m_view_used = InterlockedIncrement64(&g_views_clock);
+			} else {
+				view = NULL;
+			}
+		}
+	} catch (...) {
+		view = NULL;
+	}
+
+	ReleaseSRWLockExclusive(&m_view_lock);
+
+	return view;
+}
+
+bool OpenFile::GetAllocatedRanges(HANDLE hfile, LONGLONG start, LONGLONG len, AllocatedRanges& ranges)
+{
+	AcquireSRWLockShared(&m_ranges_lock);
+
+	bool cached = m_ranges.Covers(start, len);
+
+	if (cached)
+		ranges = m_ranges;
+
+	ULONGLONG gen = m_ranges_gen;
+
+	ReleaseSRWLockShared(&m_ranges_lock);
+
+	if (cached)
+		return true;
+
+	// query a whole window so that sequential reads of a sparse file
+	// don't each have to make the call
+
+	LONGLONG window_start = start - (start % ALLOCATED_RANGES_WINDOW);
+	LONGLONG window_len = max(start + len - window_start, (LONGLONG)ALLOCATED_RANGES_WINDOW);
+
+	if (!ranges.Query(hfile, window_start, window_len))
+		return false;
+
+	AcquireSRWLockExclusive(&m_ranges_lock);
+
+	// if the file was written to while we were querying, what we got may
+	// already be stale, so use it for this call only
+	if (m_ranges_gen == gen)
+		m_ranges = ranges;
+
+	ReleaseSRWLockExclusive(&m_ranges_lock);
+
+	return true;
+}
+
+void OpenFile::InvalidateRanges()
+{
+	AcquireSRWLockExclusive(&m_ranges_lock);
+
+	m_ranges.Clear();
+	m_ranges_gen++;
+
+	ReleaseSRWLockExclusive(&m_ranges_lock);
+}
+
+bool OpenFile::GetSize(IoBackend *io, LONG gen, LONGLONG& size)
+{
+	AcquireSRWLockShared(&m_size_lock);
+
+	bool cached = m_size_valid && m_size_gen == gen;
+
+	if (cached)
+		size = m_size;
+
+	ReleaseSRWLockShared(&m_size_lock);
+
+	if (cached)
+		return true;
+
+	if (!io->GetSize(size))
+		return false;
+
+	AcquireSRWLockExclusive(&m_size_lock);
+
+	m_size = size;
+	m_size_gen = gen;
+	m_size_valid = true;
+
+	ReleaseSRWLockExclusive(&m_size_lock);
+
+	return true;
+}
+
+OpenFileTable::OpenFileTable()
+{
+	InitializeCriticalSection(&m_crit);
+}
+
+OpenFileTable::~OpenFileTable()
+{
+	for (auto it = m_files.begin(); it != m_files.end(); it++)
+		delete it->second;
+
+	DeleteCriticalSection(&m_crit);
+}
+
+void OpenFileTable::lock()
+{
+	EnterCriticalSection(&m_crit);
+}
+
+void OpenFileTable::unlock()
+{
+	LeaveCriticalSection(&m_crit);
+}
+
+bool OpenFileTable::get_id(HANDLE hfile, OpenFileId& id, DWORD *pAttributes)
+{
+	BY_HANDLE_FILE_INFORMATION info;
+
+	if (!GetFileInformationByHandle(hfile, &info))
+		return false;
+
+	id.volume_serial = info.dwVolumeSerialNumber;
+	id.file_index = ((ULONGLONG)info.nFileIndexHigh << 32) | info.nFileIndexLow;
+
+	if (pAttributes)
+		*pAttributes = info.dwFileAttributes;
+
+	return true;
+}
+
+bool OpenFileTable::Register(HANDLE hfile)
+{
+	if (hfile == NULL || hfile == INVALID_HANDLE_VALUE)
+		return false;
+
+	OpenFileId id;
+	DWORD attributes;
+
+	if (!get_id(hfile, id, &attributes))
+		return false;
+
+	if (attributes & FILE_ATTRIBUTE_DIRECTORY)
+		return false;
+
+	bool bRet = true;
+
+	lock();
+
+	try {
+		OpenFile *file;
+
+		auto it = m_files.find(id);
+
+		if (it != m_files.end()) {
+			file = it->second;
+		} else {
+			file = new OpenFile(id);
+			m_files[id] = file;
+		}
+
+		auto hit = m_handles.find(hfile);
+
+		if (hit == m_handles.end()) {
+			m_handles[hfile] = file;
+			file->m_refcount++;
+		}
+
+		file->m_sparse = (attributes & FILE_ATTRIBUTE_SPARSE_FILE) != 0;
+
+		// the file might have been truncated by the open
+		file->InvalidateRanges();
+		file->m_block_locks.EndChanged();
+	} catch (...) {
+		bRet = false;
+	}
+
+	unlock();
+
+	return bRet;
+}
+
+void OpenFileTable::Unregister(HANDLE hfile)
+{
+	lock();
+
+	auto it = m_handles.find(hfile);
+
+	if (it != m_handles.end()) {
+		OpenFile *file = it->second;
+		m_handles.erase(it);
+		release_locked(file);
+	}
+
+	unlock();
+}
+
+OpenFile *OpenFileTable::Acquire(HANDLE hfile)
+{
+	OpenFile *file = NULL;
+
+	lock();
+
+	auto it = m_handles.find(hfile);
+
+	if (it != m_handles.end()) {
+		file = it->second;
+		file->m_refcount++;
+	}
+
+	unlock();
+
+	if (file)
+		return file;
+
+	// hfile was opened outside of CryptCreateFile(), but the file might still
+	// be open through a registered handle
+
+	OpenFileId id;
+
+	if (!get_id(hfile, id))
+		return NULL;
+
+	lock();
+
+	auto fit = m_files.find(id);
+
+	if (fit != m_files.end()) {
+		file = fit->second;
+		file->m_refcount++;
+	}
+
+	unlock();
+
+	return file;
+}
+
+void OpenFileTable::Release(OpenFile *file)
+{
+	if (!file)
+		return;
+
+	lock();
+
+	release_locked(file);
+
+	unlock();
+}
+
+OpenFile *OpenFileTable::New()
+{
+	OpenFile *file = new OpenFile(OpenFileId());
+
+	file->m_refcount = 1;
+
+	return file;
+}
+
+void OpenFileTable::AddRef(OpenFile *file)
+{
+	lock();
+
+	file->m_refcount++;
+
+	unlock();
+}
+
+void OpenFileTable::release_locked(OpenFile *file)
+{
+	if (--file->m_refcount > 0)
+		return;
+
+	// files from New() aren't in m_files
+	auto it = m_files.find(file->m_id);
+
+	if (it != m_files.end() && it->second == file)
+		m_files.erase(it);
+
+	delete file;
+}
@@ -0,0 +1,308 @@
+/*
+cppcryptfs : user-mode cryptographic virtual overlay filesystem.
+
+Copyright (C) 2016-2018 Bailey Brown (github.com/bailey27/cppcryptfs)
+
+cppcryptfs is based on the design of gocryptfs (github.com/rfjakob/gocryptfs)
+
+The MIT License (MIT)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#pragma once
+
+#include <windows.h>
+#include <winioctl.h>
+
+#include <unordered_map>
+#include <vector>
+#include <memory>
+
+using namespace std;
+
+class IoBackend;
+
+// size of the window of the backing file whose allocated ranges are queried
+// and cached at once
+#define ALLOCATED_RANGES_WINDOW (16*1024*1024)
+
+// Allocated ranges of part of a sparse backing file, as returned by
+// FSCTL_QUERY_ALLOCATED_RANGES.  Everything in [m_start, m_end) that is not
+// covered by a range is a hole.
+
+class AllocatedRanges {
+public:
+	LONGLONG m_start;
+	LONGLONG m_end;
+	vector<FILE_ALLOCATED_RANGE_BUFFER> m_ranges;
+
+	AllocatedRanges() { m_start = 0; m_end = 0; };
+
+	bool Query(HANDLE hfile, LONGLONG start, LONGLONG len);
+
+	bool Covers(LONGLONG start, LONGLONG len) const { return start >= m_start && start + len <= m_end; };
+
+	// returns true if any part of [offset, offset + len) is allocated
+	bool IsAllocated(LONGLONG offset, LONGLONG len) const;
+
+	void Clear() { m_start = 0; m_end = 0; m_ranges.clear(); };
+};
+
+// Address space the views of all the plaintext files (reverse mode) that are
+// mapped into memory can take up together, and the most one view takes.
+// Views are sized to share the budget among the files that have one, and the
+// least recently used views are unmapped to make room for new ones.
+#ifdef _WIN64
+#define MAPPED_VIEW_BUDGET (1024LL*1024*1024)
+#define MAPPED_VIEW_SIZE (64*1024*1024)
+#else
+#define MAPPED_VIEW_BUDGET (128LL*1024*1024)
+#define MAPPED_VIEW_SIZE (16*1024*1024)
+#endif
+
+// smallest share of the budget a view is given, unless a read needs more
+#define MAPPED_VIEW_MIN_SIZE (1024*1024)
+
+// A read-only view of part of a file mapped into memory.  Reads hold a
+// reference to the view they use, so a view that has been replaced (because
+// the window slid, the file grew or the view was evicted) stays mapped until
+// they finish.
+
+class MappedView {
+public:
+	const BYTE *m_base;
+	LONGLONG m_offset;    // file offset of m_base
+	LONGLONG m_len;
+
+	// returns a pointer to [offset, offset + len) if it's in the view
+	const BYTE *Get(LONGLONG offset, LONGLONG len) const
+	{
+		return offset >= m_offset && offset + len <= m_offset + m_len ? m_base + (offset - m_offset) : NULL;
+	};
+
+	// disallow copying
+	MappedView(MappedView const&) = delete;
+	void operator=(MappedView const&) = delete;
+
+	MappedView() { m_base = NULL; m_offset = 0; m_len = 0; };
+	virtual ~MappedView() { if (m_base) UnmapViewOfFile(m_base); };
+};
+
+// last block of a lock that runs to the end of the file, however far it grows
+#define BLOCK_RANGE_END MAXLONGLONG
+
+// Locks on ranges [first, last] of the plaintext blocks of a file.  Shared
+// locks can overlap each other, but an exclusive lock waits for, and keeps
+// out, every lock that overlaps it.  Locks on ranges that don't overlap never
+// wait for each other.
+//
+// Conflicting requests are granted in the order they were made: a request
+// also waits for the earlier requests that are still waiting and that it
+// conflicts with, so a steady stream of readers can't starve a writer, and
+// the other way around.
+
+class BlockRangeLocks {
+	struct Range {
+		LONGLONG first;
+		LONGLONG last;
+		bool exclusive;
+		ULONGLONG ticket; // order the lock was requested in
+	};
+
+	SRWLOCK m_lock;
+	CONDITION_VARIABLE m_released;
+	vector<Range> m_held;
+	vector<Range> m_waiting;
+	ULONGLONG m_next_ticket;
+
+	volatile LONG m_end_gen;
+
+	bool conflicts(LONGLONG first, LONGLONG last, bool exclusive, ULONGLONG ticket) const;
+	void remove_waiting(ULONGLONG ticket);
+public:
+	void Lock(LONGLONG first, LONGLONG last, bool exclusive);
+	void Unlock(LONGLONG first, LONGLONG last, bool exclusive);
+
+	// The size of a file, and the header of an empty one, only change under an
+	// exclusive lock that reaches BLOCK_RANGE_END.  The end generation is
+	// bumped when such a lock is released, or by EndChanged() when the file
+	// is changed some other way (e.g. truncated by an open).
+	LONG EndGeneration() const { return m_end_gen; };
+	void EndChanged() { InterlockedIncrement(&m_end_gen); };
+
+	// disallow copying
+	BlockRangeLocks(BlockRangeLocks const&) = delete;
+	void operator=(BlockRangeLocks const&) = delete;
+
+	BlockRangeLocks();
+	virtual ~BlockRangeLocks();
+};
+
+// holds at most one lock from a BlockRangeLocks and releases it when destroyed
+
+class BlockRangeGuard {
+	BlockRangeLocks *m_locks;
+	LONGLONG m_first;
+	LONGLONG m_last;
+	bool m_exclusive;
+public:
+	void Lock(BlockRangeLocks *locks, LONGLONG first, LONGLONG last, bool exclusive);
+	void Unlock();
+
+	// disallow copying
+	BlockRangeGuard(BlockRangeGuard const&) = delete;
+	void operator=(BlockRangeGuard const&) = delete;
+
+	BlockRangeGuard() { m_locks = NULL; m_first = 0; m_last = 0; m_exclusive = false; };
+	virtual ~BlockRangeGuard() { Unlock(); };
+};
+
+// identity of a backing file (not of a handle to it)
+
+struct OpenFileId {
+	DWORD volume_serial;
+	ULONGLONG file_index;
+
+	bool operator==(const OpenFileId& other) const
+	{
+		return volume_serial == other.volume_serial && file_index == other.file_index;
+	}
+};
+
+struct OpenFileIdHash {
+	size_t operator()(const OpenFileId& id) const
+	{
+		return hash<ULONGLONG>()(id.file_index) ^ id.volume_serial;
+	}
+};
+
+// State shared by all handles open on the same backing file.  Entries are
+// reference counted by OpenFileTable.
+
+class OpenFile {
+	friend class OpenFileTable;
+
+	OpenFileId m_id;
+	int m_refcount;
+
+	SRWLOCK m_ranges_lock;
+	AllocatedRanges m_ranges;
+	ULONGLONG m_ranges_gen; // bumped by InvalidateRanges()
+
+	SRWLOCK m_view_lock;
+	HANDLE m_mapping;
+	LONGLONG m_mapping_size;
+	shared_ptr<MappedView> m_view;
+	volatile LONGLONG m_view_used; // view clock when m_view was last used
+
+	// replaces m_view, keeping count of the address space all views take up.
+	// m_view_lock must be held exclusive.
+	void SetView(const shared_ptr<MappedView>& view);
+
+	// Returns the length of a new view, which is want bytes or the file's
+	// share of the view budget, whichever is less, but at least need bytes.
+	// Unmaps the least recently used views of other files to make room for it.
+	// m_view_lock must be held exclusive.
+	LONGLONG ReserveView(LONGLONG want, LONGLONG need);
+
+	SRWLOCK m_size_lock;
+	LONGLONG m_size;
+	LONG m_size_gen; // end generation m_size was read at
+	bool m_size_valid;
+public:
+	volatile bool m_sparse; // backing file has FILE_ATTRIBUTE_SPARSE_FILE
+
+	// file index of the backing file, or 0 if it isn't in the table
+	ULONGLONG FileIndex() const { return m_id.file_index; };
+
+	// the direct mode extend lock of the handles to the file (see HandleIoBackend)
+	SRWLOCK m_extend_lock;
+
+	// serializes reads and writes of the same blocks through different handles
+	BlockRangeLocks m_block_locks;
+
+	// copies the allocated ranges covering [start, start + len) into ranges,
+	// querying the backing file if they aren't cached
+	bool GetAllocatedRanges(HANDLE hfile, LONGLONG start, LONGLONG len, AllocatedRanges& ranges);
+
+	// must be called whenever the backing file is written to or resized
+	void InvalidateRanges();
+
+	// gets the size of the backing file as of end generation gen of
+	// m_block_locks.  Handles that see the same generation share one query.
+	bool GetSize(IoBackend *io, LONG gen, LONGLONG& size);
+
+	// Returns a view of the file, whose size is file_size, that contains
+	// [offset, offset + len) clipped to EOF.  The file is mapped, or the view
+	// moved, if necessary.  Handles that see different sizes share the view
+	// as long as it covers what they read.  Returns NULL if the file can't be
+	// mapped.
+	shared_ptr<MappedView> GetView(HANDLE hfile, LONGLONG file_size, LONGLONG offset, LONGLONG len);
+
+	// disallow copying
+	OpenFile(OpenFile const&) = delete;
+	void operator=(OpenFile const&) = delete;
+
+	OpenFile(const OpenFileId& id);
+	virtual ~OpenFile();
+};
+
+// Maps the handles CryptCreateFile() opens to the OpenFile of the file they
+// refer to.
+
+class OpenFileTable {
+private:
+	unordered_map<OpenFileId, OpenFile*, OpenFileIdHash> m_files;
+	unordered_map<HANDLE, OpenFile*> m_handles;
+
+	CRITICAL_SECTION m_crit;
+
+	void lock();
+	void unlock();
+
+	static bool get_id(HANDLE hfile, OpenFileId& id, DWORD *pAttributes = NULL);
+
+	void release_locked(OpenFile *file);
+public:
+	// disallow copying
+	OpenFileTable(OpenFileTable const&) = delete;
+	void operator=(OpenFileTable const&) = delete;
+
+	OpenFileTable();
+	virtual ~OpenFileTable();
+
+	// called after a file handle is opened and before it is closed
+	bool Register(HANDLE hfile);
+	void Unregister(HANDLE hfile);
+
+	// returns the OpenFile for hfile with a reference held, or NULL
+	// if hfile refers to a file that isn't open through a registered handle.
+	// The reference must be dropped with Release().
+	OpenFile *Acquire(HANDLE hfile);
+	void Release(OpenFile *file);
+
+	// For storage that isn't a Win32 handle (e.g. a MemoryIoBackend).  New()
+	// returns an OpenFile that isn't in the table, with a reference held, and
+	// AddRef() takes another one.  Both are dropped with Release().
+	OpenFile *New();
+	void AddRef(OpenFile *file);
+
+	size_t size() { size_t rval; lock(); rval = m_files.size(); unlock(); return rval; }
+};
@@ -0,0 +1,555 @@
+/*
+cppcryptfs : user-mode cryptographic virtual overlay filesystem.
+
+Copyright (C) 2016-2018 Bailey Brown (github.com/bailey27/cppcryptfs)
+
+cppcryptfs is based on the design of gocryptfs (github.com/rfjakob/gocryptfs)
+
+The MIT License (MIT)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#include "stdafx.h"
+
+#include "cachesim.h"
+#include "dirivcache.h"
+#include "casecache.h"
+#include "longfilenamecache.h"
+#include "cryptfilename.h"
+#include "context/oprecorder.h"
+
+#include <list>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+
+enum {
+	SIM_DIR_IV,
+	SIM_CASE,
+	SIM_LFN,
+	SIM_CACHE_COUNT
+};
+
+static const char * const sim_cache_names[SIM_CACHE_COUNT] = { "dir_iv", "case", "long_filename" };
+
+// what kind of mount each cache is used by
+static const char * const sim_cache_used[SIM_CACHE_COUNT] = { "forward", "case_insensitive", "reverse" };
+
+static const int sim_cache_entries[SIM_CACHE_COUNT] = { DIR_IV_CACHE_ENTRIES, CASE_CACHE_ENTRIES, LFN_CACHE_ENTRIES };
+
+enum {
+	SIM_POLICY_LRU,
+	SIM_POLICY_FIFO,
+	SIM_POLICY_CLOCK,
+	SIM_POLICY_COUNT
+};
+
+static const char * const sim_policy_names[SIM_POLICY_COUNT] = { "lru", "fifo", "clock" };
+
+static const int sim_capacities[] = { 25, 50, 100, 200, 500, 1000, 2000, 5000, 10000, 20000, 50000 };
+
+static const int sim_ttls[] = { 0, 1, 5, 10, 30, 60, 300 };
+
+// length of the encrypted long names that reverse mode presents
+// (the prefix and an unpadded base64 sha256 hash)
+#define SIM_LONG_NAME_LEN (LONGNAME_PREFIX_LEN + 43)
+
+// assumed length of the base dir, which is part of every dir iv cache key
+#define SIM_BASEDIR_LEN 64
+
+// assumed lengths of what a long filename cache entry holds besides its key
+#define SIM_LFN_PATH_LEN 255
+#define SIM_LFN_ENCRYPTED_LEN 340
+
+// Heap bytes per entry apart from the node and its strings: an unordered_map
+// node (two links, the wstring key and the node pointer) and its share of the
+// buckets (two pointers), and an lru list node (two links and the pointer)
+#define SIM_ENTRY_OVERHEAD (2 * sizeof(void*) + sizeof(wstring) + sizeof(void*) + 2 * sizeof(void*) + 3 * sizeof(void*))
+
+// heap bytes per file in a case cache entry: an unordered_map node of two
+// wstrings and its share of the buckets
+#define SIM_CASE_FILE_OVERHEAD (2 * sizeof(void*) + 2 * sizeof(wstring) + 2 * sizeof(void*))
+
+#define SIM_LOOKUP 0
+#define SIM_REMOVE 1
+#define SIM_MODIFY 2  // a directory's contents changed
+
+struct SimAccess {
+	ULONGLONG key;
+	ULONGLONG ms;
+	int type;
+};
+
+// heap bytes of a wstring of len characters (short strings are kept in the
+// wstring itself)
+static size_t sim_string_bytes(size_t len)
+{
+	return len < 8 ? 0 : (len + 1) * sizeof(WCHAR);
+}
+
+// length of the encrypted name of a plaintext name of len characters
+static size_t sim_encrypted_len(size_t len)
+{
+	if (len >= SHORT_NAME_MAX)
+		return SIM_LONG_NAME_LEN;
+
+	// padded to whole blocks, then base64 without padding
+	size_t bytes = (len / 16 + 1) * 16;
+
+	return (bytes * 4 + 2) / 3;
+}
+
+static ULONGLONG sim_child_key(ULONGLONG parent, ULONGLONG hash)
+{
+	return (parent ^ hash) * 0x100000001b3ULL;
+}
+
+#define SIM_ROOT_KEY 0xcbf29ce484222325ULL
+
+// Turns operations into the lookups each cache would get
+
+class SimStreams {
+private:
+	struct DirInfo {
+		size_t plain_len;
+		size_t encrypted_len;
+		size_t files;
+		size_t file_chars;
+	};
+
+	unordered_map<ULONGLONG, DirInfo> m_dirs;
+	unordered_set<ULONGLONG> m_children;
+	unordered_set<ULONGLONG> m_long_names;
+
+	// adds the path's directories to m_dirs, and returns the key of each
+	// directory from the root down to the path's parent, followed by the
+	// path's own key
+	void walk(const vector<OpRecordComponent>& path, vector<ULONGLONG>& keys);
+public:
+	vector<SimAccess> m_accesses[SIM_CACHE_COUNT];
+
+	void Add(const OpRecord& rec, ULONGLONG ms, const vector<OpRecordComponent>& path, const vector<OpRecordComponent>& path2);
+
+	// estimated heap bytes per entry of each cache, averaged over the keys
+	size_t BytesPerEntry(int cache);
+};
+
+void SimStreams::walk(const vector<OpRecordComponent>& path, vector<ULONGLONG>& keys)
+{
+	ULONGLONG key = SIM_ROOT_KEY;
+
+	DirInfo root = { 1, SIM_BASEDIR_LEN, 0, 0 };
+
+	auto dir = m_dirs.insert(make_pair(key, root)).first;
+
+	keys.clear();
+	keys.push_back(key);
+
+	for (size_t i = 0; i < path.size(); i++) {
+		ULONGLONG child = sim_child_key(key, path[i].hash);
+		if (m_children.insert(child).second) {
+			dir->second.files++;
+			dir->second.file_chars += path[i].len;
+		}
+		if (i + 1 < path.size()) {
+			DirInfo info = { dir->second.plain_len + 1 + path[i].len,
+				dir->second.encrypted_len + 1 + sim_encrypted_len(path[i].len), 0, 0 };
+			dir = m_dirs.insert(make_pair(child, info)).first;
+		}
+		key = child;
+		keys.push_back(key);
+	}
+}
+
+void SimStreams::Add(const OpRecord& rec, ULONGLONG ms, const vector<OpRecordComponent>& path, const vector<OpRecordComponent>& path2)
+{
+	bool deletes = rec.op == OPREC_CLEANUP && (rec.flags & OPREC_FLAG_DELETE_ON_CLOSE);
+
+	// the operations that encrypt their path
+	if (rec.op != OPREC_CREATE && rec.op != OPREC_FIND && rec.op != OPREC_DELETE_FILE &&
+		rec.op != OPREC_DELETE_DIRECTORY && rec.op != OPREC_MOVE && !deletes)
+		return;
+
+	bool succeeded = (LONG)rec.status >= 0;
+
+	// FILE_OPEN (1) and FILE_OVERWRITE (4) are the dispositions that can't
+	// create a file, and an existing file opened with one of the others
+	// returns STATUS_OBJECT_NAME_COLLISION
+	bool creates = rec.op == OPREC_CREATE && rec.status == 0 && rec.disposition != 1 && rec.disposition != 4;
+
+	vector<ULONGLONG> keys;
+
+	for (int i = 0; i < 2; i++) {
+		const vector<OpRecordComponent>& p = i == 0 ? path : path2;
+
+		if (i == 1 && rec.op != OPREC_MOVE)
+			break;
+
+		walk(p, keys);
+
+		// the directories from the root down to the parent, and for a
+		// find, the directory itself
+		size_t ndirs = rec.op == OPREC_FIND ? keys.size() : keys.size() - 1;
+
+		for (size_t j = 0; j < ndirs; j++)
+			m_accesses[SIM_DIR_IV].push_back({ keys[j], ms, SIM_LOOKUP });
+
+		if (!p.empty())
+			m_accesses[SIM_CASE].push_back({ keys[keys.size() - 2], ms, SIM_LOOKUP });
+
+		for (auto& comp : p) {
+			if (comp.len == SIM_LONG_NAME_LEN) {
+				m_long_names.insert(comp.hash);
+				m_accesses[SIM_LFN].push_back({ comp.hash, ms, SIM_LOOKUP });
+			}
+		}
+
+		if (p.empty() || !succeeded)
+			continue;
+
+		if (creates || deletes || rec.op == OPREC_MOVE)
+			m_accesses[SIM_CASE].push_back({ keys[keys.size() - 2], ms, SIM_MODIFY });
+
+		if ((deletes && (rec.flags & OPREC_FLAG_DIRECTORY)) || (rec.op == OPREC_MOVE && i == 0)) {
+			m_accesses[SIM_DIR_IV].push_back({ keys.back(), ms, SIM_REMOVE });
+			m_accesses[SIM_CASE].push_back({ keys.back(), ms, SIM_REMOVE });
+		}
+	}
+}
+
+size_t SimStreams::BytesPerEntry(int cache)
+{
+	size_t total = 0;
+	size_t count = 0;
+
+	if (cache == SIM_LFN) {
+		return SIM_ENTRY_OVERHEAD + sizeof(LongFilenameCacheNode) + 2 * sim_string_bytes(SIM_LONG_NAME_LEN - LONGNAME_PREFIX_LEN) +
+			sim_string_bytes(SIM_LFN_PATH_LEN) + SIM_LFN_ENCRYPTED_LEN + 1;
+	}
+
+	for (auto& it : m_dirs) {
+		const DirInfo& dir = it.second;
+		if (cache == SIM_DIR_IV) {
+			// the key is kept in the map and in the node
+			total += SIM_ENTRY_OVERHEAD + sizeof(DirIvCacheNode) + 2 * sim_string_bytes(dir.encrypted_len);
+		} else {
+			size_t name_len = dir.files ? dir.file_chars / dir.files : 0;
+			total += SIM_ENTRY_OVERHEAD + sizeof(CaseCacheNode) + 3 * sim_string_bytes(dir.plain_len) +
+				dir.files * (SIM_CASE_FILE_OVERHEAD + 2 * sim_string_bytes(name_len));
+		}
+		count++;
+	}
+
+	return count ? total / count : 0;
+}
+
+// A cache of keys only, with a replacement policy
+
+class SimCache {
+private:
+	struct Entry {
+		ULONGLONG key;
+		ULONGLONG loaded;   // ms
+		ULONGLONG checked;  // ms
+		bool referenced;
+	};
+
+	int m_policy;
+	size_t m_capacity;
+	ULONGLONG m_ttl;     // ms
+
+	// most recently inserted (or used, for lru) first
+	list<Entry> m_list;
+	unordered_map<ULONGLONG, list<Entry>::iterator> m_map;
+	list<Entry>::iterator m_hand;  // clock
+
+	unordered_map<ULONGLONG, ULONGLONG> m_modified;
+
+	void erase(unordered_map<ULONGLONG, list<Entry>::iterator>::iterator it);
+	void evict();
+public:
+	ULONGLONG m_lookups;
+	ULONGLONG m_hits;
+	ULONGLONG m_revalidations;
+	size_t m_peak;
+
+	void Access(const SimAccess& access);
+
+	SimCache(int policy, size_t capacity, int ttl);
+};
+
+SimCache::SimCache(int policy, size_t capacity, int ttl)
+{
+	m_policy = policy;
+	m_capacity = capacity;
+	m_ttl = (ULONGLONG)ttl * 1000;
+	m_hand = m_list.end();
+	m_lookups = 0;
+	m_hits = 0;
+	m_revalidations = 0;
+	m_peak = 0;
+}
+
+void SimCache::erase(unordered_map<ULONGLONG, list<Entry>::iterator>::iterator it)
+{
+	if (it->second == m_hand)
+		m_hand = m_list.erase(it->second);
+	else
+		m_list.erase(it->second);
+
+	m_map.erase(it);
+}
+
+void SimCache::evict()
+{
+	if (m_policy == SIM_POLICY_CLOCK) {
+		// give the referenced entries a second chance
+		if (m_hand == m_list.end())
+			m_hand = m_list.begin();
+		while (m_hand->referenced) {
+			m_hand->referenced = false;
+			if (++m_hand == m_list.end())
+				m_hand = m_list.begin();
+		}
+		erase(m_map.find(m_hand->key));
+	} else {
+		erase(m_map.find(m_list.back().key));
+	}
+}
+
+void SimCache::Access(const SimAccess& access)
+{
+	if (access.type == SIM_MODIFY) {
+		m_modified[access.key] = access.ms;
+		return;
+	}
+
+	auto it = m_map.find(access.key);
+
+	if (access.type == SIM_REMOVE) {
+		if (it != m_map.end())
+			erase(it);
+		return;
+	}
+
+	m_lookups++;
+
+	if (it != m_map.end()) {
+		auto entry = it->second;
+		bool clean = true;
+		if (m_ttl && access.ms - entry->checked >= m_ttl) {
+			m_revalidations++;
+			auto mod = m_modified.find(access.key);
+			clean = mod == m_modified.end() || mod->second <= entry->loaded;
+			entry->checked = access.ms;
+		}
+		if (clean) {
+			m_hits++;
+			if (m_policy == SIM_POLICY_LRU)
+				m_list.splice(m_list.begin(), m_list, entry);
+			else if (m_policy == SIM_POLICY_CLOCK)
+				entry->referenced = true;
+			return;
+		}
+		erase(it);
+	}
+
+	if (m_map.size() >= m_capacity)
+		evict();
+
+	Entry entry = { access.key, access.ms, access.ms, false };
+
+	// clock inserts behind the hand, so a new entry is looked at last
+	auto pos = m_policy == SIM_POLICY_CLOCK && m_hand != m_list.end() ? m_hand : m_list.begin();
+
+	m_map[access.key] = m_list.insert(pos, entry);
+
+	m_peak = max(m_peak, m_map.size());
+}
+
+static void sim_run(const vector<SimAccess>& accesses, SimCache& cache)
+{
+	for (auto& access : accesses)
+		cache.Access(access);
+}
+
+static ULONGLONG sim_mix(ULONGLONG x)
+{
+	// splitmix64 finalizer
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+static void synthetic_op(vector<OpRecordEntry>& entries, ULONGLONG& t, int op, const vector<OpRecordComponent>& path, bool dir)
+{
+	OpRecordEntry entry;
+
+	memset(&entry.rec, 0, sizeof(entry.rec));
+	entry.rec.op = (BYTE)op;
+	entry.rec.npaths = 1;
+	entry.rec.start = t;
+	entry.rec.disposition = 1; // FILE_OPEN
+	entry.rec.flags = dir ? OPREC_FLAG_DIRECTORY : 0;
+	entry.path = path;
+
+	entries.push_back(move(entry));
+
+	t += CACHE_SIM_SYNTHETIC_OP_US;
+}
+
+// opens and lists each directory, and opens each file in it, like a backup
+// or a search indexer
+static void synthetic_walk(vector<OpRecordEntry>& entries, ULONGLONG& t, vector<OpRecordComponent>& path, ULONGLONG id, int depth)
+{
+	synthetic_op(entries, t, OPREC_CREATE, path, true);
+	synthetic_op(entries, t, OPREC_FIND, path, true);
+	synthetic_op(entries, t, OPREC_CLEANUP, path, true);
+	synthetic_op(entries, t, OPREC_CLOSE, path, true);
+
+	for (int i = 0; i < CACHE_SIM_SYNTHETIC_FILES; i++) {
+		OpRecordComponent comp;
+		comp.hash = sim_mix(id * 1024 + i * 2);
+		comp.len = (i + 1) % CACHE_SIM_SYNTHETIC_LONG_NAME_EVERY ? 12 : SIM_LONG_NAME_LEN;
+		path.push_back(comp);
+		synthetic_op(entries, t, OPREC_CREATE, path, false);
+		synthetic_op(entries, t, OPREC_CLEANUP, path, false);
+		synthetic_op(entries, t, OPREC_CLOSE, path, false);
+		path.pop_back();
+	}
+
+	if (depth >= CACHE_SIM_SYNTHETIC_DEPTH)
+		return;
+
+	for (int i = 0; i < CACHE_SIM_SYNTHETIC_SUBDIRS; i++) {
+		OpRecordComponent comp;
+		comp.hash = sim_mix(id * 1024 + i * 2 + 1);
+		comp.len = 8;
+		path.push_back(comp);
+		synthetic_walk(entries, t, path, comp.hash, depth + 1);
+		path.pop_back();
+	}
+}
+
+bool run_cache_simulation(const WCHAR *recording, int ttl, string& json, wstring& mes)
+{
+	SimStreams streams;
+
+	ULONGLONG operations = 0;
+
+	try {
+		vector<OpRecordEntry> entries;
+		LONGLONG frequency;
+
+		if (recording) {
+			if (!read_op_recording(recording, frequency, entries, mes))
+				return false;
+		} else {
+			frequency = 1000000;
+			ULONGLONG t = 0;
+			for (int i = 0; i < CACHE_SIM_SYNTHETIC_PASSES; i++) {
+				vector<OpRecordComponent> path;
+				synthetic_walk(entries, t, path, 0, 0);
+			}
+		}
+
+		operations = entries.size();
+
+		for (auto& entry : entries)
+			streams.Add(entry.rec, (ULONGLONG)((double)entry.rec.start * 1000 / frequency), entry.path, entry.path2);
+
+	} catch (...) {
+		mes = L"unable to allocate memory for cache simulation";
+		return false;
+	}
+
+	char buf[512];
+
+	sprintf_s(buf, "{\n  \"source\": \"%s\",\n  \"operations\": %llu,\n  \"ttl_seconds\": %d,\n  \"caches\": [",
+		recording ? "recording" : "synthetic", operations, ttl);
+
+	json = buf;
+
+	try {
+		for (int c = 0; c < SIM_CACHE_COUNT; c++) {
+			const vector<SimAccess>& accesses = streams.m_accesses[c];
+
+			unordered_set<ULONGLONG> keys;
+			for (auto& access : accesses) {
+				if (access.type == SIM_LOOKUP)
+					keys.insert(access.key);
+			}
+
+			size_t bytes_per_entry = streams.BytesPerEntry(c);
+
+			// the long filename cache has no ttl
+			int cache_ttl = c == SIM_LFN ? 0 : ttl;
+
+			ULONGLONG lookups = 0;
+			if (!accesses.empty()) {
+				SimCache cache(SIM_POLICY_LRU, sim_cache_entries[c], cache_ttl);
+				sim_run(accesses, cache);
+				lookups = cache.m_lookups;
+			}
+
+			sprintf_s(buf, "%s\n    {\n      \"cache\": \"%s\",\n      \"used_by\": \"%s\",\n      \"current_entries\": %d,\n"
+				"      \"lookups\": %llu,\n      \"distinct_keys\": %llu,\n      \"bytes_per_entry\": %llu,\n      \"curves\": [",
+				c ? "," : "", sim_cache_names[c], sim_cache_used[c], sim_cache_entries[c], lookups,
+				(unsigned long long)keys.size(), (unsigned long long)bytes_per_entry);
+
+			json += buf;
+
+			for (int p = 0; p < SIM_POLICY_COUNT && lookups; p++) {
+				sprintf_s(buf, "%s\n        {\"policy\": \"%s\", \"points\": [", p ? "," : "", sim_policy_names[p]);
+				json += buf;
+				for (int i = 0; i < (int)_countof(sim_capacities); i++) {
+					SimCache cache(p, sim_capacities[i], cache_ttl);
+					sim_run(accesses, cache);
+					sprintf_s(buf, "%s\n          {\"entries\": %d, \"hit_ratio\": %.4f, \"memory_kb\": %.1f}",
+						i ? "," : "", sim_capacities[i], (double)cache.m_hits / cache.m_lookups,
+						(double)cache.m_peak * bytes_per_entry / 1024);
+					json += buf;
+				}
+				json += "\n        ]}";
+			}
+
+			json += "\n      ],\n      \"ttls\": [";
+
+			for (int i = 0; i < (int)_countof(sim_ttls) && lookups && c != SIM_LFN; i++) {
+				SimCache cache(SIM_POLICY_LRU, sim_cache_entries[c], sim_ttls[i]);
+				sim_run(accesses, cache);
+				sprintf_s(buf, "%s\n        {\"ttl_seconds\": %d, \"hit_ratio\": %.4f, \"revalidations_per_lookup\": %.4f}",
+					i ? "," : "", sim_ttls[i], (double)cache.m_hits / cache.m_lookups,
+					(double)cache.m_revalidations / cache.m_lookups);
+				json += buf;
+			}
+
+			json += "\n      ]\n    }";
+		}
+	} catch (...) {
+		mes = L"unable to allocate memory for cache simulation";
+		return false;
+	}
+
+	json += "\n  ]\n}\n";
+
+	return true;
+}
@@ -0,0 +1,66 @@
+/*
+cppcryptfs : user-mode cryptographic virtual overlay filesystem.
+
+Copyright (C) 2016-2018 Bailey Brown (github.com/bailey27/cppcryptfs)
+
+cppcryptfs is based on the design of gocryptfs (github.com/rfjakob/gocryptfs)
+
+The MIT License (MIT)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#pragma once
+
+#include <windows.h>
+
+#include <string>
+
+using namespace std;
+
+// Offline simulation of the DirIvCache, CaseCache and LongFilenameCache.
+//
+// The cache lookups a mounted volume would do are derived from an operation
+// recording (see context/oprecorder.h), or from a synthetic walk of a tree
+// when there isn't one.  They are then run through a model of each cache
+// with a range of capacities and replacement policies, and a range of TTLs,
+// to show how big the caches need to be for a workload and what that costs
+// in memory.
+//
+// The model follows the real caches: a lookup that misses inserts the key,
+// a lookup after the TTL has expired revalidates the entry (an extra file
+// open), and a revalidated case cache entry is dropped if its directory was
+// changed since it was loaded.
+
+// synthetic walk: a tree this deep, with this many subdirectories and files
+// in each directory, walked this many times
+#define CACHE_SIM_SYNTHETIC_DEPTH   4
+#define CACHE_SIM_SYNTHETIC_SUBDIRS 4
+#define CACHE_SIM_SYNTHETIC_FILES   32
+#define CACHE_SIM_SYNTHETIC_PASSES  2
+
+// every this many files in the synthetic tree has a long name
+#define CACHE_SIM_SYNTHETIC_LONG_NAME_EVERY 16
+
+// simulated time each synthetic operation takes
+#define CACHE_SIM_SYNTHETIC_OP_US 50
+
+// recording is NULL for the synthetic walk.  ttl is in seconds.
+bool run_cache_simulation(const WCHAR *recording, int ttl, string& json, wstring& mes);
@@ -529,6 +529,7 @@ decrypt_path(CryptContext *con, const WCHAR *path, wstring& storage)
 const WCHAR * // get encrypted path
 encrypt_path(CryptContext *con, const WCHAR *path, wstring& storage, string *actual_encrypted)
 {
+	PerfTimer perf(&con->m_perf, PERF_ENCRYPT_PATH);
 
 	const WCHAR *rval = NULL;
 
@@ -51,7 +51,8 @@ static const WCHAR *filename_encryption_types[] = {
 
 static const WCHAR *data_encryption_types[] = {
 	L"AES256-GCM",
-	L"AES256-SIV"
+	L"AES256-SIV",
+	L"XChaCha20-Poly1305"
 };
 
 #define AES256_GCM_INDEX 0
@@ -59,6 +60,13 @@ static const WCHAR *data_encryption_types[] = {
 
 #define NUM_DATA_ENC_TYPES (sizeof(data_encryption_types)/sizeof(data_encryption_types[0]))
 
+// in KB
+static const int block_sizes[] = {
+	4, 8, 16, 32, 64, 128, 256, 512, 1024
+};
+
+#define NUM_BLOCK_SIZES (sizeof(block_sizes)/sizeof(block_sizes[0]))
+
 
 // CCreatePropertyPage dialog
 
@@ -171,10 +179,14 @@ void CCreatePropertyPage::CreateCryptfs()
 	
 
 	bool siv = false;
+	bool xchacha = false;
 	bool eme = false;
 	bool plaintext = false;
 	bool longfilenames = false;
 	bool reverse = false;
+	bool aligned = false;
+	int blocksize = PLAIN_BS;
+	bool compress = false;
 
 	CComboBox *pBox = (CComboBox *)GetDlgItem(IDC_FILENAME_ENCRYPTION);
 
@@ -196,6 +208,17 @@ void CCreatePropertyPage::CreateCryptfs()
 
 	reverse = IsDlgButtonChecked(IDC_REVERSE) != 0;
 
+	aligned = IsDlgButtonChecked(IDC_ALIGNED_BLOCKS) != 0;
+
+	pBox = (CComboBox *)GetDlgItem(IDC_BLOCK_SIZE);
+
+	nsel = pBox->GetCurSel();
+
+	if (nsel >= 0 && nsel < NUM_BLOCK_SIZES)
+		blocksize = block_sizes[nsel] * 1024;
+
+	compress = IsDlgButtonChecked(IDC_COMPRESS) != 0;
+
 	pBox = (CComboBox *)GetDlgItem(IDC_DATA_ENCRYPTION);
 
 	nsel = pBox->GetCurSel();
@@ -207,12 +230,14 @@ void CCreatePropertyPage::CreateCryptfs()
 
 	if (cfenc == L"AES256-SIV")
 		siv = true;
+	else if (cfenc == L"XChaCha20-Poly1305")
+		xchacha = true;
 
 	CString volume_name;
 	GetDlgItemText(IDC_VOLUME_NAME, volume_name);
 
 	theApp.DoWaitCursor(1);
-	bool bResult = config.create(cpath, config_path, password.m_buf, eme, plaintext, longfilenames, siv, reverse, volume_name, error_mes);
+	bool bResult = config.create(cpath, config_path, password.m_buf, eme, plaintext, longfilenames, siv, xchacha, reverse, volume_name, aligned, blocksize, compress, error_mes);
 	theApp.DoWaitCursor(-1);
 
 	if (!bResult) {
@@ -238,6 +263,16 @@ void CCreatePropertyPage::CreateCryptfs()
 
 	theApp.WriteProfileStringW(L"CreateOptions", L"Reverse", creverse);
 
+	CString caligned = IsDlgButtonChecked(IDC_ALIGNED_BLOCKS) ? L"1" : L"0";
+
+	theApp.WriteProfileStringW(L"CreateOptions", L"AlignedBlocks", caligned);
+
+	theApp.WriteProfileInt(L"CreateOptions", L"BlockSize", blocksize / 1024);
+
+	CString ccompress = IsDlgButtonChecked(IDC_COMPRESS) ? L"1" : L"0";
+
+	theApp.WriteProfileStringW(L"CreateOptions", L"Compress", ccompress);
+
 	CComboBox* pLbox = (CComboBox*)GetDlgItem(IDC_FILENAME_ENCRYPTION);
 	if (!pLbox)
 		return;
@@ -327,6 +362,12 @@ BOOL CCreatePropertyPage::OnInitDialog()
 
 	CString creverse = theApp.GetProfileStringW(L"CreateOptions", L"Reverse", L"0");
 
+	CString caligned = theApp.GetProfileStringW(L"CreateOptions", L"AlignedBlocks", L"0");
+
+	int blocksize = theApp.GetProfileInt(L"CreateOptions", L"BlockSize", PLAIN_BS / 1024);
+
+	CString ccompress = theApp.GetProfileStringW(L"CreateOptions", L"Compress", L"0");
+
 	CString cfnenc = theApp.GetProfileStringW(L"CreateOptions", L"FilenameEncryption", L"AES256-EME");
 
 	CString cdataenc = theApp.GetProfileStringW(L"CreateOptions", L"DataEncryption", L"AES256-GCM");
@@ -335,6 +376,10 @@ BOOL CCreatePropertyPage::OnInitDialog()
 
 	CheckDlgButton(IDC_REVERSE, creverse == L"1");
 
+	CheckDlgButton(IDC_ALIGNED_BLOCKS, caligned == L"1");
+
+	CheckDlgButton(IDC_COMPRESS, ccompress == L"1" && creverse != L"1");
+
 	CComboBox *pBox = (CComboBox*)GetDlgItem(IDC_PATH);
 
 	int i;
@@ -379,6 +424,25 @@ BOOL CCreatePropertyPage::OnInitDialog()
 		}
 	}
 
+	pLbox = (CComboBox*)GetDlgItem(IDC_BLOCK_SIZE);
+
+	if (!pLbox)
+		return FALSE;
+
+	for (i = 0; i < NUM_BLOCK_SIZES; i++) {
+		CString cbs;
+		if (block_sizes[i] < 1024)
+			cbs.Format(L"%d KB", block_sizes[i]);
+		else
+			cbs.Format(L"%d MB", block_sizes[i] / 1024);
+		pLbox->InsertString(i, cbs);
+		if (blocksize == block_sizes[i])
+			pLbox->SetCurSel(i);
+	}
+
+	if (pLbox->GetCurSel() < 0)
+		pLbox->SetCurSel(0);
+
 
 	if (!m_password.ArePasswordBuffersLocked() || !m_password2.ArePasswordBuffersLocked()) {
 		MessageBox(L"unable to lock password buffers", L"cppcryptfs", MB_OK | MB_ICONERROR);
@@ -431,6 +495,10 @@ void CCreatePropertyPage::OnClickedReverse()
 	BOOL bIsChecked = IsDlgButtonChecked(IDC_REVERSE);
 
 	pEncBox->SelectString(-1, data_encryption_types[bIsChecked ? AES256_SIV_INDEX : AES256_GCM_INDEX]);
+
+	// compression isn't supported in reverse mode
+	if (bIsChecked)
+		CheckDlgButton(IDC_COMPRESS, 0);
 	
 }
 
@@ -104,6 +104,12 @@ BOOL CFsInfoDialog::OnInitDialog()
 	SetDlgItemText(IDC_MOUNT_MANAGER, m_info.mountManager ? yes : no);
 	SetDlgItemText(IDC_CASE_INSENSITIVE, m_info.caseInsensitive ? yes : no);
 	SetDlgItemText(IDC_LONG_FILE_NAMES, m_info.longFileNames ? yes : no);
+	SetDlgItemText(IDC_DIRECT_IO, m_info.directIo ? yes : no);
+	SetDlgItemText(IDC_SPARSE_ZERO, m_info.sparseZeroBlocks ? yes : no);
+	SetDlgItemText(IDC_MMAP_REVERSE, m_info.mmapReverse ? yes : no);
+	SetDlgItemText(IDC_AUTO_TUNE, m_info.autoTuned ? yes : no);
+	SetDlgItemText(IDC_AUTO_TUNE_RESULTS, m_info.autoTune.c_str());
+	SetDlgItemText(IDC_AES_IMPL, m_info.aesImplementation.c_str());
 
 	wstring txt;
 	txt = to_wstring(m_info.ioBufferSize);
@@ -148,6 +154,23 @@ BOOL CFsInfoDialog::OnInitDialog()
 		txt += L"%";
 	}
 	SetDlgItemText(IDC_DIRIV_CACHE_HR, txt.c_str());
+	r = m_info.blockCacheHitRatio;
+	if (r < 0.0f) {
+		txt = L"n/a";
+	} else {
+		_snwprintf_s(buf, _TRUNCATE, L"%.2f", r*100.0f);
+		txt = buf;
+		txt += L"%";
+	}
+	SetDlgItemText(IDC_BLOCK_CACHE_HR, txt.c_str());
+	// the edit control needs CRLF line breaks
+	txt.clear();
+	for (auto c : m_info.perfStats) {
+		if (c == '\n')
+			txt.push_back('\r');
+		txt.push_back(c);
+	}
+	SetDlgItemText(IDC_PERF_STATS, txt.c_str());
 
 	// TODO:  Add extra initialization here
 
@@ -47,6 +47,13 @@ THE SOFTWARE.
 #include "util/savedpasswords.h"
 #include "ui/FsInfoDialog.h"
 #include "dokan/MountPointManager.h"
+#include "util/trace.h"
+#include "crypt/cryptbench.h"
+#include "file/blockbench.h"
+#include "dokan/cryptreplay.h"
+#include "filename/cachesim.h"
+#include "file/cryptfsck.h"
+#include "file/bulkcopy.h"
 #include <algorithm>
 
 // CMountPropertyPage dialog
@@ -134,6 +141,8 @@ CMountPropertyPage::CMountPropertyPage()
 	: CCryptPropertyPage(IDD_MOUNT)
 {
 	m_imageIndex = -1;
+	m_offlineJob = false;
+	m_offlinePid = 0;
 }
 
 CMountPropertyPage::~CMountPropertyPage()
@@ -152,7 +161,54 @@ void CMountPropertyPage::DefaultAction()
 		MessageBox(mes, L"cppcryptfs", MB_OK | MB_ICONEXCLAMATION);
 }
 
-CString CMountPropertyPage::Mount(LPCWSTR argPath, LPCWSTR argMountPoint, LPCWSTR argPassword, bool argReadOnly, LPCWSTR argConfigPath, bool argReverse)
+// full path of a filesystem without the \\?\ prefix or trailing backslashes,
+// for comparing paths
+static CString
+volume_compare_path(LPCWSTR path)
+{
+	wstring str = path;
+
+	if (!wcsncmp(str.c_str(), L"\\\\?\\UNC\\", 8))
+		str = L"\\" + str.substr(7);
+	else if (!wcsncmp(str.c_str(), L"\\\\?\\", 4))
+		str = str.substr(4);
+
+	WCHAR buf[MAX_PATH + 1];
+
+	DWORD len = GetFullPathName(str.c_str(), _countof(buf), buf, NULL);
+
+	if (len > 0 && len < _countof(buf))
+		str = buf;
+
+	while (str.size() > 0 && str[str.size() - 1] == '\\')
+		str.erase(str.size() - 1);
+
+	return str.c_str();
+}
+
+CString CMountPropertyPage::MountedOn(LPCWSTR path)
+{
+	CString cmp = volume_compare_path(path);
+
+	vector<wstring> mps;
+
+	MountPointManager::getInstance().get_mount_points(mps);
+
+	for (auto& it : mps) {
+		wstring mpath;
+		if (!MountPointManager::getInstance().get_path(it.c_str(), mpath))
+			continue;
+		// get_path() leaves UNC\ at the start of a UNC path
+		if (!wcsncmp(mpath.c_str(), L"UNC\\", 4))
+			mpath = L"\\" + mpath.substr(3);
+		if (!lstrcmpi(volume_compare_path(mpath.c_str()), cmp))
+			return it.c_str();
+	}
+
+	return L"";
+}
+
+CString CMountPropertyPage::Mount(LPCWSTR argPath, LPCWSTR argMountPoint, LPCWSTR argPassword, bool argReadOnly, LPCWSTR argConfigPath, bool argReverse, LPCWSTR argRecordPath)
 {
 	
 
@@ -293,6 +349,10 @@ CString CMountPropertyPage::Mount(LPCWSTR argPath, LPCWSTR argMountPoint, LPCWST
 		return mes;
 	}
 
+	if (m_offlinePath.GetLength() > 0 && !lstrcmpi(volume_compare_path(cpath), volume_compare_path(m_offlinePath))) {
+		return cpath + L" is being checked or copied from the command line";
+	}
+
 	pPass->SetRealText(L"");
 
 	wstring error_mes;
@@ -329,6 +389,16 @@ CString CMountPropertyPage::Mount(LPCWSTR argPath, LPCWSTR argMountPoint, LPCWST
 
 	opts.mountmanagerwarn = theApp.GetProfileInt(L"Settings", L"MountManagerWarn", MOUNTMANAGERWARN_DEFAULT) != 0;
 
+	opts.directio = theApp.GetProfileInt(L"Settings", L"DirectIo", DIRECTIO_DEFAULT) != 0;
+
+	opts.sparsezero = theApp.GetProfileInt(L"Settings", L"SparseZeroBlocks", SPARSEZERO_DEFAULT) != 0;
+
+	opts.mmapreverse = theApp.GetProfileInt(L"Settings", L"MapReverseFiles", MMAPREVERSE_DEFAULT) != 0;
+
+	opts.autotune = theApp.GetProfileInt(L"Settings", L"AutoTune", AUTOTUNE_DEFAULT) != 0;
+
+	opts.recordpath = argRecordPath;
+
 	bool bSavePassword = argMountPoint == NULL && (IsDlgButtonChecked(IDC_SAVE_PASSWORD) != 0);	
 	
 	theApp.DoWaitCursor(1);
@@ -1118,6 +1188,18 @@ static void usage()
 	fprintf(stderr, "  -l, --list\t\tlist available and mounted drive letters (with paths)\n");
 	fprintf(stderr, "  -ld:\\p, --list=d:\\p\tlist encrypted and plaintext filenames\n");
 	fprintf(stderr, "  -i, --info=D\t\tshow information about mounted filesystem\n");
+	fprintf(stderr, "  --trace=on|off\t\tstart or stop recording trace events\n");
+	fprintf(stderr, "  --trace-dump=PATH\twrite recorded trace events to PATH as JSON\n");
+	fprintf(stderr, "  --benchmark[=N]\tmeasure crypto speed on 1 and N threads (default all cpus)\n");
+	fprintf(stderr, "  --benchmark-io[=N]\tmeasure file read/write speed on 1 and N threads (default all cpus)\n");
+	fprintf(stderr, "  --record=PATH\t\trecord the filesystem operations to PATH (use with -m)\n");
+	fprintf(stderr, "  --replay=PATH\t\treplay recorded operations as fast as possible\n");
+	fprintf(stderr, "  --replay-paced=PATH\treplay recorded operations at the recorded times\n");
+	fprintf(stderr, "  --cache-sim[=PATH]\tsimulate the name caches on recorded operations (or a synthetic walk)\n");
+	fprintf(stderr, "  --fsck=PATH\t\tcheck the encrypted files of the filesystem at PATH (use with -p or -P)\n");
+	fprintf(stderr, "  --import=DIR\t\tcopy DIR into the filesystem given with --volume (use with -p or -P)\n");
+	fprintf(stderr, "  --export=DIR\t\tcopy the filesystem given with --volume to DIR (use with -p or -P)\n");
+	fprintf(stderr, "  --volume=PATH\t\tthe filesystem to --import into or --export from\n");
 	fprintf(stderr, "  -v, --version\t\tprint version\n");
 	fprintf(stderr, "  -h, --help\t\tdisplay this help message\n");
 	
@@ -1129,6 +1211,60 @@ static bool compair_find_datas(const FindDataPair& p1, const FindDataPair& p2)
 	return lstrcmpi(p1.fdata.cFileName, p2.fdata.cFileName) < 0;
 }
 
+static DWORD WINAPI OfflineJobProc(LPVOID lpParameter)
+{
+	const function<void()>& job = *(const function<void()>*)lpParameter;
+
+	job();
+
+	return 0;
+}
+
+// Runs a long command line job, such as a benchmark, or one that opens the
+// filesystem at path without mounting it (path is NULL if there is none).
+// The job runs on its own thread, and messages are pumped until it is done so
+// the window stays responsive.  The command's console stays attached until
+// then, and the job must not write to it.
+void CMountPropertyPage::RunOfflineJob(DWORD pid, LPCWSTR path, const function<void()>& job)
+{
+	m_offlineJob = true;
+	m_offlinePath = path ? path : L"";
+	m_offlinePid = pid;
+
+	theApp.DoWaitCursor(1);
+
+	HANDLE hThread = CreateThread(NULL, 0, OfflineJobProc, (LPVOID)&job, 0, NULL);
+
+	if (hThread) {
+		bool quit = false;
+		WPARAM quitCode = 0;
+		while (MsgWaitForMultipleObjects(1, &hThread, FALSE, INFINITE, QS_ALLINPUT) == WAIT_OBJECT_0 + 1) {
+			MSG msg;
+			while (PeekMessage(&msg, NULL, 0, 0, PM_REMOVE)) {
+				if (msg.message == WM_QUIT) {
+					// leave it for the application's message loop
+					quit = true;
+					quitCode = msg.wParam;
+				} else if (!theApp.PreTranslateMessage(&msg)) {
+					TranslateMessage(&msg);
+					DispatchMessage(&msg);
+				}
+			}
+		}
+		CloseHandle(hThread);
+		if (quit)
+			PostQuitMessage((int)quitCode);
+	} else {
+		job();
+	}
+
+	theApp.DoWaitCursor(-1);
+
+	m_offlineJob = false;
+	m_offlinePath = L"";
+	m_offlinePid = 0;
+}
+
 void CMountPropertyPage::ProcessCommandLine(DWORD pid, LPCWSTR szCmd, BOOL bOnStartup)
 {
 
@@ -1152,6 +1288,14 @@ void CMountPropertyPage::ProcessCommandLine(DWORD pid, LPCWSTR szCmd, BOOL bOnSt
 		return;
 	}
 
+	if (m_offlineJob) {
+		// the console of the command whose job is running has to stay attached
+		LocalFree(argv);
+		ConsoleErrMes(L"another command is still running", pid);
+		OpenConsole(m_offlinePid);
+		return;
+	}
+
 	OpenConsole(bOnStartup ? 0 : pid);
 
 	CString path;
@@ -1176,6 +1320,26 @@ void CMountPropertyPage::ProcessCommandLine(DWORD pid, LPCWSTR szCmd, BOOL bOnSt
 
 	CString list_arg;
 
+	CString trace_arg;
+	CString trace_dump_path;
+
+	BOOL do_benchmark = FALSE;
+	BOOL do_benchmark_io = FALSE;
+	int benchmark_threads = 0;
+
+	CString record_path;
+	CString replay_path;
+	bool replay_paced = false;
+
+	BOOL do_cache_sim = FALSE;
+	CString cache_sim_path;
+
+	CString fsck_path;
+
+	CString import_path;
+	CString export_path;
+	CString volume_path;
+
 	try {
 
 		static struct option long_options[] =
@@ -1192,6 +1356,18 @@ void CMountPropertyPage::ProcessCommandLine(DWORD pid, LPCWSTR szCmd, BOOL bOnSt
 			{L"tray",  no_argument, 0, 't'},
 			{L"exit",  no_argument, 0, 'x'},
 			{L"list",  optional_argument, 0, 'l'},
+			{ L"trace",  required_argument, 0, 'T' },
+			{ L"trace-dump",  required_argument, 0, 'D' },
+			{ L"benchmark",  optional_argument, 0, 'B' },
+			{ L"benchmark-io",  optional_argument, 0, 'E' },
+			{ L"record",  required_argument, 0, 'R' },
+			{ L"replay",  required_argument, 0, 'Y' },
+			{ L"replay-paced",  required_argument, 0, 'Z' },
+			{ L"cache-sim",  optional_argument, 0, 'C' },
+			{ L"fsck",  required_argument, 0, 'F' },
+			{ L"import",  required_argument, 0, 'I' },
+			{ L"export",  required_argument, 0, 'O' },
+			{ L"volume",  required_argument, 0, 'V' },
 			{ L"version",  no_argument, 0, 'v' },
 			{L"help",  no_argument, 0, 'h'},
 			{0, 0, 0, 0}
@@ -1261,6 +1437,51 @@ void CMountPropertyPage::ProcessCommandLine(DWORD pid, LPCWSTR szCmd, BOOL bOnSt
 			case 'x':
 				exit_if_no_mounted = TRUE;
 				break;
+			case 'T':
+				trace_arg = optarg;
+				break;
+			case 'D':
+				trace_dump_path = optarg;
+				break;
+			case 'B':
+			case 'E':
+				if (c == 'B')
+					do_benchmark = TRUE;
+				else
+					do_benchmark_io = TRUE;
+				if (optarg) {
+					benchmark_threads = _wtoi(optarg);
+					if (benchmark_threads < 1) {
+						errMes = L"invalid number of benchmark threads";
+						throw(-1);
+					}
+				}
+				break;
+			case 'R':
+				record_path = optarg;
+				break;
+			case 'Y':
+			case 'Z':
+				replay_path = optarg;
+				replay_paced = c == 'Z';
+				break;
+			case 'C':
+				do_cache_sim = TRUE;
+				if (optarg)
+					cache_sim_path = optarg;
+				break;
+			case 'F':
+				fsck_path = optarg;
+				break;
+			case 'I':
+				import_path = optarg;
+				break;
+			case 'O':
+				export_path = optarg;
+				break;
+			case 'V':
+				volume_path = optarg;
+				break;
 			default:
 				throw(-1);
 			}
@@ -1299,6 +1520,111 @@ void CMountPropertyPage::ProcessCommandLine(DWORD pid, LPCWSTR szCmd, BOOL bOnSt
 			usage();
 	} else if (do_info) {
 		PrintInfo(mountPoint);
+	} else if (trace_arg.GetLength() > 0 || trace_dump_path.GetLength() > 0) {
+		if (trace_arg == L"on") {
+			trace_enable(true);
+		} else if (trace_arg == L"off") {
+			trace_enable(false);
+		} else if (trace_arg.GetLength() > 0) {
+			errMes = L"--trace must be on or off";
+		}
+		if (errMes.GetLength() == 0 && trace_dump_path.GetLength() > 0) {
+			wstring mes;
+			if (!trace_dump(trace_dump_path, mes))
+				errMes = mes.c_str();
+		}
+		if (errMes.GetLength() > 0)
+			fwprintf(stderr, L"cppcryptfs: %s\n", (LPCWSTR)errMes);
+	} else if (do_benchmark || do_benchmark_io) {
+		if (benchmark_threads < 1) {
+			SYSTEM_INFO si;
+			GetSystemInfo(&si);
+			benchmark_threads = (int)si.dwNumberOfProcessors;
+		}
+		string json;
+		wstring mes;
+		int bufferblocks = theApp.GetProfileInt(L"Settings", L"BufferBlocks", BUFFERBLOCKS_DEFAULT);
+		bool ok = false;
+		RunOfflineJob(pid, NULL, [&]() {
+			if (do_benchmark)
+				ok = run_crypt_benchmark(benchmark_threads, json, mes);
+			else
+				ok = run_block_benchmark(benchmark_threads, bufferblocks, json, mes);
+		});
+		if (ok)
+			fwprintf(stdout, L"%S", json.c_str());
+		else
+			fwprintf(stderr, L"cppcryptfs: %s\n", mes.c_str());
+	} else if (replay_path.GetLength() > 0) {
+		string json;
+		wstring mes;
+		int bufferblocks = theApp.GetProfileInt(L"Settings", L"BufferBlocks", BUFFERBLOCKS_DEFAULT);
+		bool ok = false;
+		RunOfflineJob(pid, NULL, [&]() {
+			ok = replay_operations(replay_path, replay_paced, bufferblocks, json, mes);
+		});
+		if (ok)
+			fwprintf(stdout, L"%S", json.c_str());
+		else
+			fwprintf(stderr, L"cppcryptfs: %s\n", mes.c_str());
+	} else if (do_cache_sim) {
+		string json;
+		wstring mes;
+		LPCWSTR sim_path = cache_sim_path.GetLength() > 0 ? (LPCWSTR)cache_sim_path : NULL;
+		int ttl = theApp.GetProfileInt(L"Settings", L"CacheTTL", CACHETTL_DEFAULT);
+		bool ok = false;
+		RunOfflineJob(pid, NULL, [&]() {
+			ok = run_cache_simulation(sim_path, ttl, json, mes);
+		});
+		if (ok)
+			fwprintf(stdout, L"%S", json.c_str());
+		else
+			fwprintf(stderr, L"cppcryptfs: %s\n", mes.c_str());
+	} else if (fsck_path.GetLength() > 0) {
+		wstring report;
+		wstring mes;
+		CString mountedOn = MountedOn(fsck_path);
+		if (mountedOn.GetLength() > 0) {
+			mes = wstring((LPCWSTR)fsck_path) + L" is mounted on " + (LPCWSTR)mountedOn + L" and must be dismounted first";
+		} else if (use_saved_password && !SavedPasswords::RetrievePassword(fsck_path, password.m_buf, password.m_len)) {
+			mes = L"unable to retrieve password";
+		} else {
+			LPCWSTR cfg = config_path.GetLength() > 0 ? (LPCWSTR)config_path : NULL;
+			bool ok = false;
+			RunOfflineJob(pid, fsck_path, [&]() {
+				ok = check_crypt_fs(fsck_path, cfg, password.m_buf, report, mes);
+			});
+			if (ok)
+				fwprintf(stdout, L"%s", report.c_str());
+		}
+		if (mes.length() > 0)
+			fwprintf(stderr, L"cppcryptfs: %s\n", mes.c_str());
+	} else if (import_path.GetLength() > 0 || export_path.GetLength() > 0) {
+		wstring report;
+		wstring mes;
+		CString mountedOn = volume_path.GetLength() > 0 ? MountedOn(volume_path) : L"";
+		if (import_path.GetLength() > 0 && export_path.GetLength() > 0) {
+			mes = L"--import and --export cannot be used together";
+		} else if (volume_path.GetLength() < 1) {
+			mes = L"the filesystem must be specified with --volume";
+		} else if (mountedOn.GetLength() > 0) {
+			mes = wstring((LPCWSTR)volume_path) + L" is mounted on " + (LPCWSTR)mountedOn + L" and must be dismounted first";
+		} else if (use_saved_password && !SavedPasswords::RetrievePassword(volume_path, password.m_buf, password.m_len)) {
+			mes = L"unable to retrieve password";
+		} else {
+			LPCWSTR cfg = config_path.GetLength() > 0 ? (LPCWSTR)config_path : NULL;
+			bool ok = false;
+			RunOfflineJob(pid, volume_path, [&]() {
+				if (import_path.GetLength() > 0)
+					ok = import_files(volume_path, cfg, password.m_buf, import_path, report, mes);
+				else
+					ok = export_files(volume_path, cfg, password.m_buf, export_path, report, mes);
+			});
+			if (ok)
+				fwprintf(stdout, L"%s", report.c_str());
+		}
+		if (mes.length() > 0)
+			fwprintf(stderr, L"cppcryptfs: %s\n", mes.c_str());
 	} else if (do_list) {
 		CListCtrl *pList = (CListCtrl*)GetDlgItem(IDC_DRIVE_LETTERS); 
 		if (pList) {
@@ -1355,7 +1681,8 @@ void CMountPropertyPage::ProcessCommandLine(DWORD pid, LPCWSTR szCmd, BOOL bOnSt
 			}
 			if (errMes.GetLength() < 1) {
 				if (mountPoint.GetLength() > 0)
-					errMes = Mount(path, mountPoint, password.m_buf, readonly, config_path.GetLength() > 0 ? config_path : NULL, reverse);
+					errMes = Mount(path, mountPoint, password.m_buf, readonly, config_path.GetLength() > 0 ? config_path : NULL, reverse,
+						record_path.GetLength() > 0 ? record_path : NULL);
 				else
 					errMes = L"drive letter/mount point must be specified";
 			}
@@ -1718,6 +2045,13 @@ void CMountPropertyPage::PrintInfo(LPCWSTR mountpoint)
 	fwprintf(stdout, L"Threads                %d\n", info.fsThreads);
 	fwprintf(stdout, L"I/O Buffer Size:       %dKB\n", info.ioBufferSize);
 	fwprintf(stdout, L"Cache TTL:             %d sec\n", info.cacheTTL);
+	fwprintf(stdout, L"Unbuffered I/O:        %s\n", info.directIo ? yes : no);
+	fwprintf(stdout, L"Sparse zero blocks:    %s\n", info.sparseZeroBlocks ? yes : no);
+	fwprintf(stdout, L"Mapped Reverse Reads:  %s\n", info.mmapReverse ? yes : no);
+	fwprintf(stdout, L"Auto-Tune:             %s\n", info.autoTuned ? yes : no);
+	if (info.autoTuned)
+		fwprintf(stdout, L"Auto-Tune Results:     %s\n", info.autoTune.c_str());
+	fwprintf(stdout, L"AES Implementation:    %s\n", info.aesImplementation.c_str());
 	WCHAR buf[32];
 	swprintf_s(buf, L"%0.2f%%", info.dirIvCacheHitRatio*100);
 	fwprintf(stdout, L"DirIV Cache Hit Ratio: %s\n", info.dirIvCacheHitRatio < 0 ? L"n/a" : buf);
@@ -1725,5 +2059,8 @@ void CMountPropertyPage::PrintInfo(LPCWSTR mountpoint)
 	fwprintf(stdout, L"Case Cache Hit Ratio:  %s\n", info.caseCacheHitRatio < 0 ? L"n/a" : buf);
 	swprintf_s(buf, L"%0.2f%%", info.lfnCacheHitRatio*100);
 	fwprintf(stdout, L"LFN Cache Hit Ratio:   %s\n", info.lfnCacheHitRatio < 0 ? L"n/a" : buf);
+	swprintf_s(buf, L"%0.2f%%", info.blockCacheHitRatio*100);
+	fwprintf(stdout, L"Block Cache Hit Ratio: %s\n", info.blockCacheHitRatio < 0 ? L"n/a" : buf);
+	fwprintf(stdout, L"Performance:\n%s\n", info.perfStats.c_str());
 
 }
@@ -30,6 +30,7 @@ THE SOFTWARE.
 
 #include "CryptPropertyPage.h"
 #include "SecureEdit.h"
+#include <functional>
 
 #define DL_INDEX 0
 #define PATH_INDEX 1
@@ -49,6 +50,11 @@ protected:
 	void AddMountPoint(const CString& path);
 	void GetMountPoints(CStringArray& mountPoints); // builds array of all mountpoints inclding available drive letters
 	void DeleteMountPoint(int item);
+	bool m_offlineJob; // a command line job is running (see RunOfflineJob())
+	CString m_offlinePath; // filesystem that job has open without mounting it, if any
+	DWORD m_offlinePid; // console of the command that started that job
+	CString MountedOn(LPCWSTR path); // mount point of the filesystem at path, or empty
+	void RunOfflineJob(DWORD pid, LPCWSTR path, const function<void()>& job);
 public:
 	// disallow copying
 	CMountPropertyPage(CMountPropertyPage const&) = delete;
@@ -71,7 +77,7 @@ public:
 
 	virtual void DeviceChange() override;
 
-	CString Mount(LPCWSTR argPath = NULL, LPCWSTR argMountPoint = NULL, LPCWSTR argPassword = NULL, bool argReadOnly = false, LPCWSTR argConfigPath = NULL, bool argReverse = false);
+	CString Mount(LPCWSTR argPath = NULL, LPCWSTR argMountPoint = NULL, LPCWSTR argPassword = NULL, bool argReadOnly = false, LPCWSTR argConfigPath = NULL, bool argReverse = false, LPCWSTR argRecordPath = NULL);
 
 	CString Dismount(LPCWSTR argMountPoint = NULL);
 
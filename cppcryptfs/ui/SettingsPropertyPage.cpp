@@ -48,6 +48,10 @@ CSettingsPropertyPage::CSettingsPropertyPage()
 	m_bCaseInsensitive = false;
 	m_bMountManager = false;
 	m_bEnableSavingPasswords = false;
+	m_bDirectIo = false;
+	m_bSparseZero = false;
+	m_bMmapReverse = false;
+	m_bAutoTune = false;
 }
 
 CSettingsPropertyPage::~CSettingsPropertyPage()
@@ -70,6 +74,10 @@ BEGIN_MESSAGE_MAP(CSettingsPropertyPage, CPropertyPage)
 	ON_BN_CLICKED(IDC_MOUNTMANAGER, &CSettingsPropertyPage::OnClickedMountmanager)
 	ON_BN_CLICKED(IDC_RESETWARNINGS, &CSettingsPropertyPage::OnClickedResetwarnings)
 	ON_BN_CLICKED(IDC_ENABLE_SAVING_PASSWORDS, &CSettingsPropertyPage::OnClickedEnableSavingPasswords)
+	ON_BN_CLICKED(IDC_DIRECTIO, &CSettingsPropertyPage::OnClickedDirectio)
+	ON_BN_CLICKED(IDC_SPARSEZERO, &CSettingsPropertyPage::OnClickedSparsezero)
+	ON_BN_CLICKED(IDC_MMAPREVERSE, &CSettingsPropertyPage::OnClickedMmapreverse)
+	ON_BN_CLICKED(IDC_AUTOTUNE, &CSettingsPropertyPage::OnClickedAutotune)
 END_MESSAGE_MAP()
 
 
@@ -99,15 +107,27 @@ BOOL CSettingsPropertyPage::OnInitDialog()
 
 	bool bEnableSavingPasswords = theApp.GetProfileInt(L"Settings", L"EnableSavingPasswords", ENABLE_SAVING_PASSWORDS_DEFAULT) != 0;
 
-	return SetControls(nThreads, bufferblocks, cachettl, bCaseInsensitive, bMountManager, bEnableSavingPasswords);
+	bool bDirectIo = theApp.GetProfileInt(L"Settings", L"DirectIo", DIRECTIO_DEFAULT) != 0;
+
+	bool bSparseZero = theApp.GetProfileInt(L"Settings", L"SparseZeroBlocks", SPARSEZERO_DEFAULT) != 0;
+
+	bool bMmapReverse = theApp.GetProfileInt(L"Settings", L"MapReverseFiles", MMAPREVERSE_DEFAULT) != 0;
+
+	bool bAutoTune = theApp.GetProfileInt(L"Settings", L"AutoTune", AUTOTUNE_DEFAULT) != 0;
+
+	return SetControls(nThreads, bufferblocks, cachettl, bCaseInsensitive, bMountManager, bEnableSavingPasswords, bDirectIo, bSparseZero, bMmapReverse, bAutoTune);
 }
 
-BOOL CSettingsPropertyPage::SetControls(int nThreads, int bufferblocks, int cachettl, bool bCaseInsensitive, bool bMountManager, bool bEnableSavingPasswords)
+BOOL CSettingsPropertyPage::SetControls(int nThreads, int bufferblocks, int cachettl, bool bCaseInsensitive, bool bMountManager, bool bEnableSavingPasswords, bool bDirectIo, bool bSparseZero, bool bMmapReverse, bool bAutoTune)
 {
 
 	m_bCaseInsensitive =  bCaseInsensitive;
 	m_bMountManager = bMountManager;
 	m_bEnableSavingPasswords = bEnableSavingPasswords;
+	m_bDirectIo = bDirectIo;
+	m_bSparseZero = bSparseZero;
+	m_bMmapReverse = bMmapReverse;
+	m_bAutoTune = bAutoTune;
 
 	int i;
 
@@ -185,6 +205,14 @@ BOOL CSettingsPropertyPage::SetControls(int nThreads, int bufferblocks, int cach
 
 	CheckDlgButton(IDC_ENABLE_SAVING_PASSWORDS, m_bEnableSavingPasswords ? 1 : 0);
 
+	CheckDlgButton(IDC_DIRECTIO, m_bDirectIo ? 1 : 0);
+
+	CheckDlgButton(IDC_SPARSEZERO, m_bSparseZero ? 1 : 0);
+
+	CheckDlgButton(IDC_MMAPREVERSE, m_bMmapReverse ? 1 : 0);
+
+	CheckDlgButton(IDC_AUTOTUNE, m_bAutoTune ? 1 : 0);
+
 	return TRUE;  // return TRUE unless you set the focus to a control
 				  // EXCEPTION: OCX Property Pages should return FALSE
 }
@@ -259,17 +287,25 @@ void CSettingsPropertyPage::SaveSettings()
 	m_bCaseInsensitive = !m_bCaseInsensitive; // OnBnClickedCaseinsensitive() flips it
 	m_bMountManager = !m_bMountManager; // ditto
 	m_bEnableSavingPasswords = !m_bEnableSavingPasswords; // ditto
+	m_bDirectIo = !m_bDirectIo; // ditto
+	m_bSparseZero = !m_bSparseZero; // ditto
+	m_bMmapReverse = !m_bMmapReverse; // ditto
+	m_bAutoTune = !m_bAutoTune; // ditto
 
 	OnBnClickedCaseinsensitive();
 	OnClickedMountmanager();
 	OnClickedEnableSavingPasswords();
+	OnClickedDirectio();
+	OnClickedSparsezero();
+	OnClickedMmapreverse();
+	OnClickedAutotune();
 }
 
 void CSettingsPropertyPage::OnBnClickedDefaults()
 {
 	// TODO: Add your control notification handler code here
 
-	SetControls(PER_FILESYSTEM_THREADS_DEFAULT, BUFFERBLOCKS_DEFAULT, CACHETTL_DEFAULT, CASEINSENSITIVE_DEFAULT, MOUNTMANAGER_DEFAULT, ENABLE_SAVING_PASSWORDS_DEFAULT);
+	SetControls(PER_FILESYSTEM_THREADS_DEFAULT, BUFFERBLOCKS_DEFAULT, CACHETTL_DEFAULT, CASEINSENSITIVE_DEFAULT, MOUNTMANAGER_DEFAULT, ENABLE_SAVING_PASSWORDS_DEFAULT, DIRECTIO_DEFAULT, SPARSEZERO_DEFAULT, MMAPREVERSE_DEFAULT, AUTOTUNE_DEFAULT);
 
 	SaveSettings();
 }
@@ -279,7 +315,7 @@ void CSettingsPropertyPage::OnBnClickedRecommended()
 {
 	// TODO: Add your control notification handler code here
 
-	SetControls(PER_FILESYSTEM_THREADS_RECOMMENDED, BUFFERBLOCKS_RECOMMENDED, CACHETTL_RECOMMENDED, CASEINSENSITIVE_RECOMMENDED, MOUNTMANAGER_RECOMMENDED, ENABLE_SAVING_PASSWORDS_RECOMMENDED);
+	SetControls(PER_FILESYSTEM_THREADS_RECOMMENDED, BUFFERBLOCKS_RECOMMENDED, CACHETTL_RECOMMENDED, CASEINSENSITIVE_RECOMMENDED, MOUNTMANAGER_RECOMMENDED, ENABLE_SAVING_PASSWORDS_RECOMMENDED, DIRECTIO_RECOMMENDED, SPARSEZERO_RECOMMENDED, MMAPREVERSE_RECOMMENDED, AUTOTUNE_RECOMMENDED);
 
 	SaveSettings();
 }
@@ -331,3 +367,51 @@ void CSettingsPropertyPage::OnClickedEnableSavingPasswords()
 		}
 	}
 }
+
+
+void CSettingsPropertyPage::OnClickedDirectio()
+{
+	// TODO: Add your control notification handler code here
+
+	m_bDirectIo = !m_bDirectIo;
+
+	CheckDlgButton(IDC_DIRECTIO, m_bDirectIo ? 1 : 0);
+
+	theApp.WriteProfileInt(L"Settings", L"DirectIo", m_bDirectIo ? 1 : 0);
+}
+
+
+void CSettingsPropertyPage::OnClickedSparsezero()
+{
+	// TODO: Add your control notification handler code here
+
+	m_bSparseZero = !m_bSparseZero;
+
+	CheckDlgButton(IDC_SPARSEZERO, m_bSparseZero ? 1 : 0);
+
+	theApp.WriteProfileInt(L"Settings", L"SparseZeroBlocks", m_bSparseZero ? 1 : 0);
+}
+
+
+void CSettingsPropertyPage::OnClickedMmapreverse()
+{
+	// TODO: Add your control notification handler code here
+
+	m_bMmapReverse = !m_bMmapReverse;
+
+	CheckDlgButton(IDC_MMAPREVERSE, m_bMmapReverse ? 1 : 0);
+
+	theApp.WriteProfileInt(L"Settings", L"MapReverseFiles", m_bMmapReverse ? 1 : 0);
+}
+
+
+void CSettingsPropertyPage::OnClickedAutotune()
+{
+	// TODO: Add your control notification handler code here
+
+	m_bAutoTune = !m_bAutoTune;
+
+	CheckDlgButton(IDC_AUTOTUNE, m_bAutoTune ? 1 : 0);
+
+	theApp.WriteProfileInt(L"Settings", L"AutoTune", m_bAutoTune ? 1 : 0);
+}
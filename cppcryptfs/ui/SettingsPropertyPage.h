@@ -41,6 +41,10 @@ public:
 	bool m_bCaseInsensitive;
 	bool m_bMountManager;
 	bool m_bEnableSavingPasswords;
+	bool m_bDirectIo;
+	bool m_bSparseZero;
+	bool m_bMmapReverse;
+	bool m_bAutoTune;
 
 	// disallow copying
 	CSettingsPropertyPage(CSettingsPropertyPage const&) = delete;
@@ -54,7 +58,7 @@ public:
 	enum { IDD = IDD_SETTINGS };
 #endif
 protected:
-	BOOL SetControls(int nThreads, int nBufferBlocks, int nCacheTTL, bool bCaseInsensitive, bool bMountManager, bool bEnableSavingPasswords);
+	BOOL SetControls(int nThreads, int nBufferBlocks, int nCacheTTL, bool bCaseInsensitive, bool bMountManager, bool bEnableSavingPasswords, bool bDirectIo, bool bSparseZero, bool bMmapReverse, bool bAutoTune);
 	void SaveSettings();
 protected:
 	virtual void DoDataExchange(CDataExchange* pDX);    // DDX/DDV support
@@ -71,4 +75,8 @@ public:
 	afx_msg void OnClickedMountmanager();
 	afx_msg void OnClickedResetwarnings();
 	afx_msg void OnClickedEnableSavingPasswords();
+	afx_msg void OnClickedDirectio();
+	afx_msg void OnClickedSparsezero();
+	afx_msg void OnClickedMmapreverse();
+	afx_msg void OnClickedAutotune();
 };
@@ -46,6 +46,18 @@ THE SOFTWARE.
 #define ENABLE_SAVING_PASSWORDS_DEFAULT 0
 #define ENABLE_SAVING_PASSWORDS_RECOMMENDED 0
 
+#define DIRECTIO_DEFAULT 0
+#define DIRECTIO_RECOMMENDED 0
+
+#define SPARSEZERO_DEFAULT 0
+#define SPARSEZERO_RECOMMENDED 0
+
+#define MMAPREVERSE_DEFAULT 0
+#define MMAPREVERSE_RECOMMENDED 0
+
+#define AUTOTUNE_DEFAULT 0
+#define AUTOTUNE_RECOMMENDED 0
+
 // warnings (not really settings)
 #define MOUNTMANAGERWARN_DEFAULT 1
 
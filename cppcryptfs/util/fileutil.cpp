@@ -62,8 +62,10 @@ VirtualAttributesNameFile(DWORD attr)
 }
 
 bool
-adjust_file_offset_down(LARGE_INTEGER& l)
+adjust_file_offset_down(CryptContext *con, LARGE_INTEGER& l)
 {
+	CryptConfig *cfg = con->GetConfig();
+
 	long long offset = l.QuadPart;
 
 	if (offset < 0)
@@ -72,8 +74,8 @@ adjust_file_offset_down(LARGE_INTEGER& l)
 	if (offset == 0)
 		return true;
 
-	long long blocks = (offset - CIPHER_FILE_OVERHEAD + CIPHER_BS - 1) / CIPHER_BS;
-	offset -= (blocks*CIPHER_BLOCK_OVERHEAD + CIPHER_FILE_OVERHEAD);
+	long long blocks = (offset - cfg->m_HeaderLen + cfg->m_CipherBS - 1) / cfg->m_CipherBS;
+	offset -= (blocks*cfg->BlockOverhead() + cfg->m_HeaderLen);
 	if (offset < 0)
 		return false;
 
@@ -83,8 +85,10 @@ adjust_file_offset_down(LARGE_INTEGER& l)
 }
 
 bool
-adjust_file_offset_up(LARGE_INTEGER& l)
+adjust_file_offset_up(CryptContext *con, LARGE_INTEGER& l)
 {
+	CryptConfig *cfg = con->GetConfig();
+
 	long long offset = l.QuadPart;
 
 	if (offset < 0)
@@ -93,27 +97,29 @@ adjust_file_offset_up(LARGE_INTEGER& l)
 	if (offset == 0)
 		return true;
 
-	long long blocks = (offset + PLAIN_BS - 1) / PLAIN_BS;
-	offset += (blocks*CIPHER_BLOCK_OVERHEAD + CIPHER_FILE_OVERHEAD);
+	long long blocks = (offset + cfg->m_PlainBS - 1) / cfg->m_PlainBS;
+	offset += (blocks*cfg->BlockOverhead() + cfg->m_HeaderLen);
 	
 	l.QuadPart = offset;
 
 	return true;
 }
 
-bool adjust_file_size_down(LARGE_INTEGER& l)
+bool adjust_file_size_down(CryptContext *con, LARGE_INTEGER& l)
 {
-	return adjust_file_offset_down(l);
+	return adjust_file_offset_down(con, l);
 }
 
-bool adjust_file_size_up(LARGE_INTEGER& l)
+bool adjust_file_size_up(CryptContext *con, LARGE_INTEGER& l)
 {
-	return adjust_file_offset_up(l);
+	return adjust_file_offset_up(con, l);
 }
 
 bool
-adjust_file_offset_up_truncate_zero(LARGE_INTEGER& l)
+adjust_file_offset_up_truncate_zero(CryptContext *con, LARGE_INTEGER& l)
 {
+	CryptConfig *cfg = con->GetConfig();
+
 	long long offset = l.QuadPart;
 
 	if (offset < 0)
@@ -122,8 +128,8 @@ adjust_file_offset_up_truncate_zero(LARGE_INTEGER& l)
 	if (offset == 0) // truncate zero-length file to 0 bytes
 		return true;
 
-	long long blocks = (offset + PLAIN_BS - 1) / PLAIN_BS;
-	offset += blocks*CIPHER_BLOCK_OVERHEAD + CIPHER_FILE_OVERHEAD;
+	long long blocks = (offset + cfg->m_PlainBS - 1) / cfg->m_PlainBS;
+	offset += blocks*cfg->BlockOverhead() + cfg->m_HeaderLen;
 
 	l.QuadPart = offset;
 
@@ -175,6 +181,7 @@ read_dir_iv(const TCHAR *path, unsigned char *diriv, FILETIME& LastWriteTime)
 bool
 get_dir_iv(CryptContext *con, const WCHAR *path, unsigned char *diriv)
 {
+	PerfTimer perf(con ? &con->m_perf : NULL, PERF_GET_DIR_IV);
 
 	if (con && !con->GetConfig()->DirIV()) {
 		memset(diriv, 0, DIR_IV_LEN);
@@ -220,10 +227,10 @@ convert_fdata(CryptContext *con, BOOL isRoot, const BYTE *dir_iv, const WCHAR *p
 		l.LowPart = fdata.nFileSizeLow;
 		l.HighPart = fdata.nFileSizeHigh;
 		if (con->GetConfig()->m_reverse) {
-			if (!adjust_file_size_up(l))
+			if (!adjust_file_size_up(con, l))
 				return false;
 		} else {
-			if (!adjust_file_size_down(l))
+			if (!adjust_file_size_down(con, l))
 				return false;
 		}
 		fdata.nFileSizeHigh = l.HighPart;
@@ -562,10 +569,10 @@ get_file_information(CryptContext *con, LPCWSTR FileName, LPCWSTR inputPath, HAN
 			l.HighPart = pInfo->nFileSizeHigh;
 
 			if (con->GetConfig()->m_reverse) {
-				if (!adjust_file_size_up(l))
+				if (!adjust_file_size_up(con, l))
 					throw((int)ERROR_INVALID_PARAMETER);
 			} else {
-				if (!adjust_file_size_down(l))
+				if (!adjust_file_size_down(con, l))
 					throw((int)ERROR_INVALID_PARAMETER);
 			}
 
@@ -965,10 +972,10 @@ convert_find_stream_data(CryptContext *con, LPCWSTR pt_path, LPCWSTR path, WIN32
 	}
 
 	if (reverse) {
-		if (!adjust_file_size_up(fdata.StreamSize))
+		if (!adjust_file_size_up(con, fdata.StreamSize))
 			return false;
 	} else {
-		if (!adjust_file_size_down(fdata.StreamSize))
+		if (!adjust_file_size_down(con, fdata.StreamSize))
 			return false;
 	}
 
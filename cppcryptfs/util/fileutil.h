@@ -52,19 +52,19 @@ bool
 create_dir_iv(CryptContext *con, LPCWSTR path); // path is unencrypted
 
 bool
-adjust_file_offset_down(LARGE_INTEGER& l);
+adjust_file_offset_down(CryptContext *con, LARGE_INTEGER& l);
 
 bool
-adjust_file_offset_up(LARGE_INTEGER& l);
+adjust_file_offset_up(CryptContext *con, LARGE_INTEGER& l);
 
 bool
-adjust_file_size_down(LARGE_INTEGER& l);
+adjust_file_size_down(CryptContext *con, LARGE_INTEGER& l);
 
 bool
-adjust_file_size_up(LARGE_INTEGER& l);
+adjust_file_size_up(CryptContext *con, LARGE_INTEGER& l);
 
 bool
-adjust_file_offset_up_truncate_zero(LARGE_INTEGER& l);
+adjust_file_offset_up_truncate_zero(CryptContext *con, LARGE_INTEGER& l);
 
 bool
 is_empty_directory(LPCWSTR path, BOOL bMustReallyBeEmpty = FALSE);
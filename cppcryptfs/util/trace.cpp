@@ -0,0 +1,205 @@
+/*
+cppcryptfs : user-mode cryptographic virtual overlay filesystem.
+
+Copyright (C) 2016-2018 Bailey Brown (github.com/bailey27/cppcryptfs)
+
+cppcryptfs is based on the design of gocryptfs (github.com/rfjakob/gocryptfs)
+
+The MIT License (MIT)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#include "stdafx.h"
+
+#include "trace.h"
+#include "context/perfstats.h"
+
+#include <vector>
+
+volatile bool g_trace_enabled = false;
+
+// A ring is written only by the thread that owns it.  head counts the
+// records written, and is advanced after the record is filled in, so a
+// reader knows which records are complete.  It is read and written with
+// interlocked operations because plain 64-bit accesses aren't atomic on x86.
+
+struct TraceRing {
+	TraceRecord records[TRACE_RING_RECORDS];
+	volatile LONGLONG head;
+	DWORD tid;
+	volatile LONG in_use;
+};
+
+static SRWLOCK rings_lock = SRWLOCK_INIT;
+
+// rings are reused by new threads after their owners exit, but never freed
+static vector<TraceRing*> rings;
+
+class TraceRingHolder {
+public:
+	TraceRing *m_ring;
+
+	TraceRingHolder() { m_ring = NULL; };
+	~TraceRingHolder() { if (m_ring) InterlockedExchange(&m_ring->in_use, 0); };
+};
+
+static thread_local TraceRingHolder tls_ring;
+
+static TraceRing *get_ring()
+{
+	if (tls_ring.m_ring)
+		return tls_ring.m_ring;
+
+	TraceRing *ring = NULL;
+
+	AcquireSRWLockExclusive(&rings_lock);
+
+	try {
+		for (auto r : rings) {
+			if (!r->in_use) {
+				ring = r;
+				break;
+			}
+		}
+
+		if (!ring) {
+			ring = new TraceRing;
+			rings.push_back(ring);
+		}
+
+		ring->head = 0;
+		ring->tid = GetCurrentThreadId();
+		ring->in_use = 1;
+	} catch (...) {
+		ring = NULL;
+	}
+
+	ReleaseSRWLockExclusive(&rings_lock);
+
+	tls_ring.m_ring = ring;
+
+	return ring;
+}
+
+void trace_enable(bool enable)
+{
+	g_trace_enabled = enable;
+}
+
+void trace_event(int op, LONGLONG ts, LONGLONG dur, ULONGLONG file, LONGLONG offset, DWORD len, DWORD status)
+{
+	TraceRing *ring = get_ring();
+
+	if (!ring)
+		return;
+
+	LONGLONG head = ring->head;
+
+	TraceRecord& rec = ring->records[head & (TRACE_RING_RECORDS - 1)];
+
+	rec.ts = ts;
+	rec.dur = dur;
+	rec.file = file;
+	rec.offset = offset;
+	rec.len = len;
+	rec.status = status;
+	rec.op = op;
+
+	// publish the record (the exchange is also a full barrier)
+	InterlockedExchange64(&ring->head, head + 1);
+}
+
+static LONGLONG read_head(TraceRing *ring)
+{
+	return InterlockedCompareExchange64(&ring->head, 0, 0);
+}
+
+bool trace_dump(const WCHAR *path, wstring& mes)
+{
+	vector<TraceRecord> recs;
+	vector<DWORD> tids;
+
+	AcquireSRWLockShared(&rings_lock);
+
+	try {
+		for (auto ring : rings) {
+			LONGLONG end = read_head(ring);
+			LONGLONG begin = max(end - TRACE_RING_RECORDS, 0LL);
+
+			size_t first = recs.size();
+
+			for (LONGLONG i = begin; i < end; i++)
+				recs.push_back(ring->records[i & (TRACE_RING_RECORDS - 1)]);
+
+			// drop the records the owner overwrote while they were being copied
+			LONGLONG valid = max(read_head(ring) - TRACE_RING_RECORDS + 1, begin);
+
+			recs.erase(recs.begin() + first, recs.begin() + first + (size_t)(min(valid, end) - begin));
+
+			tids.resize(recs.size(), ring->tid);
+		}
+	} catch (...) {
+		recs.clear();
+		tids.clear();
+	}
+
+	ReleaseSRWLockShared(&rings_lock);
+
+	FILE *fl = NULL;
+
+	if (_wfopen_s(&fl, path, L"w") || !fl) {
+		mes = L"unable to open trace file";
+		return false;
+	}
+
+	LARGE_INTEGER freq;
+	QueryPerformanceFrequency(&freq);
+
+	const double us_per_tick = 1e6 / (double)freq.QuadPart;
+
+	LONGLONG base = MAXLONGLONG;
+
+	for (auto& rec : recs)
+		base = min(base, rec.ts);
+
+	DWORD pid = GetCurrentProcessId();
+
+	fprintf(fl, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [");
+
+	for (size_t i = 0; i < recs.size(); i++) {
+		const TraceRecord& rec = recs[i];
+		fprintf(fl, "%s\n{\"name\": \"%S\", \"ph\": \"X\", \"pid\": %lu, \"tid\": %lu, \"ts\": %.3f, \"dur\": %.3f, "
+			"\"args\": {\"file\": \"0x%llx\", \"offset\": %lld, \"len\": %lu, \"status\": \"0x%08lx\"}}",
+			i ? "," : "", perf_op_name(rec.op), pid, tids[i], (rec.ts - base) * us_per_tick, rec.dur * us_per_tick,
+			rec.file, rec.offset, rec.len, rec.status);
+	}
+
+	fprintf(fl, "\n]}\n");
+
+	bool ok = !ferror(fl);
+
+	if (fclose(fl) || !ok) {
+		mes = L"error writing trace file";
+		return false;
+	}
+
+	return true;
+}
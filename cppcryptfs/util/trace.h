@@ -0,0 +1,69 @@
+/*
+cppcryptfs : user-mode cryptographic virtual overlay filesystem.
+
+Copyright (C) 2016-2018 Bailey Brown (github.com/bailey27/cppcryptfs)
+
+cppcryptfs is based on the design of gocryptfs (github.com/rfjakob/gocryptfs)
+
+The MIT License (MIT)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#pragma once
+
+#include <windows.h>
+
+#include <string>
+
+using namespace std;
+
+// Event tracing for performance diagnosis.
+//
+// Each thread that records an event gets its own ring buffer of fixed-size
+// binary records, so recording an event is a few stores and no locking or
+// formatting.  When a ring is full, the oldest records are overwritten.
+// trace_dump() converts the records of all the rings into the Chrome trace
+// event format (JSON), which can be loaded into chrome://tracing or Perfetto.
+
+// records per thread (must be a power of two).  A ring is allocated when its
+// thread first records an event.
+#define TRACE_RING_RECORDS 8192
+
+struct TraceRecord {
+	LONGLONG ts;       // QueryPerformanceCounter() at the start of the operation
+	LONGLONG dur;      // in QueryPerformanceCounter() ticks
+	ULONGLONG file;    // file index of the backing file (see OpenFile::FileIndex()), or 0
+	LONGLONG offset;
+	DWORD len;
+	DWORD status;
+	int op;            // PerfOp
+	DWORD reserved;
+};
+
+extern volatile bool g_trace_enabled;
+
+void trace_enable(bool enable);
+
+void trace_event(int op, LONGLONG ts, LONGLONG dur, ULONGLONG file, LONGLONG offset, DWORD len, DWORD status);
+
+// Writes the events currently in the rings to path.  Returns false and sets
+// mes on error.
+bool trace_dump(const WCHAR *path, wstring& mes);
@@ -772,3 +772,75 @@ BOOL GetPathHash(LPCWSTR path, wstring& hashstr)
 
 	return TRUE;
 }
+
+struct ParallelForState {
+	const function<bool(int, int)> *fn;
+	int count;
+	int per_task;
+	LONG tasks;
+	volatile LONG next;
+	volatile LONG failed;
+};
+
+static void parallel_for_run(ParallelForState *st)
+{
+	LONG task;
+
+	while ((task = InterlockedIncrement(&st->next) - 1) < st->tasks) {
+		int first = task * st->per_task;
+		int last = min(first + st->per_task, st->count);
+		if (!(*st->fn)(first, last))
+			InterlockedExchange(&st->failed, 1);
+	}
+}
+
+static VOID CALLBACK parallel_for_callback(PTP_CALLBACK_INSTANCE instance, PVOID context, PTP_WORK work)
+{
+	parallel_for_run((ParallelForState*)context);
+}
+
+bool parallel_for(int count, int min_per_task, const function<bool(int, int)>& fn)
+{
+	static int ncpus = 0;
+
+	if (!ncpus) {
+		SYSTEM_INFO si;
+		GetSystemInfo(&si);
+		ncpus = max((int)si.dwNumberOfProcessors, 1);
+	}
+
+	if (count < 1)
+		return true;
+
+	int workers = min(ncpus, (count + min_per_task - 1) / max(min_per_task, 1));
+
+	if (workers < 2)
+		return fn(0, count);
+
+	ParallelForState st;
+
+	st.fn = &fn;
+	st.count = count;
+	st.per_task = (count + workers - 1) / workers;
+	st.tasks = (count + st.per_task - 1) / st.per_task;
+	st.next = 0;
+	st.failed = 0;
+
+	PTP_WORK work = CreateThreadpoolWork(parallel_for_callback, &st, NULL);
+
+	if (!work)
+		return fn(0, count);
+
+	// the calling thread takes tasks too, so one fewer is submitted
+	for (LONG i = 1; i < st.tasks; i++)
+		SubmitThreadpoolWork(work);
+
+	parallel_for_run(&st);
+
+	// every task has been taken by now, so callbacks that haven't started have nothing to do
+	WaitForThreadpoolWorkCallbacks(work, TRUE);
+
+	CloseThreadpoolWork(work);
+
+	return st.failed == 0;
+}
@@ -32,6 +32,7 @@ THE SOFTWARE.
 #include <vector>
 #include <utility>
 #include <memory>
+#include <functional>
 
 using namespace std;
 
@@ -106,6 +107,11 @@ bool mountmanager_continue_mounting();
 
 BOOL GetPathHash(LPCWSTR path, wstring& hashstr);
 
+// Calls fn(first, last) on consecutive ranges that together cover [0, count),
+// in parallel on the process thread pool and the calling thread.  Each range
+// has at least min_per_task items.  Returns false if any call returned false.
+bool parallel_for(int count, int min_per_task, const function<bool(int, int)>& fn);
+
 namespace cppcryptfs
 {
 	/*